@@ -0,0 +1,56 @@
+#include "pch.h"
+#include "AudioBenchmark.h"
+
+#include <Kore/Log.h>
+#include <chrono>
+#include <thread>
+#include "AudioDevice.h"
+#include "AudioMixer.h"
+#include "Benchmark.h"
+#include "MemoryTracking.h"
+
+using namespace Kore;
+
+void benchmarkAudio(const char* streamFile, int seconds, int triggersPerSecond) {
+	NullAudioDevice* nullAudio;
+	AudioMixer* mixer;
+	{
+		MemoryScope scope(MemoryAudio);
+		nullAudio = new NullAudioDevice;
+		mixer = new AudioMixer(nullAudio);
+	}
+	int stream = mixer->openStream(streamFile);
+	int clip = createImpactSound(*mixer);
+	mixer->playStream(stream, 0.5f, true);
+
+	const int frameRate = 60;
+	int frames = seconds * frameRate;
+	int triggers = 0;
+	double triggerSeconds = 0.0;
+	// Give the mixer time to fill the ring, like the output starting after the game
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	BenchmarkClock::time_point start = BenchmarkClock::now();
+	for (int frame = 0; frame < frames; ++frame) {
+		int due = (int)((long long)triggersPerSecond * (frame + 1) / frameRate);
+		BenchmarkClock::time_point triggerStart = BenchmarkClock::now();
+		for (; triggers < due; ++triggers) {
+			float volume = 0.1f + 0.9f * ((triggers * 37) % 100) / 100.0f;
+			float pan = ((triggers * 53) % 200) / 100.0f - 1.0f;
+			mixer->play(clip, volume, pan, 0.8f + 0.4f * (triggers % 5) / 4.0f, (int)(volume * 100.0f));
+		}
+		BenchmarkClock::time_point triggerEnd = BenchmarkClock::now();
+		triggerSeconds += std::chrono::duration<double>(triggerEnd - triggerStart).count();
+
+		nullAudio->pull(nullAudio->getSampleRate() / frameRate);
+		std::this_thread::sleep_until(start + std::chrono::microseconds(1000000LL * (frame + 1) / frameRate));
+	}
+
+	AudioStats stats = mixer->getStats();
+	double mixedSeconds = (double)stats.framesMixed / mixer->getSampleRate();
+	Kore::log(Info, "Audio: %i triggers in %i s, %.0f ns per trigger on the calling thread", triggers, seconds, triggers > 0 ? triggerSeconds * 1e9 / triggers : 0.0);
+	Kore::log(Info, "Mixer: %i played, %i stolen, %i dropped, %i events lost, %.2f ms per second of audio",
+		stats.played, stats.stolen, stats.dropped, stats.eventsLost, mixedSeconds > 0.0 ? stats.mixSeconds * 1000.0 / mixedSeconds : 0.0);
+	Kore::log(Info, "Output: %lld frames, %i samples missing, peak %.2f", nullAudio->framesPlayed, nullAudio->underruns.load(), nullAudio->peak);
+	delete mixer;
+	delete nullAudio;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "pch.h"
+
+// Trigger impacts at the given rate and loop streamFile for some seconds of real time, on the null audio device.
+// The loop only pushes events and takes the output out like an audio backend would, all mixing happens on the mixer thread.
+void benchmarkAudio(const char* streamFile, int seconds, int triggersPerSecond);
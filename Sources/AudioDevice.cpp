@@ -0,0 +1,100 @@
+#include "pch.h"
+#include "AudioDevice.h"
+
+#include <Kore/Audio2/Audio.h>
+#include <thread>
+
+using namespace Kore;
+
+namespace {
+	// Samples are copied in blocks of this size
+	const int copyBlock = 256;
+
+	// Set by start and stop on the game thread, read by the callback on the thread of the audio backend
+	std::atomic<KoreAudioDevice*> koreDevice(nullptr);
+	std::atomic<AudioRing*> koreRing(nullptr);
+	// Callbacks between loading the ring and being done with it, stop waits for them
+	std::atomic<int> callbacksRunning(0);
+}
+
+// Kore
+
+int KoreAudioDevice::getSampleRate() {
+	return Audio2::samplesPerSecond;
+}
+
+void KoreAudioDevice::start(AudioRing* ring) {
+	koreDevice.store(this);
+	koreRing.store(ring);
+	Audio2::audioCallback = callback;
+}
+
+// The ring may be freed once this returns, so it waits for a callback that already got the ring
+void KoreAudioDevice::stop() {
+	Audio2::audioCallback = nullptr;
+	koreRing.store(nullptr);
+	koreDevice.store(nullptr);
+	while (callbacksRunning.load() > 0) std::this_thread::yield();
+}
+
+void KoreAudioDevice::callback(int samples) {
+	// Counted before loading the ring, so stop either sees this callback or the callback sees no ring
+	callbacksRunning.fetch_add(1);
+	AudioRing* ring = koreRing.load();
+	KoreAudioDevice* device = koreDevice.load();
+
+	// Audio2's buffer takes one float per sample, like Audio1 writes it
+	Audio2::Buffer& buffer = Audio2::buffer;
+	float block[copyBlock];
+	while (samples > 0) {
+		int count = samples < copyBlock ? samples : copyBlock;
+		int read = ring != nullptr ? ring->read(block, count) : 0;
+		for (int i = read; i < count; ++i) block[i] = 0.0f;
+		if (read < count && device != nullptr) device->underruns.fetch_add(count - read, std::memory_order_relaxed);
+
+		for (int i = 0; i < count; ++i) {
+			*(float*)&buffer.data[buffer.writeLocation] = block[i];
+			buffer.writeLocation += 4;
+			if (buffer.writeLocation >= buffer.dataSize) buffer.writeLocation = 0;
+		}
+		samples -= count;
+	}
+	callbacksRunning.fetch_sub(1);
+}
+
+// Null
+
+NullAudioDevice::NullAudioDevice(int sampleRate) : framesPlayed(0), peak(0.0f), hash(14695981039346656037ull), sampleRate(sampleRate), ring(nullptr) {}
+
+int NullAudioDevice::getSampleRate() {
+	return sampleRate;
+}
+
+void NullAudioDevice::start(AudioRing* inRing) {
+	ring = inRing;
+}
+
+void NullAudioDevice::stop() {
+	ring = nullptr;
+}
+
+void NullAudioDevice::pull(int frames) {
+	float block[copyBlock];
+	int samples = frames * 2;
+	while (samples > 0) {
+		int count = samples < copyBlock ? samples : copyBlock;
+		int read = ring != nullptr ? ring->read(block, count) : 0;
+		if (read < count) underruns.fetch_add(count - read, std::memory_order_relaxed);
+		for (int i = 0; i < read; ++i) {
+			float level = block[i] < 0.0f ? -block[i] : block[i];
+			if (level > peak) peak = level;
+		}
+		const unsigned char* bytes = (const unsigned char*)block;
+		for (int i = 0; i < read * (int)sizeof(float); ++i) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		samples -= count;
+	}
+	framesPlayed += frames;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "pch.h"
+
+#include <atomic>
+#include "MemoryTracking.h"
+
+// Bounded ring of float samples for one producer and one consumer thread.
+// The positions only grow, their difference is the number of samples in the ring. Capacity is rounded up to a power of two.
+class AudioRing {
+public:
+	AudioRing(int minCapacity) {
+		capacity = 1;
+		while ((int)capacity < minCapacity) capacity *= 2;
+		mask = capacity - 1;
+		MemoryScope scope(MemoryAudio);
+		data = new float[capacity];
+		readPosition.store(0, std::memory_order_relaxed);
+		writePosition.store(0, std::memory_order_relaxed);
+	}
+
+	~AudioRing() {
+		delete[] data;
+	}
+
+	int readable() const {
+		return (int)(writePosition.load(std::memory_order_acquire) - readPosition.load(std::memory_order_acquire));
+	}
+
+	int writable() const {
+		return (int)capacity - readable();
+	}
+
+	// Only the producer, writes at most writable() samples and returns how many
+	int write(const float* samples, int count) {
+		unsigned position = writePosition.load(std::memory_order_relaxed);
+		int free = (int)capacity - (int)(position - readPosition.load(std::memory_order_acquire));
+		if (count > free) count = free;
+		for (int i = 0; i < count; ++i) {
+			data[(position + i) & mask] = samples[i];
+		}
+		writePosition.store(position + count, std::memory_order_release);
+		return count;
+	}
+
+	// Only the consumer, returns how many samples were read
+	int read(float* samples, int count) {
+		unsigned position = readPosition.load(std::memory_order_relaxed);
+		int available = (int)(writePosition.load(std::memory_order_acquire) - position);
+		if (count > available) count = available;
+		for (int i = 0; i < count; ++i) {
+			samples[i] = data[(position + i) & mask];
+		}
+		readPosition.store(position + count, std::memory_order_release);
+		return count;
+	}
+
+	int getCapacity() const {
+		return (int)capacity;
+	}
+
+private:
+	float* data;
+	unsigned capacity;
+	unsigned mask;
+
+	// Keep the producer and the consumer on different cache lines
+	char padding0[64];
+	std::atomic<unsigned> readPosition;
+	char padding1[64];
+	std::atomic<unsigned> writePosition;
+
+	AudioRing(const AudioRing&);
+	AudioRing& operator=(const AudioRing&);
+};
+
+// Where the mixed audio goes. The mixer fills a ring with interleaved stereo samples on its own thread,
+// the device empties it on the thread of the output.
+class AudioDevice {
+public:
+	AudioDevice() {
+		underruns.store(0);
+	}
+
+	virtual ~AudioDevice() {}
+
+	virtual int getSampleRate() = 0;
+
+	// The device reads from the ring until stop is called
+	virtual void start(AudioRing* ring) = 0;
+	virtual void stop() = 0;
+
+	// Samples the output needed while the ring was empty, they are played as silence
+	std::atomic<int> underruns;
+};
+
+// Kore's Audio2, which asks for samples from a thread of the audio backend. Only one can exist.
+class KoreAudioDevice : public AudioDevice {
+public:
+	int getSampleRate() override;
+	void start(AudioRing* ring) override;
+	void stop() override;
+
+private:
+	static void callback(int samples);
+};
+
+// No output, for running without audio hardware. The caller takes the samples out with pull, e.g. with the length of each frame,
+// which makes the ring drain at the speed of the game. Keeps the peak level and a hash of everything it received.
+class NullAudioDevice : public AudioDevice {
+public:
+	NullAudioDevice(int sampleRate = 44100);
+
+	int getSampleRate() override;
+	void start(AudioRing* ring) override;
+	void stop() override;
+
+	// Consume frames stereo frames, counting missing ones as underruns
+	void pull(int frames);
+
+	long long framesPlayed;
+	float peak;
+	// FNV-1a over the received samples
+	unsigned long long hash;
+
+private:
+	int sampleRate;
+	AudioRing* ring;
+};
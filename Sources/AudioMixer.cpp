@@ -0,0 +1,424 @@
+#include "pch.h"
+#include "AudioMixer.h"
+
+#include <Kore/Log.h>
+#include <Kore/Math/Core.h>
+#include <chrono>
+#include <cstring>
+
+using namespace Kore;
+
+namespace {
+	// Frames mixed at once, a new event waits at most this long for the next block
+	const int blockFrames = 256;
+
+	// A stolen voice fades out over this many frames instead of stopping with a click
+	const int fadeFrames = 64;
+
+	// Frames read from a stream at once
+	const int chunkFrames = 4096;
+
+	const int maxRingFrames = 8192;
+
+	struct WavFormat {
+		int channels;
+		int sampleRate;
+		int bitsPerSample;
+		int dataOffset;
+		int dataBytes;
+	};
+
+	int readInt(const unsigned char* bytes) {
+		return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+	}
+
+	int readShort(const unsigned char* bytes) {
+		return bytes[0] | (bytes[1] << 8);
+	}
+
+	// Walks the RIFF chunks up to the samples and leaves the reader there
+	bool readWavFormat(FileReader& reader, WavFormat& format) {
+		unsigned char header[12];
+		if (reader.read(header, 12) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) return false;
+
+		bool hasFormat = false;
+		int encoding = 0;
+		for (;;) {
+			unsigned char chunk[8];
+			if (reader.read(chunk, 8) != 8) return false;
+			int size = readInt(chunk + 4);
+			int start = reader.pos();
+			if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+				unsigned char fmt[16];
+				reader.read(fmt, 16);
+				encoding = readShort(fmt);
+				format.channels = readShort(fmt + 2);
+				format.sampleRate = readInt(fmt + 4);
+				format.bitsPerSample = readShort(fmt + 14);
+				hasFormat = true;
+			}
+			else if (memcmp(chunk, "data", 4) == 0) {
+				format.dataOffset = start;
+				format.dataBytes = size;
+				// Uncompressed 16 bit mono or stereo only
+				return hasFormat && encoding == 1 && format.bitsPerSample == 16 && (format.channels == 1 || format.channels == 2) && format.sampleRate > 0;
+			}
+			// Chunks are padded to an even size
+			reader.seek(start + size + (size & 1));
+		}
+	}
+}
+
+AudioMixer::AudioMixer(AudioDevice* device, int inMaxVoices, int eventCapacity)
+	: latencyFrames(2048), device(device), sampleRate(device->getSampleRate()), ring(maxRingFrames * 2), events(eventCapacity, MemoryAudio),
+	maxSounds(64), maxVoices(inMaxVoices), startedVoices(0), maxStreams(4) {
+	MemoryScope scope(MemoryAudio);
+	sounds = new SoundData[maxSounds];
+	voices = new Voice[maxVoices];
+	for (int i = 0; i < maxVoices; ++i) {
+		voices[i].active = false;
+	}
+	streams = new StreamPlayback[maxStreams];
+	for (int i = 0; i < maxStreams; ++i) {
+		streams[i].used = false;
+		streams[i].chunk = new short[chunkFrames * 2];
+	}
+	mixBuffer = new float[blockFrames * 2];
+
+	numSounds.store(0);
+	activeVoices.store(0);
+	played.store(0);
+	stolen.store(0);
+	dropped.store(0);
+	eventsLost.store(0);
+	framesMixed.store(0);
+	mixNanoseconds.store(0);
+
+	device->start(&ring);
+	running.store(true);
+	thread = std::thread(&AudioMixer::mixerMain, this);
+}
+
+AudioMixer::~AudioMixer() {
+	running.store(false);
+	thread.join();
+	device->stop();
+
+	for (int i = 0; i < maxVoices; ++i) {
+		if (voices[i].active) stopVoice(voices[i]);
+	}
+	for (int i = 0; i < numSounds.load(); ++i) {
+		delete[] sounds[i].samples;
+	}
+	for (int i = 0; i < maxStreams; ++i) {
+		delete[] streams[i].chunk;
+	}
+	delete[] streams;
+	delete[] voices;
+	delete[] sounds;
+	delete[] mixBuffer;
+}
+
+int AudioMixer::loadClip(const char* filename) {
+	if (numSounds.load(std::memory_order_relaxed) == maxSounds) return -1;
+	FileReader reader;
+	WavFormat format;
+	if (!reader.open(filename) || !readWavFormat(reader, format)) {
+		Kore::log(Warning, "%s is not a 16 bit PCM WAV file", filename);
+		return -1;
+	}
+
+	MemoryScope scope(MemoryAudio);
+	int frames = format.dataBytes / (2 * format.channels);
+	short* samples = new short[frames * format.channels];
+	reader.read(samples, frames * format.channels * 2);
+	int clip = addClip(samples, frames, format.channels, format.sampleRate);
+	delete[] samples;
+	return clip;
+}
+
+int AudioMixer::addClip(const short* samples, int frames, int channels, int rate) {
+	// Only the thread registering sounds changes the count
+	int index = numSounds.load(std::memory_order_relaxed);
+	if (index == maxSounds || frames <= 0) return -1;
+	MemoryScope scope(MemoryAudio);
+	SoundData& sound = sounds[index];
+	sound.filename[0] = 0;
+	sound.channels = channels;
+	sound.sampleRate = rate;
+	sound.frames = frames;
+	sound.samples = new short[frames * channels];
+	memcpy(sound.samples, samples, frames * channels * sizeof(short));
+	sound.dataOffset = 0;
+	// Published after the data, the mixer ignores events for sounds it does not see yet
+	numSounds.store(index + 1, std::memory_order_release);
+	return index;
+}
+
+int AudioMixer::openStream(const char* filename) {
+	int index = numSounds.load(std::memory_order_relaxed);
+	if (index == maxSounds || strlen(filename) >= sizeof(sounds[0].filename)) return -1;
+	FileReader reader;
+	WavFormat format;
+	if (!reader.open(filename) || !readWavFormat(reader, format)) {
+		Kore::log(Warning, "%s is not a 16 bit PCM WAV file", filename);
+		return -1;
+	}
+
+	SoundData& sound = sounds[index];
+	strcpy(sound.filename, filename);
+	sound.channels = format.channels;
+	sound.sampleRate = format.sampleRate;
+	sound.frames = format.dataBytes / (2 * format.channels);
+	sound.samples = nullptr;
+	sound.dataOffset = format.dataOffset;
+	numSounds.store(index + 1, std::memory_order_release);
+	return index;
+}
+
+bool AudioMixer::play(int clip, float volume, float pan, float pitch, int priority) {
+	AudioEvent event;
+	event.type = AudioEvent::Play;
+	event.sound = clip;
+	event.volume = volume;
+	event.pan = pan;
+	event.pitch = pitch;
+	event.priority = priority;
+	event.loop = false;
+	if (events.push(event)) return true;
+	eventsLost.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+bool AudioMixer::playStream(int stream, float volume, bool loop, int priority) {
+	AudioEvent event;
+	event.type = AudioEvent::PlayStream;
+	event.sound = stream;
+	event.volume = volume;
+	event.pan = 0.0f;
+	event.pitch = 1.0f;
+	event.priority = priority;
+	event.loop = loop;
+	if (events.push(event)) return true;
+	eventsLost.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+bool AudioMixer::stopAll() {
+	AudioEvent event;
+	memset(&event, 0, sizeof(event));
+	event.type = AudioEvent::StopAll;
+	if (events.push(event)) return true;
+	eventsLost.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+AudioStats AudioMixer::getStats() const {
+	AudioStats stats;
+	stats.activeVoices = activeVoices.load(std::memory_order_relaxed);
+	stats.played = played.load(std::memory_order_relaxed);
+	stats.stolen = stolen.load(std::memory_order_relaxed);
+	stats.dropped = dropped.load(std::memory_order_relaxed);
+	stats.eventsLost = eventsLost.load(std::memory_order_relaxed);
+	stats.framesMixed = framesMixed.load(std::memory_order_relaxed);
+	stats.mixSeconds = mixNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+	return stats;
+}
+
+void AudioMixer::mixerMain() {
+	// Opening streams can allocate
+	MemoryScope scope(MemoryAudio);
+	while (running.load()) {
+		int latency = latencyFrames < maxRingFrames / 2 ? latencyFrames : maxRingFrames / 2;
+		while (ring.readable() < latency * 2 && ring.writable() >= blockFrames * 2) {
+			mixBlock();
+		}
+		// Half a block, so the ring never drains by more than that before it is filled up again
+		std::this_thread::sleep_for(std::chrono::microseconds(blockFrames * 500000LL / sampleRate));
+	}
+}
+
+void AudioMixer::mixBlock() {
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	memset(mixBuffer, 0, blockFrames * 2 * sizeof(float));
+
+	// Events start at the beginning of the block, stolen voices fade out at the start of it
+	AudioEvent event;
+	while (events.pop(event)) {
+		handleEvent(event);
+	}
+
+	int active = 0;
+	for (int i = 0; i < maxVoices; ++i) {
+		if (!voices[i].active) continue;
+		mixVoice(voices[i], mixBuffer, blockFrames, 1.0f, 1.0f);
+		if (voices[i].active) ++active;
+	}
+	for (int i = 0; i < blockFrames * 2; ++i) {
+		if (mixBuffer[i] > 1.0f) mixBuffer[i] = 1.0f;
+		else if (mixBuffer[i] < -1.0f) mixBuffer[i] = -1.0f;
+	}
+	ring.write(mixBuffer, blockFrames * 2);
+
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+	activeVoices.store(active, std::memory_order_relaxed);
+	framesMixed.fetch_add(blockFrames, std::memory_order_relaxed);
+	mixNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), std::memory_order_relaxed);
+}
+
+void AudioMixer::handleEvent(const AudioEvent& event) {
+	if (event.type == AudioEvent::StopAll) {
+		for (int i = 0; i < maxVoices; ++i) {
+			if (voices[i].active) stopVoice(voices[i]);
+		}
+		return;
+	}
+	if (event.sound < 0 || event.sound >= numSounds.load(std::memory_order_acquire)) return;
+	const SoundData* sound = &sounds[event.sound];
+	// Clips have samples, streams a file
+	bool stream = event.type == AudioEvent::PlayStream;
+	if (stream == (sound->samples != nullptr)) return;
+	startVoice(event, sound, stream);
+}
+
+void AudioMixer::startVoice(const AudioEvent& event, const SoundData* sound, bool stream) {
+	StreamPlayback* playback = nullptr;
+	if (stream) {
+		for (int i = 0; i < maxStreams && playback == nullptr; ++i) {
+			if (!streams[i].used) playback = &streams[i];
+		}
+		if (playback == nullptr || !playback->reader.open(sound->filename)) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+
+	Voice* voice = nullptr;
+	for (int i = 0; i < maxVoices && voice == nullptr; ++i) {
+		if (!voices[i].active) voice = &voices[i];
+	}
+	if (voice == nullptr) {
+		// The lowest priority, the oldest of those
+		Voice* victim = &voices[0];
+		for (int i = 1; i < maxVoices; ++i) {
+			Voice& other = voices[i];
+			if (other.priority < victim->priority || (other.priority == victim->priority && (int)(other.started - victim->started) < 0)) victim = &other;
+		}
+		if (victim->priority > event.priority) {
+			if (playback != nullptr) playback->reader.close();
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		if (victim->active) mixVoice(*victim, mixBuffer, fadeFrames, 1.0f, 0.0f);
+		if (victim->active) stopVoice(*victim);
+		stolen.fetch_add(1, std::memory_order_relaxed);
+		voice = victim;
+	}
+
+	// Equal power panning
+	float angle = (Kore::max(-1.0f, Kore::min(1.0f, event.pan)) + 1.0f) * Kore::pi * 0.25f;
+	voice->active = true;
+	voice->sound = sound;
+	voice->stream = playback;
+	voice->loop = event.loop;
+	voice->position = 0.0;
+	voice->step = (double)sound->sampleRate / sampleRate * event.pitch;
+	voice->leftGain = event.volume * Kore::cos(angle) / 32768.0f;
+	voice->rightGain = event.volume * Kore::sin(angle) / 32768.0f;
+	voice->priority = event.priority;
+	voice->started = startedVoices++;
+	if (playback != nullptr) {
+		playback->used = true;
+		playback->chunkFrames = 0;
+		playback->chunkStart = 0;
+	}
+	played.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AudioMixer::stopVoice(Voice& voice) {
+	voice.active = false;
+	if (voice.stream != nullptr) {
+		voice.stream->reader.close();
+		voice.stream->used = false;
+		voice.stream = nullptr;
+	}
+}
+
+bool AudioMixer::loadChunk(Voice& voice, int frame) {
+	StreamPlayback& playback = *voice.stream;
+	const SoundData& sound = *voice.sound;
+	int frames = sound.frames - frame;
+	if (frames <= 0) return false;
+	if (frames > chunkFrames) frames = chunkFrames;
+	playback.reader.seek(sound.dataOffset + frame * sound.channels * 2);
+	playback.chunkFrames = playback.reader.read(playback.chunk, frames * sound.channels * 2) / (sound.channels * 2);
+	playback.chunkStart = frame;
+	return playback.chunkFrames > 0;
+}
+
+void AudioMixer::mixVoice(Voice& voice, float* out, int frames, float gainStart, float gainEnd) {
+	const SoundData& sound = *voice.sound;
+	int channels = sound.channels;
+	float gainStep = (gainEnd - gainStart) / frames;
+	for (int f = 0; f < frames; ++f) {
+		int index = (int)voice.position;
+		if (index >= sound.frames) {
+			if (!voice.loop) {
+				stopVoice(voice);
+				return;
+			}
+			voice.position -= sound.frames;
+			index = (int)voice.position;
+		}
+		float t = (float)(voice.position - index);
+
+		// Linear interpolation with the next frame, streams only within the loaded chunk
+		const short* samples;
+		int next;
+		if (voice.stream != nullptr) {
+			StreamPlayback& playback = *voice.stream;
+			if (index < playback.chunkStart || index >= playback.chunkStart + playback.chunkFrames) {
+				if (!loadChunk(voice, index)) {
+					stopVoice(voice);
+					return;
+				}
+			}
+			samples = playback.chunk;
+			next = index + 1 < playback.chunkStart + playback.chunkFrames ? index + 1 - playback.chunkStart : index - playback.chunkStart;
+			index -= playback.chunkStart;
+		}
+		else {
+			samples = sound.samples;
+			next = index + 1 < sound.frames ? index + 1 : index;
+		}
+
+		float gain = gainStart + gainStep * f;
+		float left = samples[index * channels] + (samples[next * channels] - samples[index * channels]) * t;
+		float right = left;
+		if (channels == 2) right = samples[index * 2 + 1] + (samples[next * 2 + 1] - samples[index * 2 + 1]) * t;
+		out[f * 2 + 0] += left * voice.leftGain * gain;
+		out[f * 2 + 1] += right * voice.rightGain * gain;
+		voice.position += voice.step;
+	}
+}
+
+int createImpactSound(AudioMixer& mixer) {
+	const int rate = 22050;
+	const int frames = rate / 10;
+	short* samples = new short[frames];
+	float envelope = 1.0f;
+	float phase = 0.0f;
+	unsigned noise = 12345;
+	for (int i = 0; i < frames; ++i) {
+		float frequency = 180.0f + 400.0f * envelope;
+		phase += 2.0f * Kore::pi * frequency / rate;
+		noise = noise * 1103515245u + 12345u;
+		float hiss = ((noise >> 16) & 0x7fff) / 16384.0f - 1.0f;
+		float value = Kore::sin(phase) * envelope + hiss * envelope * envelope * envelope * 0.5f;
+		samples[i] = (short)(Kore::max(-1.0f, Kore::min(1.0f, value)) * 20000.0f);
+		envelope *= 0.9985f;
+	}
+	int clip = mixer.addClip(samples, frames, 1, rate);
+	delete[] samples;
+	return clip;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/IO/FileReader.h>
+#include <atomic>
+#include <thread>
+#include "AudioDevice.h"
+#include "CommandQueue.h"
+
+using namespace Kore;
+
+// A request from the game to the mixer thread
+struct AudioEvent {
+	enum Type { Play, PlayStream, StopAll };
+	Type type;
+
+	// Play: the clip, PlayStream: the stream
+	int sound;
+	float volume;
+	// -1 is left, 1 is right
+	float pan;
+	// Playback speed, also for streams
+	float pitch;
+	int priority;
+	bool loop;
+};
+
+// Counters of the mixer thread, updated once per block
+struct AudioStats {
+	int activeVoices;
+	int played;
+	// Voices taken from a lower priority sound and sounds dropped because all voices had a higher priority
+	int stolen;
+	int dropped;
+	// Events lost because the ring was full
+	int eventsLost;
+	long long framesMixed;
+	// Time spent mixing
+	double mixSeconds;
+};
+
+// Mixes sounds on its own thread. The game only pushes events into a lock-free ring, so triggering a sound never blocks,
+// allocates or touches the samples. A fixed number of voices play at once, a new sound takes the voice of the
+// lowest priority sound (which fades out over a few samples) if that is not higher than its own.
+// Short sounds are loaded completely as clips, long ones are read from disk in chunks while they play.
+// 16 bit PCM WAV files with one or two channels are supported, any sample rate.
+class AudioMixer {
+public:
+	AudioMixer(AudioDevice* device, int maxVoices = 32, int eventCapacity = 1024);
+	// Stops the thread and the device
+	~AudioMixer();
+
+	// Clips and streams are registered from the thread pushing the events, before they are played. Return -1 on failure.
+	int loadClip(const char* filename);
+	// Samples are copied, interleaved when there are two channels
+	int addClip(const short* samples, int frames, int channels, int sampleRate);
+	// Only reads the header, every playing copy opens the file again
+	int openStream(const char* filename);
+
+	// Safe to call from any thread, false if the event ring was full
+	bool play(int clip, float volume, float pan = 0.0f, float pitch = 1.0f, int priority = 0);
+	bool playStream(int stream, float volume, bool loop = false, int priority = 100);
+	bool stopAll();
+
+	AudioStats getStats() const;
+
+	int getSampleRate() const {
+		return sampleRate;
+	}
+
+	// Frames the mixer keeps ready in the ring, at most 4096. Lower values let sounds start sooner.
+	int latencyFrames;
+
+private:
+	struct SoundData {
+		char filename[128];
+		int channels;
+		int sampleRate;
+		int frames;
+		// Clips only
+		short* samples;
+		// Streams only, start of the samples in the file
+		int dataOffset;
+	};
+
+	// A playing stream, the file stays open while the voice plays
+	struct StreamPlayback {
+		bool used;
+		FileReader reader;
+		short* chunk;
+		// Frames in chunk and the frame of the file where chunk starts
+		int chunkFrames;
+		int chunkStart;
+	};
+
+	struct Voice {
+		bool active;
+		const SoundData* sound;
+		// Streams only
+		StreamPlayback* stream;
+		bool loop;
+		// In frames of the sound
+		double position;
+		double step;
+		float leftGain;
+		float rightGain;
+		int priority;
+		// Order of starting, the oldest of equal priority is stolen first
+		unsigned started;
+	};
+
+	void mixerMain();
+	void handleEvent(const AudioEvent& event);
+	void startVoice(const AudioEvent& event, const SoundData* sound, bool stream);
+	void stopVoice(Voice& voice);
+	// Adds frames of the voice to out, with the gain going from gainStart to gainEnd
+	void mixVoice(Voice& voice, float* out, int frames, float gainStart, float gainEnd);
+	// Read the chunk of the stream starting at frame, false at the end of the file
+	bool loadChunk(Voice& voice, int frame);
+	void mixBlock();
+
+	AudioDevice* device;
+	int sampleRate;
+	AudioRing ring;
+	CommandQueue<AudioEvent> events;
+
+	SoundData* sounds;
+	// Written by the game thread after the sound is complete, read by the mixer thread
+	std::atomic<int> numSounds;
+	int maxSounds;
+
+	Voice* voices;
+	int maxVoices;
+	unsigned startedVoices;
+
+	StreamPlayback* streams;
+	int maxStreams;
+
+	float* mixBuffer;
+
+	std::atomic<bool> running;
+	std::thread thread;
+
+	std::atomic<int> activeVoices;
+	std::atomic<int> played;
+	std::atomic<int> stolen;
+	std::atomic<int> dropped;
+	std::atomic<int> eventsLost;
+	std::atomic<long long> framesMixed;
+	std::atomic<long long> mixNanoseconds;
+};
+
+// A knock: a falling tone that decays within a few milliseconds, with some noise at the start. Returns the clip, -1 on failure.
+int createImpactSound(AudioMixer& mixer);
@@ -0,0 +1,128 @@
+#include "pch.h"
+#include "BatchRunner.h"
+
+#include <chrono>
+#include <cstring>
+#include "PhysicsObject.h"
+#include "PhysicsWorld.h"
+
+BatchRunner::BatchRunner(CollisionMesh* inLevel, const BoxCollider& inGoal, int threadCount)
+	: level(inLevel), goal(inGoal), settings(nullptr), results(nullptr), count(0), deltaT(0.0f), maxTime(0.0f), generation(0), busyWorkers(0), stopping(false) {
+	memset(&stats, 0, sizeof(stats));
+	nextWorld.store(0);
+	worldSteps.store(0);
+
+	numThreads = threadCount > 0 ? threadCount : (int)std::thread::hardware_concurrency();
+	if (numThreads < 1) numThreads = 1;
+	threads = new std::thread[numThreads];
+	for (int i = 0; i < numThreads; ++i) {
+		threads[i] = std::thread(&BatchRunner::workerMain, this);
+	}
+}
+
+BatchRunner::~BatchRunner() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	runStarted.notify_all();
+	for (int i = 0; i < numThreads; ++i) {
+		threads[i].join();
+	}
+	delete[] threads;
+}
+
+void BatchRunner::run(const BatchWorldSettings* worldSettings, BatchWorldResult* worldResults, int worldCount, float stepTime, float timeLimit) {
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		settings = worldSettings;
+		results = worldResults;
+		count = worldCount;
+		deltaT = stepTime;
+		maxTime = timeLimit;
+		nextWorld.store(0);
+		worldSteps.store(0);
+		busyWorkers = numThreads;
+		++generation;
+	}
+	runStarted.notify_all();
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (busyWorkers > 0) runFinished.wait(lock);
+	}
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+	stats.worlds = worldCount;
+	stats.worldSteps = worldSteps.load();
+	stats.seconds = std::chrono::duration<double>(end - start).count();
+	stats.worldStepsPerSecond = stats.seconds > 0.0 ? stats.worldSteps / stats.seconds : 0.0;
+}
+
+void BatchRunner::workerMain() {
+	int seenGeneration = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stopping && generation == seenGeneration) runStarted.wait(lock);
+			if (stopping) return;
+			seenGeneration = generation;
+		}
+
+		// Worlds are taken one at a time, they finish after very different numbers of steps
+		for (;;) {
+			int world = nextWorld.fetch_add(1);
+			if (world >= count) break;
+			simulate(settings[world], results[world]);
+			worldSteps.fetch_add(results[world].steps);
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (--busyWorkers == 0) runFinished.notify_all();
+	}
+}
+
+void BatchRunner::simulate(const BatchWorldSettings& settings, BatchWorldResult& result) {
+	// A single ball, no commands from other threads
+	PhysicsWorld world(1, 2);
+	world.AddMeshCollider(level);
+
+	// Set up like the ball of the game
+	PhysicsObject* ball = world.GetObject(world.SpawnObject());
+	ball->SetPosition(settings.spawnPosition);
+	ball->Velocity = settings.spawnVelocity;
+	ball->Collider.radius = 0.5f;
+	ball->Mass = 5;
+	ball->Restitution = settings.restitution;
+	ball->Damping = settings.damping;
+	ball->ApplyImpulse(settings.spawnVelocity);
+
+	vec3 goalCenter((goal.negX.d - goal.posX.d) * 0.5f, (goal.negY.d - goal.posY.d) * 0.5f, (goal.negZ.d - goal.posZ.d) * 0.5f);
+	float floor = level->min.y() - 10.0f;
+	int maxSteps = (int)(maxTime / deltaT);
+
+	result.reachedGoal = false;
+	result.timeToGoal = -1.0f;
+	result.fellOff = false;
+	result.steps = 0;
+	while (result.steps < maxSteps) {
+		if (settings.steering > 0.0f) {
+			vec3 position = ball->GetPosition();
+			vec3 direction(goalCenter.x() - position.x(), 0.0f, goalCenter.z() - position.z());
+			float length = direction.getLength();
+			if (length > 0.0f) ball->ApplyForceToCenter(direction * (settings.steering / length));
+		}
+		world.Update(deltaT);
+		++result.steps;
+		if (ball->Collider.IntersectsWith(goal)) {
+			result.reachedGoal = true;
+			result.timeToGoal = result.steps * deltaT;
+			break;
+		}
+		if (ball->GetPosition().y() < floor) {
+			result.fellOff = true;
+			break;
+		}
+	}
+	result.finalPosition = ball->GetPosition();
+}
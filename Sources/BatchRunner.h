@@ -0,0 +1,86 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/Math/Vector.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "Collision.h"
+#include "CollisionMesh.h"
+
+using namespace Kore;
+
+// Parameters of one simulation in a batch
+struct BatchWorldSettings {
+	float restitution;
+	float damping;
+	vec3 spawnPosition;
+	vec3 spawnVelocity;
+	// Horizontal force pushing the ball towards the goal each step, like holding the arrow keys (20 in the game). 0 lets it roll freely.
+	float steering;
+};
+
+struct BatchWorldResult {
+	bool reachedGoal;
+	// Simulated seconds until the ball touched the goal, -1 if it never did
+	float timeToGoal;
+	// Set if the ball dropped below the level
+	bool fellOff;
+	int steps;
+	vec3 finalPosition;
+};
+
+struct BatchStats {
+	int worlds;
+	long long worldSteps;
+	double seconds;
+	double worldStepsPerSecond;
+};
+
+// Runs many short, independent simulations of a ball in the level, e.g. for parameter sweeps.
+// Every simulation gets its own PhysicsWorld, all of them share the read-only collision mesh of the level.
+// The worlds are distributed over a pool of threads which is kept alive between runs.
+class BatchRunner {
+public:
+	// threads = 0 uses one thread per hardware thread
+	BatchRunner(CollisionMesh* level, const BoxCollider& goal, int threads = 0);
+	~BatchRunner();
+
+	// Blocks until all count worlds ran for maxTime seconds or reached the goal
+	void run(const BatchWorldSettings* settings, BatchWorldResult* results, int count, float deltaT = 1.0f / 60.0f, float maxTime = 30.0f);
+
+	int getThreadCount() const {
+		return numThreads;
+	}
+
+	// Of the last run
+	BatchStats stats;
+
+private:
+	void workerMain();
+	void simulate(const BatchWorldSettings& settings, BatchWorldResult& result);
+
+	CollisionMesh* level;
+	BoxCollider goal;
+
+	std::thread* threads;
+	int numThreads;
+
+	// The current run, shared with the workers
+	std::mutex mutex;
+	std::condition_variable runStarted;
+	std::condition_variable runFinished;
+	const BatchWorldSettings* settings;
+	BatchWorldResult* results;
+	int count;
+	float deltaT;
+	float maxTime;
+	// Incremented for every run, workers wait for it to change
+	int generation;
+	int busyWorkers;
+	bool stopping;
+	std::atomic<int> nextWorld;
+	std::atomic<long long> worldSteps;
+};
@@ -0,0 +1,44 @@
+#include "pch.h"
+#include "BatchSweep.h"
+
+#include <Kore/Log.h>
+#include "Benchmark.h"
+#include "BatchRunner.h"
+
+using namespace Kore;
+
+void runBatchSweep(const char* levelFile, const BoxCollider& goal, int worlds, int threads) {
+	CollisionMesh* collision = loadCollisionMesh(levelFile);
+
+	BatchWorldSettings* settings = new BatchWorldSettings[worlds];
+	BatchWorldResult* results = new BatchWorldResult[worlds];
+	for (int i = 0; i < worlds; ++i) {
+		settings[i].restitution = 0.2f + 0.1f * (i % 8);
+		settings[i].damping = 0.95f + 0.006f * ((i / 8) % 8);
+		settings[i].steering = 10.0f + 4.0f * ((i / 64) % 16);
+		// The start of the game, then moved along the starting platform
+		settings[i].spawnPosition = vec3(10.0f - (i / 1024) % 4, 5.5f, -10.0f + (i / 1024) % 4);
+		settings[i].spawnVelocity = vec3(0, 0, 0);
+	}
+
+	BatchRunner runner(collision, goal, threads);
+	runner.run(settings, results, worlds);
+
+	int reached = 0, fell = 0;
+	int best = -1;
+	for (int i = 0; i < worlds; ++i) {
+		if (results[i].fellOff) ++fell;
+		if (!results[i].reachedGoal) continue;
+		++reached;
+		if (best < 0 || results[i].timeToGoal < results[best].timeToGoal) best = i;
+	}
+	Kore::log(Info, "Batch: %i worlds on %i threads, %i reached the goal, %i fell off, %i timed out", worlds, runner.getThreadCount(), reached, fell, worlds - reached - fell);
+	if (best >= 0) {
+		Kore::log(Info, "Fastest: %.2f s with restitution %.2f, damping %.3f, steering %.0f", results[best].timeToGoal, settings[best].restitution, settings[best].damping, settings[best].steering);
+	}
+	Kore::log(Info, "Throughput: %lld world steps in %.2f s, %.0f world steps per second", runner.stats.worldSteps, runner.stats.seconds, runner.stats.worldStepsPerSecond);
+
+	delete[] results;
+	delete[] settings;
+	delete collision;
+}
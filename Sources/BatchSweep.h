@@ -0,0 +1,9 @@
+#pragma once
+
+#include "pch.h"
+
+#include "Collision.h"
+
+// Sweeps restitution, damping, the steering force and the start position of the ball over worlds independent simulations
+// of the level in levelFile, and logs how many reached the goal, the fastest settings and the throughput of the runner.
+void runBatchSweep(const char* levelFile, const BoxCollider& goal, int worlds, int threads);
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/Math/Core.h>
+#include <cstring>
+#include "MemoryTracking.h"
+#include "ObjLoader.h"
+#include "Culling.h"
+#include "RenderDevice.h"
+#include "RenderQueue.h"
+
+using namespace Kore;
+
+// Static geometry from several OBJ files, merged into one vertex and one index buffer.
+// The texture of every material becomes a layer of a single texture array, so all materials are drawn with one call.
+// Expects the vertex structure pos (float3), tex (float2), nor (float3), layer (float1).
+class BatchedMeshObject {
+public:
+	// The indices of all materials using one texture layer
+	struct MaterialRange {
+		int layer;
+		int firstIndex;
+		int indexCount;
+	};
+
+	// Materials of meshFiles[i] without a map_Kd entry use fallbackTextures[i]
+	BatchedMeshObject(RenderDevice* device, const char** meshFiles, const char** fallbackTextures, int count, const Graphics4::VertexStructure& structure) : device(device) {
+		MemoryScope scope(MemoryRender);
+		numMeshes = count;
+		meshes = new Mesh*[count];
+		int totalVertices = 0;
+		int totalIndices = 0;
+		int totalMaterials = 0;
+		for (int i = 0; i < count; ++i) {
+			meshes[i] = loadObj(meshFiles[i]);
+			totalVertices += meshes[i]->numVertices;
+			totalIndices += meshes[i]->numFaces * 3;
+			totalMaterials += meshes[i]->numMaterials;
+		}
+
+		// Assign a texture layer to every material, sharing layers between materials with the same texture
+		const char** textureFiles = new const char*[totalMaterials];
+		int* materialLayers = new int[totalMaterials];
+		numLayers = 0;
+		int materialIndex = 0;
+		for (int i = 0; i < count; ++i) {
+			for (int m = 0; m < meshes[i]->numMaterials; ++m) {
+				const char* texture = meshes[i]->materials[m].texture[0] != 0 ? meshes[i]->materials[m].texture : fallbackTextures[i];
+				int layer = 0;
+				while (layer < numLayers && strcmp(textureFiles[layer], texture) != 0) ++layer;
+				if (layer == numLayers) textureFiles[numLayers++] = texture;
+				materialLayers[materialIndex++] = layer;
+			}
+		}
+
+		vertexBuffer = device->createVertexBuffer(totalVertices, structure, 0);
+		float* vertices = device->lock(vertexBuffer);
+		int baseVertex = 0;
+		materialIndex = 0;
+		for (int i = 0; i < count; ++i) {
+			Mesh* mesh = meshes[i];
+			for (int v = 0; v < mesh->numVertices; ++v) {
+				float* target = &vertices[(baseVertex + v) * 9];
+				target[0] = mesh->vertices[v * 8 + 0];
+				target[1] = mesh->vertices[v * 8 + 1];
+				target[2] = mesh->vertices[v * 8 + 2];
+				target[3] = mesh->vertices[v * 8 + 3];
+				target[4] = 1.0f - mesh->vertices[v * 8 + 4];
+				target[5] = mesh->vertices[v * 8 + 5];
+				target[6] = mesh->vertices[v * 8 + 6];
+				target[7] = mesh->vertices[v * 8 + 7];
+				target[8] = 0.0f;
+			}
+			// The layer is a vertex attribute, so vertices are expected not to be shared between materials
+			for (int m = 0; m < mesh->numMaterials; ++m) {
+				MeshMaterial& material = mesh->materials[m];
+				for (int k = material.firstIndex; k < material.firstIndex + material.indexCount; ++k) {
+					vertices[(baseVertex + mesh->indices[k]) * 9 + 8] = (float)materialLayers[materialIndex];
+				}
+				++materialIndex;
+			}
+			baseVertex += mesh->numVertices;
+		}
+		device->unlock(vertexBuffer);
+
+		// Write the indices grouped by layer, so every layer is one contiguous range
+		ranges = new MaterialRange[numLayers];
+		indexBuffer = device->createIndexBuffer(totalIndices);
+		int* indices = device->lock(indexBuffer);
+		int* current = indices;
+		for (int layer = 0; layer < numLayers; ++layer) {
+			ranges[layer].layer = layer;
+			ranges[layer].firstIndex = (int)(current - indices);
+			baseVertex = 0;
+			materialIndex = 0;
+			for (int i = 0; i < count; ++i) {
+				Mesh* mesh = meshes[i];
+				for (int m = 0; m < mesh->numMaterials; ++m) {
+					if (materialLayers[materialIndex++] != layer) continue;
+					MeshMaterial& material = mesh->materials[m];
+					for (int k = material.firstIndex; k < material.firstIndex + material.indexCount; ++k) {
+						*current++ = baseVertex + mesh->indices[k];
+					}
+				}
+				baseVertex += mesh->numVertices;
+			}
+			ranges[layer].indexCount = (int)(current - indices) - ranges[layer].firstIndex;
+		}
+		device->unlock(indexBuffer);
+
+		textures = device->createTextureArray(textureFiles, numLayers);
+
+		delete[] materialLayers;
+		delete[] textureFiles;
+
+		// Enclose the bounds of all source meshes
+		Bounds* meshBounds = new Bounds[count];
+		for (int i = 0; i < count; ++i) {
+			meshBounds[i] = Bounds::fromVertices(meshes[i]->vertices, 8, meshes[i]->numVertices);
+			for (int k = 0; k < 3; ++k) {
+				bounds.min[k] = i == 0 ? meshBounds[i].min[k] : Kore::min(bounds.min[k], meshBounds[i].min[k]);
+				bounds.max[k] = i == 0 ? meshBounds[i].max[k] : Kore::max(bounds.max[k], meshBounds[i].max[k]);
+			}
+		}
+		bounds.center = (bounds.min + bounds.max) * 0.5f;
+		bounds.radius = 0.0f;
+		for (int i = 0; i < count; ++i) {
+			bounds.radius = Kore::max(bounds.radius, (meshBounds[i].center - bounds.center).getLength() + meshBounds[i].radius);
+		}
+		delete[] meshBounds;
+
+		M = mat4::Identity();
+	}
+
+	~BatchedMeshObject() {
+		releaseCpuData();
+		delete[] meshes;
+		delete[] ranges;
+		device->destroy(vertexBuffer);
+		device->destroy(indexBuffer);
+		device->destroy(textures);
+	}
+
+	// Free the CPU-side copies of the source meshes
+	void releaseCpuData() {
+		for (int i = 0; i < numMeshes; ++i) {
+			delete meshes[i];
+			meshes[i] = nullptr;
+		}
+	}
+
+	// Draw all materials at once
+	void render(Graphics4::TextureUnit tex) {
+		device->setTexture(tex, textures);
+		device->setVertexBuffers(&vertexBuffer, 1);
+		device->setIndexBuffer(indexBuffer);
+		device->drawIndexedVertices();
+	}
+
+	// Queue a draw instead of drawing right away
+	void submit(RenderQueue& queue, int pipeline, float depth) {
+		DrawItem item;
+		item.pipeline = pipeline;
+		item.texture = textures;
+		item.vertexBuffers[0] = vertexBuffer;
+		item.vertexBuffers[1] = nullptr;
+		item.numVertexBuffers = 1;
+		item.indexBuffer = indexBuffer;
+		item.instanceCount = 0;
+		item.M = M;
+		queue.add(item, depth);
+	}
+
+	mat4 M;
+
+	// Local space bounds, transform with M for culling
+	Bounds bounds;
+
+	RenderDevice* device;
+	DeviceVertexBuffer* vertexBuffer;
+	DeviceIndexBuffer* indexBuffer;
+	DeviceTexture* textures;
+
+	int numLayers;
+	MaterialRange* ranges;
+
+	// The source meshes in the order they were passed, until releaseCpuData is called
+	int numMeshes;
+	Mesh** meshes;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "pch.h"
+
+#include <chrono>
+#include "CollisionMesh.h"
+#include "ObjLoader.h"
+
+// Shared by the benchmarks started from the command line
+
+typedef std::chrono::high_resolution_clock BenchmarkClock;
+
+inline double millisecondsSince(BenchmarkClock::time_point start) {
+	return std::chrono::duration<double, std::milli>(BenchmarkClock::now() - start).count();
+}
+
+// The collision mesh of an OBJ file, the render data is not kept
+inline CollisionMesh* loadCollisionMesh(const char* filename) {
+	Mesh* mesh = loadObj(filename);
+	CollisionMesh* collision = buildCollisionMesh(*mesh);
+	delete mesh;
+	return collision;
+}
+
+// A square from -extent to extent on the XZ plane at height 0, facing up
+inline CollisionMesh* createGroundMesh(float extent) {
+	float ground[] = { -extent, 0, -extent, extent, 0, -extent, extent, 0, extent, -extent, 0, extent };
+	int groundIndices[] = { 0, 2, 1, 0, 3, 2 };
+	return createCollisionMesh(ground, 4, groundIndices, 2);
+}
@@ -0,0 +1,564 @@
+#include "pch.h"
+#include "ChunkedLevel.h"
+
+#include <Kore/Math/Core.h>
+#include <Kore/Log.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include "MemoryTracking.h"
+#include "ObjLoader.h"
+
+using namespace Kore;
+
+namespace {
+	const int chunkFileVersion = 2;
+
+	// Floats per render vertex: pos, tex, nor, layer
+	const int vertexSize = 9;
+
+	int tileCoordinate(float value, float tileSize) {
+		return (int)floor(value / tileSize);
+	}
+
+	// Distance from a point to an axis aligned box, 0 inside
+	float distance(const Bounds& bounds, const vec3& point) {
+		vec3 closest;
+		for (int k = 0; k < 3; ++k) {
+			closest[k] = Kore::max(bounds.min[k], Kore::min(point[k], bounds.max[k]));
+		}
+		return (closest - point).getLength();
+	}
+}
+
+bool buildLevelChunks(const char** meshFiles, const char** fallbackTextures, int count, float tileSize, const char* outputFile) {
+	MemoryScope scope(MemoryLoader);
+	Mesh** meshes = new Mesh*[count];
+	int totalTriangles = 0;
+	int totalMaterials = 0;
+	for (int i = 0; i < count; ++i) {
+		meshes[i] = loadObj(meshFiles[i]);
+		totalTriangles += meshes[i]->numFaces;
+		totalMaterials += meshes[i]->numMaterials;
+	}
+
+	// Assign texture layers the same way BatchedMeshObject does and remember the layer of every triangle
+	const char** textureFiles = new const char*[totalMaterials];
+	int numLayers = 0;
+	int** triangleLayers = new int*[count];
+	for (int i = 0; i < count; ++i) {
+		triangleLayers[i] = new int[meshes[i]->numFaces];
+		for (int m = 0; m < meshes[i]->numMaterials; ++m) {
+			MeshMaterial& material = meshes[i]->materials[m];
+			const char* texture = material.texture[0] != 0 ? material.texture : fallbackTextures[i];
+			int layer = 0;
+			while (layer < numLayers && strcmp(textureFiles[layer], texture) != 0) ++layer;
+			if (layer == numLayers) textureFiles[numLayers++] = texture;
+			for (int t = material.firstIndex / 3; t < (material.firstIndex + material.indexCount) / 3; ++t) {
+				triangleLayers[i][t] = layer;
+			}
+		}
+	}
+
+	// Put every triangle into the tile containing its centroid
+	int* triangleTiles = new int[totalTriangles];
+	int* triangleRows = new int[totalTriangles];
+	int minX = 0, maxX = 0, minZ = 0, maxZ = 0;
+	int triangle = 0;
+	for (int i = 0; i < count; ++i) {
+		Mesh* mesh = meshes[i];
+		for (int t = 0; t < mesh->numFaces; ++t, ++triangle) {
+			float x = 0.0f, z = 0.0f;
+			for (int k = 0; k < 3; ++k) {
+				x += mesh->vertices[mesh->indices[t * 3 + k] * 8 + 0];
+				z += mesh->vertices[mesh->indices[t * 3 + k] * 8 + 2];
+			}
+			int tileX = tileCoordinate(x / 3.0f, tileSize);
+			int tileZ = tileCoordinate(z / 3.0f, tileSize);
+			minX = triangle == 0 ? tileX : Kore::min(minX, tileX);
+			maxX = triangle == 0 ? tileX : Kore::max(maxX, tileX);
+			minZ = triangle == 0 ? tileZ : Kore::min(minZ, tileZ);
+			maxZ = triangle == 0 ? tileZ : Kore::max(maxZ, tileZ);
+			triangleTiles[triangle] = tileX;
+			triangleRows[triangle] = tileZ;
+		}
+	}
+	int gridWidth = maxX - minX + 1;
+	int gridHeight = maxZ - minZ + 1;
+	int numCells = gridWidth * gridHeight;
+	int* cellCounts = new int[numCells + 1];
+	memset(cellCounts, 0, (numCells + 1) * sizeof(int));
+	for (int t = 0; t < totalTriangles; ++t) {
+		triangleTiles[t] = (triangleRows[t] - minZ) * gridWidth + (triangleTiles[t] - minX);
+		++cellCounts[triangleTiles[t]];
+	}
+
+	// Sort the triangles by cell (counting sort), storing mesh and triangle index
+	int* cellStarts = new int[numCells + 1];
+	cellStarts[0] = 0;
+	for (int c = 0; c < numCells; ++c) cellStarts[c + 1] = cellStarts[c] + cellCounts[c];
+	int* sortedMesh = new int[totalTriangles];
+	int* sortedTriangle = new int[totalTriangles];
+	memcpy(cellCounts, cellStarts, numCells * sizeof(int));
+	triangle = 0;
+	for (int i = 0; i < count; ++i) {
+		for (int t = 0; t < meshes[i]->numFaces; ++t, ++triangle) {
+			int slot = cellCounts[triangleTiles[triangle]]++;
+			sortedMesh[slot] = i;
+			sortedTriangle[slot] = t;
+		}
+	}
+
+	int numTiles = 0;
+	for (int c = 0; c < numCells; ++c) {
+		if (cellStarts[c + 1] > cellStarts[c]) ++numTiles;
+	}
+
+	FILE* file = fopen(outputFile, "wb");
+	if (file == nullptr) {
+		Kore::log(Error, "Could not open %s for writing", outputFile);
+	}
+	else {
+		ChunkFileHeader header;
+		memcpy(header.magic, "LCHK", 4);
+		header.version = chunkFileVersion;
+		header.tileSize = tileSize;
+		header.numTiles = numTiles;
+		header.numLayers = numLayers;
+		fwrite(&header, sizeof(header), 1, file);
+		for (int layer = 0; layer < numLayers; ++layer) {
+			char name[128];
+			memset(name, 0, sizeof(name));
+			strncpy(name, textureFiles[layer], sizeof(name) - 1);
+			fwrite(name, sizeof(name), 1, file);
+		}
+
+		// The table is written again once the offsets are known
+		long tableStart = ftell(file);
+		ChunkFileTile* table = new ChunkFileTile[numTiles];
+		fwrite(table, sizeof(ChunkFileTile), numTiles, file);
+
+		// Per-mesh vertex remapping, reset after every tile
+		int** remap = new int*[count];
+		for (int i = 0; i < count; ++i) {
+			remap[i] = new int[meshes[i]->numVertices];
+			for (int v = 0; v < meshes[i]->numVertices; ++v) remap[i][v] = -1;
+		}
+
+		int maxTriangles = 0;
+		for (int c = 0; c < numCells; ++c) maxTriangles = Kore::max(maxTriangles, cellStarts[c + 1] - cellStarts[c]);
+		float* vertices = new float[maxTriangles * 3 * vertexSize];
+		int* indices = new int[maxTriangles * 3];
+
+		int tile = 0;
+		for (int c = 0; c < numCells; ++c) {
+			int first = cellStarts[c];
+			int last = cellStarts[c + 1];
+			if (first == last) continue;
+
+			ChunkFileBlob blob;
+			blob.numVertices = 0;
+			blob.numIndices = 0;
+			for (int s = first; s < last; ++s) {
+				Mesh* mesh = meshes[sortedMesh[s]];
+				int* meshRemap = remap[sortedMesh[s]];
+				int t = sortedTriangle[s];
+				for (int k = 0; k < 3; ++k) {
+					int source = mesh->indices[t * 3 + k];
+					if (meshRemap[source] < 0) {
+						meshRemap[source] = blob.numVertices;
+						const float* from = &mesh->vertices[source * 8];
+						float* to = &vertices[blob.numVertices * vertexSize];
+						to[0] = from[0];
+						to[1] = from[1];
+						to[2] = from[2];
+						to[3] = from[3];
+						to[4] = 1.0f - from[4];
+						to[5] = from[5];
+						to[6] = from[6];
+						to[7] = from[7];
+						to[8] = (float)triangleLayers[sortedMesh[s]][t];
+						++blob.numVertices;
+					}
+					indices[blob.numIndices++] = meshRemap[source];
+				}
+			}
+			for (int s = first; s < last; ++s) {
+				Mesh* mesh = meshes[sortedMesh[s]];
+				for (int k = 0; k < 3; ++k) remap[sortedMesh[s]][mesh->indices[sortedTriangle[s] * 3 + k]] = -1;
+			}
+
+			// All meshes of the tile collide, their vertices were just gathered with the position first
+			CollisionMesh* collision = buildCollisionMesh(vertices, vertexSize, indices, blob.numIndices / 3);
+			if (collision->numTriangles == 0) {
+				delete collision;
+				collision = nullptr;
+			}
+			blob.numCollisionVertices = collision != nullptr ? collision->numVertices : 0;
+			blob.numCollisionTriangles = collision != nullptr ? collision->numTriangles : 0;
+
+			Bounds bounds = Bounds::fromVertices(vertices, vertexSize, blob.numVertices);
+			ChunkFileTile& entry = table[tile++];
+			entry.x = minX + c % gridWidth;
+			entry.z = minZ + c / gridWidth;
+			for (int k = 0; k < 3; ++k) {
+				entry.min[k] = bounds.min[k];
+				entry.max[k] = bounds.max[k];
+			}
+			entry.offset = (int)ftell(file);
+
+			fwrite(&blob, sizeof(blob), 1, file);
+			fwrite(vertices, sizeof(float), blob.numVertices * vertexSize, file);
+			fwrite(indices, sizeof(int), blob.numIndices, file);
+			for (int v = 0; v < blob.numCollisionVertices; ++v) {
+				fwrite(&collision->positions[v * 3], sizeof(float), 3, file);
+			}
+			for (int i = 0; i < blob.numCollisionTriangles * 3; ++i) {
+				int index = collision->index(i);
+				fwrite(&index, sizeof(int), 1, file);
+			}
+			entry.size = (int)ftell(file) - entry.offset;
+			delete collision;
+		}
+
+		fseek(file, tableStart, SEEK_SET);
+		fwrite(table, sizeof(ChunkFileTile), numTiles, file);
+		long size = (fseek(file, 0, SEEK_END), ftell(file));
+		fclose(file);
+		Kore::log(Info, "Wrote %i tiles of %.1f units (%i triangles) to %s, %li bytes", numTiles, tileSize, totalTriangles, outputFile, size);
+
+		delete[] indices;
+		delete[] vertices;
+		for (int i = 0; i < count; ++i) delete[] remap[i];
+		delete[] remap;
+		delete[] table;
+	}
+
+	delete[] sortedTriangle;
+	delete[] sortedMesh;
+	delete[] cellStarts;
+	delete[] cellCounts;
+	delete[] triangleRows;
+	delete[] triangleTiles;
+	for (int i = 0; i < count; ++i) {
+		delete[] triangleLayers[i];
+		delete meshes[i];
+	}
+	delete[] triangleLayers;
+	delete[] textureFiles;
+	delete[] meshes;
+	return file != nullptr;
+}
+
+ChunkedLevel::ChunkedLevel(RenderDevice* device, PhysicsWorld* physics, const char* filename, const Graphics4::VertexStructure& structure)
+	: loadRadius(24.0f), unloadRadius(32.0f), tileSize(0.0f), numTiles(0), tiles(nullptr), textures(nullptr),
+	device(device), physics(physics), structure(structure), evictions(nullptr), requests(nullptr), numRequests(0), finished(nullptr), numFinished(0), stopping(false) {
+	MemoryScope scope(MemoryLoader);
+	memset(&stats, 0, sizeof(stats));
+	strncpy(this->filename, filename, sizeof(this->filename) - 1);
+	this->filename[sizeof(this->filename) - 1] = 0;
+
+	FileReader reader;
+	if (!reader.open(filename)) return;
+	ChunkFileHeader header;
+	if (reader.read(&header, sizeof(header)) != (int)sizeof(header) || memcmp(header.magic, "LCHK", 4) != 0 || header.version != chunkFileVersion) {
+		Kore::log(Warning, "%s is not a level chunk file", filename);
+		return;
+	}
+
+	// The layer names and the tile table have to fit into the file, otherwise the level is loaded from the OBJ files.
+	// Without tiles numTiles stays 0, so isValid fails.
+	int remaining = reader.size() - (int)sizeof(header);
+	if (header.numLayers < 1 || header.numLayers > remaining / 128 || header.numTiles < 1
+		|| header.numTiles > (remaining - header.numLayers * 128) / (int)sizeof(ChunkFileTile)) {
+		Kore::log(Warning, "%s is damaged", filename);
+		return;
+	}
+
+	char (*layers)[128] = new char[header.numLayers][128];
+	ChunkFileTile* table = new ChunkFileTile[header.numTiles];
+	if (reader.read(layers, header.numLayers * 128) != header.numLayers * 128
+		|| reader.read(table, header.numTiles * sizeof(ChunkFileTile)) != header.numTiles * (int)sizeof(ChunkFileTile)) {
+		Kore::log(Warning, "%s is damaged", filename);
+		delete[] table;
+		delete[] layers;
+		return;
+	}
+
+	const char** layerNames = new const char*[header.numLayers];
+	for (int layer = 0; layer < header.numLayers; ++layer) {
+		layers[layer][127] = 0;
+		layerNames[layer] = layers[layer];
+	}
+	textures = device->createTextureArray(layerNames, header.numLayers);
+	delete[] layerNames;
+	delete[] layers;
+
+	tileSize = header.tileSize;
+	numTiles = header.numTiles;
+	tiles = new Tile[numTiles];
+	for (int i = 0; i < numTiles; ++i) {
+		Tile& tile = tiles[i];
+		tile.x = table[i].x;
+		tile.z = table[i].z;
+		tile.bounds.min = vec3(table[i].min[0], table[i].min[1], table[i].min[2]);
+		tile.bounds.max = vec3(table[i].max[0], table[i].max[1], table[i].max[2]);
+		tile.bounds.center = (tile.bounds.min + tile.bounds.max) * 0.5f;
+		tile.bounds.radius = (tile.bounds.max - tile.bounds.center).getLength();
+		tile.offset = table[i].offset;
+		tile.size = table[i].size;
+		tile.state = Unloaded;
+		tile.wanted = false;
+		tile.vertexBuffer = nullptr;
+		tile.indexBuffer = nullptr;
+		tile.collision = nullptr;
+		tile.memoryUsage = 0;
+	}
+	delete[] table;
+
+	// Every tile is queued at most once at a time
+	requests = new int[numTiles];
+	evictions = new int[numTiles];
+	finished = new LoadedTile*[numTiles];
+	loader = std::thread(&ChunkedLevel::loaderMain, this);
+}
+
+ChunkedLevel::~ChunkedLevel() {
+	if (loader.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		requestsChanged.notify_one();
+		loader.join();
+	}
+	for (int i = 0; i < numFinished; ++i) {
+		delete[] finished[i]->vertices;
+		delete[] finished[i]->indices;
+		delete finished[i]->collision;
+		delete finished[i];
+	}
+	for (int i = 0; i < numTiles; ++i) {
+		if (tiles[i].state == Resident) evict(tiles[i]);
+	}
+	device->destroy(textures);
+	delete[] finished;
+	delete[] requests;
+	delete[] evictions;
+	delete[] tiles;
+}
+
+void ChunkedLevel::loaderMain() {
+	MemoryScope scope(MemoryLoader);
+	FileReader reader;
+	bool opened = reader.open(filename);
+	for (;;) {
+		int tile;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			requestsChanged.wait(lock, [this] { return stopping || numRequests > 0; });
+			if (stopping) return;
+			tile = requests[0];
+			memmove(requests, requests + 1, (numRequests - 1) * sizeof(int));
+			--numRequests;
+		}
+
+		LoadedTile* loaded = opened ? loadTile(reader, tile) : nullptr;
+		if (loaded == nullptr) {
+			if (opened) Kore::log(Warning, "Tile %i of %s is damaged", tile, filename);
+			loaded = new LoadedTile;
+			loaded->tile = tile;
+			memset(&loaded->blob, 0, sizeof(loaded->blob));
+			loaded->vertices = nullptr;
+			loaded->indices = nullptr;
+			loaded->collision = nullptr;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finished[numFinished++] = loaded;
+		}
+		loadsFinished.notify_one();
+	}
+}
+
+// Returns nullptr if the tile does not match its table entry, e.g. because the file was only partly written
+ChunkedLevel::LoadedTile* ChunkedLevel::loadTile(FileReader& reader, int tile) {
+	const Tile& entry = tiles[tile];
+	if (entry.offset < 0 || entry.size < (int)sizeof(ChunkFileBlob) || entry.offset > reader.size() - entry.size) return nullptr;
+
+	ChunkFileBlob blob;
+	reader.seek(entry.offset);
+	if (reader.read(&blob, sizeof(ChunkFileBlob)) != sizeof(ChunkFileBlob)) return nullptr;
+	if (blob.numVertices < 0 || blob.numIndices < 0 || blob.numCollisionVertices < 0 || blob.numCollisionTriangles < 0) return nullptr;
+	long long expected = (long long)sizeof(ChunkFileBlob) + ((long long)blob.numVertices * vertexSize + blob.numIndices) * 4
+		+ ((long long)blob.numCollisionVertices * 3 + (long long)blob.numCollisionTriangles * 3) * 4;
+	if (expected != entry.size) return nullptr;
+
+	LoadedTile* loaded = new LoadedTile;
+	loaded->tile = tile;
+	loaded->blob = blob;
+	loaded->vertices = new float[blob.numVertices * vertexSize];
+	loaded->indices = new int[blob.numIndices];
+	loaded->collision = nullptr;
+	bool valid = reader.read(loaded->vertices, blob.numVertices * vertexSize * sizeof(float)) == blob.numVertices * vertexSize * (int)sizeof(float)
+		&& reader.read(loaded->indices, blob.numIndices * sizeof(int)) == blob.numIndices * (int)sizeof(int);
+	for (int i = 0; valid && i < blob.numIndices; ++i) {
+		if (loaded->indices[i] < 0 || loaded->indices[i] >= blob.numVertices) valid = false;
+	}
+
+	if (valid && blob.numCollisionTriangles > 0) {
+		float* positions = new float[blob.numCollisionVertices * 3];
+		int* indices = new int[blob.numCollisionTriangles * 3];
+		valid = reader.read(positions, blob.numCollisionVertices * 3 * sizeof(float)) == blob.numCollisionVertices * 3 * (int)sizeof(float)
+			&& reader.read(indices, blob.numCollisionTriangles * 3 * sizeof(int)) == blob.numCollisionTriangles * 3 * (int)sizeof(int);
+		for (int i = 0; valid && i < blob.numCollisionTriangles * 3; ++i) {
+			if (indices[i] < 0 || indices[i] >= blob.numCollisionVertices) valid = false;
+		}
+		if (valid) loaded->collision = createCollisionMesh(positions, blob.numCollisionVertices, indices, blob.numCollisionTriangles);
+		delete[] indices;
+		delete[] positions;
+	}
+
+	if (!valid) {
+		delete[] loaded->vertices;
+		delete[] loaded->indices;
+		delete loaded;
+		return nullptr;
+	}
+	return loaded;
+}
+
+// Runs on the main thread, which owns the device and the physics world.
+// The buffers of streamed tiles count for the loader, they are created while the game runs.
+void ChunkedLevel::finish(LoadedTile* loaded) {
+	MemoryScope scope(MemoryLoader);
+	Tile& tile = tiles[loaded->tile];
+	ChunkFileBlob& blob = loaded->blob;
+	if (tile.wanted) {
+		// A tile that failed to load stays resident without geometry, so it is not requested again every frame
+		if (blob.numIndices > 0) {
+			tile.vertexBuffer = device->createVertexBuffer(blob.numVertices, structure, 0);
+			memcpy(device->lock(tile.vertexBuffer), loaded->vertices, blob.numVertices * vertexSize * sizeof(float));
+			device->unlock(tile.vertexBuffer);
+			tile.indexBuffer = device->createIndexBuffer(blob.numIndices);
+			memcpy(device->lock(tile.indexBuffer), loaded->indices, blob.numIndices * sizeof(int));
+			device->unlock(tile.indexBuffer);
+		}
+
+		tile.collision = loaded->collision;
+		if (tile.collision != nullptr) physics->AddMeshCollider(tile.collision);
+
+		tile.memoryUsage = (blob.numVertices * vertexSize + blob.numIndices) * 4 + (tile.collision != nullptr ? tile.collision->memoryUsage() : 0);
+		tile.state = Resident;
+		++stats.loads;
+	}
+	else {
+		// Left the neighborhood while loading
+		delete loaded->collision;
+		tile.state = Unloaded;
+	}
+	delete[] loaded->vertices;
+	delete[] loaded->indices;
+	delete loaded;
+}
+
+void ChunkedLevel::evict(Tile& tile) {
+	if (tile.collision != nullptr) physics->RemoveMeshCollider(tile.collision);
+	delete tile.collision;
+	if (tile.vertexBuffer != nullptr) device->destroy(tile.vertexBuffer);
+	if (tile.indexBuffer != nullptr) device->destroy(tile.indexBuffer);
+	tile.collision = nullptr;
+	tile.vertexBuffer = nullptr;
+	tile.indexBuffer = nullptr;
+	tile.memoryUsage = 0;
+	tile.state = Unloaded;
+	++stats.evictions;
+}
+
+void ChunkedLevel::update(const vec3& focus, const vec3& camera, bool wait) {
+	if (numTiles == 0) return;
+
+	LoadedTile* done[64];
+	int numDone;
+	do {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			numDone = Kore::min(numFinished, 64);
+			memcpy(done, finished, numDone * sizeof(LoadedTile*));
+			memmove(finished, finished + numDone, (numFinished - numDone) * sizeof(LoadedTile*));
+			numFinished -= numDone;
+		}
+		for (int i = 0; i < numDone; ++i) finish(done[i]);
+	} while (numDone == 64);
+
+	// Evicting removes colliders and destroys buffers, which is done after the loader thread can use the lock again
+	int numQueued = 0;
+	int numEvictions = 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < numTiles; ++i) {
+			Tile& tile = tiles[i];
+			float d = Kore::min(distance(tile.bounds, focus), distance(tile.bounds, camera));
+			if (d < loadRadius) {
+				tile.wanted = true;
+				if (tile.state == Unloaded) {
+					tile.state = Loading;
+					requests[numRequests++] = i;
+					++numQueued;
+				}
+			}
+			else if (d > unloadRadius) {
+				tile.wanted = false;
+				if (tile.state == Resident) evictions[numEvictions++] = i;
+			}
+		}
+	}
+	if (numQueued > 0) requestsChanged.notify_one();
+	for (int i = 0; i < numEvictions; ++i) evict(tiles[evictions[i]]);
+
+	if (wait) {
+		for (;;) {
+			int loading = 0;
+			for (int i = 0; i < numTiles; ++i) {
+				if (tiles[i].state == Loading) ++loading;
+			}
+			if (loading == 0) break;
+
+			std::unique_lock<std::mutex> lock(mutex);
+			loadsFinished.wait(lock, [this] { return numFinished > 0; });
+			numDone = Kore::min(numFinished, 64);
+			memcpy(done, finished, numDone * sizeof(LoadedTile*));
+			memmove(finished, finished + numDone, (numFinished - numDone) * sizeof(LoadedTile*));
+			numFinished -= numDone;
+			lock.unlock();
+			for (int i = 0; i < numDone; ++i) finish(done[i]);
+		}
+	}
+
+	stats.resident = 0;
+	stats.loading = 0;
+	stats.residentBytes = 0;
+	for (int i = 0; i < numTiles; ++i) {
+		if (tiles[i].state == Resident) {
+			++stats.resident;
+			stats.residentBytes += tiles[i].memoryUsage;
+		}
+		else if (tiles[i].state == Loading) {
+			++stats.loading;
+		}
+	}
+}
+
+void ChunkedLevel::submit(int tile, RenderQueue& queue, int pipeline, float depth) {
+	DrawItem item;
+	item.pipeline = pipeline;
+	item.texture = textures;
+	item.vertexBuffers[0] = tiles[tile].vertexBuffer;
+	item.vertexBuffers[1] = nullptr;
+	item.numVertexBuffers = 1;
+	item.indexBuffer = tiles[tile].indexBuffer;
+	item.instanceCount = 0;
+	item.M = mat4::Identity();
+	queue.add(item, depth);
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/IO/FileReader.h>
+#include <Kore/Math/Vector.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "CollisionMesh.h"
+#include "Culling.h"
+#include "PhysicsWorld.h"
+#include "RenderDevice.h"
+#include "RenderQueue.h"
+
+using namespace Kore;
+
+// A level split into square tiles on the XZ plane, each with its own render and collision data.
+//
+// File layout (all values 32 bit, little endian):
+//   ChunkFileHeader
+//   char[128] per texture layer
+//   ChunkFileTile per tile
+//   per tile at its offset: ChunkFileBlob, then
+//     float[numVertices * 9]   pos, tex, nor, layer (as for BatchedMeshObject)
+//     int[numIndices]
+//     float[numCollisionVertices * 3]
+//     int[numCollisionTriangles * 3]
+struct ChunkFileHeader {
+	char magic[4];
+	int version;
+	float tileSize;
+	int numTiles;
+	int numLayers;
+};
+
+struct ChunkFileTile {
+	int x;
+	int z;
+	float min[3];
+	float max[3];
+	int offset;
+	int size;
+};
+
+struct ChunkFileBlob {
+	int numVertices;
+	int numIndices;
+	int numCollisionVertices;
+	int numCollisionTriangles;
+};
+
+// Split the OBJ files into tiles and write them to outputFile. Collision data is built from all meshes of a tile.
+// Materials of meshFiles[i] without a map_Kd entry use fallbackTextures[i].
+bool buildLevelChunks(const char** meshFiles, const char** fallbackTextures, int count, float tileSize, const char* outputFile);
+
+struct ChunkStats {
+	int resident;
+	int loading;
+	// Totals since the level was opened
+	int loads;
+	int evictions;
+	// GPU and collision memory of the resident tiles
+	int residentBytes;
+};
+
+// Streams the tiles of a chunk file around a focus point (the followed ball) and the camera.
+// Tiles are read on a background thread; uploading and registering the collision mesh happens in update.
+// Tiles load within loadRadius and are only evicted beyond unloadRadius, so moving along a tile border does not thrash.
+class ChunkedLevel {
+public:
+	enum TileState { Unloaded, Loading, Resident };
+
+	struct Tile {
+		int x;
+		int z;
+		Bounds bounds;
+		int offset;
+		int size;
+
+		TileState state;
+		// Cleared when the tile leaves the neighborhood while it is still loading
+		bool wanted;
+
+		DeviceVertexBuffer* vertexBuffer;
+		DeviceIndexBuffer* indexBuffer;
+		CollisionMesh* collision;
+		int memoryUsage;
+	};
+
+	ChunkedLevel(RenderDevice* device, PhysicsWorld* physics, const char* filename, const Graphics4::VertexStructure& structure);
+	~ChunkedLevel();
+
+	// False if the file could not be read or is damaged, the level has to be loaded differently then
+	bool isValid() const {
+		return numTiles > 0;
+	}
+
+	// Request and evict tiles for the current position. If wait is set, this blocks until all requested tiles are resident.
+	void update(const vec3& focus, const vec3& camera, bool wait = false);
+
+	// Queue the draw of a resident tile (tiles without geometry have no index buffer)
+	void submit(int tile, RenderQueue& queue, int pipeline, float depth);
+
+	float loadRadius;
+	float unloadRadius;
+
+	float tileSize;
+	int numTiles;
+	Tile* tiles;
+
+	DeviceTexture* textures;
+
+	ChunkStats stats;
+
+private:
+	// CPU data of one tile, produced by the loader thread
+	struct LoadedTile {
+		int tile;
+		ChunkFileBlob blob;
+		float* vertices;
+		int* indices;
+		CollisionMesh* collision;
+	};
+
+	void loaderMain();
+	LoadedTile* loadTile(FileReader& reader, int tile);
+	void finish(LoadedTile* loaded);
+	void evict(Tile& tile);
+
+	RenderDevice* device;
+	PhysicsWorld* physics;
+	Graphics4::VertexStructure structure;
+	char filename[256];
+
+	// Tiles to evict in the current update
+	int* evictions;
+
+	// Shared with the loader thread
+	std::thread loader;
+	std::mutex mutex;
+	std::condition_variable requestsChanged;
+	std::condition_variable loadsFinished;
+	int* requests;
+	int numRequests;
+	LoadedTile** finished;
+	int numFinished;
+	bool stopping;
+};
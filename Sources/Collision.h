@@ -2,6 +2,7 @@
 
 #include "pch.h"
 #include "MeshObject.h"
+#include "CollisionMesh.h"
 #include "Quat.h"
 
 using namespace Kore;
@@ -56,8 +57,8 @@ public:
 
 
 class TriangleCollider {
-	void LoadVector(vec3& v, int index, float* vb) {
-		v.set(vb[index*8 + 0], vb[index*8 + 1], vb[index*8 + 2]);
+	void LoadVector(vec3& v, int index, float* vb, int stride) {
+		v.set(vb[index*stride + 0], vb[index*stride + 1], vb[index*stride + 2]);
 	}
 
 public:
@@ -69,10 +70,14 @@ public:
 		return 0.5f * ((B-A).cross(C-A)).getLength();
 	}
 
-	void LoadFromBuffers(int index, int* ib, float* vb) {
-		LoadVector(A, ib[index * 3], vb);
-		LoadVector(B, ib[index * 3 + 1], vb);
-		LoadVector(C, ib[index * 3 + 2], vb);
+	void LoadFromBuffers(int index, int* ib, float* vb, int stride = 8) {
+		LoadVector(A, ib[index * 3], vb, stride);
+		LoadVector(B, ib[index * 3 + 1], vb, stride);
+		LoadVector(C, ib[index * 3 + 2], vb, stride);
+	}
+
+	void LoadFromCollisionMesh(int index, const CollisionMesh& mesh) {
+		mesh.getTriangle(index, A, B, C);
 	}
 
 	vec3 GetNormal() {
@@ -91,15 +96,232 @@ public:
 		return p;
 
 	}
-	
+
+	// Where the closest point lies: on a corner, on the edge between two corners or inside the face
+	enum Region { RegionA, RegionB, RegionC, RegionAB, RegionAC, RegionBC, RegionFace };
+
+	// The point of the triangle closest to P (Ericson, Real-Time Collision Detection 5.1.5)
+	vec3 ClosestPoint(const vec3& P) const {
+		Region region;
+		return ClosestPoint(P, region);
+	}
+
+	vec3 ClosestPoint(const vec3& P, Region& region) const {
+		vec3 AB = B - A;
+		vec3 AC = C - A;
+		vec3 AP = P - A;
+		float d1 = AB.dot(AP);
+		float d2 = AC.dot(AP);
+		region = RegionA;
+		if (d1 <= 0.0f && d2 <= 0.0f) return A;
+
+		vec3 BP = P - B;
+		float d3 = AB.dot(BP);
+		float d4 = AC.dot(BP);
+		region = RegionB;
+		if (d3 >= 0.0f && d4 <= d3) return B;
+
+		float vc = d1 * d4 - d3 * d2;
+		region = RegionAB;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return A + AB * (d1 / (d1 - d3));
+
+		vec3 CP = P - C;
+		float d5 = AB.dot(CP);
+		float d6 = AC.dot(CP);
+		region = RegionC;
+		if (d6 >= 0.0f && d5 <= d6) return C;
+
+		float vb = d5 * d2 - d1 * d6;
+		region = RegionAC;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return A + AC * (d2 / (d2 - d6));
+
+		float va = d3 * d6 - d5 * d4;
+		region = RegionBC;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) return B + (C - B) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+		float denominator = 1.0f / (va + vb + vc);
+		region = RegionFace;
+		return A + AB * (vb * denominator) + AC * (vc * denominator);
+	}
 
 };
 
+// A collision mesh placed in the world. Several colliders can share one mesh.
 class TriangleMeshCollider {
 public:
-	MeshObject* mesh;
+	CollisionMesh* mesh;
 
 	int lastCollision;
+
+	// Mesh to world space, only rotation, translation and uniform scale are supported
+	mat4 transform;
+	mat4 inverseTransform;
+	float scale;
+
+	// Untransformed colliders use the mesh data directly, without rounding through the matrices
+	bool identity;
+
+	// World space bounds of the transformed mesh
+	vec3 min;
+	vec3 max;
+
+	// Triangle and primitive tests made since PhysicsWorld last collected them
+	int triangleTests;
+	int primitiveTests;
+
+	TriangleMeshCollider() : mesh(nullptr), lastCollision(0), scale(1.0f), identity(true), triangleTests(0), primitiveTests(0) {
+		transform = mat4::Identity();
+		inverseTransform = mat4::Identity();
+	}
+
+	// Call again when the mesh is replaced
+	void SetTransform(const mat4& M) {
+		transform = M;
+		inverseTransform = M.Invert();
+		scale = Kore::sqrt(M.get(0, 0) * M.get(0, 0) + M.get(1, 0) * M.get(1, 0) + M.get(2, 0) * M.get(2, 0));
+		identity = true;
+		mat4 I = mat4::Identity();
+		for (int i = 0; i < 16; ++i) {
+			if (M.data[i] != I.data[i]) identity = false;
+		}
+
+		if (mesh == nullptr) return;
+		// Transform the center and project the half extents onto the world axes
+		vec3 center = (mesh->min + mesh->max) * 0.5f;
+		vec3 extents = (mesh->max - mesh->min) * 0.5f;
+		for (int row = 0; row < 3; ++row) {
+			float c = M.get(row, 0) * center.x() + M.get(row, 1) * center.y() + M.get(row, 2) * center.z() + M.get(row, 3);
+			float e = Kore::abs(M.get(row, 0)) * extents.x() + Kore::abs(M.get(row, 1)) * extents.y() + Kore::abs(M.get(row, 2)) * extents.z();
+			min[row] = identity ? mesh->min[row] : c - e;
+			max[row] = identity ? mesh->max[row] : c + e;
+		}
+	}
+
+	vec3 ToWorld(const vec3& p) const {
+		if (identity) return p;
+		vec3 result;
+		for (int row = 0; row < 3; ++row) {
+			result[row] = transform.get(row, 0) * p.x() + transform.get(row, 1) * p.y() + transform.get(row, 2) * p.z() + transform.get(row, 3);
+		}
+		return result;
+	}
+
+	vec3 ToMesh(const vec3& p) const {
+		if (identity) return p;
+		vec3 result;
+		for (int row = 0; row < 3; ++row) {
+			result[row] = inverseTransform.get(row, 0) * p.x() + inverseTransform.get(row, 1) * p.y() + inverseTransform.get(row, 2) * p.z() + inverseTransform.get(row, 3);
+		}
+		return result;
+	}
+
+	PlaneCollider ToWorld(const PlaneCollider& plane) const {
+		if (identity) return plane;
+		vec3 point = ToWorld(plane.normal * -plane.d);
+		PlaneCollider result;
+		for (int row = 0; row < 3; ++row) {
+			result.normal[row] = transform.get(row, 0) * plane.normal.x() + transform.get(row, 1) * plane.normal.y() + transform.get(row, 2) * plane.normal.z();
+		}
+		result.normal.normalize();
+		result.d = -result.normal.dot(point);
+		return result;
+	}
+
+	// The triangle in world space
+	void LoadTriangle(int index, TriangleCollider& triangle) const {
+		triangle.LoadFromCollisionMesh(index, *mesh);
+		triangle.A = ToWorld(triangle.A);
+		triangle.B = ToWorld(triangle.B);
+		triangle.C = ToWorld(triangle.C);
+	}
+};
+
+// Where a sphere touches a triangle mesh, in world space
+struct MeshContact {
+	// Primitives only have faces
+	enum Feature { Face, Edge, Vertex };
+	Feature feature;
+
+	// From the mesh towards the center of the sphere
+	vec3 normal;
+	// The point of the sphere deepest in the mesh
+	vec3 point;
+	// How far the sphere has to move along the normal to leave the feature
+	float depth;
+
+	// Mesh vertices of an edge (the lower index first) or twice the vertex, -1 for faces
+	int vertexA;
+	int vertexB;
+
+	// The triangle or primitive and its order in the mesh, equally deep contacts are sorted by it
+	int source;
+	int order;
+};
+
+// All contacts of a sphere with one mesh collider, the deepest first
+struct ContactManifold {
+	static const int maxContacts = 16;
+	MeshContact contacts[maxContacts];
+	int count;
+
+	// A contact with the same feature as an existing one (the same edge or vertex, or a face in the same plane) only replaces it if it is deeper.
+	// When the manifold is full the shallowest contact is replaced.
+	void Add(const MeshContact& contact) {
+		for (int i = 0; i < count; ++i) {
+			const MeshContact& existing = contacts[i];
+			if (existing.feature != contact.feature) continue;
+			bool same = contact.feature == MeshContact::Face
+				? existing.normal.dot(contact.normal) > 0.999f && Kore::abs(existing.depth - contact.depth) < 0.001f
+				: existing.vertexA == contact.vertexA && existing.vertexB == contact.vertexB;
+			if (!same) continue;
+			if (Deeper(contact, existing)) contacts[i] = contact;
+			return;
+		}
+		if (count < maxContacts) {
+			contacts[count++] = contact;
+			return;
+		}
+		int replace = 0;
+		for (int i = 1; i < count; ++i) {
+			if (Deeper(contacts[replace], contacts[i])) replace = i;
+		}
+		if (Deeper(contact, contacts[replace])) contacts[replace] = contact;
+	}
+
+	// Drops edges and vertices of triangles touching with their face and those pushing almost like a face, then sorts by depth
+	void Finish(const CollisionMesh& mesh) {
+		int kept = 0;
+		for (int i = 0; i < count; ++i) {
+			const MeshContact& contact = contacts[i];
+			bool covered = false;
+			for (int j = 0; j < count && contact.feature != MeshContact::Face && !covered; ++j) {
+				const MeshContact& face = contacts[j];
+				if (face.feature != MeshContact::Face) continue;
+				if (face.normal.dot(contact.normal) > 0.95f) covered = true;
+				if (!mesh.isTriangle(face.source)) continue;
+				bool hasA = false, hasB = false;
+				for (int corner = 0; corner < 3; ++corner) {
+					int vertex = mesh.index(face.source * 3 + corner);
+					if (vertex == contact.vertexA) hasA = true;
+					if (vertex == contact.vertexB) hasB = true;
+				}
+				if (hasA && hasB) covered = true;
+			}
+			if (!covered) contacts[kept++] = contact;
+		}
+		count = kept;
+
+		for (int i = 1; i < count; ++i) {
+			MeshContact contact = contacts[i];
+			int j = i;
+			for (; j > 0 && Deeper(contact, contacts[j - 1]); --j) contacts[j] = contacts[j - 1];
+			contacts[j] = contact;
+		}
+	}
+
+	static bool Deeper(const MeshContact& a, const MeshContact& b) {
+		return a.depth > b.depth || (a.depth == b.depth && a.order < b.order);
+	}
 };
 
 // A sphere is defined by a radius and a center.
@@ -228,37 +450,170 @@ public:
 	}
 	
 	bool IntersectsWith(TriangleMeshCollider& other) {
-		TriangleCollider coll;
-		int* current = other.mesh->mesh->indices;
-		float* currentVertex = other.mesh->mesh->vertices;
-		for (int i = 0; i < other.mesh->mesh->numFaces; i++) {
-			coll.LoadFromBuffers(i, current, currentVertex);
-			if (coll.Area() < 0.1f) continue;
-			if (IntersectsWith(coll)) {
-				other.lastCollision = i;
-				vec3 normal;
-				if (coll.GetNormal().x() < -0.8f)
-					normal = coll.GetNormal();
-				// Kore::log(Warning, "Intersected with triangle: %f, %f, %f", coll.GetNormal().x(), coll.GetNormal().y(), coll.GetNormal().z());
-				return true;
+		if (other.mesh == nullptr) return false;
+
+		// Most meshes of a chunked level are far away
+		for (int k = 0; k < 3; ++k) {
+			if (center[k] + radius < other.min[k] || center[k] - radius > other.max[k]) return false;
+		}
+
+		// Test in mesh space. Slivers were already removed when building the collision mesh.
+		SphereCollider local;
+		local.center = other.ToMesh(center);
+		local.radius = radius / other.scale;
+		vec3 extents(local.radius, local.radius, local.radius);
+
+		// The intersecting feature replacing the lowest triangle, like a test of all triangles in order would find
+		const CollisionMesh& mesh = *other.mesh;
+		int hit = -1;
+		int hitOrder = 0;
+		auto test = [&](int feature) {
+			int order = mesh.order(feature);
+			if (hit >= 0 && order > hitOrder) return;
+			bool touches;
+			if (mesh.isTriangle(feature)) {
+				TriangleCollider coll;
+				coll.LoadFromCollisionMesh(feature, mesh);
+				touches = local.IntersectsWith(coll);
+				++other.triangleTests;
+			}
+			else {
+				touches = local.IntersectsWith(mesh.primitive(feature));
+				++other.primitiveTests;
 			}
+			if (touches) {
+				hit = feature;
+				hitOrder = order;
+			}
+		};
+		mesh.query(local.center - extents, local.center + extents, test);
+		if (hit < 0) return false;
+		other.lastCollision = hit;
+		return true;
+	}
+
+	// Both sides of a rectangle and the inside of a box count
+	bool IntersectsWith(const CollisionPrimitive& other) {
+		float distance2 = 0.0f;
+		for (int k = 0; k < 3; ++k) {
+			float outside = Kore::max(other.min[k] - center[k], center[k] - other.max[k]);
+			if (outside > 0.0f) distance2 += outside * outside;
 		}
-		return false;
+		return distance2 <= radius * radius;
+	}
+
+	// Every feature of the mesh touching the sphere, found in one traversal of the hierarchy. Faces (also of primitives) push along
+	// the normal of their plane like the single contact of IntersectsWith, coplanar faces like the two triangles of a tile give one contact.
+	// Edges and vertices push away from the closest point, but only where no face contact includes them, so a ball rolling
+	// across the seam between two tiles does not bump into the edge. Returns the number of contacts.
+	int GetContacts(TriangleMeshCollider& other, ContactManifold& manifold) {
+		manifold.count = 0;
+		if (other.mesh == nullptr) return 0;
+
+		for (int k = 0; k < 3; ++k) {
+			if (center[k] + radius < other.min[k] || center[k] - radius > other.max[k]) return 0;
+		}
+
+		SphereCollider local;
+		local.center = other.ToMesh(center);
+		local.radius = radius / other.scale;
+		vec3 extents(local.radius, local.radius, local.radius);
+
+		// Corners of the edge or vertex regions of TriangleCollider::ClosestPoint
+		static const int corners[6][2] = { { 0, 0 }, { 1, 1 }, { 2, 2 }, { 0, 1 }, { 0, 2 }, { 1, 2 } };
+
+		const CollisionMesh& mesh = *other.mesh;
+		auto test = [&](int feature) {
+			MeshContact contact;
+			contact.source = feature;
+			contact.order = mesh.order(feature);
+			contact.vertexA = -1;
+			contact.vertexB = -1;
+			if (mesh.isTriangle(feature)) {
+				TriangleCollider coll;
+				coll.LoadFromCollisionMesh(feature, mesh);
+				++other.triangleTests;
+				if (!local.IntersectsWith(coll)) return;
+
+				TriangleCollider::Region region;
+				vec3 closest = coll.ClosestPoint(local.center, region);
+				PlaneCollider plane = GetContactPlane(other, feature);
+				if (region == TriangleCollider::RegionFace) {
+					contact.feature = MeshContact::Face;
+					contact.normal = plane.normal;
+					contact.depth = -PenetrationDepth(plane);
+				}
+				else {
+					contact.feature = region <= TriangleCollider::RegionC ? MeshContact::Vertex : MeshContact::Edge;
+					int a = mesh.index(feature * 3 + corners[region][0]);
+					int b = mesh.index(feature * 3 + corners[region][1]);
+					contact.vertexA = Kore::min(a, b);
+					contact.vertexB = Kore::max(a, b);
+					vec3 offset = center - other.ToWorld(closest);
+					float distance = offset.getLength();
+					// A center on the edge leaves through the face
+					contact.normal = distance > 1e-6f ? offset * (1.0f / distance) : plane.normal;
+					contact.depth = radius - distance;
+					if (contact.depth < 0.0f) return;
+				}
+			}
+			else {
+				++other.primitiveTests;
+				if (!local.IntersectsWith(mesh.primitive(feature))) return;
+				PlaneCollider plane = GetContactPlane(other, feature);
+				contact.feature = MeshContact::Face;
+				contact.normal = plane.normal;
+				contact.depth = -PenetrationDepth(plane);
+			}
+			contact.point = center - contact.normal * radius;
+			manifold.Add(contact);
+		};
+		mesh.query(local.center - extents, local.center + extents, test);
+
+		manifold.Finish(mesh);
+		if (manifold.count > 0) other.lastCollision = manifold.contacts[0].source;
+		return manifold.count;
+	}
+
+	// The world space plane of the feature found by the last intersection test
+	PlaneCollider GetContactPlane(const TriangleMeshCollider& other) {
+		return GetContactPlane(other, other.lastCollision);
+	}
+
+	// For a box this is the face the center is furthest outside of, like the plane of a triangle it is used for the whole contact.
+	PlaneCollider GetContactPlane(const TriangleMeshCollider& other, int feature) {
+		const CollisionMesh& mesh = *other.mesh;
+		if (mesh.isTriangle(feature)) {
+			TriangleCollider coll;
+			other.LoadTriangle(feature, coll);
+			return coll.GetPlane();
+		}
+
+		const CollisionPrimitive& primitive = mesh.primitive(feature);
+		PlaneCollider plane;
+		if (primitive.shape == CollisionPrimitive::Rectangle) {
+			plane.normal = primitive.normal;
+			plane.d = -primitive.normal.dot(primitive.min);
+		}
+		else {
+			BoxCollider box((primitive.min + primitive.max) * 0.5f, primitive.max - primitive.min);
+			const PlaneCollider* faces[] = { &box.posX, &box.negX, &box.posY, &box.negY, &box.posZ, &box.negZ };
+			SphereCollider local;
+			local.center = other.ToMesh(center);
+			plane = *faces[0];
+			for (int i = 1; i < 6; ++i) {
+				if (local.Distance(*faces[i]) > local.Distance(plane)) plane = *faces[i];
+			}
+		}
+		return other.ToWorld(plane);
 	}
 
 	vec3 GetCollisionNormal(const TriangleMeshCollider& other) {
-		TriangleCollider coll;
-		coll.LoadFromBuffers(other.lastCollision, other.mesh->mesh->indices, other.mesh->mesh->vertices);
-		return coll.GetNormal();
+		return GetContactPlane(other).normal;
 	}
 
 	float PenetrationDepth(const TriangleMeshCollider& other) {
-		// Get a collider for the plane of the triangle
-		TriangleCollider coll;
-		coll.LoadFromBuffers(other.lastCollision, other.mesh->mesh->indices, other.mesh->mesh->vertices);
-		PlaneCollider plane = coll.GetPlane();
-
-		return PenetrationDepth(plane);		
+		return PenetrationDepth(GetContactPlane(other));
 	}
 
 
@@ -273,10 +628,6 @@ public:
 	// and the other two vectors are perpendicular to the collision normal
 	mat3 GetCollisonBasis(vec3 x) {
 		x.normalize();
-		mat3 basis;
-		basis.Set(0, 0, x.x());
-		basis.Set(1, 0, x.y());
-		basis.Set(2, 0, x.z());
 
 		// Find a y-vector
 		// x will often be the global y-axis, so don't use this -> use global z instead
@@ -284,16 +635,20 @@ public:
 		y = x.cross(y);
 		y = y.normalize();
 
-		basis.Set(0, 1, y.x());
-		basis.Set(1, 1, y.y());
-		basis.Set(2, 1, y.z());
-
 		vec3 z = x.cross(y);
 		z.normalize();
 
-		basis.Set(0, 2, z.x());
-		basis.Set(1, 2, z.y());
-		basis.Set(2, 2, z.z());
+		// Write the columns directly (column major)
+		mat3 basis;
+		basis.data[0] = x.x();
+		basis.data[1] = x.y();
+		basis.data[2] = x.z();
+		basis.data[3] = y.x();
+		basis.data[4] = y.y();
+		basis.data[5] = y.z();
+		basis.data[6] = z.x();
+		basis.data[7] = z.y();
+		basis.data[8] = z.z();
 		return basis;
 	}
 
@@ -0,0 +1,215 @@
+#include "pch.h"
+#include "CollisionBenchmark.h"
+
+#include <Kore/Log.h>
+#include <Kore/Math/Core.h>
+#include <Kore/Math/Random.h>
+#include <chrono>
+#include "Collision.h"
+
+using namespace Kore;
+
+namespace {
+	typedef std::chrono::high_resolution_clock Clock;
+
+	enum Distribution { Hit, NearMiss, FarMiss, NumDistributions };
+	const char* distributionNames[] = { "hit", "near", "far" };
+
+	// Every primitive runs at least this many operations so short tests are not dominated by the clock
+	const int minOperations = 4000000;
+
+	const float radius = 0.5f;
+
+	float randomFloat(float min, float max) {
+		return min + (max - min) * (Random::get(0, 10000) / 10000.0f);
+	}
+
+	vec3 randomDirection() {
+		for (;;) {
+			vec3 v(randomFloat(-1, 1), randomFloat(-1, 1), randomFloat(-1, 1));
+			float length = v.getLength();
+			if (length > 0.1f && length <= 1.0f) return v * (1.0f / length);
+		}
+	}
+
+	// Keeps the results alive so the tests are not optimized away
+	volatile int sink;
+
+	void report(const char* name, Distribution distribution, double nanoseconds, int trueCount, int count) {
+		Kore::log(Info, "  %-24s %-5s %7.2f ns/op %8.1f Mops/s %6.1f%% true", name, distributionNames[distribution], nanoseconds, 1000.0 / nanoseconds, 100.0 * trueCount / count);
+	}
+
+	// Calls test(i) for all cases often enough for minOperations and returns ns per call. trueCount is the number of cases returning true.
+	template<class Test> double measure(Test test, int count, int& trueCount) {
+		int repeats = minOperations / count + 1;
+		trueCount = 0;
+		for (int i = 0; i < count; ++i) trueCount += test(i) ? 1 : 0;
+
+		int total = 0;
+		Clock::time_point start = Clock::now();
+		for (int repeat = 0; repeat < repeats; ++repeat) {
+			for (int i = 0; i < count; ++i) total += test(i) ? 1 : 0;
+		}
+		double nanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / ((double)repeats * count);
+		sink = total;
+		return nanoseconds;
+	}
+
+	// Spheres around random triangles, placed on the triangle (hit), just beyond the radius from the triangle's plane,
+	// an edge or a vertex (near) or far away (far)
+	void createTriangleCases(Distribution distribution, TriangleCollider* triangles, SphereCollider* spheres, int count) {
+		for (int i = 0; i < count; ++i) {
+			TriangleCollider& triangle = triangles[i];
+			vec3 offset(randomFloat(-20, 20), randomFloat(-5, 5), randomFloat(-20, 20));
+			triangle.A = offset + vec3(randomFloat(-2, 2), randomFloat(-0.5f, 0.5f), randomFloat(-2, 2));
+			triangle.B = offset + vec3(randomFloat(-2, 2), randomFloat(-0.5f, 0.5f), randomFloat(-2, 2));
+			triangle.C = offset + vec3(randomFloat(-2, 2), randomFloat(-0.5f, 0.5f), randomFloat(-2, 2));
+			if (triangle.Area() < 0.05f) {
+				--i;
+				continue;
+			}
+			vec3 normal = triangle.GetNormal();
+
+			// Barycentric weights of a point inside the triangle
+			float u = randomFloat(0, 1), v = randomFloat(0, 1);
+			if (u + v > 1.0f) {
+				u = 1.0f - u;
+				v = 1.0f - v;
+			}
+			vec3 inside = triangle.A + (triangle.B - triangle.A) * u + (triangle.C - triangle.A) * v;
+
+			spheres[i].radius = radius;
+			if (distribution == Hit) {
+				spheres[i].center = inside + normal * randomFloat(-0.9f, 0.9f) * radius;
+			}
+			else if (distribution == NearMiss) {
+				int feature = Random::get(0, 2);
+				if (feature == 0) {
+					float side = Random::get(0, 1) == 0 ? -1.0f : 1.0f;
+					spheres[i].center = inside + normal * side * radius * randomFloat(1.01f, 1.5f);
+				}
+				else if (feature == 1) {
+					// Beyond the edge AB, away from C
+					vec3 edge = triangle.B - triangle.A;
+					vec3 out = edge.cross(normal);
+					out.normalize();
+					if (out.dot(triangle.C - triangle.A) > 0.0f) out = out * -1.0f;
+					vec3 onEdge = triangle.A + edge * randomFloat(0.1f, 0.9f);
+					spheres[i].center = onEdge + out * radius * randomFloat(1.01f, 1.5f);
+				}
+				else {
+					// Beyond the vertex A, away from the triangle
+					vec3 out = (triangle.A - triangle.B) + (triangle.A - triangle.C);
+					out.normalize();
+					spheres[i].center = triangle.A + out * radius * randomFloat(1.01f, 1.5f);
+				}
+			}
+			else {
+				spheres[i].center = inside + randomDirection() * randomFloat(10, 50);
+			}
+		}
+	}
+
+	// Spheres inside the box, just outside one of its faces or far away. The box is the goal of the level.
+	void createBoxCases(Distribution distribution, const vec3& center, const vec3& extents, SphereCollider* spheres, int count) {
+		for (int i = 0; i < count; ++i) {
+			spheres[i].radius = radius;
+			vec3 p(randomFloat(-0.5f, 0.5f) * extents.x(), randomFloat(-0.5f, 0.5f) * extents.y(), randomFloat(-0.5f, 0.5f) * extents.z());
+			if (distribution == NearMiss) {
+				int axis = Random::get(0, 2);
+				float side = Random::get(0, 1) == 0 ? -1.0f : 1.0f;
+				p[axis] = side * (extents[axis] * 0.5f + radius * randomFloat(1.01f, 1.5f));
+			}
+			else if (distribution == FarMiss) {
+				p = randomDirection() * randomFloat(20, 100);
+			}
+			spheres[i].center = center + p;
+		}
+	}
+
+	// Spheres crossing, just beside or far from random planes
+	void createPlaneCases(Distribution distribution, PlaneCollider* planes, SphereCollider* spheres, int count) {
+		for (int i = 0; i < count; ++i) {
+			planes[i].normal = randomDirection();
+			planes[i].d = randomFloat(-20, 20);
+			float side = Random::get(0, 1) == 0 ? -1.0f : 1.0f;
+			float distance;
+			if (distribution == Hit) distance = randomFloat(-0.9f, 0.9f) * radius;
+			else if (distribution == NearMiss) distance = side * radius * randomFloat(1.01f, 1.5f);
+			else distance = side * randomFloat(10, 100);
+
+			// A point on the plane moved along the normal
+			vec3 tangent = planes[i].normal.cross(randomDirection()) * randomFloat(0, 20);
+			spheres[i].radius = radius;
+			spheres[i].center = planes[i].normal * -planes[i].d + tangent + planes[i].normal * distance;
+		}
+	}
+}
+
+void benchmarkCollision(int count, int seed) {
+	Random::init(seed);
+	Kore::log(Info, "Collision benchmark, %i cases per distribution, seed %i", count, seed);
+
+	TriangleCollider* triangles = new TriangleCollider[count];
+	PlaneCollider* planes = new PlaneCollider[count];
+	SphereCollider* spheres = new SphereCollider[count];
+	int trueCount;
+
+	for (int distribution = 0; distribution < NumDistributions; ++distribution) {
+		Distribution d = (Distribution)distribution;
+		createTriangleCases(d, triangles, spheres, count);
+
+		double ns = measure([&](int i) { return spheres[i].IntersectsWith(triangles[i]); }, count, trueCount);
+		report("sphere-triangle", d, ns, trueCount, count);
+		ns = measure([&](int i) { return spheres[i].IsSeparatedByVertexA(triangles[i]); }, count, trueCount);
+		report("separated by vertex A", d, ns, trueCount, count);
+		ns = measure([&](int i) { return spheres[i].IsSeparatedByVertexB(triangles[i]); }, count, trueCount);
+		report("separated by vertex B", d, ns, trueCount, count);
+		ns = measure([&](int i) { return spheres[i].IsSeparatedByVertexC(triangles[i]); }, count, trueCount);
+		report("separated by vertex C", d, ns, trueCount, count);
+	}
+
+	vec3 boxCenter(-46.0f, -4.0f, 44.0f);
+	vec3 boxExtents(10.6f, 4.4f, 4.0f);
+	BoxCollider box(boxCenter, boxExtents);
+	for (int distribution = 0; distribution < NumDistributions; ++distribution) {
+		Distribution d = (Distribution)distribution;
+		createBoxCases(d, boxCenter, boxExtents, spheres, count);
+
+		double ns = measure([&](int i) { return spheres[i].IntersectsWith(box); }, count, trueCount);
+		report("sphere-box", d, ns, trueCount, count);
+		ns = measure([&](int i) { return spheres[i].IntersectsWithSides(box); }, count, trueCount);
+		report("sphere-box sides", d, ns, trueCount, count);
+		ns = measure([&](int i) { return spheres[i].IsInside(box); }, count, trueCount);
+		report("sphere inside box", d, ns, trueCount, count);
+	}
+
+	for (int distribution = 0; distribution < NumDistributions; ++distribution) {
+		Distribution d = (Distribution)distribution;
+		createPlaneCases(d, planes, spheres, count);
+
+		double ns = measure([&](int i) { return spheres[i].IntersectsWith(planes[i]); }, count, trueCount);
+		report("sphere-plane", d, ns, trueCount, count);
+		ns = measure([&](int i) { return spheres[i].IsInside(planes[i]); }, count, trueCount);
+		report("sphere inside plane", d, ns, trueCount, count);
+		ns = measure([&](int i) { return spheres[i].IsOutside(planes[i]); }, count, trueCount);
+		report("sphere outside plane", d, ns, trueCount, count);
+	}
+
+	// The basis only depends on the normal, the result is checked for orthonormality
+	vec3* normals = new vec3[count];
+	for (int i = 0; i < count; ++i) normals[i] = randomDirection();
+	SphereCollider sphere;
+	sphere.center = vec3(0, 0, 0);
+	sphere.radius = radius;
+	double ns = measure([&](int i) {
+		mat3 basis = sphere.GetCollisonBasis(normals[i]);
+		return Kore::abs(basis.data[0] * basis.data[3] + basis.data[1] * basis.data[4] + basis.data[2] * basis.data[5]) < 0.001f;
+	}, count, trueCount);
+	Kore::log(Info, "  %-24s %-5s %7.2f ns/op %8.1f Mops/s %6.1f%% orthogonal", "collision basis", "", ns, 1000.0 / ns, 100.0 * trueCount / count);
+
+	delete[] normals;
+	delete[] spheres;
+	delete[] planes;
+	delete[] triangles;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "pch.h"
+
+// Times the primitive tests of Collision.h in isolation and logs ns/op and throughput per primitive.
+// Every test runs on count random cases per distribution: hits, near misses just outside the contact distance
+// and far misses. The same seed gives the same cases.
+void benchmarkCollision(int count, int seed);
@@ -0,0 +1,766 @@
+#include "pch.h"
+#include "CollisionMesh.h"
+#include "MemoryTracking.h"
+
+#include <Kore/Math/Core.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace Kore;
+
+CollisionMesh::CollisionMesh() : numVertices(0), numTriangles(0), positions(nullptr), indices16(nullptr), indices32(nullptr), primitives(nullptr), numPrimitives(0), numReplacedTriangles(0),
+	nodes(nullptr), numNodes(0), featureOrder(nullptr), numFeatures(0), arena(nullptr), arenaSize(0) {}
+
+CollisionMesh::~CollisionMesh() {
+	delete[] featureOrder;
+	delete[] nodes;
+	delete[] primitives;
+	delete[] arena;
+}
+
+namespace {
+	struct WeldEntry {
+		long long key[3];
+		int source;
+
+		bool operator<(const WeldEntry& other) const {
+			if (key[0] != other.key[0]) return key[0] < other.key[0];
+			if (key[1] != other.key[1]) return key[1] < other.key[1];
+			if (key[2] != other.key[2]) return key[2] < other.key[2];
+			return source < other.source;
+		}
+
+		bool samePosition(const WeldEntry& other) const {
+			return key[0] == other.key[0] && key[1] == other.key[1] && key[2] == other.key[2];
+		}
+	};
+
+	long long quantize(float value, float cell) {
+		return (long long)floor(value / cell + 0.5f);
+	}
+
+	// Merge all vertices that fall into the same grid cell.
+	// Writes the unique positions to out and the new index of every input vertex to remap, returns the number of unique positions.
+	int weld(const float* vertices, int stride, int count, float cell, float* out, int* remap) {
+		WeldEntry* entries = new WeldEntry[count];
+		for (int i = 0; i < count; ++i) {
+			for (int k = 0; k < 3; ++k) entries[i].key[k] = quantize(vertices[i * stride + k], cell);
+			entries[i].source = i;
+		}
+		std::sort(entries, entries + count);
+
+		int unique = 0;
+		for (int i = 0; i < count; ++i) {
+			if (i == 0 || !entries[i].samePosition(entries[i - 1])) {
+				// The first vertex of a cell defines the position
+				const float* v = &vertices[entries[i].source * stride];
+				out[unique * 3 + 0] = v[0];
+				out[unique * 3 + 1] = v[1];
+				out[unique * 3 + 2] = v[2];
+				++unique;
+			}
+			remap[entries[i].source] = unique - 1;
+		}
+
+		delete[] entries;
+		return unique;
+	}
+
+	vec3 load(const float* positions, int index) {
+		return vec3(positions[index * 3 + 0], positions[index * 3 + 1], positions[index * 3 + 2]);
+	}
+
+	struct SortedTriangle {
+		int key[3];
+		int triangle;
+
+		bool operator<(const SortedTriangle& other) const {
+			if (key[0] != other.key[0]) return key[0] < other.key[0];
+			if (key[1] != other.key[1]) return key[1] < other.key[1];
+			if (key[2] != other.key[2]) return key[2] < other.key[2];
+			return triangle < other.triangle;
+		}
+	};
+
+	// Remove triangles which use the same three vertices as an earlier one (in either winding).
+	// Returns the new triangle count, the order of the remaining triangles is preserved.
+	int removeDuplicates(int* triangles, int count) {
+		SortedTriangle* sorted = new SortedTriangle[count];
+		for (int i = 0; i < count; ++i) {
+			int* t = &triangles[i * 3];
+			sorted[i].key[0] = t[0];
+			sorted[i].key[1] = t[1];
+			sorted[i].key[2] = t[2];
+			std::sort(sorted[i].key, sorted[i].key + 3);
+			sorted[i].triangle = i;
+		}
+		std::sort(sorted, sorted + count);
+
+		bool* keep = new bool[count];
+		for (int i = 0; i < count; ++i) {
+			keep[sorted[i].triangle] = i == 0 || memcmp(sorted[i].key, sorted[i - 1].key, sizeof(sorted[i].key)) != 0;
+		}
+
+		int remaining = 0;
+		for (int i = 0; i < count; ++i) {
+			if (!keep[i]) continue;
+			memmove(&triangles[remaining * 3], &triangles[i * 3], 3 * sizeof(int));
+			++remaining;
+		}
+
+		delete[] keep;
+		delete[] sorted;
+		return remaining;
+	}
+
+	struct Edge {
+		int a, b;
+		int triangle;
+
+		bool operator<(const Edge& other) const {
+			if (a != other.a) return a < other.a;
+			if (b != other.b) return b < other.b;
+			return triangle < other.triangle;
+		}
+	};
+
+	// An axis-aligned rectangle in the (u, v) coordinates of its plane
+	struct Rectangle {
+		// Quantized u and v directions, plane offset and winding
+		long long group[8];
+		vec3 du;
+		vec3 dv;
+		float w;
+		bool flip;
+		float u0, u1, v0, v1;
+		bool removed;
+	};
+
+	bool sameGroup(const Rectangle& a, const Rectangle& b) {
+		return memcmp(a.group, b.group, sizeof(a.group)) == 0;
+	}
+
+	int compareGroup(const Rectangle& a, const Rectangle& b) {
+		for (int i = 0; i < 8; ++i) {
+			if (a.group[i] != b.group[i]) return a.group[i] < b.group[i] ? -1 : 1;
+		}
+		return 0;
+	}
+
+	// Flip a direction so that its first significant component is positive
+	vec3 canonicalDirection(vec3 d) {
+		for (int i = 0; i < 3; ++i) {
+			if (Kore::abs(d[i]) > 0.0001f) {
+				return d[i] < 0.0f ? d * -1.0f : d;
+			}
+		}
+		return d;
+	}
+
+	bool lexicographicallyGreater(const vec3& a, const vec3& b) {
+		for (int i = 0; i < 3; ++i) {
+			if (Kore::abs(a[i] - b[i]) > 0.0001f) return a[i] > b[i];
+		}
+		return false;
+	}
+
+	// Build a rectangle from the triangles (corner, a, b) and (other corner, b, a) which share the diagonal a-b.
+	// Returns false if the two triangles do not form a rectangle.
+	bool makeRectangle(const float* positions, int corner, int a, int b, int otherCorner, const vec3& normal, float cell, Rectangle& rect) {
+		vec3 c = load(positions, corner);
+		vec3 U = load(positions, a) - c;
+		vec3 V = load(positions, b) - c;
+		vec3 parallelogram = c + U + V - load(positions, otherCorner);
+		if (parallelogram.getLength() > cell) return false;
+		float lengthU = U.getLength();
+		float lengthV = V.getLength();
+		if (Kore::abs(U.dot(V)) > 0.001f * lengthU * lengthV) return false;
+
+		vec3 du = canonicalDirection(U / lengthU);
+		vec3 dv = canonicalDirection(V / lengthV);
+		if (lexicographicallyGreater(dv, du)) std::swap(du, dv);
+		vec3 n = du.cross(dv);
+
+		rect.du = du;
+		rect.dv = dv;
+		rect.w = n.dot(c);
+		rect.flip = n.dot(normal) < 0.0f;
+		vec3 corners[4] = { c, c + U, c + V, c + U + V };
+		rect.u0 = rect.u1 = du.dot(c);
+		rect.v0 = rect.v1 = dv.dot(c);
+		for (int i = 1; i < 4; ++i) {
+			rect.u0 = Kore::min(rect.u0, du.dot(corners[i]));
+			rect.u1 = Kore::max(rect.u1, du.dot(corners[i]));
+			rect.v0 = Kore::min(rect.v0, dv.dot(corners[i]));
+			rect.v1 = Kore::max(rect.v1, dv.dot(corners[i]));
+		}
+		for (int i = 0; i < 3; ++i) {
+			rect.group[i] = quantize(du[i], 0.0001f);
+			rect.group[3 + i] = quantize(dv[i], 0.0001f);
+		}
+		rect.group[6] = quantize(rect.w, cell);
+		rect.group[7] = rect.flip ? 1 : 0;
+		rect.removed = false;
+		return true;
+	}
+
+	struct AlongU {
+		float cell;
+		bool operator()(const Rectangle& a, const Rectangle& b) const {
+			int group = compareGroup(a, b);
+			if (group != 0) return group < 0;
+			if (quantize(a.v0, cell) != quantize(b.v0, cell)) return a.v0 < b.v0;
+			if (quantize(a.v1, cell) != quantize(b.v1, cell)) return a.v1 < b.v1;
+			return a.u0 < b.u0;
+		}
+	};
+
+	struct AlongV {
+		float cell;
+		bool operator()(const Rectangle& a, const Rectangle& b) const {
+			int group = compareGroup(a, b);
+			if (group != 0) return group < 0;
+			if (quantize(a.u0, cell) != quantize(b.u0, cell)) return a.u0 < b.u0;
+			if (quantize(a.u1, cell) != quantize(b.u1, cell)) return a.u1 < b.u1;
+			return a.v0 < b.v0;
+		}
+	};
+
+	// Merge neighbouring rectangles of the same row into one, returns the new count
+	int mergeAlongU(Rectangle* rects, int count, float cell) {
+		AlongU order = { cell };
+		std::sort(rects, rects + count, order);
+		int last = -1;
+		for (int i = 0; i < count; ++i) {
+			Rectangle& r = rects[i];
+			if (last >= 0) {
+				Rectangle& l = rects[last];
+				if (sameGroup(l, r) && quantize(l.v0, cell) == quantize(r.v0, cell) && quantize(l.v1, cell) == quantize(r.v1, cell)
+					&& Kore::abs(l.u1 - r.u0) <= cell) {
+					l.u1 = Kore::max(l.u1, r.u1);
+					r.removed = true;
+					continue;
+				}
+			}
+			last = i;
+		}
+		return (int)(std::remove_if(rects, rects + count, [](const Rectangle& r) { return r.removed; }) - rects);
+	}
+
+	int mergeAlongV(Rectangle* rects, int count, float cell) {
+		AlongV order = { cell };
+		std::sort(rects, rects + count, order);
+		int last = -1;
+		for (int i = 0; i < count; ++i) {
+			Rectangle& r = rects[i];
+			if (last >= 0) {
+				Rectangle& l = rects[last];
+				if (sameGroup(l, r) && quantize(l.u0, cell) == quantize(r.u0, cell) && quantize(l.u1, cell) == quantize(r.u1, cell)
+					&& Kore::abs(l.v1 - r.v0) <= cell) {
+					l.v1 = Kore::max(l.v1, r.v1);
+					r.removed = true;
+					continue;
+				}
+			}
+			last = i;
+		}
+		return (int)(std::remove_if(rects, rects + count, [](const Rectangle& r) { return r.removed; }) - rects);
+	}
+
+	void emit(float*& soup, const vec3& v) {
+		soup[0] = v.x();
+		soup[1] = v.y();
+		soup[2] = v.z();
+		soup += 3;
+	}
+
+	// Replace pairs of coplanar triangles forming rectangles by merged rectangles.
+	// Writes the resulting triangles as a soup of positions (9 floats per triangle) and returns the triangle count.
+	int mergeCoplanar(const float* positions, const int* triangles, int count, float cell, float* soup) {
+		Edge* edges = new Edge[count * 3];
+		for (int i = 0; i < count; ++i) {
+			for (int k = 0; k < 3; ++k) {
+				int a = triangles[i * 3 + k];
+				int b = triangles[i * 3 + (k + 1) % 3];
+				edges[i * 3 + k].a = Kore::min(a, b);
+				edges[i * 3 + k].b = Kore::max(a, b);
+				edges[i * 3 + k].triangle = i;
+			}
+		}
+		std::sort(edges, edges + count * 3);
+
+		vec3* normals = new vec3[count];
+		for (int i = 0; i < count; ++i) {
+			vec3 a = load(positions, triangles[i * 3 + 0]);
+			vec3 b = load(positions, triangles[i * 3 + 1]);
+			vec3 c = load(positions, triangles[i * 3 + 2]);
+			normals[i] = (b - a).cross(c - a);
+			normals[i].normalize();
+		}
+
+		bool* paired = new bool[count];
+		for (int i = 0; i < count; ++i) paired[i] = false;
+		Rectangle* rects = new Rectangle[count / 2 + 1];
+		int numRects = 0;
+
+		for (int i = 0; i + 1 < count * 3; ++i) {
+			Edge& e0 = edges[i];
+			Edge& e1 = edges[i + 1];
+			if (e0.a != e1.a || e0.b != e1.b) continue;
+			// Only edges shared by exactly two triangles
+			if (i + 2 < count * 3 && edges[i + 2].a == e0.a && edges[i + 2].b == e0.b) continue;
+			if (i > 0 && edges[i - 1].a == e0.a && edges[i - 1].b == e0.b) continue;
+			if (paired[e0.triangle] || paired[e1.triangle]) continue;
+			if (normals[e0.triangle].dot(normals[e1.triangle]) < 0.9999f) continue;
+
+			int corner = -1;
+			int otherCorner = -1;
+			for (int k = 0; k < 3; ++k) {
+				int v = triangles[e0.triangle * 3 + k];
+				if (v != e0.a && v != e0.b) corner = v;
+				v = triangles[e1.triangle * 3 + k];
+				if (v != e0.a && v != e0.b) otherCorner = v;
+			}
+
+			if (makeRectangle(positions, corner, e0.a, e0.b, otherCorner, normals[e0.triangle], cell, rects[numRects])) {
+				paired[e0.triangle] = true;
+				paired[e1.triangle] = true;
+				++numRects;
+			}
+		}
+
+		// Alternate until nothing merges anymore
+		int before;
+		do {
+			before = numRects;
+			numRects = mergeAlongU(rects, numRects, cell);
+			numRects = mergeAlongV(rects, numRects, cell);
+		} while (numRects != before);
+
+		float* out = soup;
+		for (int i = 0; i < numRects; ++i) {
+			Rectangle& r = rects[i];
+			vec3 n = r.du.cross(r.dv) * r.w;
+			vec3 p00 = r.du * r.u0 + r.dv * r.v0 + n;
+			vec3 p10 = r.du * r.u1 + r.dv * r.v0 + n;
+			vec3 p11 = r.du * r.u1 + r.dv * r.v1 + n;
+			vec3 p01 = r.du * r.u0 + r.dv * r.v1 + n;
+			if (r.flip) {
+				emit(out, p00); emit(out, p11); emit(out, p10);
+				emit(out, p11); emit(out, p00); emit(out, p01);
+			}
+			else {
+				emit(out, p00); emit(out, p10); emit(out, p11);
+				emit(out, p11); emit(out, p01); emit(out, p00);
+			}
+		}
+		for (int i = 0; i < count; ++i) {
+			if (paired[i]) continue;
+			for (int k = 0; k < 3; ++k) emit(out, load(positions, triangles[i * 3 + k]));
+		}
+
+		delete[] rects;
+		delete[] paired;
+		delete[] normals;
+		delete[] edges;
+		return (int)(out - soup) / 9;
+	}
+}
+
+namespace {
+	struct CenterLess {
+		const float* boxes;
+		int axis;
+		// Twice the center, ties broken by the index so the order does not depend on the sort
+		bool operator()(int a, int b) const {
+			float ca = boxes[a * 6 + axis] + boxes[a * 6 + 3 + axis];
+			float cb = boxes[b * 6 + axis] + boxes[b * 6 + 3 + axis];
+			if (ca != cb) return ca < cb;
+			return a < b;
+		}
+	};
+
+	int buildNode(const float* boxes, int* order, int start, int count, int leafSize, CollisionNode* nodes, int& numNodes) {
+		int index = numNodes++;
+		CollisionNode& node = nodes[index];
+		float centerMin[3], centerMax[3];
+		for (int i = 0; i < count; ++i) {
+			const float* box = &boxes[order[start + i] * 6];
+			for (int k = 0; k < 3; ++k) {
+				float center = box[k] + box[3 + k];
+				node.min[k] = i == 0 ? box[k] : Kore::min(node.min[k], box[k]);
+				node.max[k] = i == 0 ? box[3 + k] : Kore::max(node.max[k], box[3 + k]);
+				centerMin[k] = i == 0 ? center : Kore::min(centerMin[k], center);
+				centerMax[k] = i == 0 ? center : Kore::max(centerMax[k], center);
+			}
+		}
+
+		if (count <= leafSize) {
+			// Ascending, so the lowest hit within a leaf is found first
+			std::sort(order + start, order + start + count);
+			node.start = start;
+			node.count = count;
+			return index;
+		}
+
+		CenterLess less = { boxes, 0 };
+		for (int k = 1; k < 3; ++k) {
+			if (centerMax[k] - centerMin[k] > centerMax[less.axis] - centerMin[less.axis]) less.axis = k;
+		}
+		int half = count / 2;
+		std::nth_element(order + start, order + start + half, order + start + count, less);
+		buildNode(boxes, order, start, half, leafSize, nodes, numNodes);
+		node.start = buildNode(boxes, order, start + half, count - half, leafSize, nodes, numNodes);
+		node.count = 0;
+		return index;
+	}
+}
+
+namespace {
+	// The axis n points along, -1 if it is not axis aligned
+	int normalAxis(const vec3& n) {
+		for (int k = 0; k < 3; ++k) {
+			if (Kore::abs(n[k]) > 0.9999f) return k;
+		}
+		return -1;
+	}
+
+	// Identifies a face of an axis aligned box by its normal, its extent on the two other axes and its position along the normal
+	struct FaceKey {
+		long long key[6];
+		int rectangle;
+
+		bool operator<(const FaceKey& other) const {
+			for (int i = 0; i < 6; ++i) {
+				if (key[i] != other.key[i]) return key[i] < other.key[i];
+			}
+			return rectangle < other.rectangle;
+		}
+
+		bool sameFace(const FaceKey& other) const {
+			return memcmp(key, other.key, sizeof(key)) == 0;
+		}
+	};
+
+	FaceKey boxFace(const vec3& min, const vec3& max, int axis, bool positive, float cell) {
+		int u = (axis + 1) % 3;
+		int v = (axis + 2) % 3;
+		FaceKey face;
+		face.key[0] = axis * 2 + (positive ? 1 : 0);
+		face.key[1] = quantize(min[u], cell);
+		face.key[2] = quantize(max[u], cell);
+		face.key[3] = quantize(min[v], cell);
+		face.key[4] = quantize(max[v], cell);
+		face.key[5] = quantize(positive ? max[axis] : min[axis], cell);
+		face.rectangle = -1;
+		return face;
+	}
+
+	// The first unused rectangle with the given face, -1 if there is none
+	int findFace(const FaceKey* faces, int count, const FaceKey& face, const bool* used) {
+		for (const FaceKey* f = std::lower_bound(faces, faces + count, face); f != faces + count && f->sameFace(face); ++f) {
+			if (!used[f->rectangle]) return f->rectangle;
+		}
+		return -1;
+	}
+
+	// Two triangles sharing their diagonal which exactly cover an axis aligned rectangle
+	bool makeAxisAlignedRectangle(const CollisionMesh& mesh, int t0, int t1, int axis, float cell, CollisionPrimitive& rect) {
+		vec3 corners[6];
+		mesh.getTriangle(t0, corners[0], corners[1], corners[2]);
+		mesh.getTriangle(t1, corners[3], corners[4], corners[5]);
+		rect.min = rect.max = corners[0];
+		for (int i = 1; i < 6; ++i) {
+			for (int k = 0; k < 3; ++k) {
+				rect.min[k] = Kore::min(rect.min[k], corners[i][k]);
+				rect.max[k] = Kore::max(rect.max[k], corners[i][k]);
+			}
+		}
+		if (rect.max[axis] - rect.min[axis] > cell) return false;
+
+		// Every corner of the triangles is a corner of the rectangle
+		int u = (axis + 1) % 3;
+		int v = (axis + 2) % 3;
+		for (int i = 0; i < 6; ++i) {
+			bool onU = Kore::abs(corners[i][u] - rect.min[u]) <= cell || Kore::abs(corners[i][u] - rect.max[u]) <= cell;
+			bool onV = Kore::abs(corners[i][v] - rect.min[v]) <= cell || Kore::abs(corners[i][v] - rect.max[v]) <= cell;
+			if (!onU || !onV) return false;
+		}
+
+		// And the triangles do not overlap
+		float area = 0.5f * ((corners[1] - corners[0]).cross(corners[2] - corners[0]).getLength() + (corners[4] - corners[3]).cross(corners[5] - corners[3]).getLength());
+		float rectangleArea = (rect.max[u] - rect.min[u]) * (rect.max[v] - rect.min[v]);
+		if (Kore::abs(area - rectangleArea) > 0.001f * rectangleArea) return false;
+
+		rect.shape = CollisionPrimitive::Rectangle;
+		rect.min[axis] = rect.max[axis] = 0.5f * (rect.min[axis] + rect.max[axis]);
+		rect.order = Kore::min(t0, t1);
+		return true;
+	}
+
+	// Find axis aligned rectangles made of two triangles and closed boxes made of six such rectangles with their normals pointing outwards.
+	// Marks the replaced triangles and returns the number of primitives written to out (at most numTriangles / 2).
+	int findPrimitives(const CollisionMesh& mesh, float cell, bool* replaced, CollisionPrimitive* out) {
+		int count = mesh.numTriangles;
+		vec3* normals = new vec3[count];
+		int* axes = new int[count];
+		for (int i = 0; i < count; ++i) {
+			vec3 a, b, c;
+			mesh.getTriangle(i, a, b, c);
+			normals[i] = (b - a).cross(c - a);
+			normals[i].normalize();
+			axes[i] = normalAxis(normals[i]);
+		}
+
+		Edge* edges = new Edge[count * 3];
+		for (int i = 0; i < count; ++i) {
+			for (int k = 0; k < 3; ++k) {
+				int a = mesh.index(i * 3 + k);
+				int b = mesh.index(i * 3 + (k + 1) % 3);
+				edges[i * 3 + k].a = Kore::min(a, b);
+				edges[i * 3 + k].b = Kore::max(a, b);
+				edges[i * 3 + k].triangle = i;
+			}
+		}
+		std::sort(edges, edges + count * 3);
+
+		CollisionPrimitive* rectangles = new CollisionPrimitive[count / 2 + 1];
+		int numRectangles = 0;
+		for (int i = 0; i + 1 < count * 3; ++i) {
+			Edge& e0 = edges[i];
+			Edge& e1 = edges[i + 1];
+			if (e0.a != e1.a || e0.b != e1.b) continue;
+			int t0 = e0.triangle;
+			int t1 = e1.triangle;
+			if (replaced[t0] || replaced[t1] || axes[t0] < 0 || axes[t0] != axes[t1] || normals[t0].dot(normals[t1]) < 0.9999f) continue;
+
+			CollisionPrimitive& rect = rectangles[numRectangles];
+			if (!makeAxisAlignedRectangle(mesh, t0, t1, axes[t0], cell, rect)) continue;
+			rect.normal = vec3(0, 0, 0);
+			rect.normal[axes[t0]] = normals[t0][axes[t0]] > 0.0f ? 1.0f : -1.0f;
+			replaced[t0] = true;
+			replaced[t1] = true;
+			++numRectangles;
+		}
+
+		FaceKey* faces = new FaceKey[numRectangles];
+		bool* used = new bool[numRectangles];
+		for (int i = 0; i < numRectangles; ++i) {
+			int axis = normalAxis(rectangles[i].normal);
+			faces[i] = boxFace(rectangles[i].min, rectangles[i].max, axis, rectangles[i].normal[axis] > 0.0f, cell);
+			faces[i].rectangle = i;
+			used[i] = false;
+		}
+		std::sort(faces, faces + numRectangles);
+
+		int numPrimitives = 0;
+		for (int i = 0; i < numRectangles; ++i) {
+			CollisionPrimitive& top = rectangles[i];
+			if (used[i] || top.normal.y() <= 0.0f) continue;
+
+			// The nearest face below the top with the same extent closes the box
+			FaceKey below = boxFace(top.min, top.max, 1, false, cell);
+			below.key[5] = quantize(top.max.y(), cell);
+			const FaceKey* candidate = std::lower_bound(faces, faces + numRectangles, below);
+			int bottom = -1;
+			while (candidate != faces) {
+				--candidate;
+				if (memcmp(candidate->key, below.key, 5 * sizeof(long long)) != 0) break;
+				if (!used[candidate->rectangle]) {
+					bottom = candidate->rectangle;
+					break;
+				}
+			}
+			if (bottom < 0 || rectangles[bottom].min.y() >= top.max.y() - cell) continue;
+
+			vec3 min = top.min;
+			vec3 max = top.max;
+			min[1] = rectangles[bottom].min.y();
+			int sides[4];
+			int numSides = 0;
+			for (int axis = 0; axis < 3; axis += 2) {
+				for (int positive = 0; positive < 2; ++positive) {
+					sides[numSides++] = findFace(faces, numRectangles, boxFace(min, max, axis, positive != 0, cell), used);
+				}
+			}
+			if (sides[0] < 0 || sides[1] < 0 || sides[2] < 0 || sides[3] < 0) continue;
+
+			CollisionPrimitive& box = out[numPrimitives++];
+			box.shape = CollisionPrimitive::Box;
+			box.min = min;
+			box.max = max;
+			box.normal = vec3(0, 0, 0);
+			box.order = Kore::min(top.order, rectangles[bottom].order);
+			used[i] = used[bottom] = true;
+			for (int k = 0; k < 4; ++k) {
+				used[sides[k]] = true;
+				box.order = Kore::min(box.order, rectangles[sides[k]].order);
+			}
+		}
+		for (int i = 0; i < numRectangles; ++i) {
+			if (!used[i]) out[numPrimitives++] = rectangles[i];
+		}
+
+		delete[] used;
+		delete[] faces;
+		delete[] rectangles;
+		delete[] edges;
+		delete[] axes;
+		delete[] normals;
+		return numPrimitives;
+	}
+}
+
+int buildCollisionTree(const float* boxes, int count, int leafSize, CollisionNode* nodes, int* order) {
+	if (count == 0) return 0;
+	for (int i = 0; i < count; ++i) order[i] = i;
+	int numNodes = 0;
+	buildNode(boxes, order, 0, count, leafSize, nodes, numNodes);
+	return numNodes;
+}
+
+CollisionMesh* buildCollisionMesh(const float* vertices, int vertexStride, const int* indices, int numTriangles, const CollisionMeshSettings& settings) {
+	MemoryScope scope(MemoryPhysics);
+	float cell = settings.weldDistance;
+
+	// Weld the positions of all vertices that are referenced
+	int maxIndex = -1;
+	for (int i = 0; i < numTriangles * 3; ++i) maxIndex = Kore::max(maxIndex, indices[i]);
+	int numInput = maxIndex + 1;
+	float* positions = new float[numInput * 3];
+	int* remap = new int[numInput];
+	weld(vertices, vertexStride, numInput, cell, positions, remap);
+
+	// Remove degenerate triangles
+	int* triangles = new int[numTriangles * 3];
+	int count = 0;
+	for (int i = 0; i < numTriangles; ++i) {
+		int a = remap[indices[i * 3 + 0]];
+		int b = remap[indices[i * 3 + 1]];
+		int c = remap[indices[i * 3 + 2]];
+		if (a == b || b == c || c == a) continue;
+		float area = 0.5f * (load(positions, b) - load(positions, a)).cross(load(positions, c) - load(positions, a)).getLength();
+		if (area < settings.minArea) continue;
+		triangles[count * 3 + 0] = a;
+		triangles[count * 3 + 1] = b;
+		triangles[count * 3 + 2] = c;
+		++count;
+	}
+
+	count = removeDuplicates(triangles, count);
+
+	// Flatten to a triangle soup (after merging) and weld once more to get the final index buffer
+	float* soup = new float[count * 9];
+	if (settings.mergeCoplanar) {
+		count = mergeCoplanar(positions, triangles, count, cell, soup);
+	}
+	else {
+		for (int i = 0; i < count * 3; ++i) {
+			memcpy(&soup[i * 3], &positions[triangles[i] * 3], 3 * sizeof(float));
+		}
+	}
+	delete[] triangles;
+	delete[] remap;
+	delete[] positions;
+
+	float* welded = new float[count * 9];
+	int* soupRemap = new int[count * 3];
+	int numVertices = weld(soup, 3, count * 3, cell, welded, soupRemap);
+
+	CollisionMesh* mesh = createCollisionMesh(welded, numVertices, soupRemap, count, settings.extractPrimitives);
+
+	delete[] soupRemap;
+	delete[] welded;
+	delete[] soup;
+	return mesh;
+}
+
+CollisionMesh* createCollisionMesh(const float* positions, int numVertices, const int* indices, int numTriangles, bool extractPrimitives) {
+	MemoryScope scope(MemoryPhysics);
+	CollisionMesh* mesh = new CollisionMesh;
+	mesh->numVertices = numVertices;
+	mesh->numTriangles = numTriangles;
+	bool narrow = numVertices <= 0x10000;
+	int positionBytes = numVertices * 3 * sizeof(float);
+	int indexBytes = numTriangles * 3 * (narrow ? sizeof(unsigned short) : sizeof(unsigned int));
+	mesh->arenaSize = positionBytes + indexBytes;
+	mesh->arena = new char[mesh->arenaSize];
+	mesh->positions = reinterpret_cast<float*>(mesh->arena);
+	memcpy(mesh->positions, positions, positionBytes);
+	if (narrow) {
+		mesh->indices16 = reinterpret_cast<unsigned short*>(mesh->arena + positionBytes);
+		for (int i = 0; i < numTriangles * 3; ++i) mesh->indices16[i] = (unsigned short)indices[i];
+	}
+	else {
+		mesh->indices32 = reinterpret_cast<unsigned int*>(mesh->arena + positionBytes);
+		for (int i = 0; i < numTriangles * 3; ++i) mesh->indices32[i] = (unsigned int)indices[i];
+	}
+
+	for (int i = 0; i < numVertices; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			float value = positions[i * 3 + k];
+			mesh->min[k] = i == 0 ? value : Kore::min(mesh->min[k], value);
+			mesh->max[k] = i == 0 ? value : Kore::max(mesh->max[k], value);
+		}
+	}
+
+	bool* replaced = new bool[numTriangles];
+	for (int i = 0; i < numTriangles; ++i) replaced[i] = false;
+	CollisionPrimitive* primitives = new CollisionPrimitive[numTriangles / 2 + 1];
+	mesh->numPrimitives = extractPrimitives ? findPrimitives(*mesh, 0.001f, replaced, primitives) : 0;
+	mesh->primitives = new CollisionPrimitive[mesh->numPrimitives];
+	memcpy(mesh->primitives, primitives, mesh->numPrimitives * sizeof(CollisionPrimitive));
+	delete[] primitives;
+
+	// The remaining triangles and the primitives sorted by the order of their contacts, so leaves list them in that order
+	// and a query can skip the rest of a leaf after a hit
+	int* features = new int[numTriangles + mesh->numPrimitives];
+	mesh->numFeatures = 0;
+	for (int i = 0; i < numTriangles; ++i) {
+		if (!replaced[i]) features[mesh->numFeatures++] = i;
+	}
+	mesh->numReplacedTriangles = numTriangles - mesh->numFeatures;
+	for (int i = 0; i < mesh->numPrimitives; ++i) {
+		features[mesh->numFeatures++] = numTriangles + i;
+	}
+	std::sort(features, features + mesh->numFeatures, [mesh](int a, int b) { return mesh->order(a) < mesh->order(b); });
+
+	float* boxes = new float[mesh->numFeatures * 6];
+	for (int i = 0; i < mesh->numFeatures; ++i) {
+		vec3 min, max;
+		if (mesh->isTriangle(features[i])) {
+			vec3 a, b, c;
+			mesh->getTriangle(features[i], a, b, c);
+			for (int k = 0; k < 3; ++k) {
+				min[k] = Kore::min(a[k], Kore::min(b[k], c[k]));
+				max[k] = Kore::max(a[k], Kore::max(b[k], c[k]));
+			}
+		}
+		else {
+			min = mesh->primitive(features[i]).min;
+			max = mesh->primitive(features[i]).max;
+		}
+		for (int k = 0; k < 3; ++k) {
+			boxes[i * 6 + k] = min[k];
+			boxes[i * 6 + 3 + k] = max[k];
+		}
+	}
+
+	// Leaves of a few features, the tree is sized exactly once the node count is known
+	CollisionNode* nodes = new CollisionNode[mesh->numFeatures * 2];
+	mesh->featureOrder = new int[mesh->numFeatures];
+	mesh->numNodes = buildCollisionTree(boxes, mesh->numFeatures, 4, nodes, mesh->featureOrder);
+	for (int i = 0; i < mesh->numFeatures; ++i) mesh->featureOrder[i] = features[mesh->featureOrder[i]];
+	mesh->nodes = new CollisionNode[mesh->numNodes];
+	memcpy(mesh->nodes, nodes, mesh->numNodes * sizeof(CollisionNode));
+	delete[] nodes;
+	delete[] boxes;
+	delete[] features;
+	delete[] replaced;
+	return mesh;
+}
+
+CollisionMesh* buildCollisionMesh(const Mesh& mesh, const CollisionMeshSettings& settings) {
+	return buildCollisionMesh(mesh.vertices, 8, mesh.indices, mesh.numFaces, settings);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/Math/Vector.h>
+#include "ObjLoader.h"
+
+using namespace Kore;
+
+// A node of a bounding volume hierarchy, stored depth first. The left child of an inner node follows it directly
+// and start is the index of the right child. A leaf (count > 0) covers count entries of the order array starting at start.
+struct CollisionNode {
+	float min[3];
+	float max[3];
+	int start;
+	int count;
+};
+
+// Build a hierarchy over count boxes (6 floats each, min and then max) by splitting at the median of the longest axis.
+// nodes needs room for 2 * count nodes, order receives the box indices (ascending within a leaf). Returns the number of nodes.
+int buildCollisionTree(const float* boxes, int count, int leafSize, CollisionNode* nodes, int* order);
+
+// Calls visit(index) for every box index in a leaf whose bounds overlap the box from boxMin to boxMax
+template<typename Visitor> void queryCollisionTree(const CollisionNode* nodes, int numNodes, const int* order, const vec3& boxMin, const vec3& boxMax, Visitor& visit) {
+	// Enough for any tree built by a median split
+	int stack[64];
+	int top = 0;
+	if (numNodes > 0) stack[top++] = 0;
+	while (top > 0) {
+		int index = stack[--top];
+		const CollisionNode& node = nodes[index];
+		if (boxMin.x() > node.max[0] || boxMax.x() < node.min[0] || boxMin.y() > node.max[1] || boxMax.y() < node.min[1] || boxMin.z() > node.max[2] || boxMax.z() < node.min[2]) continue;
+		if (node.count > 0) {
+			for (int i = 0; i < node.count; ++i) visit(order[node.start + i]);
+			continue;
+		}
+		stack[top++] = node.start;
+		stack[top++] = index + 1;
+	}
+}
+
+// An axis aligned part of a collision mesh, tested instead of the triangles it was fitted to
+struct CollisionPrimitive {
+	enum Shape { Rectangle, Box };
+	Shape shape;
+
+	// A rectangle is flat along the axis of its normal
+	vec3 min;
+	vec3 max;
+
+	// Rectangles only, points along one of the axes
+	vec3 normal;
+
+	// The lowest index of the replaced triangles, contacts are found in the order of the triangles they replace
+	int order;
+};
+
+// A compact triangle mesh used only for collision detection.
+// It is independent of the render data: positions are stored densely (3 floats per vertex)
+// and the indices use 16 bits whenever the mesh has few enough vertices.
+class CollisionMesh {
+public:
+	CollisionMesh();
+	~CollisionMesh();
+
+	int numVertices;
+	int numTriangles;
+
+	// 3 floats per vertex
+	float* positions;
+
+	// Exactly one of these is set
+	unsigned short* indices16;
+	unsigned int* indices32;
+
+	int index(int i) const {
+		return indices16 != nullptr ? indices16[i] : (int)indices32[i];
+	}
+
+	vec3 vertex(int i) const {
+		return vec3(positions[i * 3 + 0], positions[i * 3 + 1], positions[i * 3 + 2]);
+	}
+
+	void getTriangle(int triangle, vec3& a, vec3& b, vec3& c) const {
+		a = vertex(index(triangle * 3 + 0));
+		b = vertex(index(triangle * 3 + 1));
+		c = vertex(index(triangle * 3 + 2));
+	}
+
+	// Axis aligned bounds of all positions
+	vec3 min;
+	vec3 max;
+
+	// Axis aligned rectangles and closed boxes found in the triangles. The triangles they replace stay in the
+	// index buffer (e.g. for writing the mesh to a file), but are not part of the hierarchy.
+	CollisionPrimitive* primitives;
+	int numPrimitives;
+	int numReplacedTriangles;
+
+	// Hierarchy over the features of the mesh: feature i < numTriangles is a triangle, the others are primitives
+	CollisionNode* nodes;
+	int numNodes;
+	int* featureOrder;
+	int numFeatures;
+
+	bool isTriangle(int feature) const {
+		return feature < numTriangles;
+	}
+
+	const CollisionPrimitive& primitive(int feature) const {
+		return primitives[feature - numTriangles];
+	}
+
+	// Contacts with lower values are reported first
+	int order(int feature) const {
+		return isTriangle(feature) ? feature : primitive(feature).order;
+	}
+
+	// Calls visit(feature) for all features in leaves overlapping the box, in no particular order
+	template<typename Visitor> void query(const vec3& boxMin, const vec3& boxMax, Visitor& visit) const {
+		queryCollisionTree(nodes, numNodes, featureOrder, boxMin, boxMax, visit);
+	}
+
+	// Size of the collision data in bytes
+	int memoryUsage() const {
+		return sizeof(CollisionMesh) + arenaSize + numPrimitives * sizeof(CollisionPrimitive) + numNodes * sizeof(CollisionNode) + numFeatures * sizeof(int);
+	}
+
+	// positions and indices live in this single allocation
+	char* arena;
+	int arenaSize;
+};
+
+struct CollisionMeshSettings {
+	// Vertices closer than this are merged
+	float weldDistance = 0.001f;
+
+	// Triangles with a smaller area are dropped
+	float minArea = 0.1f;
+
+	// Merge coplanar rectangles (e.g. floor tiles) into larger ones
+	bool mergeCoplanar = true;
+
+	// Replace axis aligned rectangles and boxes by primitives
+	bool extractPrimitives = true;
+};
+
+// Build a collision mesh from a strided position buffer (the first 3 floats of each vertex are used)
+CollisionMesh* buildCollisionMesh(const float* vertices, int vertexStride, const int* indices, int numTriangles, const CollisionMeshSettings& settings = CollisionMeshSettings());
+
+CollisionMesh* buildCollisionMesh(const Mesh& mesh, const CollisionMeshSettings& settings = CollisionMeshSettings());
+
+// Wrap already processed data (e.g. loaded from a file) without welding or merging, primitives are still extracted
+CollisionMesh* createCollisionMesh(const float* positions, int numVertices, const int* indices, int numTriangles, bool extractPrimitives = true);
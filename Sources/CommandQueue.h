@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include "MemoryTracking.h"
+
+// Bounded lock-free queue for many producers and a single consumer.
+// Each slot carries a sequence number telling producers and the consumer whose turn it is,
+// so push never blocks and never allocates. Capacity is rounded up to a power of two.
+template<class T> class CommandQueue {
+public:
+	// The slots are allocated for the given tag
+	CommandQueue(int minCapacity, MemoryTag tag = MemoryUntagged) {
+		capacity = 1;
+		while ((int)capacity < minCapacity) capacity *= 2;
+		mask = capacity - 1;
+		MemoryScope scope(tag);
+		cells = new Cell[capacity];
+		for (unsigned i = 0; i < capacity; ++i) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		head.store(0, std::memory_order_relaxed);
+		tail = 0;
+	}
+
+	~CommandQueue() {
+		delete[] cells;
+	}
+
+	// Safe to call from any thread, false if the queue is full
+	bool push(const T& value) {
+		unsigned position = head.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[position & mask];
+			unsigned sequence = cell.sequence.load(std::memory_order_acquire);
+			int difference = (int)(sequence - position);
+			if (difference == 0) {
+				if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					cell.value = value;
+					cell.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0) {
+				return false;
+			}
+			else {
+				position = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Only the consumer thread may call this, false if the queue is empty
+	bool pop(T& value) {
+		Cell& cell = cells[tail & mask];
+		unsigned sequence = cell.sequence.load(std::memory_order_acquire);
+		if ((int)(sequence - (tail + 1)) < 0) return false;
+		value = cell.value;
+		cell.sequence.store(tail + capacity, std::memory_order_release);
+		++tail;
+		return true;
+	}
+
+	int getCapacity() const {
+		return (int)capacity;
+	}
+
+private:
+	struct Cell {
+		std::atomic<unsigned> sequence;
+		T value;
+	};
+
+	Cell* cells;
+	unsigned capacity;
+	unsigned mask;
+
+	// Keep producers and the consumer on different cache lines
+	char padding0[64];
+	std::atomic<unsigned> head;
+	char padding1[64];
+	unsigned tail;
+
+	CommandQueue(const CommandQueue&);
+	CommandQueue& operator=(const CommandQueue&);
+};
@@ -0,0 +1,131 @@
+#include "pch.h"
+#include "Culling.h"
+
+#include <Kore/Math/Core.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define CULLING_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace Kore;
+
+Bounds Bounds::fromVertices(const float* vertices, int stride, int count, float scale) {
+	Bounds bounds;
+	if (count == 0) {
+		bounds.radius = 0.0f;
+		return bounds;
+	}
+	bounds.min = vec3(vertices[0], vertices[1], vertices[2]) * scale;
+	bounds.max = bounds.min;
+	for (int i = 1; i < count; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			float value = vertices[i * stride + k] * scale;
+			bounds.min[k] = Kore::min(bounds.min[k], value);
+			bounds.max[k] = Kore::max(bounds.max[k], value);
+		}
+	}
+	bounds.center = (bounds.min + bounds.max) * 0.5f;
+
+	// The sphere around the box center, tightened to the actual vertices
+	float radiusSquared = 0.0f;
+	for (int i = 0; i < count; ++i) {
+		vec3 v = vec3(vertices[i * stride + 0], vertices[i * stride + 1], vertices[i * stride + 2]) * scale;
+		radiusSquared = Kore::max(radiusSquared, (v - bounds.center).dot(v - bounds.center));
+	}
+	bounds.radius = Kore::sqrt(radiusSquared);
+	return bounds;
+}
+
+void Bounds::transformSphere(const mat4& M, vec3& worldCenter, float& worldRadius) const {
+	for (int row = 0; row < 3; ++row) {
+		worldCenter[row] = M.get(row, 0) * center.x() + M.get(row, 1) * center.y() + M.get(row, 2) * center.z() + M.get(row, 3);
+	}
+	float scale = 0.0f;
+	for (int col = 0; col < 3; ++col) {
+		float lengthSquared = M.get(0, col) * M.get(0, col) + M.get(1, col) * M.get(1, col) + M.get(2, col) * M.get(2, col);
+		scale = Kore::max(scale, lengthSquared);
+	}
+	worldRadius = radius * Kore::sqrt(scale);
+}
+
+void Bounds::transformBox(const mat4& M, vec3& worldMin, vec3& worldMax) const {
+	// Transform the center and project the half extents onto the world axes
+	vec3 extents = (max - min) * 0.5f;
+	for (int row = 0; row < 3; ++row) {
+		float c = M.get(row, 0) * center.x() + M.get(row, 1) * center.y() + M.get(row, 2) * center.z() + M.get(row, 3);
+		float e = Kore::abs(M.get(row, 0)) * extents.x() + Kore::abs(M.get(row, 1)) * extents.y() + Kore::abs(M.get(row, 2)) * extents.z();
+		worldMin[row] = c - e;
+		worldMax[row] = c + e;
+	}
+}
+
+void Frustum::extract(const mat4& PV) {
+	// Gribb/Hartmann: every plane is the last row plus or minus one of the others
+	for (int i = 0; i < 6; ++i) {
+		int row = i / 2;
+		float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+		float a = PV.get(3, 0) + sign * PV.get(row, 0);
+		float b = PV.get(3, 1) + sign * PV.get(row, 1);
+		float c = PV.get(3, 2) + sign * PV.get(row, 2);
+		float w = PV.get(3, 3) + sign * PV.get(row, 3);
+		float length = Kore::sqrt(a * a + b * b + c * c);
+		nx[i] = a / length;
+		ny[i] = b / length;
+		nz[i] = c / length;
+		d[i] = w / length;
+	}
+}
+
+bool Frustum::intersectsSphere(const vec3& center, float radius) const {
+	for (int i = 0; i < 6; ++i) {
+		if (nx[i] * center.x() + ny[i] * center.y() + nz[i] * center.z() + d[i] < -radius) return false;
+	}
+	return true;
+}
+
+bool Frustum::intersectsBox(const vec3& min, const vec3& max) const {
+	for (int i = 0; i < 6; ++i) {
+		// The corner furthest along the plane normal
+		float x = nx[i] >= 0.0f ? max.x() : min.x();
+		float y = ny[i] >= 0.0f ? max.y() : min.y();
+		float z = nz[i] >= 0.0f ? max.z() : min.z();
+		if (nx[i] * x + ny[i] * y + nz[i] * z + d[i] < 0.0f) return false;
+	}
+	return true;
+}
+
+int Frustum::intersectSpheres(const float* x, const float* y, const float* z, const float* radius, int count, unsigned char* visible) const {
+	int numVisible = 0;
+	int i = 0;
+#ifdef CULLING_SSE
+	for (; i + 4 <= count; i += 4) {
+		__m128 px = _mm_loadu_ps(&x[i]);
+		__m128 py = _mm_loadu_ps(&y[i]);
+		__m128 pz = _mm_loadu_ps(&z[i]);
+		__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&radius[i]));
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; ++p) {
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(nx[p])), _mm_mul_ps(py, _mm_set1_ps(ny[p]))),
+			                             _mm_add_ps(_mm_mul_ps(pz, _mm_set1_ps(nz[p])), _mm_set1_ps(d[p])));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negativeRadius));
+		}
+		int mask = _mm_movemask_ps(outside);
+		for (int k = 0; k < 4; ++k) {
+			visible[i + k] = (mask & (1 << k)) == 0 ? 1 : 0;
+			numVisible += visible[i + k];
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		visible[i] = 1;
+		for (int p = 0; p < 6; ++p) {
+			if (nx[p] * x[i] + ny[p] * y[i] + nz[p] * z[i] + d[p] < -radius[i]) {
+				visible[i] = 0;
+				break;
+			}
+		}
+		numVisible += visible[i];
+	}
+	return numVisible;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/Math/Matrix.h>
+
+using namespace Kore;
+
+// Axis aligned box and bounding sphere of a mesh in its local space
+struct Bounds {
+	vec3 min;
+	vec3 max;
+	vec3 center;
+	float radius;
+
+	// The first 3 floats of every vertex are its position
+	static Bounds fromVertices(const float* vertices, int stride, int count, float scale = 1.0f);
+
+	// The bounding sphere after a transformation with M (the radius is scaled by the largest axis scale)
+	void transformSphere(const mat4& M, vec3& worldCenter, float& worldRadius) const;
+
+	// The world space axis aligned box enclosing the transformed box
+	void transformBox(const mat4& M, vec3& worldMin, vec3& worldMax) const;
+};
+
+// The six planes of a view frustum with normals pointing inwards
+class Frustum {
+public:
+	// Plane i is nx[i] * x + ny[i] * y + nz[i] * z + d[i] = 0, stored as separate arrays for the batch test
+	float nx[6];
+	float ny[6];
+	float nz[6];
+	float d[6];
+
+	// Extract the planes from a projection * view matrix
+	void extract(const mat4& PV);
+
+	bool intersectsSphere(const vec3& center, float radius) const;
+
+	bool intersectsBox(const vec3& min, const vec3& max) const;
+
+	// Test count spheres given as separate coordinate arrays (SSE, 4 spheres at a time).
+	// Writes 1 to visible for spheres touching the frustum and 0 for the others, returns the number of visible spheres.
+	int intersectSpheres(const float* x, const float* y, const float* z, const float* radius, int count, unsigned char* visible) const;
+};
+
+// Per-frame culling counters
+struct CullingStats {
+	int visible;
+	int culled;
+
+	void reset() {
+		visible = 0;
+		culled = 0;
+	}
+};
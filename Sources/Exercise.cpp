@@ -4,16 +4,40 @@
 #include <Kore/Math/Core.h>
 #include <Kore/Math/Random.h>
 #include <Kore/System.h>
-#include <Kore/Audio1/Audio.h>
+#include <Kore/Audio2/Audio.h>
 #include <Kore/Input/Keyboard.h>
 #include <Kore/Input/Mouse.h>
 #include <Kore/Graphics1/Image.h>
 #include <Kore/Graphics4/Graphics.h>
-#include <Kore/Graphics4/PipelineState.h>
 #include <Kore/Log.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
 
 #include "ObjLoader.h"
+#include "AudioBenchmark.h"
+#include "AudioMixer.h"
+#include "BatchedMeshObject.h"
+#include "BatchSweep.h"
+#include "ChunkedLevel.h"
 #include "Collision.h"
+#include "CollisionBenchmark.h"
+#include "Culling.h"
+#include "InputRecording.h"
+#include "InstanceBenchmark.h"
+#include "InstancedRenderer.h"
+#include "LevelGenerator.h"
+#include "LodBenchmark.h"
+#include "MemoryTracking.h"
+#include "ParticleBenchmark.h"
+#include "ParticleSystem.h"
+#include "RenderDevice.h"
+#include "RenderQueue.h"
+#include "SimdMath.h"
+#include "SnapshotBenchmark.h"
+#include "TextureCache.h"
 #include "PhysicsWorld.h"
 #include "PhysicsObject.h"
 
@@ -22,22 +46,79 @@ using namespace Kore;
 namespace {
 	const int width = 512;
 	const int height = 512;
+	const float farPlane = 100.0f;
 	double startTime;
-	Graphics4::Shader* vertexShader;
-	Graphics4::Shader* fragmentShader;
-	Graphics4::PipelineState* pipeline;
+
+	// All rendering goes through the device, which is a null device when running headless
+	RenderDevice* device;
+	bool headless = false;
+
+	DevicePipeline* pipeline;
+
+	// The level uses its own pipeline which samples from a texture array
+	DevicePipeline* levelPipeline;
+
+	// Spheres are drawn instanced, with the model matrices in a second vertex buffer
+	DevicePipeline* instancedPipeline;
 
 	// controls
 	bool left = false;
 	bool right = false;
 	bool up = false;
 	bool down = false;
+	bool reloadLevel = false;
+	// Toggled with P, drops marbles around the ball
+	bool marbleRain = false;
+
+	// Set by --record, gets the input of every frame
+	InputRecorder* recorder = nullptr;
+
+	// Set by --assert-no-alloc. Buffers grow to their final size in the first frames, after that frames must not allocate.
+	bool assertNoAllocations = false;
+	const int allocationWarmupFrames = 60;
+	int memoryFrames = 0;
+
+	unsigned char getKeys() {
+		return (up ? InputUp : 0) | (down ? InputDown : 0) | (left ? InputLeft : 0) | (right ? InputRight : 0) | (reloadLevel ? InputReload : 0) | (marbleRain ? InputMarbles : 0);
+	}
+
+	void setKeys(unsigned char keys) {
+		up = (keys & InputUp) != 0;
+		down = (keys & InputDown) != 0;
+		left = (keys & InputLeft) != 0;
+		right = (keys & InputRight) != 0;
+		reloadLevel = (keys & InputReload) != 0;
+		marbleRain = (keys & InputMarbles) != 0;
+	}
+
+	// The textures are taken from the MTL files if they are referenced there
+	const char* levelFiles[] = { "Level/Level.obj", "Level/Level_yellow.obj", "Level/Level_red.obj" };
+	const char* levelTextures[] = { "Level/basicTiles6x6.png", "Level/basicTiles3x3yellow.png", "Level/basicTiles3x3red.png" };
+
+	// Written by --build-chunks, the level is streamed from it if it exists
+	const char* levelChunkFile = "Level/level.chunks";
+
+	// All static level geometry, drawn with a single call
+	BatchedMeshObject* level = nullptr;
+
+	// Collision geometry of the level, one per level mesh
+	CollisionMesh* levelCollision[3] = { nullptr, nullptr, nullptr };
+
+	// Used instead of level and levelCollision when the level is streamed in tiles
+	ChunkedLevel* chunkedLevel = nullptr;
 
-	// null terminated array of MeshObject pointers
-	MeshObject* objects[] = { nullptr, nullptr, nullptr, nullptr, nullptr, nullptr };
+	// Mixes on its own thread, not created when running headless
+	AudioDevice* audioDevice = nullptr;
+	AudioMixer* audio = nullptr;
 
-	// The sound to play for the winning condition
-	Sound* winSound;
+	// The sound to play for the winning condition, streamed from disk
+	int winSound = -1;
+
+	// Played when a ball hits something, generated at startup
+	int impactSound = -1;
+	// Velocities of the physics objects before the update, a sudden change in the update is a contact
+	vec3* impactVelocities = nullptr;
+	int impactCapacity = 0;
 	
 	// Was the sound already played?
 	bool playedSound = false;
@@ -60,13 +141,81 @@ namespace {
 	MeshObject* sphere;
 	PhysicsObject* po;
 
+	// Physics objects are drawn instanced, one renderer for each mesh they use
+	const int maxBodyMeshes = 8;
+	MeshObject* bodyMeshes[maxBodyMeshes];
+	InstancedRenderer* bodyRenderers[maxBodyMeshes];
+	int numBodyMeshes = 0;
+
 	PhysicsWorld physics;
+
+	// Marbles are particles of the physics world, drawn with the sphere mesh in one instanced draw
+	const int maxMarbles = 20000;
+	const float marbleRadius = 0.1f;
+	const int marblesPerFrame = 50;
+	InstancedRenderer* marbles;
+	int marblesEmitted = 0;
+
+	// A ring of marbles above the position, rotating from frame to frame so the marbles don't stack up
+	void emitMarbles(vec3 position) {
+		for (int i = 0; i < marblesPerFrame; ++i) {
+			float angle = (marblesEmitted + i) * 2.39996f;
+			float distance = 0.5f + 2.5f * ((marblesEmitted + i) % 97) / 97.0f;
+			vec3 start = position + vec3(Kore::cos(angle) * distance, 6.0f, Kore::sin(angle) * distance);
+			if (!physics.particles->Emit(start, vec3(0.0f, -2.0f, 0.0f))) break;
+		}
+		marblesEmitted += marblesPerFrame;
+	}
+
+	// Compared between recording and replay. The marbles are not part of the physics state, but a replay without them isn't comparable.
+	unsigned getFrameChecksum() {
+		return (physics.GetStateChecksum() ^ physics.particles->GetChecksum()) * 16777619u;
+	}
+
+	void rememberVelocities() {
+		for (int i = 0; i < impactCapacity && physics.physicsObjects[i] != nullptr; ++i) {
+			impactVelocities[i] = physics.physicsObjects[i]->Velocity;
+		}
+	}
+
+	// Every object whose velocity changed by more than gravity explains has hit something in the update.
+	// Harder hits are louder and take voices from softer ones, the pan follows the camera.
+	void playImpacts(float deltaT) {
+		vec3 forward = lookAt - cameraPosition;
+		vec3 right = forward.cross(vec3(0, 1, 0));
+		if (right.getLength() > 0.0f) right.normalize();
+		for (int i = 0; i < impactCapacity && physics.physicsObjects[i] != nullptr; ++i) {
+			PhysicsObject* po = physics.physicsObjects[i];
+			vec3 change = po->Velocity - impactVelocities[i] - vec3(0.0f, -9.81f * deltaT, 0.0f);
+			float strength = change.getLength();
+			if (strength < 1.0f) continue;
+
+			vec3 offset = po->GetPosition() - cameraPosition;
+			float distance = offset.getLength();
+			float pan = distance > 0.0f ? offset.dot(right) / distance : 0.0f;
+			float volume = Kore::min(1.0f, strength / 10.0f) / (1.0f + distance * 0.1f);
+			// Smaller balls sound higher
+			float pitch = 0.5f / Kore::max(0.1f, po->Collider.radius);
+			audio->play(impactSound, volume, pan, pitch, (int)(volume * 100.0f));
+		}
+	}
+
+	// Command sources, commands are applied in this order within a step
+	const int inputCommands = 0;
+	const int gameCommands = 1;
 	
 	// uniform locations - add more as you see fit
 	Graphics4::TextureUnit tex;
 	Graphics4::ConstantLocation pvLocation;
 	Graphics4::ConstantLocation mLocation;
 
+	Graphics4::TextureUnit levelTex;
+	Graphics4::ConstantLocation levelPvLocation;
+	Graphics4::ConstantLocation levelMLocation;
+
+	Graphics4::TextureUnit instancedTex;
+	Graphics4::ConstantLocation instancedPvLocation;
+
 	/************************************************************************/
 	/* Task P9.2 - Initialize the box collider                           */
 	/************************************************************************/
@@ -74,17 +223,129 @@ namespace {
 
 	double lastTime = 0.0;
 
-	void update() {
-		double t = System::time() - startTime;
-		double deltaT = t - lastTime;
-		lastTime = t;
+	// All draws of a frame are sorted by state before they are submitted
+	RenderQueue renderQueue;
+	int defaultPipelineId;
+	int levelPipelineId;
+	int instancedPipelineId;
+
+	// View frustum culling
+	Frustum frustum;
+	CullingStats cullingStats;
+	double lastCullingLog = 0.0;
+
+	// Bounding spheres of the physics objects for the batch test
+	int cullingCapacity = 0;
+	float* cullX = nullptr;
+	float* cullY = nullptr;
+	float* cullZ = nullptr;
+	float* cullRadius = nullptr;
+	unsigned char* cullVisible = nullptr;
+
+	void ensureCullingCapacity(int count) {
+		if (count <= cullingCapacity) return;
+		MemoryScope scope(MemoryRender);
+		delete[] cullX;
+		delete[] cullY;
+		delete[] cullZ;
+		delete[] cullRadius;
+		delete[] cullVisible;
+		cullingCapacity = count * 2;
+		cullX = new float[cullingCapacity];
+		cullY = new float[cullingCapacity];
+		cullZ = new float[cullingCapacity];
+		cullRadius = new float[cullingCapacity];
+		cullVisible = new unsigned char[cullingCapacity];
+	}
 
-		Kore::Audio2::update();
-		
-		Graphics4::begin();
-		Graphics4::clear(Graphics4::ClearColorFlag | Graphics4::ClearDepthFlag, 0xff9999FF, 1000.0f);
+	// depth is set to the view distance of the bounding sphere's center
+	bool isVisible(const Bounds& bounds, const mat4& M, float& depth) {
+		vec3 center;
+		float radius;
+		bounds.transformSphere(M, center, radius);
+		depth = (center - cameraPosition).getLength();
+		if (frustum.intersectsSphere(center, radius)) {
+			// The sphere test is cheap but loose, confirm with the box
+			vec3 min, max;
+			bounds.transformBox(M, min, max);
+			if (frustum.intersectsBox(min, max)) {
+				++cullingStats.visible;
+				return true;
+			}
+		}
+		++cullingStats.culled;
+		return false;
+	}
+
+	// Kept alive for reloading the level
+	Graphics4::VertexStructure structure;
+	Graphics4::VertexStructure levelStructure;
+	Graphics4::VertexStructure instanceStructure;
+
+	// The renderer for the objects with this mesh, created and begun for the frame the mesh first shows up in.
+	// Objects without a mesh, or with more distinct meshes than there are renderers, are not drawn.
+	InstancedRenderer* getBodyRenderer(MeshObject* mesh, int maxInstances) {
+		if (mesh == nullptr) return nullptr;
+		for (int i = 0; i < numBodyMeshes; ++i) {
+			if (bodyMeshes[i] == mesh) return bodyRenderers[i];
+		}
+		if (numBodyMeshes == maxBodyMeshes) return nullptr;
+		MemoryScope scope(MemoryRender);
+		bodyMeshes[numBodyMeshes] = mesh;
+		bodyRenderers[numBodyMeshes] = new InstancedRenderer(mesh, instanceStructure);
+		bodyRenderers[numBodyMeshes]->begin(maxInstances);
+		return bodyRenderers[numBodyMeshes++];
+	}
+
+	void loadLevel() {
+		chunkedLevel = new ChunkedLevel(device, &physics, levelChunkFile, levelStructure);
+		if (chunkedLevel->isValid()) {
+			Kore::log(Info, "Streaming the level in %i tiles of %.1f units", chunkedLevel->numTiles, chunkedLevel->tileSize);
+			return;
+		}
+		delete chunkedLevel;
+		chunkedLevel = nullptr;
 
-		Graphics4::setPipeline(pipeline);
+		level = new BatchedMeshObject(device, levelFiles, levelTextures, 3, levelStructure);
+
+		for (int i = 0; i < 3; ++i) {
+			levelCollision[i] = buildCollisionMesh(*level->meshes[i]);
+			physics.AddMeshCollider(levelCollision[i], level->M);
+			CollisionMesh* collision = levelCollision[i];
+			Kore::log(Info, "Level collision mesh %i: %i triangles (from %i), %i primitives replace %i of them, %i bytes",
+				i, collision->numTriangles, level->meshes[i]->numFaces, collision->numPrimitives, collision->numReplacedTriangles, collision->memoryUsage());
+		}
+
+		// The render data is needed on the GPU only
+		level->releaseCpuData();
+	}
+
+	void unloadLevel() {
+		delete chunkedLevel;
+		chunkedLevel = nullptr;
+		for (int i = 0; i < 3; ++i) {
+			if (levelCollision[i] != nullptr) physics.RemoveMeshCollider(levelCollision[i]);
+			delete levelCollision[i];
+			levelCollision[i] = nullptr;
+		}
+		delete level;
+		level = nullptr;
+	}
+
+	// One step of the game, t is the time since the start
+	void frame(double t, float deltaT) {
+		if (reloadLevel) {
+			reloadLevel = false;
+			unloadLevel();
+			loadLevel();
+			physics.particles->Clear();
+		}
+
+		// Reloading the level is not part of the frame
+		beginMemoryFrame();
+		
+		device->begin();
+		device->clear(Graphics4::ClearColorFlag | Graphics4::ClearDepthFlag, 0xff9999FF, 1000.0f);
 
 		// set the camera
 		targetCameraPosition = physics.physicsObjects[0]->GetPosition();
@@ -100,22 +361,39 @@ namespace {
 		oldLookAt = lookAt;
 
 		// Follow the ball with the camera
-		P = mat4::Perspective(60.0f * Kore::pi / 180.0f, (float)width / (float)height, 0.1f, 100);
+		P = mat4::Perspective(60.0f * Kore::pi / 180.0f, (float)width / (float)height, 0.1f, farPlane);
 		View = mat4::lookAt(cameraPosition, lookAt, vec3(0, 1, 0)); 
 		PV = P * View;
+		frustum.extract(PV);
+		cullingStats.reset();
+
+		renderQueue.begin(PV, farPlane);
+		float depth;
+
+		if (chunkedLevel != nullptr) {
+			// Nothing is resident at startup or after a reload, so the first load blocks.
+			// Recordings need the same tiles in the same frames as their replays.
+			chunkedLevel->update(physics.physicsObjects[0]->GetPosition(), cameraPosition, headless || recorder != nullptr || chunkedLevel->stats.resident == 0);
+			mat4 identity = mat4::Identity();
+			for (int i = 0; i < chunkedLevel->numTiles; ++i) {
+				ChunkedLevel::Tile& tile = chunkedLevel->tiles[i];
+				if (tile.state == ChunkedLevel::Resident && tile.indexBuffer != nullptr && isVisible(tile.bounds, identity, depth)) {
+					chunkedLevel->submit(i, renderQueue, levelPipelineId, depth);
+				}
+			}
+		}
+		// The static level is one draw call
+		else if (isVisible(level->bounds, level->M, depth)) {
+			level->submit(renderQueue, levelPipelineId, depth);
+		}
 
-		Graphics4::setMatrix(pvLocation, PV);
-
-		// Render the mesh objects
-		MeshObject** current = &objects[0];
-		while (*current != nullptr) {
-			// set the model matrix
-			Graphics4::setMatrix(mLocation, (*current)->M);
-			(*current)->render(tex);
-			++current;
-		} 
-
-		physics.Update((float) deltaT);
+		// Objects away from the ball and the camera are simulated at a lower rate
+		vec3 focus[] = { physics.physicsObjects[0]->GetPosition(), cameraPosition };
+		physics.SetFocusPoints(focus, 2);
+		if (marbleRain) emitMarbles(physics.physicsObjects[0]->GetPosition());
+		if (audio != nullptr) rememberVelocities();
+		physics.Update(deltaT);
+		if (audio != nullptr) playImpacts(deltaT);
 		PhysicsObject** currentP = &physics.physicsObjects[0];
 	
 
@@ -127,17 +405,86 @@ namespace {
 		if (left) forceZ -= 1.0f;
 		if (right) forceZ += 1.0f;
 
-		// Apply gravity
+		// Push the ball, the force is applied at the start of the next step
 		vec3 force(forceX, 0.0f, forceZ);
 		force = force * 20.0f;
-		(*currentP)->ApplyForceToCenter(force);
+		PhysicsCommand command;
+		command.type = PhysicsCommand::Force;
+		command.source = inputCommands;
+		command.body = physics.GetHandle(*currentP);
+		command.vector = force;
+		physics.PushCommand(command);
+
+		// Cull all physics objects at once
+		int numObjects = 0;
+		while (physics.physicsObjects[numObjects] != nullptr) ++numObjects;
+		ensureCullingCapacity(numObjects);
+		for (int i = 0; i < numObjects; ++i) {
+			SphereCollider& collider = physics.physicsObjects[i]->Collider;
+			cullX[i] = collider.center.x();
+			cullY[i] = collider.center.y();
+			cullZ[i] = collider.center.z();
+			cullRadius[i] = collider.radius;
+		}
+		int numVisible = frustum.intersectSpheres(cullX, cullY, cullZ, cullRadius, numObjects, cullVisible);
+		cullingStats.visible += numVisible;
+		cullingStats.culled += numObjects - numVisible;
+
+		// Render the meshes, one instanced draw for all objects sharing a mesh
+		int matricesRebuilt = 0;
+		int matricesUnchanged = 0;
+		for (int i = 0; i < numBodyMeshes; ++i) {
+			bodyRenderers[i]->begin(numObjects);
+		}
+		for (int i = 0; i < numObjects; ++i, ++currentP) {
+			if (!cullVisible[i]) continue;
+			InstancedRenderer* renderer = getBodyRenderer((*currentP)->Mesh, numObjects);
+			if (renderer == nullptr) continue;
+			if ((*currentP)->UpdateMatrix()) ++matricesRebuilt;
+			else ++matricesUnchanged;
+			renderer->add((*currentP)->Transform);
+		}
+		for (int i = 0; i < numBodyMeshes; ++i) {
+			bodyRenderers[i]->end();
+			bodyRenderers[i]->submit(renderQueue, instancedPipelineId, (physics.physicsObjects[0]->GetPosition() - cameraPosition).getLength());
+		}
 
-		// Render the meshes
-		while (*currentP != nullptr) {
-			(*currentP)->UpdateMatrix();
-			Graphics4::setMatrix(mLocation, (*currentP)->Mesh->M);
-			(*currentP)->Mesh->render(tex);
-			++currentP;
+		// The marbles are small and many, they are drawn without culling
+		ParticleSystem* particles = physics.particles;
+		marbles->begin(particles->GetCount());
+		for (int i = 0; i < particles->GetCount(); ++i) {
+			vec3 position = particles->GetPosition(i);
+			marbles->add(position.x(), position.y(), position.z(), particles->radius);
+		}
+		marbles->end();
+		marbles->submit(renderQueue, instancedPipelineId, (physics.physicsObjects[0]->GetPosition() - cameraPosition).getLength());
+
+		renderQueue.submit(*device);
+
+		if (!headless && t - lastCullingLog > 1.0) {
+			lastCullingLog = t;
+			Kore::log(Info, "Culling: %i visible, %i culled", cullingStats.visible, cullingStats.culled);
+			Kore::log(Info, "Matrices: %i rebuilt, %i unchanged", matricesRebuilt, matricesUnchanged);
+			SimulationStats& simulation = physics.stats;
+			Kore::log(Info, "Simulation: %i full rate, %i reduced, %i steps, %i skipped, %i pair tests, %i skipped, level: %i primitive and %i triangle tests",
+				simulation.fullRate, simulation.reduced, simulation.steps, simulation.stepsSkipped, simulation.pairTests, simulation.pairTestsSkipped, simulation.primitiveTests, simulation.triangleTests);
+			if (physics.particles->GetCount() > 0) {
+				ParticleStats& marbleStats = physics.particles->stats;
+				Kore::log(Info, "Marbles: %i particles, %i contacts, %i level contacts", marbleStats.particles, marbleStats.contacts, marbleStats.levelContacts);
+			}
+			Kore::log(Info, "Rendering: %i draw calls, %i state changes, %i avoided", renderQueue.stats.drawCalls, renderQueue.stats.stateChanges, renderQueue.stats.stateChangesAvoided);
+			if (chunkedLevel != nullptr) {
+				ChunkStats& stats = chunkedLevel->stats;
+				Kore::log(Info, "Streaming: %i tiles resident (%i bytes), %i loading, %i loads, %i evictions", stats.resident, stats.residentBytes, stats.loading, stats.loads, stats.evictions);
+			}
+			long long liveBytes = 0;
+			int frameAllocations = 0;
+			for (int tag = 0; tag < NumMemoryTags; ++tag) {
+				MemoryStats memory = getMemoryStats((MemoryTag)tag);
+				liveBytes += memory.liveBytes;
+				frameAllocations += memory.frameAllocations;
+			}
+			Kore::log(Info, "Memory: %lld bytes live, %i allocations in the last frame", liveBytes, frameAllocations);
 		}
 
 
@@ -148,25 +495,57 @@ namespace {
 		bool result = SpherePO->Collider.IntersectsWith(boxCollider);
 		if (result && !playedSound) {
 			playedSound = true;
-			Audio1::play(winSound);
+			if (audio != nullptr) audio->playStream(winSound, 1.0f);
 		}
 			
-		Graphics4::end();
-		Graphics4::swapBuffers();
+		device->end();
+		device->swapBuffers();
+
+		endMemoryFrame();
+		// Streaming the level keeps allocating, all other subsystems get a budget of no allocations
+		if (assertNoAllocations && ++memoryFrames == allocationWarmupFrames) {
+			for (int tag = 0; tag < NumMemoryTags; ++tag) {
+				if (tag != MemoryLoader) setMemoryBudget((MemoryTag)tag, -1, 0);
+			}
+			setAllocationAssertions(true);
+		}
 	}
 
+	void update() {
+		double t = System::time() - startTime;
+		double deltaT = t - lastTime;
+		lastTime = t;
+
+		{
+			MemoryScope scope(MemoryAudio);
+			Kore::Audio2::update();
+		}
+
+		if (recorder == nullptr) {
+			frame(t, (float)deltaT);
+			return;
+		}
+
+		RecordedFrame recorded;
+		recorded.deltaT = recorder->fixedStep ? recorder->step : (float)deltaT;
+		recorded.keys = getKeys();
+		frame(t, recorded.deltaT);
+		recorded.checksum = getFrameChecksum();
+		recorder->add(recorded);
+	}
+
+	// The sphere is created at the start of the next physics step
 	void SpawnSphere(vec3 Position, vec3 Velocity) {
-		PhysicsObject* po = new PhysicsObject();
-		po->SetPosition(Position);
-		po->Velocity = Velocity;
-		po->Collider.radius = 0.5f;
-		po->Mass = 5;
-		po->Mesh = sphere;
-			
+		PhysicsCommand command;
+		command.type = PhysicsCommand::Spawn;
+		command.source = gameCommands;
+		command.position = Position;
 		// The impulse should carry the object forward
-
-		po->ApplyImpulse(Velocity);
-		physics.AddObject(po);
+		command.vector = Velocity;
+		command.radius = 0.5f;
+		command.mass = 5;
+		command.mesh = sphere;
+		physics.PushCommand(command);
 	}
 
 	void handleKeyEvent(KeyCode code, bool isDown)
@@ -179,6 +558,10 @@ namespace {
 			right = isDown;
 		} else if (code == KeyRight || code == KeyD) {
 			left = isDown;
+		} else if (code == KeyR && isDown) {
+			reloadLevel = true;
+		} else if (code == KeyP && isDown) {
+			marbleRain = !marbleRain;
 		}
 	}
 
@@ -200,56 +583,313 @@ namespace {
 	}
 
 	void init() {
-		FileReader vs("shader.vert");
-		FileReader fs("shader.frag");
-		vertexShader = new Graphics4::Shader(vs.readAll(), vs.size(), Graphics4::VertexShader);
-		fragmentShader = new Graphics4::Shader(fs.readAll(), fs.size(), Graphics4::FragmentShader);
+		MemoryScope scope(MemoryRender);
 
 		// This defines the structure of your Vertex Buffer
-		Graphics4::VertexStructure structure;
 		structure.add("pos", Graphics4::Float3VertexData);
 		structure.add("tex", Graphics4::Float2VertexData);
 		structure.add("nor", Graphics4::Float3VertexData);
 
-		pipeline = new Graphics4::PipelineState;
-		pipeline->depthMode = Graphics4::ZCompareLess;
-		pipeline->depthWrite = true;
-		pipeline->inputLayout[0] = &structure;
-		pipeline->inputLayout[1] = nullptr;
-		pipeline->vertexShader = vertexShader;
-		pipeline->fragmentShader = fragmentShader;
-		pipeline->compile();
-
-		tex = pipeline->getTextureUnit("tex");
-		pvLocation = pipeline->getConstantLocation("PV");
-		mLocation = pipeline->getConstantLocation("M");
-
-		objects[0] = new MeshObject("Level/Level.obj", "Level/basicTiles6x6.png", structure);
-		objects[1] = new MeshObject("Level/Level_yellow.obj", "Level/basicTiles3x3yellow.png", structure);
-		objects[2] = new MeshObject("Level/Level_red.obj", "Level/basicTiles3x3red.png", structure);
-
-		sphere = new MeshObject("ball_at_origin.obj", "Level/unshaded.png", structure);
+		Graphics4::VertexStructure* layout[] = { &structure, nullptr, nullptr };
+		pipeline = device->createPipeline("shader.vert", "shader.frag", layout);
+
+		tex = device->getTextureUnit(pipeline, "tex");
+		pvLocation = device->getConstantLocation(pipeline, "PV");
+		mLocation = device->getConstantLocation(pipeline, "M");
+
+		// The level vertices additionally carry the texture array layer
+		levelStructure.add("pos", Graphics4::Float3VertexData);
+		levelStructure.add("tex", Graphics4::Float2VertexData);
+		levelStructure.add("nor", Graphics4::Float3VertexData);
+		levelStructure.add("layer", Graphics4::Float1VertexData);
+
+		layout[0] = &levelStructure;
+		levelPipeline = device->createPipeline("level.vert", "level.frag", layout);
+
+		levelTex = device->getTextureUnit(levelPipeline, "tex");
+		levelPvLocation = device->getConstantLocation(levelPipeline, "PV");
+		levelMLocation = device->getConstantLocation(levelPipeline, "M");
+
+		// One model matrix per instance
+		instanceStructure.add("M", Graphics4::Float4x4VertexData);
+
+		layout[0] = &structure;
+		layout[1] = &instanceStructure;
+		instancedPipeline = device->createPipeline("instanced.vert", "shader.frag", layout);
+
+		instancedTex = device->getTextureUnit(instancedPipeline, "tex");
+		instancedPvLocation = device->getConstantLocation(instancedPipeline, "PV");
+
+		RenderPipeline binding;
+		binding.pipeline = pipeline;
+		binding.tex = tex;
+		binding.pvLocation = pvLocation;
+		binding.mLocation = mLocation;
+		binding.hasModelMatrix = true;
+		defaultPipelineId = renderQueue.addPipeline(binding);
+
+		binding.pipeline = levelPipeline;
+		binding.tex = levelTex;
+		binding.pvLocation = levelPvLocation;
+		binding.mLocation = levelMLocation;
+		levelPipelineId = renderQueue.addPipeline(binding);
+
+		binding.pipeline = instancedPipeline;
+		binding.tex = instancedTex;
+		binding.pvLocation = instancedPvLocation;
+		binding.hasModelMatrix = false;
+		instancedPipelineId = renderQueue.addPipeline(binding);
+
+		loadLevel();
+
+		sphere = new MeshObject(device, "ball_at_origin.obj", "Level/unshaded.png", structure);
+		sphere->releaseCpuData();
+		// Allocated up front, so raining marbles never allocates in a frame
+		physics.EnableParticles(maxMarbles, marbleRadius);
+		marbles = new InstancedRenderer(sphere, instanceStructure, maxMarbles);
 		float pos = -10.0f;
 
 		SpawnSphere(vec3(-pos, 5.5f, pos), vec3(0, 0, 0));
-		physics.meshCollider.mesh = objects[0];
+		// The camera follows the ball from the first frame on
+		physics.ApplyCommands();
 
 		// Sound source: http://opengameart.org/content/level-up-sound-effects
 		/************************************************************************/
 		/* Task P9.2: Play this sound when the goal is reached                   */
 		/************************************************************************/
-		winSound = new Sound("chipquest.wav");
+		if (!headless) {
+			MemoryScope audioScope(MemoryAudio);
+			audioDevice = new KoreAudioDevice;
+			audio = new AudioMixer(audioDevice);
+			winSound = audio->openStream("chipquest.wav");
+			impactSound = createImpactSound(*audio);
+			impactCapacity = physics.GetObjectCount() + physics.GetFreeCount();
+			impactVelocities = new vec3[impactCapacity];
+		}
 		
-		Graphics4::setTextureAddressing(tex, Graphics4::U, Graphics4::Repeat);
-		Graphics4::setTextureAddressing(tex, Graphics4::V, Graphics4::Repeat);
+		device->setTextureAddressing(tex, Graphics4::U, Graphics4::Repeat);
+		device->setTextureAddressing(tex, Graphics4::V, Graphics4::Repeat);
+		device->setTextureAddressing(levelTex, Graphics4::U, Graphics4::Repeat);
+		device->setTextureAddressing(levelTex, Graphics4::V, Graphics4::Repeat);
+		device->setTextureAddressing(instancedTex, Graphics4::U, Graphics4::Repeat);
+		device->setTextureAddressing(instancedTex, Graphics4::V, Graphics4::Repeat);
+	}
+
+	// Frees what init created, whatever is still live afterwards (except for the physics world) was leaked
+	void shutdown() {
+		setAllocationAssertions(false);
+		unloadLevel();
+		for (int i = 0; i < numBodyMeshes; ++i) {
+			delete bodyRenderers[i];
+		}
+		numBodyMeshes = 0;
+		delete marbles;
+		marbles = nullptr;
+		delete sphere;
+		sphere = nullptr;
+		delete audio;
+		audio = nullptr;
+		delete audioDevice;
+		audioDevice = nullptr;
+		delete[] impactVelocities;
+		impactVelocities = nullptr;
+		Kore::log(Info, "Memory after shutdown:");
+		logMemoryStats();
+	}
+
+	// Sorts frameTimes
+	void logFrameTimes(const char* name, double* frameTimes, int frames) {
+		std::sort(frameTimes, frameTimes + frames);
+		double total = 0.0;
+		for (int i = 0; i < frames; ++i) total += frameTimes[i];
+		Kore::log(Info, "%s: %i frames, mean %.1f us, min %.1f us, median %.1f us, p95 %.1f us, p99 %.1f us, max %.1f us",
+			name, frames, total / frames, frameTimes[0], frameTimes[frames / 2], frameTimes[frames * 95 / 100], frameTimes[frames * 99 / 100], frameTimes[frames - 1]);
 	}
+
+	// Run the game loop without window, GPU or audio with a fixed time step and report the CPU frame times
+	void runHeadless(int frames) {
+		NullRenderDevice* nullDevice;
+		{
+			MemoryScope scope(MemoryRender);
+			nullDevice = new NullRenderDevice;
+		}
+		device = nullDevice;
+		headless = true;
+		init();
+
+		const float deltaT = 1.0f / 60.0f;
+		double* frameTimes = new double[frames];
+		for (int i = 0; i < frames; ++i) {
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			frame(i * deltaT, deltaT);
+			std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+			frameTimes[i] = std::chrono::duration<double, std::micro>(end - start).count();
+		}
+
+		logFrameTimes("Headless", frameTimes, frames);
+		Kore::log(Info, "Draw stream: %i draw calls, %i commands in the last frame, hash %016llx", nullDevice->drawCalls, nullDevice->numCommands, nullDevice->streamHash);
+		Kore::log(Info, "Memory after %i frames:", frames);
+		logMemoryStats();
+		delete[] frameTimes;
+		shutdown();
+	}
+
+	// Play a recording on the null device. The physics state is compared with the recorded checksum after every frame.
+	// With fixedStep every frame uses the step of the recording (or 1/60 s) instead of the recorded time.
+	void runReplay(const char* filename, bool fixedStep) {
+		InputReplay replay(filename);
+		if (!replay.isValid() || replay.numFrames == 0) return;
+
+		NullRenderDevice* nullDevice = new NullRenderDevice;
+		device = nullDevice;
+		headless = true;
+		init();
+
+		// Checksums only match if the frames use the recorded time steps
+		float step = replay.fixedStep ? replay.step : 1.0f / 60.0f;
+		bool compare = !fixedStep || replay.fixedStep;
+		if (!compare) Kore::log(Warning, "%s was recorded with the wall clock time, the checksums are not compared", filename);
+
+		int mismatches = 0;
+		int firstMismatch = -1;
+		double t = 0.0;
+		double* frameTimes = new double[replay.numFrames];
+		for (int i = 0; i < replay.numFrames; ++i) {
+			RecordedFrame& recorded = replay.frames[i];
+			float deltaT = fixedStep ? step : recorded.deltaT;
+			t += deltaT;
+			setKeys(recorded.keys);
+
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			frame(t, deltaT);
+			std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+			frameTimes[i] = std::chrono::duration<double, std::micro>(end - start).count();
+
+			if (compare && getFrameChecksum() != recorded.checksum) {
+				if (firstMismatch < 0) firstMismatch = i;
+				++mismatches;
+			}
+		}
+
+		logFrameTimes("Replay", frameTimes, replay.numFrames);
+		if (compare && mismatches == 0) Kore::log(Info, "Replay matches the recording in all %i frames", replay.numFrames);
+		else if (compare) Kore::log(Error, "Replay differs from the recording in %i of %i frames, first in frame %i", mismatches, replay.numFrames, firstMismatch);
+		delete[] frameTimes;
+		shutdown();
+	}
+
 }
 
 int kore(int argc, char** argv) {
+	// --headless [frames] runs the game loop on the null device and reports frame times
+	// --build-chunks [tile size] splits the level into tiles for streaming
+	// --bake-textures [bc1] writes the texture caches, optionally compressed, which are used instead of the PNG files from then on
+	// --bench-math [bodies] compares the SIMD math with the Kore types
+	// --bench-lod [bodies] compares full rate and level of detail simulation of many spheres
+	// --batch [worlds] [threads] runs a parameter sweep of independent simulations
+	// --bench-collision [cases] [seed] times the primitive tests of Collision.h
+	// --bench-snapshot [bodies] checks resimulating from a world snapshot and times saving and restoring
+	// --bench-instances [count] times balls on up to count placements of one level mesh
+	// --bench-particles [count] [threads] times marbles falling onto the level on one and on several threads
+	// --bench-audio [seconds] [triggers per second] mixes impact sounds and a stream in real time on the null audio device
+	// --generate-level [triangles] [seed] writes a random level to Level/generated.obj and Level/generated.chunks
+	// --record file records the input of the game, --replay file plays it back on the null device
+	// --fixed-step makes recordings and replays use 1/60 s per frame instead of the wall clock time
+	// --assert-no-alloc aborts on any allocation in a frame after the warm-up, except for streaming the level
+	bool fixedStep = false;
+	const char* recording = nullptr;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--fixed-step") == 0) fixedStep = true;
+		if (strcmp(argv[i], "--assert-no-alloc") == 0) assertNoAllocations = true;
+	}
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			runReplay(argv[i + 1], fixedStep);
+			return 0;
+		}
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			recording = argv[i + 1];
+		}
+		if (strcmp(argv[i], "--bench-collision") == 0) {
+			int cases = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			int seed = i + 2 < argc ? atoi(argv[i + 2]) : 0;
+			benchmarkCollision(cases > 0 ? cases : 10000, seed > 0 ? seed : 1234);
+			return 0;
+		}
+		if (strcmp(argv[i], "--generate-level") == 0) {
+			int triangles = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			int seed = i + 2 < argc ? atoi(argv[i + 2]) : 0;
+			const char* objFile = "Level/generated.obj";
+			triangles = generateLevel(objFile, triangles > 0 ? triangles : 100000, seed > 0 ? seed : 1234);
+			if (triangles == 0) return 1;
+			// The chunk file stores 32 bit offsets, which is enough for a few million triangles
+			if (triangles > 4000000) {
+				Kore::log(Warning, "Too many triangles for a chunk file, only the OBJ file was written");
+				return 0;
+			}
+			const char* textures[] = { "Level/basicTiles6x6.png" };
+			return buildLevelChunks(&objFile, textures, 1, 16.0f, "Level/generated.chunks") ? 0 : 1;
+		}
+		if (strcmp(argv[i], "--batch") == 0) {
+			int worlds = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			int threads = i + 2 < argc ? atoi(argv[i + 2]) : 0;
+			runBatchSweep(levelFiles[0], boxCollider, worlds > 0 ? worlds : 1024, threads);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bench-instances") == 0) {
+			int instances = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			benchmarkInstances(levelFiles[0], instances > 0 ? instances : 4096);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bench-particles") == 0) {
+			int count = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			int threads = i + 2 < argc ? atoi(argv[i + 2]) : 0;
+			benchmarkParticles(levelFiles[0], count > 0 ? count : 100000, threads);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bench-audio") == 0) {
+			int seconds = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			int triggers = i + 2 < argc ? atoi(argv[i + 2]) : 0;
+			benchmarkAudio("chipquest.wav", seconds > 0 ? seconds : 5, triggers > 0 ? triggers : 500);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bench-snapshot") == 0) {
+			int bodies = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			benchmarkSnapshot(bodies > 0 ? bodies : 2000);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bench-lod") == 0) {
+			int bodies = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			benchmarkLod(bodies > 0 ? bodies : 2000);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bench-math") == 0) {
+			int bodies = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			benchmarkMath(bodies > 0 ? bodies : 10000);
+			return 0;
+		}
+		if (strcmp(argv[i], "--bake-textures") == 0) {
+			const char* textures[] = { levelTextures[0], levelTextures[1], levelTextures[2], "Level/unshaded.png" };
+			bakeTextures(textures, 4, i + 1 < argc && strcmp(argv[i + 1], "bc1") == 0);
+			return 0;
+		}
+		if (strcmp(argv[i], "--build-chunks") == 0) {
+			float tileSize = i + 1 < argc ? (float)atof(argv[i + 1]) : 0.0f;
+			return buildLevelChunks(levelFiles, levelTextures, 3, tileSize > 0.0f ? tileSize : 16.0f, levelChunkFile) ? 0 : 1;
+		}
+		if (strcmp(argv[i], "--headless") == 0) {
+			int frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			runHeadless(frames > 0 ? frames : 10000);
+			return 0;
+		}
+	}
+
 	Kore::System::init("Solution 9", width, height);
+	device = new KoreRenderDevice;
+
+	if (recording != nullptr) recorder = new InputRecorder(recording, fixedStep, 1.0f / 60.0f);
 
 	Kore::Audio2::init();
-	Kore::Audio1::init();
 
 	init();
 
@@ -265,5 +905,9 @@ int kore(int argc, char** argv) {
 
 	Kore::System::start();
 
+	delete recorder;
+	recorder = nullptr;
+	shutdown();
+
 	return 0;
 }
@@ -0,0 +1,80 @@
+#include "pch.h"
+#include "InputRecording.h"
+
+#include <Kore/IO/FileReader.h>
+#include <Kore/Log.h>
+#include <cstring>
+
+using namespace Kore;
+
+namespace {
+	const int inputFileVersion = 2;
+
+	// deltaT, checksum and keys
+	const int frameSize = 9;
+
+	// Recordings end wherever the game was closed, so the file is flushed now and then
+	const int flushInterval = 60;
+}
+
+InputRecorder::InputRecorder(const char* filename, bool inFixedStep, float inStep) : fixedStep(inFixedStep), step(inStep), numFrames(0) {
+	file = fopen(filename, "wb");
+	if (file == nullptr) {
+		Kore::log(Error, "Could not open %s for recording", filename);
+		return;
+	}
+	InputFileHeader header;
+	memcpy(header.magic, "INPR", 4);
+	header.version = inputFileVersion;
+	header.fixedStep = fixedStep ? 1 : 0;
+	header.step = step;
+	fwrite(&header, sizeof(header), 1, file);
+}
+
+InputRecorder::~InputRecorder() {
+	if (file != nullptr) fclose(file);
+}
+
+void InputRecorder::add(const RecordedFrame& frame) {
+	if (file == nullptr) return;
+	unsigned char data[frameSize];
+	memcpy(&data[0], &frame.deltaT, 4);
+	memcpy(&data[4], &frame.checksum, 4);
+	data[8] = frame.keys;
+	fwrite(data, frameSize, 1, file);
+	if (++numFrames % flushInterval == 0) fflush(file);
+}
+
+InputReplay::InputReplay(const char* filename) : fixedStep(false), step(0.0f), numFrames(0), frames(nullptr) {
+	FileReader reader;
+	if (!reader.open(filename)) {
+		Kore::log(Error, "Could not open the recording %s", filename);
+		return;
+	}
+	InputFileHeader header;
+	if (reader.size() < (int)sizeof(header)) return;
+	reader.read(&header, sizeof(header));
+	if (memcmp(header.magic, "INPR", 4) != 0 || header.version != inputFileVersion) {
+		Kore::log(Error, "%s is not an input recording", filename);
+		return;
+	}
+	fixedStep = header.fixedStep != 0;
+	step = header.step;
+
+	// A recording cut off in the middle of a frame drops that frame
+	numFrames = (reader.size() - (int)sizeof(header)) / frameSize;
+	unsigned char* data = new unsigned char[numFrames * frameSize + 1];
+	reader.read(data, numFrames * frameSize);
+	frames = new RecordedFrame[numFrames + 1];
+	for (int i = 0; i < numFrames; ++i) {
+		unsigned char* frame = &data[i * frameSize];
+		memcpy(&frames[i].deltaT, &frame[0], 4);
+		memcpy(&frames[i].checksum, &frame[4], 4);
+		frames[i].keys = frame[8];
+	}
+	delete[] data;
+}
+
+InputReplay::~InputReplay() {
+	delete[] frames;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "pch.h"
+
+#include <cstdio>
+
+// Keys held during a frame, one bit each
+enum InputKey {
+	InputUp = 1,
+	InputDown = 2,
+	InputLeft = 4,
+	InputRight = 8,
+	InputReload = 16,
+	// Not a held key, set while the marble rain toggled with P is on
+	InputMarbles = 32
+};
+
+// File layout (all values 32 bit, little endian):
+//   InputFileHeader
+//   per frame: float deltaT, unsigned checksum, unsigned char keys (9 bytes, no padding)
+struct InputFileHeader {
+	char magic[4];
+	int version;
+	// Set if the frames were simulated with fixedStep instead of the wall clock time
+	int fixedStep;
+	float step;
+};
+
+struct RecordedFrame {
+	float deltaT;
+	// PhysicsWorld::GetStateChecksum after the frame, combined with the checksum of the particles
+	unsigned checksum;
+	unsigned char keys;
+};
+
+// Appends the input and time step of every frame to a file
+class InputRecorder {
+public:
+	// step is only used if fixedStep is set
+	InputRecorder(const char* filename, bool fixedStep, float step);
+	~InputRecorder();
+
+	bool isValid() const {
+		return file != nullptr;
+	}
+
+	void add(const RecordedFrame& frame);
+
+	bool fixedStep;
+	float step;
+	int numFrames;
+
+private:
+	FILE* file;
+};
+
+// A recording read back completely
+class InputReplay {
+public:
+	InputReplay(const char* filename);
+	~InputReplay();
+
+	// False if the file could not be read
+	bool isValid() const {
+		return frames != nullptr;
+	}
+
+	bool fixedStep;
+	float step;
+	int numFrames;
+	RecordedFrame* frames;
+};
@@ -0,0 +1,51 @@
+#include "pch.h"
+#include "InstanceBenchmark.h"
+
+#include <Kore/Log.h>
+#include <Kore/Math/Core.h>
+#include "Benchmark.h"
+#include "PhysicsObject.h"
+#include "PhysicsWorld.h"
+
+using namespace Kore;
+
+void benchmarkInstances(const char* levelFile, int maxInstances) {
+	const float deltaT = 1.0f / 60.0f;
+	const int updates = 300;
+	const int balls = 64;
+
+	CollisionMesh* collision = loadCollisionMesh(levelFile);
+	vec3 size = collision->max - collision->min;
+	float spacing = Kore::max(size.x(), size.z()) * 1.5f;
+	vec3 center = (collision->min + collision->max) * 0.5f;
+
+	for (int instances = 1; instances <= maxInstances; instances *= 4) {
+		PhysicsWorld world(balls);
+		int side = (int)Kore::sqrt((float)instances);
+		if (side * side < instances) ++side;
+		for (int i = 0; i < instances; ++i) {
+			mat4 M = mat4::Translation((i % side) * spacing, 0.0f, (i / side) * spacing) * mat4::RotationY(i * 0.5f) * mat4::Scale(0.75f + 0.125f * (i % 3), 0.75f + 0.125f * (i % 3), 0.75f + 0.125f * (i % 3));
+			world.AddMeshCollider(collision, M * mat4::Translation(-center.x(), -center.y(), -center.z()));
+		}
+		for (int i = 0; i < balls; ++i) {
+			int instance = (i * 7919) % instances;
+			PhysicsObject* po = world.GetObject(world.SpawnObject());
+			po->SetPosition(vec3((instance % side) * spacing + (i % 5) - 2.0f, size.y() + 2.0f, (instance / side) * spacing + (i % 3) - 1.0f));
+		}
+
+		int onLevel = 0;
+		BenchmarkClock::time_point start = BenchmarkClock::now();
+		for (int u = 0; u < updates; ++u) {
+			world.Update(deltaT);
+		}
+		double ms = millisecondsSince(start);
+		for (int i = 0; i < world.GetObjectCount(); ++i) {
+			if (world.physicsObjects[i]->GetPosition().y() > collision->min.y() - center.y() - 1.0f) ++onLevel;
+		}
+
+		Kore::log(Info, "Instances: %5i placements, %i bytes of collision mesh, %i bytes per placement, %.3f ms per update, %i of %i balls still on the level",
+			instances, collision->memoryUsage(), (int)sizeof(TriangleMeshCollider), ms / updates, onLevel, balls);
+		world.RemoveMeshCollider(collision);
+	}
+	delete collision;
+}
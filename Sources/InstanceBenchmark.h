@@ -0,0 +1,7 @@
+#pragma once
+
+#include "pch.h"
+
+// Place the level mesh of levelFile up to maxInstances times on a grid, rotated and scaled, and drop balls onto random placements.
+// The collision mesh exists once, the time per update should grow with the logarithm of the number of placements.
+void benchmarkInstances(const char* levelFile, int maxInstances);
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "pch.h"
+
+#include <cstring>
+#include "MemoryTracking.h"
+#include "MeshObject.h"
+#include "RenderDevice.h"
+#include "RenderQueue.h"
+
+using namespace Kore;
+
+// Draws many copies of one MeshObject with a single call.
+// The model matrices are written to an instance vertex buffer (one "M" Float4x4 per instance) between begin and end.
+class InstancedRenderer {
+public:
+	InstancedRenderer(MeshObject* mesh, const Graphics4::VertexStructure& instanceStructure, int capacity = 64)
+		: mesh(mesh), count(0), structure(instanceStructure), capacity(capacity), data(nullptr) {
+		MemoryScope scope(MemoryRender);
+		instanceBuffer = mesh->device->createVertexBuffer(capacity, structure, 1);
+	}
+
+	~InstancedRenderer() {
+		mesh->device->destroy(instanceBuffer);
+	}
+
+	// Start collecting instances for this frame, makes room for at least maxInstances
+	void begin(int maxInstances) {
+		if (maxInstances > capacity) {
+			MemoryScope scope(MemoryRender);
+			mesh->device->destroy(instanceBuffer);
+			capacity = maxInstances * 2;
+			instanceBuffer = mesh->device->createVertexBuffer(capacity, structure, 1);
+		}
+		count = 0;
+		data = mesh->device->lock(instanceBuffer);
+	}
+
+	void add(const mat4& M) {
+		memcpy(&data[count * 16], M.data, 16 * sizeof(float));
+		++count;
+	}
+
+	// A translated and uniformly scaled instance, without building the matrix
+	void add(float x, float y, float z, float scale) {
+		float* M = &data[count * 16];
+		memset(M, 0, 16 * sizeof(float));
+		M[0] = scale;
+		M[5] = scale;
+		M[10] = scale;
+		M[12] = x;
+		M[13] = y;
+		M[14] = z;
+		M[15] = 1.0f;
+		++count;
+	}
+
+	void end() {
+		mesh->device->unlock(instanceBuffer);
+		data = nullptr;
+	}
+
+	void render(Graphics4::TextureUnit tex) {
+		if (count == 0) return;
+		RenderDevice* device = mesh->device;
+		DeviceVertexBuffer* buffers[2] = { mesh->vertexBuffer, instanceBuffer };
+		device->setTexture(tex, mesh->image);
+		device->setVertexBuffers(buffers, 2);
+		device->setIndexBuffer(mesh->indexBuffer);
+		device->drawIndexedVerticesInstanced(count);
+	}
+
+	// Queue the instanced draw instead of drawing right away
+	void submit(RenderQueue& queue, int pipeline, float depth) {
+		if (count == 0) return;
+		DrawItem item;
+		item.pipeline = pipeline;
+		item.texture = mesh->image;
+		item.vertexBuffers[0] = mesh->vertexBuffer;
+		item.vertexBuffers[1] = instanceBuffer;
+		item.numVertexBuffers = 2;
+		item.indexBuffer = mesh->indexBuffer;
+		item.instanceCount = count;
+		queue.add(item, depth);
+	}
+
+	MeshObject* mesh;
+
+	// Number of instances added since begin
+	int count;
+
+private:
+	Graphics4::VertexStructure structure;
+	DeviceVertexBuffer* instanceBuffer;
+	int capacity;
+	float* data;
+};
@@ -0,0 +1,375 @@
+#include "pch.h"
+#include "LevelGenerator.h"
+
+#include <Kore/Log.h>
+#include <Kore/Math/Core.h>
+#include <Kore/Math/Random.h>
+#include <Kore/Math/Vector.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using namespace Kore;
+
+namespace {
+	// Cells are unit tiles like in level.obj, plateaus are square blocks of cells
+	const int blockSize = 8;
+	const float levelHeight = 1.5f;
+	const int maxLevel = 3;
+
+	// Ramps are 2 cells wide and climb one level over 2 cells, they start at this offset along the block border
+	const int rampLength = 2;
+	const int rampWidth = 2;
+	const int minRampOffset = 2;
+	const int maxRampOffset = blockSize - minRampOffset - rampWidth;
+
+	// Goal boxes enclose this many cells in the middle of a block
+	const int goalStart = 3;
+	const int goalSize = 3;
+	const float goalHeight = 1.0f;
+
+	const float rimHeight = 1.5f;
+
+	enum Material { Floor, Wall, Goal, NumMaterials };
+	const char* materialNames[] = { "floorMaterial", "wallMaterial", "goalMaterial" };
+	const char* materialTextures[] = { "basicTiles6x6.png", "basicTiles3x3yellow.png", "basicTiles3x3red.png" };
+
+	// Fixed normals written at the start of the file: up, the four wall directions and the four ramp directions
+	enum Normal { Up, PosX, NegX, PosZ, NegZ, RampPosX, RampNegX, RampPosZ, RampNegZ, NumNormals };
+
+	// Plateau heights and the ramps between neighboring plateaus
+	struct Layout {
+		int cells;
+		int blocks;
+		// Level of each block
+		int* levels;
+		// Offset of the ramp to the +x (+z) neighbor along the border, -1 if there is none
+		int* rampX;
+		int* rampZ;
+		bool* goals;
+		int numRamps;
+		int numGoals;
+
+		Layout(int numCells) {
+			blocks = numCells / blockSize;
+			cells = blocks * blockSize;
+			levels = new int[blocks * blocks];
+			rampX = new int[blocks * blocks];
+			rampZ = new int[blocks * blocks];
+			goals = new bool[blocks * blocks];
+			numRamps = 0;
+			numGoals = 0;
+			for (int i = 0; i < blocks * blocks; ++i) {
+				levels[i] = Random::get(0, maxLevel);
+				goals[i] = Random::get(0, 15) == 0;
+				if (goals[i]) ++numGoals;
+			}
+			for (int bz = 0; bz < blocks; ++bz) {
+				for (int bx = 0; bx < blocks; ++bx) {
+					int i = bz * blocks + bx;
+					rampX[i] = -1;
+					rampZ[i] = -1;
+					if (bx + 1 < blocks && Kore::abs(levels[i] - levels[i + 1]) == 1 && Random::get(0, 1) == 0) {
+						rampX[i] = Random::get(minRampOffset, maxRampOffset);
+						++numRamps;
+					}
+					if (bz + 1 < blocks && Kore::abs(levels[i] - levels[i + blocks]) == 1 && Random::get(0, 1) == 0) {
+						rampZ[i] = Random::get(minRampOffset, maxRampOffset);
+						++numRamps;
+					}
+				}
+			}
+		}
+
+		~Layout() {
+			delete[] goals;
+			delete[] rampZ;
+			delete[] rampX;
+			delete[] levels;
+		}
+
+		float height(int bx, int bz) const {
+			return levels[bz * blocks + bx] * levelHeight;
+		}
+	};
+
+	// Writes quads and triangles as separate vertices (like the level exported from Blender) or only counts them if file is null
+	struct ObjWriter {
+		FILE* file;
+		int vertices;
+		int triangles;
+		vec3 normals[NumNormals];
+
+		ObjWriter(FILE* outputFile) : file(outputFile), vertices(0), triangles(0) {
+			float slope = levelHeight / rampLength;
+			normals[Up] = vec3(0, 1, 0);
+			normals[PosX] = vec3(1, 0, 0);
+			normals[NegX] = vec3(-1, 0, 0);
+			normals[PosZ] = vec3(0, 0, 1);
+			normals[NegZ] = vec3(0, 0, -1);
+			normals[RampPosX] = vec3(-slope, 1, 0);
+			normals[RampNegX] = vec3(slope, 1, 0);
+			normals[RampPosZ] = vec3(0, 1, -slope);
+			normals[RampNegZ] = vec3(0, 1, slope);
+			for (int i = 0; i < NumNormals; ++i) normals[i].normalize();
+		}
+
+		void header(const char* materialLibrary) {
+			if (file == nullptr) return;
+			fprintf(file, "# Generated level\nmtllib %s\n", materialLibrary);
+			for (int i = 0; i < NumNormals; ++i) {
+				fprintf(file, "vn %f %f %f\n", normals[i].x(), normals[i].y(), normals[i].z());
+			}
+			// One texture tile of the 6x6 and of the 3x3 textures
+			float tiles[] = { 1.0f / 6.0f, 1.0f / 3.0f };
+			for (int t = 0; t < 2; ++t) {
+				fprintf(file, "vt 0.000000 0.000000\nvt %f 0.000000\nvt %f %f\nvt 0.000000 %f\n", tiles[t], tiles[t], tiles[t], tiles[t]);
+			}
+		}
+
+		void material(Material material) {
+			if (file == nullptr) return;
+			fprintf(file, "usemtl %s\n", materialNames[material]);
+		}
+
+		void vertex(const vec3& v) {
+			if (file != nullptr) fprintf(file, "v %f %f %f\n", v.x(), v.y(), v.z());
+			++vertices;
+		}
+
+		// The corners go around the quad, the winding is fixed up to face along normal
+		void quad(Material material, Normal normal, vec3 p0, vec3 p1, vec3 p2, vec3 p3) {
+			if ((p1 - p0).cross(p2 - p0).dot(normals[normal]) < 0.0f) {
+				vec3 swap = p1;
+				p1 = p3;
+				p3 = swap;
+			}
+			vertex(p0);
+			vertex(p1);
+			vertex(p2);
+			vertex(p3);
+			triangles += 2;
+			if (file == nullptr) return;
+			int v = vertices - 3;
+			int t = material == Floor ? 1 : 5;
+			int n = normal + 1;
+			fprintf(file, "f %i/%i/%i %i/%i/%i %i/%i/%i\n", v, t, n, v + 1, t + 1, n, v + 2, t + 2, n);
+			fprintf(file, "f %i/%i/%i %i/%i/%i %i/%i/%i\n", v, t, n, v + 2, t + 2, n, v + 3, t + 3, n);
+		}
+
+		void triangle(Material material, Normal normal, vec3 p0, vec3 p1, vec3 p2) {
+			if ((p1 - p0).cross(p2 - p0).dot(normals[normal]) < 0.0f) {
+				vec3 swap = p1;
+				p1 = p2;
+				p2 = swap;
+			}
+			vertex(p0);
+			vertex(p1);
+			vertex(p2);
+			triangles += 1;
+			if (file == nullptr) return;
+			int v = vertices - 2;
+			int t = material == Floor ? 1 : 5;
+			int n = normal + 1;
+			fprintf(file, "f %i/%i/%i %i/%i/%i %i/%i/%i\n", v, t, n, v + 1, t + 1, n, v + 2, t + 2, n);
+		}
+
+		// A vertical quad along x (constant z) or along z (constant x) from bottom to top, facing along normal
+		void wall(Material material, Normal normal, float x0, float z0, float x1, float z1, float bottom, float top) {
+			quad(material, normal, vec3(x0, bottom, z0), vec3(x1, bottom, z1), vec3(x1, top, z1), vec3(x0, top, z0));
+		}
+	};
+
+	// Which ramp covers the cell, if any. direction is the normal of the ramp, t counts the cells from the lower end.
+	bool findRamp(const Layout& layout, int cx, int cz, Normal& direction, float& low, int& t) {
+		int bx = cx / blockSize, bz = cz / blockSize;
+		int lx = cx % blockSize, lz = cz % blockSize;
+		int i = bz * layout.blocks + bx;
+
+		// Ramps lie in the lower of the two blocks, next to the border
+		if (lx >= blockSize - rampLength && layout.rampX[i] >= 0 && lz >= layout.rampX[i] && lz < layout.rampX[i] + rampWidth && layout.levels[i] < layout.levels[i + 1]) {
+			direction = RampPosX;
+			t = lx - (blockSize - rampLength);
+		}
+		else if (lx < rampLength && bx > 0 && layout.rampX[i - 1] >= 0 && lz >= layout.rampX[i - 1] && lz < layout.rampX[i - 1] + rampWidth && layout.levels[i] < layout.levels[i - 1]) {
+			direction = RampNegX;
+			t = rampLength - 1 - lx;
+		}
+		else if (lz >= blockSize - rampLength && layout.rampZ[i] >= 0 && lx >= layout.rampZ[i] && lx < layout.rampZ[i] + rampWidth && layout.levels[i] < layout.levels[i + layout.blocks]) {
+			direction = RampPosZ;
+			t = lz - (blockSize - rampLength);
+		}
+		else if (lz < rampLength && bz > 0 && layout.rampZ[i - layout.blocks] >= 0 && lx >= layout.rampZ[i - layout.blocks] && lx < layout.rampZ[i - layout.blocks] + rampWidth && layout.levels[i] < layout.levels[i - layout.blocks]) {
+			direction = RampNegZ;
+			t = rampLength - 1 - lz;
+		}
+		else {
+			return false;
+		}
+		low = layout.height(bx, bz);
+		return true;
+	}
+
+	void writeFloor(ObjWriter& writer, const Layout& layout) {
+		writer.material(Floor);
+		for (int cz = 0; cz < layout.cells; ++cz) {
+			for (int cx = 0; cx < layout.cells; ++cx) {
+				float x = (float)cx, z = (float)cz;
+				Normal direction;
+				float low;
+				int t;
+				if (!findRamp(layout, cx, cz, direction, low, t)) {
+					float y = layout.height(cx / blockSize, cz / blockSize);
+					writer.quad(Floor, Up, vec3(x, y, z), vec3(x, y, z + 1), vec3(x + 1, y, z + 1), vec3(x + 1, y, z));
+					continue;
+				}
+				// Heights at the lower and upper edge of this cell
+				float y0 = low + levelHeight * t / rampLength;
+				float y1 = low + levelHeight * (t + 1) / rampLength;
+				if (direction == RampPosX) writer.quad(Floor, direction, vec3(x, y0, z), vec3(x, y0, z + 1), vec3(x + 1, y1, z + 1), vec3(x + 1, y1, z));
+				else if (direction == RampNegX) writer.quad(Floor, direction, vec3(x + 1, y0, z), vec3(x + 1, y0, z + 1), vec3(x, y1, z + 1), vec3(x, y1, z));
+				else if (direction == RampPosZ) writer.quad(Floor, direction, vec3(x, y0, z), vec3(x + 1, y0, z), vec3(x + 1, y1, z + 1), vec3(x, y1, z + 1));
+				else writer.quad(Floor, direction, vec3(x, y0, z + 1), vec3(x + 1, y0, z + 1), vec3(x + 1, y1, z), vec3(x, y1, z));
+			}
+		}
+	}
+
+	// The border between block i and its neighbor, facing the lower side. Cells where a ramp arrives stay open.
+	void writeBorder(ObjWriter& writer, const Layout& layout, int bx, int bz, bool alongX) {
+		int i = bz * layout.blocks + bx;
+		int neighbor = alongX ? i + 1 : i + layout.blocks;
+		if (layout.levels[i] == layout.levels[neighbor]) return;
+		float here = layout.levels[i] * levelHeight;
+		float there = layout.levels[neighbor] * levelHeight;
+		int ramp = alongX ? layout.rampX[i] : layout.rampZ[i];
+		Normal normal = alongX ? (here < there ? NegX : PosX) : (here < there ? NegZ : PosZ);
+		float bottom = Kore::min(here, there), top = Kore::max(here, there);
+		for (int c = 0; c < blockSize; ++c) {
+			if (ramp >= 0 && c >= ramp && c < ramp + rampWidth) continue;
+			if (alongX) {
+				float x = (float)((bx + 1) * blockSize);
+				float z = (float)(bz * blockSize + c);
+				writer.wall(Wall, normal, x, z, x, z + 1, bottom, top);
+			}
+			else {
+				float x = (float)(bx * blockSize + c);
+				float z = (float)((bz + 1) * blockSize);
+				writer.wall(Wall, normal, x, z, x + 1, z, bottom, top);
+			}
+		}
+
+		// Close the sides of the ramp, which sits in the lower block
+		if (ramp < 0) return;
+		float end = alongX ? (float)((bx + 1) * blockSize) : (float)((bz + 1) * blockSize);
+		float start = here < there ? end - rampLength : end + rampLength;
+		float sides[] = { (float)((alongX ? bz : bx) * blockSize + ramp), (float)((alongX ? bz : bx) * blockSize + ramp + rampWidth) };
+		for (int s = 0; s < 2; ++s) {
+			// Facing away from the ramp
+			Normal out = alongX ? (s == 0 ? NegZ : PosZ) : (s == 0 ? NegX : PosX);
+			if (alongX) writer.triangle(Wall, out, vec3(start, bottom, sides[s]), vec3(end, bottom, sides[s]), vec3(end, top, sides[s]));
+			else writer.triangle(Wall, out, vec3(sides[s], bottom, start), vec3(sides[s], bottom, end), vec3(sides[s], top, end));
+		}
+	}
+
+	void writeWalls(ObjWriter& writer, const Layout& layout) {
+		writer.material(Wall);
+		for (int bz = 0; bz < layout.blocks; ++bz) {
+			for (int bx = 0; bx < layout.blocks; ++bx) {
+				if (bx + 1 < layout.blocks) writeBorder(writer, layout, bx, bz, true);
+				if (bz + 1 < layout.blocks) writeBorder(writer, layout, bx, bz, false);
+			}
+		}
+
+		// A rim around the whole level, facing inwards
+		float size = (float)layout.cells;
+		for (int c = 0; c < layout.cells; ++c) {
+			float a = (float)c;
+			float y0 = layout.height(c / blockSize, 0), y1 = layout.height(c / blockSize, layout.blocks - 1);
+			float y2 = layout.height(0, c / blockSize), y3 = layout.height(layout.blocks - 1, c / blockSize);
+			writer.wall(Wall, PosZ, a, 0, a + 1, 0, y0, y0 + rimHeight);
+			writer.wall(Wall, NegZ, a, size, a + 1, size, y1, y1 + rimHeight);
+			writer.wall(Wall, PosX, 0, a, 0, a + 1, y2, y2 + rimHeight);
+			writer.wall(Wall, NegX, size, a, size, a + 1, y3, y3 + rimHeight);
+		}
+	}
+
+	// Thin walls around the middle of the block, visible from both sides
+	void writeGoals(ObjWriter& writer, const Layout& layout) {
+		writer.material(Goal);
+		for (int bz = 0; bz < layout.blocks; ++bz) {
+			for (int bx = 0; bx < layout.blocks; ++bx) {
+				if (!layout.goals[bz * layout.blocks + bx]) continue;
+				float y = layout.height(bx, bz);
+				float x0 = (float)(bx * blockSize + goalStart), z0 = (float)(bz * blockSize + goalStart);
+				float x1 = x0 + goalSize, z1 = z0 + goalSize;
+				for (int c = 0; c < goalSize; ++c) {
+					float a = x0 + c, b = z0 + c;
+					writer.wall(Goal, PosZ, a, z0, a + 1, z0, y, y + goalHeight);
+					writer.wall(Goal, NegZ, a, z0, a + 1, z0, y, y + goalHeight);
+					writer.wall(Goal, PosZ, a, z1, a + 1, z1, y, y + goalHeight);
+					writer.wall(Goal, NegZ, a, z1, a + 1, z1, y, y + goalHeight);
+					writer.wall(Goal, PosX, x0, b, x0, b + 1, y, y + goalHeight);
+					writer.wall(Goal, NegX, x0, b, x0, b + 1, y, y + goalHeight);
+					writer.wall(Goal, PosX, x1, b, x1, b + 1, y, y + goalHeight);
+					writer.wall(Goal, NegX, x1, b, x1, b + 1, y, y + goalHeight);
+				}
+			}
+		}
+	}
+
+	// Builds the layout for the seed and writes it, or only counts the triangles if file is null
+	int writeLevel(FILE* file, const char* materialLibrary, int cells, int seed, Layout** layoutOut = nullptr) {
+		Random::init(seed);
+		Layout* layout = new Layout(cells);
+		ObjWriter writer(file);
+		writer.header(materialLibrary);
+		writeFloor(writer, *layout);
+		writeWalls(writer, *layout);
+		writeGoals(writer, *layout);
+		if (layoutOut != nullptr) *layoutOut = layout;
+		else delete layout;
+		return writer.triangles;
+	}
+}
+
+int generateLevel(const char* objFile, int targetTriangles, int seed) {
+	// Roughly two triangles per cell, corrected once by counting
+	int cells = (int)(std::sqrt(targetTriangles / 2.0) / blockSize + 1) * blockSize;
+	int triangles = writeLevel(nullptr, nullptr, cells, seed);
+	cells = (int)(cells * std::sqrt((double)targetTriangles / triangles) / blockSize + 0.5) * blockSize;
+	if (cells < blockSize * 2) cells = blockSize * 2;
+
+	// The material library goes next to the OBJ file
+	char mtlFile[256];
+	strncpy(mtlFile, objFile, sizeof(mtlFile) - 5);
+	mtlFile[sizeof(mtlFile) - 5] = 0;
+	char* extension = strrchr(mtlFile, '.');
+	if (extension != nullptr) *extension = 0;
+	strcat(mtlFile, ".mtl");
+	const char* mtlName = strrchr(mtlFile, '/');
+	mtlName = mtlName != nullptr ? mtlName + 1 : mtlFile;
+
+	FILE* mtl = fopen(mtlFile, "wb");
+	if (mtl == nullptr) {
+		Kore::log(Error, "Could not write %s", mtlFile);
+		return 0;
+	}
+	for (int m = 0; m < NumMaterials; ++m) {
+		fprintf(mtl, "newmtl %s\nKd 1.000000 1.000000 1.000000\nmap_Kd %s\n\n", materialNames[m], materialTextures[m]);
+	}
+	fclose(mtl);
+
+	FILE* file = fopen(objFile, "wb");
+	if (file == nullptr) {
+		Kore::log(Error, "Could not write %s", objFile);
+		return 0;
+	}
+	Layout* layout;
+	triangles = writeLevel(file, mtlName, cells, seed, &layout);
+	fclose(file);
+
+	Kore::log(Info, "Generated %s: %i triangles, %i x %i cells, %i plateaus, %i ramps, %i goal boxes, seed %i",
+		objFile, triangles, cells, cells, layout->blocks * layout->blocks, layout->numRamps, layout->numGoals, seed);
+	delete layout;
+	return triangles;
+}
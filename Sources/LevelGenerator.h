@@ -0,0 +1,10 @@
+#pragma once
+
+#include "pch.h"
+
+// Writes a random level in the style of Level/level.obj for scaling tests: unit floor tiles on plateaus of
+// different heights, walls at the height changes, ramps between neighboring plateaus and goal boxes.
+// The grid size is chosen so the level has about targetTriangles triangles, the same seed gives the same level.
+// objFile gets a material library next to it which uses the textures of the Level directory.
+// Returns the number of triangles written, 0 if the file could not be written.
+int generateLevel(const char* objFile, int targetTriangles, int seed);
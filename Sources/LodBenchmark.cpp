@@ -0,0 +1,50 @@
+#include "pch.h"
+#include "LodBenchmark.h"
+
+#include <Kore/Log.h>
+#include <Kore/Math/Core.h>
+#include "Benchmark.h"
+#include "PhysicsObject.h"
+#include "PhysicsWorld.h"
+
+using namespace Kore;
+
+void benchmarkLod(int bodies) {
+	const float deltaT = 1.0f / 60.0f;
+	const int updates = 600;
+	int side = (int)Kore::sqrt((float)bodies) + 1;
+	float extent = side * 1.5f;
+	CollisionMesh* groundMesh = createGroundMesh(extent);
+
+	for (int run = 0; run < 2; ++run) {
+		PhysicsWorld world(bodies);
+		world.AddMeshCollider(groundMesh);
+		world.lodInterval = run == 0 ? 1 : 4;
+
+		for (int i = 0; i < bodies; ++i) {
+			PhysicsObject* po = world.GetObject(world.SpawnObject());
+			po->SetPosition(vec3((i % side) * 3.0f - extent, 0.6f, (i / side) * 3.0f - extent));
+			po->Velocity = vec3((i % 7) * 0.1f - 0.3f, 0.0f, (i % 5) * 0.1f - 0.2f);
+		}
+
+		long long steps = 0, stepsSkipped = 0, pairTests = 0, pairTestsSkipped = 0, promotions = 0;
+		BenchmarkClock::time_point start = BenchmarkClock::now();
+		for (int u = 0; u < updates; ++u) {
+			float angle = u * deltaT * 0.5f;
+			vec3 focus(Kore::cos(angle) * extent * 0.5f, 0.0f, Kore::sin(angle) * extent * 0.5f);
+			world.SetFocusPoints(&focus, 1);
+			world.Update(deltaT);
+			steps += world.stats.steps;
+			stepsSkipped += world.stats.stepsSkipped;
+			pairTests += world.stats.pairTests;
+			pairTestsSkipped += world.stats.pairTestsSkipped;
+			promotions += world.stats.promotions;
+		}
+		double ms = millisecondsSince(start);
+
+		Kore::log(Info, "%s: %i bodies, %.3f ms per update, %lld steps (%lld skipped), %lld pair tests (%lld skipped), %lld promotions",
+			run == 0 ? "Full rate" : "Level of detail", bodies, ms / updates, steps, stepsSkipped, pairTests, pairTestsSkipped, promotions);
+		world.RemoveMeshCollider(groundMesh);
+	}
+	delete groundMesh;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "pch.h"
+
+// Simulates that many spheres on a flat ground with a focus point circling through it, once at full rate
+// and once with level of detail, and logs the time per update and the steps and pair tests of both runs.
+void benchmarkLod(int bodies);
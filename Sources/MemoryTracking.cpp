@@ -0,0 +1,203 @@
+#include "pch.h"
+#include "MemoryTracking.h"
+
+#include <Kore/Log.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+using namespace Kore;
+
+namespace {
+	// Every allocation starts with its size and tag, 16 bytes keep the alignment of malloc
+	const size_t headerSize = 16;
+
+	const char* tagNames[] = { "untagged", "loader", "mesh", "physics", "render", "audio" };
+
+	// Only zero-initialized members, allocations can happen before any constructor of this file ran
+	struct TagCounters {
+		std::atomic<long long> liveBytes;
+		std::atomic<long long> peakBytes;
+		std::atomic<long long> allocations;
+		// Only changed by the thread inside the frame
+		int frameAllocations;
+		long long frameBytes;
+
+		int lastFrameAllocations;
+		long long lastFrameBytes;
+
+		bool limitsBytes;
+		long long budgetBytes;
+		bool limitsFrameAllocations;
+		int budgetFrameAllocations;
+		bool overBudget;
+	};
+
+	TagCounters tags[NumMemoryTags];
+
+	thread_local MemoryTag currentTag = MemoryUntagged;
+	// Set on the thread running the frame loop between beginMemoryFrame and endMemoryFrame
+	thread_local bool insideFrame = false;
+	std::atomic<bool> assertions;
+
+	void failAllocation(MemoryTag tag, size_t size) {
+		// Logging must not end up here again
+		assertions.store(false);
+		Kore::log(Error, "Allocation of %lld bytes for %s within a frame, the budget is %i allocations per frame", (long long)size, tagNames[tag], tags[tag].budgetFrameAllocations);
+		fflush(nullptr);
+		abort();
+	}
+
+	void* allocate(size_t size) {
+		char* block = (char*)malloc(size + headerSize);
+		if (block == nullptr) return nullptr;
+
+		MemoryTag tag = currentTag;
+		*reinterpret_cast<size_t*>(block) = size;
+		*reinterpret_cast<int*>(block + sizeof(size_t)) = tag;
+
+		TagCounters& counters = tags[tag];
+		long long live = counters.liveBytes.fetch_add((long long)size, std::memory_order_relaxed) + (long long)size;
+		long long peak = counters.peakBytes.load(std::memory_order_relaxed);
+		while (live > peak && !counters.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+		counters.allocations.fetch_add(1, std::memory_order_relaxed);
+
+		if (insideFrame) {
+			++counters.frameAllocations;
+			counters.frameBytes += (long long)size;
+			if (counters.limitsFrameAllocations && counters.frameAllocations > counters.budgetFrameAllocations && assertions.load(std::memory_order_relaxed)) {
+				failAllocation(tag, size);
+			}
+		}
+		return block + headerSize;
+	}
+
+	void release(void* pointer) {
+		if (pointer == nullptr) return;
+		char* block = reinterpret_cast<char*>(pointer) - headerSize;
+		size_t size = *reinterpret_cast<size_t*>(block);
+		int tag = *reinterpret_cast<int*>(block + sizeof(size_t));
+		tags[tag].liveBytes.fetch_sub((long long)size, std::memory_order_relaxed);
+		free(block);
+	}
+
+	void* allocateOrThrow(size_t size) {
+		void* pointer = allocate(size);
+		if (pointer == nullptr) throw std::bad_alloc();
+		return pointer;
+	}
+}
+
+void* operator new(size_t size) {
+	return allocateOrThrow(size);
+}
+
+void* operator new[](size_t size) {
+	return allocateOrThrow(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return allocate(size);
+}
+
+void operator delete(void* pointer) noexcept {
+	release(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+	release(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+	release(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+	release(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+	release(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+	release(pointer);
+}
+
+MemoryScope::MemoryScope(MemoryTag tag) : previous(currentTag) {
+	currentTag = tag;
+}
+
+MemoryScope::~MemoryScope() {
+	currentTag = previous;
+}
+
+const char* getMemoryTagName(MemoryTag tag) {
+	return tagNames[tag];
+}
+
+MemoryStats getMemoryStats(MemoryTag tag) {
+	TagCounters& counters = tags[tag];
+	MemoryStats stats;
+	stats.liveBytes = counters.liveBytes.load();
+	stats.peakBytes = counters.peakBytes.load();
+	stats.allocations = counters.allocations.load();
+	stats.frameAllocations = counters.lastFrameAllocations;
+	stats.frameBytes = counters.lastFrameBytes;
+	return stats;
+}
+
+void setMemoryBudget(MemoryTag tag, long long liveBytes, int frameAllocations) {
+	TagCounters& counters = tags[tag];
+	counters.limitsBytes = liveBytes >= 0;
+	counters.budgetBytes = liveBytes;
+	counters.limitsFrameAllocations = frameAllocations >= 0;
+	counters.budgetFrameAllocations = frameAllocations;
+	counters.overBudget = false;
+}
+
+void beginMemoryFrame() {
+	for (int i = 0; i < NumMemoryTags; ++i) {
+		tags[i].frameAllocations = 0;
+		tags[i].frameBytes = 0;
+	}
+	insideFrame = true;
+}
+
+bool endMemoryFrame() {
+	insideFrame = false;
+	bool withinBudget = true;
+	for (int i = 0; i < NumMemoryTags; ++i) {
+		TagCounters& counters = tags[i];
+		counters.lastFrameAllocations = counters.frameAllocations;
+		counters.lastFrameBytes = counters.frameBytes;
+		long long live = counters.liveBytes.load();
+
+		bool over = (counters.limitsBytes && live > counters.budgetBytes) || (counters.limitsFrameAllocations && counters.lastFrameAllocations > counters.budgetFrameAllocations);
+		// Only log when a tag goes over its budget, not in every frame it stays there
+		if (over && !counters.overBudget) {
+			Kore::log(Warning, "Memory budget of %s exceeded: %lld live bytes, %i allocations in the frame", tagNames[i], live, counters.lastFrameAllocations);
+		}
+		counters.overBudget = over;
+		if (over) withinBudget = false;
+	}
+	return withinBudget;
+}
+
+void setAllocationAssertions(bool enabled) {
+	assertions.store(enabled);
+}
+
+void logMemoryStats() {
+	for (int i = 0; i < NumMemoryTags; ++i) {
+		MemoryStats stats = getMemoryStats((MemoryTag)i);
+		if (stats.allocations == 0) continue;
+		Kore::log(Info, "  %-8s %10lld bytes live, %10lld peak, %8lld allocations, %i in the last frame (%lld bytes)",
+			tagNames[i], stats.liveBytes, stats.peakBytes, stats.allocations, stats.frameAllocations, stats.frameBytes);
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "pch.h"
+
+// Every heap allocation made with new is counted for the tag of the current thread.
+// Allocations made with malloc (which includes most of Kore) are not tracked.
+enum MemoryTag {
+	MemoryUntagged,
+	// File contents and temporary data while loading
+	MemoryLoader,
+	// CPU-side mesh data
+	MemoryMesh,
+	MemoryPhysics,
+	MemoryRender,
+	MemoryAudio,
+	NumMemoryTags
+};
+
+struct MemoryStats {
+	long long liveBytes;
+	long long peakBytes;
+	long long allocations;
+
+	// Of the last finished frame
+	int frameAllocations;
+	long long frameBytes;
+};
+
+// Allocations of the current thread get the tag until the scope ends, scopes can be nested
+class MemoryScope {
+public:
+	MemoryScope(MemoryTag tag);
+	~MemoryScope();
+
+private:
+	MemoryTag previous;
+};
+
+const char* getMemoryTagName(MemoryTag tag);
+
+MemoryStats getMemoryStats(MemoryTag tag);
+
+// Limits for one tag, checked at the end of every frame. Negative values mean no limit, which is the default.
+void setMemoryBudget(MemoryTag tag, long long liveBytes, int frameAllocations);
+
+// Allocations of the calling thread between these calls count for the frame, other threads (like the level streaming) are not included.
+// endMemoryFrame returns false if a tag went over its budget in the frame.
+void beginMemoryFrame();
+bool endMemoryFrame();
+
+// Every allocation within a frame which goes over the frame budget of its tag is logged and aborts the program,
+// so a debugger stops at the allocation. Set the frame budgets to 0 to enforce frames which do not allocate at all.
+void setAllocationAssertions(bool enabled);
+
+// Live and peak bytes and the allocations of the last frame per tag
+void logMemoryStats();
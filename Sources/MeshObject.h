@@ -4,21 +4,24 @@
 
 #include <Kore/IO/FileReader.h>
 #include <Kore/Math/Core.h>
-#include <Kore/Graphics1/Image.h>
-#include <Kore/Graphics4/Graphics.h>
+#include "MemoryTracking.h"
 #include "ObjLoader.h"
+#include "Culling.h"
+#include "RenderDevice.h"
+#include "RenderQueue.h"
 
 
 using namespace Kore;
 
 class MeshObject {
 public:
-	MeshObject(const char* meshFile, const char* textureFile, const Graphics4::VertexStructure& structure, float scale = 1.0f) {
+	MeshObject(RenderDevice* device, const char* meshFile, const char* textureFile, const Graphics4::VertexStructure& structure, float scale = 1.0f) : device(device) {
+		MemoryScope scope(MemoryRender);
 		mesh = loadObj(meshFile);
-		image = new Graphics4::Texture(textureFile, true);
+		image = device->createTexture(textureFile);
 
-		vertexBuffer = new Graphics4::VertexBuffer(mesh->numVertices, structure, 0);
-		float* vertices = vertexBuffer->lock();
+		vertexBuffer = device->createVertexBuffer(mesh->numVertices, structure, 0);
+		float* vertices = device->lock(vertexBuffer);
 		for (int i = 0; i < mesh->numVertices; ++i) {
 			vertices[i * 8 + 0] = mesh->vertices[i * 8 + 0] * scale;
 			vertices[i * 8 + 1] = mesh->vertices[i * 8 + 1] * scale;
@@ -29,30 +32,68 @@ public:
 			vertices[i * 8 + 6] = mesh->vertices[i * 8 + 6];
 			vertices[i * 8 + 7] = mesh->vertices[i * 8 + 7];
 		}
-		vertexBuffer->unlock();
+		device->unlock(vertexBuffer);
 
-		indexBuffer = new Graphics4::IndexBuffer(mesh->numFaces * 3);
-		int* indices = indexBuffer->lock();
+		indexBuffer = device->createIndexBuffer(mesh->numFaces * 3);
+		int* indices = device->lock(indexBuffer);
 		for (int i = 0; i < mesh->numFaces * 3; i++) {
 			indices[i] = mesh->indices[i];
 		}
-		indexBuffer->unlock();
+		device->unlock(indexBuffer);
+
+		bounds = Bounds::fromVertices(mesh->vertices, 8, mesh->numVertices, scale);
 
 		M = mat4::Identity();
 	}
 
+	~MeshObject() {
+		device->destroy(vertexBuffer);
+		device->destroy(indexBuffer);
+		device->destroy(image);
+		delete mesh;
+	}
+
+	// Free the CPU-side copy of the mesh once it lives on the GPU
+	void releaseCpuData() {
+		delete mesh;
+		mesh = nullptr;
+	}
+
 	void render(Graphics4::TextureUnit tex) {
-		Graphics4::setTexture(tex, image);
-		Graphics4::setVertexBuffer(*vertexBuffer);
-		Graphics4::setIndexBuffer(*indexBuffer);
-		Graphics4::drawIndexedVertices();
+		device->setTexture(tex, image);
+		device->setVertexBuffers(&vertexBuffer, 1);
+		device->setIndexBuffer(indexBuffer);
+		device->drawIndexedVertices();
+	}
+
+	// Queue a draw instead of drawing right away
+	void submit(RenderQueue& queue, int pipeline, float depth) {
+		DrawItem item;
+		item.pipeline = pipeline;
+		item.texture = image;
+		item.vertexBuffers[0] = vertexBuffer;
+		item.vertexBuffers[1] = nullptr;
+		item.numVertexBuffers = 1;
+		item.indexBuffer = indexBuffer;
+		item.instanceCount = 0;
+		item.M = M;
+		queue.add(item, depth);
 	}
 
 	mat4 M;
 
-	Graphics4::VertexBuffer* vertexBuffer;
-	Graphics4::IndexBuffer* indexBuffer;
+	// Local space bounds, transform with M for culling
+	Bounds bounds;
+
+	RenderDevice* device;
+	DeviceVertexBuffer* vertexBuffer;
+	DeviceIndexBuffer* indexBuffer;
 
 	Mesh* mesh;
-	Graphics4::Texture* image;
+	DeviceTexture* image;
+
+private:
+	// Owns the mesh and the device resources
+	MeshObject(const MeshObject&);
+	MeshObject& operator=(const MeshObject&);
 };
@@ -1,5 +1,6 @@
 #include "pch.h"
 #include "ObjLoader.h"
+#include "MemoryTracking.h"
 #include <Kore/IO/FileReader.h>
 #include <cstring>
 #include <cstdlib>
@@ -7,32 +8,52 @@
 using namespace Kore;
 
 namespace {
-	char* tokenize(char* s, char delimiter, int& i) {
-		int lastIndex = i;
-		char* index = strchr(s + lastIndex + 1, delimiter);
-		if (index == nullptr) {
-			return nullptr;
+	// Walks over the delimited parts of a text. Every part is copied into the same buffer, which only grows
+	// for longer parts, so reading a file does not allocate once per line.
+	struct Tokenizer {
+		Tokenizer(char* s) : s(s), i(0), token(nullptr), capacity(0) {}
+
+		~Tokenizer() {
+			delete[] token;
 		}
-		int newIndex = (int)(index - s);
-		i = newIndex;
-		int length = newIndex - lastIndex;
-		char* token = new char[length + 1];
-		strncpy(token, s + lastIndex + 1, length);
-		token[length] = 0;
-		return token;
-	}
+
+		// The next part including its delimiter, nullptr after the last delimiter. Valid until the next call.
+		char* next(char delimiter) {
+			int lastIndex = i;
+			char* index = strchr(s + lastIndex + 1, delimiter);
+			if (index == nullptr) {
+				return nullptr;
+			}
+			int newIndex = (int)(index - s);
+			i = newIndex;
+			int length = newIndex - lastIndex;
+			if (length + 1 > capacity) {
+				delete[] token;
+				capacity = length + 1 > 256 ? length + 1 : 256;
+				token = new char[capacity];
+			}
+			memcpy(token, s + lastIndex + 1, length);
+			token[length] = 0;
+			return token;
+		}
+
+		char* s;
+		int i;
+		char* token;
+		int capacity;
+	};
 
 	int countFirstCharLines(char* source, const char* start) {
 		int count = 0;
 
-		int index = 0;
-		char* line = tokenize(source, '\n', index);
+		Tokenizer lines(source);
+		char* line = lines.next('\n');
 
 		while (line != nullptr) {
 			char *pch = strstr(line, start);
 			if (pch == line)
 				count++;
-			line = tokenize(source, '\n', index);
+			line = lines.next('\n');
 		}
 		return count;
 	}
@@ -58,14 +79,14 @@ namespace {
 	int countFaces(char* source) {
 		int count = 0;
 
-		int index = 0;
-		char* line = tokenize(source, '\n', index);
+		Tokenizer lines(source);
+		char* line = lines.next('\n');
 
 		while (line != nullptr) {
 			if (line[0] == 'f') {
 				count += countFacesInLine(line);
 			}
-			line = tokenize(source, '\n', index);
+			line = lines.next('\n');
 		}
 		return count;
 	}
@@ -186,67 +207,232 @@ namespace {
 		}
 	}
 
+	// Copy the rest of the current strtok line, without trailing whitespace
+	void copyArgument(char* target, int size) {
+		char* token = strtok(nullptr, "\r\n");
+		if (token == nullptr) token = (char*)"";
+		while (*token == ' ' || *token == '\t') ++token;
+		strncpy(target, token, size - 1);
+		target[size - 1] = 0;
+		int length = (int)strlen(target);
+		while (length > 0 && (target[length - 1] == ' ' || target[length - 1] == '\t' || target[length - 1] == '\r')) {
+			target[--length] = 0;
+		}
+	}
+
+	void parseMaterial(Mesh* mesh, char* line) {
+		char name[64];
+		copyArgument(name, sizeof(name));
+		for (int i = 0; i < mesh->numMaterials; ++i) {
+			if (strcmp(mesh->materials[i].name, name) == 0) {
+				mesh->curMaterial = i;
+				return;
+			}
+		}
+		MeshMaterial& material = mesh->materials[mesh->numMaterials];
+		strcpy(material.name, name);
+		material.texture[0] = 0;
+		mesh->curMaterial = mesh->numMaterials++;
+	}
+
 	void parseLine(Mesh* mesh, char* line) {
 		char* token = strtok(line, " ");
+		if (token == nullptr) return;
 		if (strcmp(token, "v") == 0) {
 			// Read some vertex data
 			parseVertex(mesh, line);
 		}
 		else if (strcmp(token, "f") == 0) {
 			// Read some face data
+			int first = mesh->numFaces;
 			parseFace(mesh, line);
+			for (int i = first; i < mesh->numFaces; ++i) mesh->faceMaterials[i] = mesh->curMaterial;
 		}
 		else if (strcmp(token, "vt") == 0) {
 			parseUV(mesh, line);
 		} else if (strcmp(token, "vn") == 0) {
 			parseNormal(mesh, line);
+		} else if (strcmp(token, "usemtl") == 0) {
+			parseMaterial(mesh, line);
+		} else if (strcmp(token, "mtllib") == 0) {
+			copyArgument(mesh->materialLibrary, sizeof(mesh->materialLibrary));
 		}
 
 		// Ignore all other commands (for now)	
 	}
+
+	int countMaterials(char* source) {
+		return countFirstCharLines(source, "usemtl ");
+	}
+
+	// The directory part of path including the trailing slash, or an empty string
+	void directoryOf(const char* path, char* directory, int size) {
+		strncpy(directory, path, size - 1);
+		directory[size - 1] = 0;
+		char* slash = strrchr(directory, '/');
+		if (slash != nullptr) slash[1] = 0;
+		else directory[0] = 0;
+	}
+
+	// Read the map_Kd entries of the material library. Texture paths are reduced to their file name
+	// and looked up next to the OBJ file, because exporters tend to write absolute paths.
+	void loadMaterialLibrary(Mesh* mesh, const char* objFilename) {
+		char directory[128];
+		directoryOf(objFilename, directory, sizeof(directory));
+		char path[256];
+		strcpy(path, directory);
+		strncat(path, mesh->materialLibrary, sizeof(path) - strlen(path) - 1);
+
+		FileReader reader;
+		if (!reader.open(path, FileReader::Asset)) {
+			return;
+		}
+		int length = reader.size();
+		char* source = new char[length + 2];
+		source[0] = '\n';
+		memcpy(source + 1, reader.readAll(), length);
+		source[length + 1] = 0;
+
+		MeshMaterial* current = nullptr;
+		Tokenizer lines(source);
+		char* line = lines.next('\n');
+		while (line != nullptr) {
+			char* token = strtok(line, " \t");
+			if (token != nullptr && strcmp(token, "newmtl") == 0) {
+				char name[64];
+				copyArgument(name, sizeof(name));
+				current = nullptr;
+				for (int i = 0; i < mesh->numMaterials; ++i) {
+					if (strcmp(mesh->materials[i].name, name) == 0) current = &mesh->materials[i];
+				}
+			}
+			else if (token != nullptr && strcmp(token, "map_Kd") == 0 && current != nullptr) {
+				char texture[128];
+				copyArgument(texture, sizeof(texture));
+				const char* file = texture;
+				for (const char* c = texture; *c != 0; ++c) {
+					if (*c == '/' || *c == '\\') file = c + 1;
+				}
+				strcpy(current->texture, directory);
+				strncat(current->texture, file, sizeof(current->texture) - strlen(current->texture) - 1);
+			}
+			line = lines.next('\n');
+		}
+
+		delete[] source;
+	}
+
+	// Reorder the faces so that every material covers one contiguous index range
+	void sortFacesByMaterial(Mesh* mesh) {
+		int* sorted = new int[mesh->numFaces * 3];
+		int* current = sorted;
+		for (int m = 0; m < mesh->numMaterials; ++m) {
+			MeshMaterial& material = mesh->materials[m];
+			material.firstIndex = (int)(current - sorted);
+			for (int i = 0; i < mesh->numFaces; ++i) {
+				if (mesh->faceMaterials[i] != m) continue;
+				current[0] = mesh->indices[i * 3 + 0];
+				current[1] = mesh->indices[i * 3 + 1];
+				current[2] = mesh->indices[i * 3 + 2];
+				current += 3;
+			}
+			material.indexCount = (int)(current - sorted) - material.firstIndex;
+		}
+		memcpy(mesh->indices, sorted, mesh->numFaces * 3 * sizeof(int));
+		delete[] sorted;
+	}
+}
+
+Mesh::Mesh() : numFaces(0), numVertices(0), numUVs(0), numNormals(0),
+	vertices(nullptr), indices(nullptr), uvs(nullptr), normals(nullptr), numMaterials(0), materials(nullptr), arena(nullptr), arenaSize(0),
+	curVertex(nullptr), curIndex(nullptr), curUV(nullptr), curNormal(nullptr), curMaterial(0), faceMaterials(nullptr) {
+	materialLibrary[0] = 0;
+}
+
+Mesh::~Mesh() {
+	delete[] arena;
+}
+
+int Mesh::memoryUsage() const {
+	return sizeof(Mesh) + arenaSize;
 }
 
 Mesh* loadObj(const char* filename) {
+	// The file and the temporary arrays count for the loader, the mesh data for the meshes
+	MemoryScope scope(MemoryLoader);
+
 	FileReader fileReader(filename, FileReader::Asset);
-	void* data = fileReader.readAll();
-	int length = fileReader.size() + 1;
-	char* source = new char[length];
-	for (int i = 0; i < length; ++i) source[i] = reinterpret_cast<char*>(data)[i];
+	int length = fileReader.size();
+	char* source = new char[length + 1];
+	memcpy(source, fileReader.readAll(), length);
 	source[length] = 0;
 	
-	Mesh* mesh = new Mesh;
+	Mesh* mesh;
+	{
+		MemoryScope meshScope(MemoryMesh);
+		mesh = new Mesh;
+	}
 
 	int vertices = countVertices(source);
-	mesh->vertices = new float[vertices * 8];
-	mesh->curVertex = mesh->vertices;
 	int faces = countFaces(source);
-	mesh->indices = new int[faces * 3];
-	mesh->curIndex = mesh->indices;
 	mesh->numUVs = countUVs(source);
-	mesh->uvs = new float[mesh->numUVs * 2];
-	mesh->curUV = mesh->uvs;
 	int normals = countNormals(source);
 	mesh->numNormals = normals;
-	mesh->normals = new float[normals * 3];
-	mesh->curNormal = mesh->normals;
-
-
+	// Faces before the first usemtl get a default material
+	int materials = countMaterials(source) + 1;
+
+	// Carve all arrays out of one block
+	int vertexBytes = vertices * 8 * sizeof(float);
+	int indexBytes = faces * 3 * sizeof(int);
+	int uvBytes = mesh->numUVs * 2 * sizeof(float);
+	int normalBytes = normals * 3 * sizeof(float);
+	int materialBytes = materials * sizeof(MeshMaterial);
+	mesh->arenaSize = vertexBytes + indexBytes + uvBytes + normalBytes + materialBytes;
+	{
+		MemoryScope meshScope(MemoryMesh);
+		mesh->arena = new char[mesh->arenaSize];
+	}
 
+	mesh->vertices = reinterpret_cast<float*>(mesh->arena);
+	mesh->curVertex = mesh->vertices;
+	mesh->indices = reinterpret_cast<int*>(mesh->arena + vertexBytes);
+	mesh->curIndex = mesh->indices;
+	mesh->uvs = reinterpret_cast<float*>(mesh->arena + vertexBytes + indexBytes);
+	mesh->curUV = mesh->uvs;
+	mesh->normals = reinterpret_cast<float*>(mesh->arena + vertexBytes + indexBytes + uvBytes);
+	mesh->curNormal = mesh->normals;
+	mesh->materials = reinterpret_cast<MeshMaterial*>(mesh->arena + vertexBytes + indexBytes + uvBytes + normalBytes);
+	mesh->materials[0].name[0] = 0;
+	mesh->materials[0].texture[0] = 0;
+	mesh->numMaterials = 1;
+	mesh->faceMaterials = new int[faces];
 	
 	mesh->numVertices = 0;
 	mesh->numFaces = 0;
 	
-	
-	
-	int index = 0;
-	char* line = tokenize(source, '\n', index);
+	Tokenizer lines(source);
+	char* line = lines.next('\n');
 	
 	int lineNumber = 0;
 	while (line != nullptr) {
 		parseLine(mesh, line);
 		lineNumber++;
-		delete[] line;
-		line = tokenize(source, '\n', index);
+		line = lines.next('\n');
+	}
+
+	delete[] source;
+
+	if (mesh->materialLibrary[0] != 0) {
+		loadMaterialLibrary(mesh, filename);
+	}
+	sortFacesByMaterial(mesh);
+	delete[] mesh->faceMaterials;
+	mesh->faceMaterials = nullptr;
+
+	// Drop the default material if every face has a named one
+	if (mesh->numMaterials > 1 && mesh->materials[0].indexCount == 0) {
+		mesh->materials++;
+		mesh->numMaterials--;
 	}
 
 	return mesh;
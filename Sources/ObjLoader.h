@@ -1,21 +1,55 @@
 #pragma once
 
+// A range of faces sharing one material (from usemtl/newmtl)
+struct MeshMaterial {
+	char name[64];
+
+	// Diffuse texture (map_Kd) relative to the asset directory, empty if unknown
+	char texture[128];
+
+	int firstIndex;
+	int indexCount;
+};
+
 struct Mesh {
+	Mesh();
+	~Mesh();
+
 	int numFaces;
 	int numVertices;
 	int numUVs;
 	int numNormals;
 
+	// 8 floats per vertex: position, uv, normal
 	float* vertices;
 	int* indices;
 	float* uvs;
 	float * normals;
 
+	// The faces are sorted by material, so every material covers one contiguous index range
+	int numMaterials;
+	MeshMaterial* materials;
+
+	// Size of the CPU-side data in bytes
+	int memoryUsage() const;
+
+	// All arrays above live in this single allocation
+	char* arena;
+	int arenaSize;
+
 	// very private
 	float* curVertex;
 	int* curIndex;
 	float* curUV;
 	float* curNormal;
+	int curMaterial;
+	int* faceMaterials;
+	char materialLibrary[128];
+
+private:
+	// The arena is freed by the destructor, a copy would free it twice
+	Mesh(const Mesh&);
+	Mesh& operator=(const Mesh&);
 };
 
 Mesh* loadObj(const char* filename);
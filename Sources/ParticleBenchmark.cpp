@@ -0,0 +1,58 @@
+#include "pch.h"
+#include "ParticleBenchmark.h"
+
+#include <Kore/Log.h>
+#include "Benchmark.h"
+#include "ParticleSystem.h"
+#include "PhysicsWorld.h"
+
+using namespace Kore;
+
+void benchmarkParticles(const char* levelFile, int count, int threads) {
+	const float deltaT = 1.0f / 60.0f;
+	const int updates = 180;
+	const float radius = 0.1f;
+
+	CollisionMesh* collision = loadCollisionMesh(levelFile);
+
+	PhysicsWorld world(1);
+	world.AddMeshCollider(collision);
+	float spacing = radius * 2.5f;
+	// A column above the start of the ball, which piles up on the starting platform
+	const float side = 8.0f;
+	vec3 corner(10.0f - side * 0.5f, collision->max.y() + 1.0f, -10.0f - side * 0.5f);
+	int perRow = (int)(side / spacing);
+	int perLayer = perRow * perRow;
+
+	unsigned checksums[2];
+	int threadCounts[2] = { 1, threads };
+	for (int run = 0; run < 2; ++run) {
+		world.EnableParticles(count, radius, threadCounts[run]);
+		ParticleSystem* particles = world.particles;
+		for (int i = 0; i < count; ++i) {
+			int layer = i / perLayer;
+			int cell = i % perLayer;
+			// Every other layer is offset, so the layers don't land exactly on top of each other
+			float offset = (layer % 2) * spacing * 0.5f;
+			particles->Emit(corner + vec3((cell % perRow) * spacing + offset, layer * spacing, (cell / perRow) * spacing + offset), vec3(0, 0, 0));
+		}
+
+		BenchmarkClock::time_point start = BenchmarkClock::now();
+		for (int u = 0; u < updates; ++u) {
+			world.Update(deltaT);
+		}
+		double ms = millisecondsSince(start);
+
+		int onLevel = 0;
+		for (int i = 0; i < particles->GetCount(); ++i) {
+			if (particles->GetPosition(i).y() > collision->min.y() - 1.0f) ++onLevel;
+		}
+		checksums[run] = particles->GetChecksum();
+		Kore::log(Info, "Particles: %i on %i threads, %.3f ms per update, %i contacts and %i level contacts in the last update, %i still on the level",
+			count, particles->GetThreadCount(), ms / updates, particles->stats.contacts, particles->stats.levelContacts, onLevel);
+	}
+	Kore::log(checksums[0] == checksums[1] ? Info : Error, "Particles: the runs %s", checksums[0] == checksums[1] ? "ended in the same state" : "differ");
+
+	world.RemoveMeshCollider(collision);
+	delete collision;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "pch.h"
+
+// Drop count marbles in layers onto the level mesh of levelFile, once on a single thread and once on the given number of threads (0 for one per hardware thread).
+// Both runs have to end in the same state, the particles of a thread only depend on the previous iteration.
+void benchmarkParticles(const char* levelFile, int count, int threads);
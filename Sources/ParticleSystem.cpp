@@ -0,0 +1,479 @@
+#include "pch.h"
+#include "ParticleSystem.h"
+
+#include <cmath>
+#include <cstring>
+#include "MemoryTracking.h"
+#include "PhysicsWorld.h"
+
+namespace {
+	// Moved particles are corrected by the average of their constraints times this, which converges faster than the plain average
+	const float overRelaxation = 1.5f;
+
+	const float gravity = -9.81f;
+
+	// Closest point of an axis aligned rectangle or box. Points inside a box are moved to the nearest face.
+	vec3 closestPoint(const CollisionPrimitive& primitive, const vec3& p) {
+		vec3 result;
+		bool inside = true;
+		for (int k = 0; k < 3; ++k) {
+			result[k] = p[k];
+			if (p[k] < primitive.min[k]) {
+				result[k] = primitive.min[k];
+				inside = false;
+			}
+			else if (p[k] > primitive.max[k]) {
+				result[k] = primitive.max[k];
+				inside = false;
+			}
+		}
+		if (!inside || primitive.shape == CollisionPrimitive::Rectangle) return result;
+
+		int axis = 0;
+		float value = primitive.min[0];
+		float nearest = p[0] - primitive.min[0];
+		for (int k = 0; k < 3; ++k) {
+			if (p[k] - primitive.min[k] < nearest) {
+				axis = k;
+				value = primitive.min[k];
+				nearest = p[k] - primitive.min[k];
+			}
+			if (primitive.max[k] - p[k] < nearest) {
+				axis = k;
+				value = primitive.max[k];
+				nearest = primitive.max[k] - p[k];
+			}
+		}
+		result[axis] = value;
+		return result;
+	}
+}
+
+ParticleSystem::ParticleSystem(int inMaxParticles, float inRadius, int threadCount)
+	: radius(inRadius), iterations(4), damping(0.999f), friction(0.2f), maxParticles(inMaxParticles), numParticles(0),
+	stepTime(0.0f), world(nullptr), lastIteration(false), phase(Predict), generation(0), busyWorkers(0), stopping(false) {
+	MemoryScope scope(MemoryPhysics);
+	memset(&stats, 0, sizeof(stats));
+
+	float** arrays[] = { &x, &y, &z, &vx, &vy, &vz, &px, &py, &pz, &dx, &dy, &dz };
+	for (int i = 0; i < 12; ++i) {
+		*arrays[i] = new float[maxParticles];
+	}
+	for (int i = 0; i < 9; ++i) {
+		scratch[i] = new float[maxParticles];
+	}
+	corrections = new int[maxParticles];
+
+	// Neighbors are found once per update, the projections only move particles a fraction of the radius
+	cellSize = 2.5f * radius;
+	unsigned tableSize = 1;
+	while (tableSize < (unsigned)maxParticles * 2) tableSize *= 2;
+	tableMask = tableSize - 1;
+	cellOfParticle = new unsigned[maxParticles];
+	cellStart = new int[tableSize + 1];
+	sortedParticles = new int[maxParticles];
+	neighbors = new int[maxParticles * maxNeighbors];
+	numNeighbors = new int[maxParticles];
+
+	numThreads = threadCount > 0 ? threadCount : (int)std::thread::hardware_concurrency();
+	if (numThreads < 1) numThreads = 1;
+	threadStats = new ThreadStats[numThreads];
+	// The calling thread works on the first range of every phase
+	threads = new std::thread[numThreads - 1];
+	for (int i = 1; i < numThreads; ++i) {
+		threads[i - 1] = std::thread(&ParticleSystem::WorkerMain, this, i);
+	}
+}
+
+ParticleSystem::~ParticleSystem() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	phaseStarted.notify_all();
+	for (int i = 0; i < numThreads - 1; ++i) {
+		threads[i].join();
+	}
+	delete[] threads;
+	delete[] threadStats;
+
+	float* arrays[] = { x, y, z, vx, vy, vz, px, py, pz, dx, dy, dz };
+	for (int i = 0; i < 12; ++i) {
+		delete[] arrays[i];
+	}
+	for (int i = 0; i < 9; ++i) {
+		delete[] scratch[i];
+	}
+	delete[] corrections;
+	delete[] cellOfParticle;
+	delete[] cellStart;
+	delete[] sortedParticles;
+	delete[] neighbors;
+	delete[] numNeighbors;
+}
+
+bool ParticleSystem::Emit(const vec3& position, const vec3& velocity) {
+	if (numParticles == maxParticles) return false;
+	int i = numParticles++;
+	x[i] = position.x();
+	y[i] = position.y();
+	z[i] = position.z();
+	vx[i] = velocity.x();
+	vy[i] = velocity.y();
+	vz[i] = velocity.z();
+	return true;
+}
+
+void ParticleSystem::Clear() {
+	numParticles = 0;
+}
+
+unsigned ParticleSystem::GetChecksum() const {
+	unsigned hash = 2166136261u;
+	const float* arrays[] = { x, y, z, vx, vy, vz };
+	for (int a = 0; a < 6; ++a) {
+		const unsigned char* bytes = (const unsigned char*)arrays[a];
+		for (int b = 0; b < numParticles * (int)sizeof(float); ++b) {
+			hash ^= bytes[b];
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+void ParticleSystem::Update(float deltaT, const PhysicsWorld& inWorld) {
+	memset(&stats, 0, sizeof(stats));
+	stats.particles = numParticles;
+	if (numParticles == 0 || deltaT <= 0.0f) return;
+
+	stepTime = deltaT;
+	world = &inWorld;
+	memset(threadStats, 0, numThreads * sizeof(ThreadStats));
+
+	RunPhase(Predict);
+	SortByCell();
+	RunPhase(Gather);
+	// The gathered arrays replace the old ones, which become the scratch buffers for the next update
+	float** arrays[] = { &x, &y, &z, &vx, &vy, &vz, &px, &py, &pz };
+	for (int i = 0; i < 9; ++i) {
+		float* sorted = scratch[i];
+		scratch[i] = *arrays[i];
+		*arrays[i] = sorted;
+	}
+	RunPhase(FindNeighbors);
+
+	for (int i = 0; i < iterations; ++i) {
+		lastIteration = i == iterations - 1;
+		RunPhase(Project);
+		RunPhase(Apply);
+	}
+	RunPhase(Finish);
+
+	for (int i = 0; i < numThreads; ++i) {
+		stats.contacts += threadStats[i].contacts;
+		stats.levelContacts += threadStats[i].levelContacts;
+	}
+	// Every pair was counted from both sides
+	stats.contacts /= 2;
+	world = nullptr;
+}
+
+unsigned ParticleSystem::CellHash(int cx, int cy, int cz) const {
+	return ((unsigned)cx * 73856093u ^ (unsigned)cy * 19349663u ^ (unsigned)cz * 83492791u) & tableMask;
+}
+
+int ParticleSystem::CellCoordinate(float position) const {
+	return (int)floor(position / cellSize);
+}
+
+void ParticleSystem::SortByCell() {
+	// Counting sort, stable so the same particles always end up in the same order
+	int tableSize = (int)tableMask + 1;
+	memset(cellStart, 0, (tableSize + 1) * sizeof(int));
+	for (int i = 0; i < numParticles; ++i) {
+		++cellStart[cellOfParticle[i] + 1];
+	}
+	for (int i = 0; i < tableSize; ++i) {
+		cellStart[i + 1] += cellStart[i];
+	}
+	// Filling every cell from its end moves each entry back to the start of the cell before it
+	for (int i = numParticles - 1; i >= 0; --i) {
+		sortedParticles[--cellStart[cellOfParticle[i] + 1]] = i;
+	}
+	for (int i = 0; i < tableSize; ++i) {
+		cellStart[i] = cellStart[i + 1];
+	}
+	cellStart[tableSize] = numParticles;
+}
+
+void ParticleSystem::PredictRange(int begin, int end) {
+	for (int i = begin; i < end; ++i) {
+		vy[i] += gravity * stepTime;
+		px[i] = x[i] + vx[i] * stepTime;
+		py[i] = y[i] + vy[i] * stepTime;
+		pz[i] = z[i] + vz[i] * stepTime;
+		cellOfParticle[i] = CellHash(CellCoordinate(px[i]), CellCoordinate(py[i]), CellCoordinate(pz[i]));
+	}
+}
+
+void ParticleSystem::GatherRange(int begin, int end) {
+	float* arrays[] = { x, y, z, vx, vy, vz, px, py, pz };
+	for (int a = 0; a < 9; ++a) {
+		const float* source = arrays[a];
+		float* target = scratch[a];
+		for (int i = begin; i < end; ++i) {
+			target[i] = source[sortedParticles[i]];
+		}
+	}
+}
+
+void ParticleSystem::FindNeighborsRange(int begin, int end) {
+	float reach = cellSize;
+	float reach2 = reach * reach;
+	for (int i = begin; i < end; ++i) {
+		float pix = px[i];
+		float piy = py[i];
+		float piz = pz[i];
+		int* list = &neighbors[i * maxNeighbors];
+		int count = 0;
+
+		int x0 = CellCoordinate(pix);
+		int y0 = CellCoordinate(piy);
+		int z0 = CellCoordinate(piz);
+		// Different cells can share a hash entry, which must only be searched once.
+		// The bit mask rules out most repeats without comparing with all visited entries.
+		unsigned visited[27];
+		int numVisited = 0;
+		unsigned long long seenBits[4] = { 0, 0, 0, 0 };
+		for (int ox = -1; ox <= 1; ++ox) for (int oy = -1; oy <= 1; ++oy) for (int oz = -1; oz <= 1; ++oz) {
+			unsigned cell = CellHash(x0 + ox, y0 + oy, z0 + oz);
+			unsigned long long bit = 1ull << (cell & 63);
+			unsigned long long& bits = seenBits[(cell >> 6) & 3];
+			if (bits & bit) {
+				bool seen = false;
+				for (int v = 0; v < numVisited; ++v) {
+					if (visited[v] == cell) seen = true;
+				}
+				if (seen) continue;
+			}
+			bits |= bit;
+			visited[numVisited++] = cell;
+
+			for (int j = cellStart[cell]; j < cellStart[cell + 1] && count < maxNeighbors; ++j) {
+				if (j == i) continue;
+				float ex = pix - px[j];
+				float ey = piy - py[j];
+				float ez = piz - pz[j];
+				if (ex * ex + ey * ey + ez * ez < reach2) list[count++] = j;
+			}
+		}
+		numNeighbors[i] = count;
+	}
+}
+
+void ParticleSystem::ProjectRange(int begin, int end, int thread) {
+	float diameter = 2.0f * radius;
+	float diameter2 = diameter * diameter;
+	int contacts = 0;
+	for (int i = begin; i < end; ++i) {
+		float pix = px[i];
+		float piy = py[i];
+		float piz = pz[i];
+		float cx = 0.0f;
+		float cy = 0.0f;
+		float cz = 0.0f;
+		int count = 0;
+
+		const int* list = &neighbors[i * maxNeighbors];
+		for (int n = 0; n < numNeighbors[i]; ++n) {
+			int j = list[n];
+			float ex = pix - px[j];
+			float ey = piy - py[j];
+			float ez = piz - pz[j];
+			float distance2 = ex * ex + ey * ey + ez * ez;
+			if (distance2 >= diameter2) continue;
+
+			// Both particles move half of the overlap apart, coincident ones are separated along the y axis by their order
+			float distance = Kore::sqrt(distance2);
+			float push;
+			if (distance > 1e-6f) {
+				push = 0.5f * (diameter - distance) / distance;
+			}
+			else {
+				ex = 0.0f;
+				ey = i < j ? -1.0f : 1.0f;
+				ez = 0.0f;
+				push = 0.5f * diameter;
+			}
+			cx += ex * push;
+			cy += ey * push;
+			cz += ez * push;
+			++count;
+		}
+		dx[i] = cx;
+		dy[i] = cy;
+		dz[i] = cz;
+		corrections[i] = count;
+		contacts += count;
+	}
+	threadStats[thread].contacts += contacts;
+}
+
+void ParticleSystem::ApplyRange(int begin, int end, int thread) {
+	int levelContacts = 0;
+	for (int i = begin; i < end; ++i) {
+		if (corrections[i] > 0) {
+			float scale = overRelaxation / corrections[i];
+			px[i] += dx[i] * scale;
+			py[i] += dy[i] * scale;
+			pz[i] += dz[i] * scale;
+		}
+		if (CollideWithLevel(i)) ++levelContacts;
+	}
+	threadStats[thread].levelContacts += levelContacts;
+}
+
+void ParticleSystem::FinishRange(int begin, int end) {
+	float velocityScale = damping / stepTime;
+	for (int i = begin; i < end; ++i) {
+		vx[i] = (px[i] - x[i]) * velocityScale;
+		vy[i] = (py[i] - y[i]) * velocityScale;
+		vz[i] = (pz[i] - z[i]) * velocityScale;
+		x[i] = px[i];
+		y[i] = py[i];
+		z[i] = pz[i];
+	}
+}
+
+bool ParticleSystem::CollideWithLevel(int particle) {
+	vec3 position(px[particle], py[particle], pz[particle]);
+	vec3 extents(radius, radius, radius);
+	bool touched = false;
+
+	auto collideWithCollider = [&](int index) {
+		const TriangleMeshCollider& collider = world->meshColliders[index];
+		const CollisionMesh& mesh = *collider.mesh;
+		// Features are tested in mesh space, where the radius shrinks with the scale of the collider
+		vec3 local = collider.ToMesh(position);
+		float localRadius = radius / collider.scale;
+		vec3 localExtents(localRadius, localRadius, localRadius);
+
+		auto collideWithFeature = [&](int feature) {
+			vec3 closest;
+			vec3 faceNormal;
+			bool inside = false;
+			if (mesh.isTriangle(feature)) {
+				TriangleCollider triangle;
+				triangle.LoadFromCollisionMesh(feature, mesh);
+				closest = triangle.ClosestPoint(local);
+				faceNormal = triangle.GetNormal();
+			}
+			else {
+				const CollisionPrimitive& primitive = mesh.primitive(feature);
+				closest = closestPoint(primitive, local);
+				faceNormal = primitive.shape == CollisionPrimitive::Rectangle ? primitive.normal : vec3(0.0f, 1.0f, 0.0f);
+				inside = primitive.shape == CollisionPrimitive::Box && local.x() >= primitive.min.x() && local.x() <= primitive.max.x()
+					&& local.y() >= primitive.min.y() && local.y() <= primitive.max.y() && local.z() >= primitive.min.z() && local.z() <= primitive.max.z();
+			}
+
+			vec3 offset = local - closest;
+			float distance2 = offset.dot(offset);
+			if (distance2 >= localRadius * localRadius && !inside) return;
+
+			// Out of the nearest point, through the face when the center lies on it
+			float distance = Kore::sqrt(distance2);
+			vec3 normal;
+			if (distance <= 1e-6f) {
+				normal = faceNormal;
+				distance = 0.0f;
+			}
+			else if (inside) {
+				normal = offset * (-1.0f / distance);
+				distance = -distance;
+			}
+			else {
+				normal = offset * (1.0f / distance);
+			}
+			local += normal * (localRadius - distance);
+			touched = true;
+
+			// Friction only once per update, against the sliding since the start of the update
+			if (!lastIteration || friction <= 0.0f) return;
+			vec3 start = collider.ToMesh(vec3(x[particle], y[particle], z[particle]));
+			vec3 moved = local - start;
+			vec3 sliding = moved - normal * normal.dot(moved);
+			local -= sliding * friction;
+		};
+		mesh.query(local - localExtents, local + localExtents, collideWithFeature);
+		position = collider.ToWorld(local);
+	};
+	world->QueryMeshColliders(position - extents, position + extents, collideWithCollider);
+
+	if (!touched) return false;
+	px[particle] = position.x();
+	py[particle] = position.y();
+	pz[particle] = position.z();
+	return true;
+}
+
+void ParticleSystem::RunPhase(Phase inPhase) {
+	if (numThreads == 1) {
+		RunRange(inPhase, 0);
+		return;
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		phase = inPhase;
+		busyWorkers = numThreads - 1;
+		++generation;
+	}
+	phaseStarted.notify_all();
+	RunRange(inPhase, 0);
+	std::unique_lock<std::mutex> lock(mutex);
+	while (busyWorkers > 0) phaseFinished.wait(lock);
+}
+
+void ParticleSystem::WorkerMain(int thread) {
+	int seenGeneration = 0;
+	for (;;) {
+		Phase current;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stopping && generation == seenGeneration) phaseStarted.wait(lock);
+			if (stopping) return;
+			seenGeneration = generation;
+			current = phase;
+		}
+
+		RunRange(current, thread);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (--busyWorkers == 0) phaseFinished.notify_all();
+	}
+}
+
+void ParticleSystem::RunRange(Phase current, int thread) {
+	// Fixed ranges, so the result doesn't depend on how fast the threads are
+	int begin = (int)((long long)numParticles * thread / numThreads);
+	int end = (int)((long long)numParticles * (thread + 1) / numThreads);
+	switch (current) {
+	case Predict:
+		PredictRange(begin, end);
+		break;
+	case Gather:
+		GatherRange(begin, end);
+		break;
+	case FindNeighbors:
+		FindNeighborsRange(begin, end);
+		break;
+	case Project:
+		ProjectRange(begin, end, thread);
+		break;
+	case Apply:
+		ApplyRange(begin, end, thread);
+		break;
+	case Finish:
+		FinishRange(begin, end);
+		break;
+	}
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/Math/Vector.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace Kore;
+
+class PhysicsWorld;
+
+// Work done by the last Update
+struct ParticleStats {
+	int particles;
+	// Overlapping particle pairs and particles pushed out of the level, summed over all iterations
+	int contacts;
+	int levelContacts;
+};
+
+// Many small spheres of one radius and mass, simulated with position based dynamics instead of as PhysicsObjects.
+// Positions and velocities are stored as separate arrays (one per component) and reordered by grid cell every update,
+// so neighbors are close in memory. Overlaps are resolved by Jacobi iterations: every particle sums its corrections
+// from the positions of the previous iteration, which lets the particles be split over threads without changing the result.
+// Particles collide with each other and the mesh colliders of the world, not with the PhysicsObjects.
+class ParticleSystem {
+public:
+	// threads = 0 uses one thread per hardware thread, the thread calling Update is one of them
+	ParticleSystem(int inMaxParticles, float inRadius, int threads = 0);
+	~ParticleSystem();
+
+	// Returns false if all particles are in use
+	bool Emit(const vec3& position, const vec3& velocity);
+
+	void Clear();
+
+	// Doesn't allocate. Level collision reads the mesh colliders of the world, which must not change during the update.
+	void Update(float deltaT, const PhysicsWorld& world);
+
+	int GetCount() const {
+		return numParticles;
+	}
+
+	int GetMaxCount() const {
+		return maxParticles;
+	}
+
+	int GetThreadCount() const {
+		return numThreads;
+	}
+
+	vec3 GetPosition(int particle) const {
+		return vec3(x[particle], y[particle], z[particle]);
+	}
+
+	// FNV-1a over positions and velocities, for comparing runs
+	unsigned GetChecksum() const;
+
+	float radius;
+
+	// Projections per update, more make piles stiffer
+	int iterations;
+
+	// Multiplies the velocity every update
+	float damping;
+
+	// Fraction of the sliding along the level removed every update, 1 makes particles stick where they land
+	float friction;
+
+	ParticleStats stats;
+
+private:
+	// Steps of an update that are split over the threads, in this order
+	enum Phase { Predict, Gather, FindNeighbors, Project, Apply, Finish };
+
+	void RunPhase(Phase phase);
+	void RunRange(Phase phase, int thread);
+	void WorkerMain(int thread);
+
+	void PredictRange(int begin, int end);
+	void GatherRange(int begin, int end);
+	void FindNeighborsRange(int begin, int end);
+	void ProjectRange(int begin, int end, int thread);
+	void ApplyRange(int begin, int end, int thread);
+	void FinishRange(int begin, int end);
+
+	// Sort the particles into cells by the hashes of their predicted positions
+	void SortByCell();
+
+	unsigned CellHash(int cx, int cy, int cz) const;
+	int CellCoordinate(float position) const;
+
+	// Push the predicted position out of the level, returns true on contact
+	bool CollideWithLevel(int particle);
+
+	int maxParticles;
+	int numParticles;
+
+	// Current positions and velocities
+	float* x;
+	float* y;
+	float* z;
+	float* vx;
+	float* vy;
+	float* vz;
+	// Predicted positions, moved by the projections
+	float* px;
+	float* py;
+	float* pz;
+	// Corrections of the current iteration and how many constraints contributed
+	float* dx;
+	float* dy;
+	float* dz;
+	int* corrections;
+
+	// One buffer per array the gather writes to, swapped with it afterwards
+	float* scratch[9];
+
+	// Cells are a bit larger than a particle, so all neighbors are found in the 27 surrounding cells.
+	// Cell coordinates are hashed into a table of a power of two entries, at least two per particle.
+	float cellSize;
+	unsigned tableMask;
+	unsigned* cellOfParticle;
+	// Start of every hash entry in sortedParticles, one more entry for the end
+	int* cellStart;
+	int* sortedParticles;
+
+	// Particles closer than cellSize at the start of the update, which the projections test for overlaps.
+	// Enough for densely packed spheres, further ones are ignored.
+	static const int maxNeighbors = 16;
+	int* neighbors;
+	int* numNeighbors;
+
+	// Of the running update
+	float stepTime;
+	const PhysicsWorld* world;
+	bool lastIteration;
+
+	// Padded to keep the threads from writing to the same cache line
+	struct ThreadStats {
+		int contacts;
+		int levelContacts;
+		char padding[56];
+	};
+	ThreadStats* threadStats;
+
+	std::thread* threads;
+	int numThreads;
+
+	// The current phase, shared with the workers
+	std::mutex mutex;
+	std::condition_variable phaseStarted;
+	std::condition_variable phaseFinished;
+	Phase phase;
+	// Incremented for every phase, workers wait for it to change
+	int generation;
+	int busyWorkers;
+	bool stopping;
+};
@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "PhysicsObject.h"
 #include "Kore/Log.h"
+#include "SimdMath.h"
 
 
 using namespace Kore;
@@ -10,7 +11,21 @@ PhysicsObject::PhysicsObject() {
 	Velocity = vec3(0, 0, 0);
 	Collider.radius = 0.5f;
 	Rotation = Quat();
+	Scale = 0.5f;
 	Mass = 1.0f;
+	Restitution = 0.8f;
+	Damping = 0.98f;
+	Transform = mat4::Identity();
+	TransformDirty = true;
+	PoolIndex = -1;
+	ActiveIndex = -1;
+	StepInterval = 1;
+	StepPhase = 0;
+	Stepping = true;
+	PendingTime = 0.0f;
+	PendingSteps = 0;
+	LastStepTime = 0.0f;
+	WakeUpdates = 0;
 	float I = 2.0f/5.0f * Mass * Collider.radius * Collider.radius;
 	MomentOfInertia.Set(0, 0, I);
 	MomentOfInertia.Set(1, 1, I);
@@ -19,138 +34,128 @@ PhysicsObject::PhysicsObject() {
 	InverseMomentOfInertia = MomentOfInertia.Invert();
 }
 
-void SetSkewSymmetric(mat3& matrix, vec3& v) {
-	matrix.Set(0, 0, 0);
-	matrix.Set(0, 1, -v.z());
-	matrix.Set(0, 2, v.y());
-	matrix.Set(1, 0, v.z());
-	matrix.Set(1, 1, 0);
-	matrix.Set(1, 2, -v.x());
-	matrix.Set(2, 0, -v.y());
-	matrix.Set(2, 1, v.x());
-	matrix.Set(2, 2, 0);
-}
-
-void PhysicsObject::HandleCollision(TriangleMeshCollider& otherCollider, float deltaT) {
-
-	// Check if we are colliding with the plane
-	if (Collider.IntersectsWith(otherCollider)) {
-
-		// Calculate the contact velocity
-
-		// Get the matrix contact coordinate system to world coordinate system
-		mat3 contactToWorld = Collider.GetCollisonBasis(Collider.GetCollisionNormal(otherCollider));
+bool PhysicsObject::HandleCollision(TriangleMeshCollider& otherCollider, float deltaT) {
+	ContactManifold manifold;
+	if (Collider.GetContacts(otherCollider, manifold) == 0) return false;
+
+	// The deepest face is always resolved. The other contacts only while their point still moves into the mesh,
+	// so the faces of a corner do not both take out the same velocity. Edges and vertices have no friction:
+	// stopping the contact point of a rolling ball on an edge would turn all of its spin into a sideways kick.
+	for (int i = 0; i < manifold.count; ++i) {
+		const MeshContact& contact = manifold.contacts[i];
+		bool face = contact.feature == MeshContact::Face;
+		vec3 pointVelocity = AngularVelocity.cross(contact.point - Collider.center) + Velocity;
+		if ((i > 0 || !face) && pointVelocity.dot(contact.normal) >= 0.0f) continue;
+		ApplyContactImpulse(contact.normal, contact.point, deltaT, face);
+	}
 
-		// Get the relative contact position
-		vec3 collisionGlobalPosition = Collider.GetCollisionPoint(otherCollider);
-		vec3 collisionRelativePosition = collisionGlobalPosition - Collider.center;
+	// Move the object out of all contacts at once, each one only by what the others left of its depth
+	vec3 push(0.0f, 0.0f, 0.0f);
+	for (int iteration = 0; iteration < 4; ++iteration) {
+		for (int i = 0; i < manifold.count; ++i) {
+			const MeshContact& contact = manifold.contacts[i];
+			float remaining = contact.depth - push.dot(contact.normal);
+			if (remaining > 0.0f) push += contact.normal * remaining;
+		}
+	}
+	SetPosition(Position + push * 1.05f);
+	return true;
+}
 
-		// Work out the velocity of the contact point.
-		vec3 vel = AngularVelocity.cross(collisionRelativePosition);
-		vel += Velocity;
+void PhysicsObject::ApplyContactImpulse(const vec3& contactNormal, const vec3& contactPoint, float deltaT, bool withFriction) {
+	// Get the matrix contact coordinate system to world coordinate system
+	SimdMat3 contactToWorld = SimdMat3::basis(SimdVec3(contactNormal));
 
-		// Turn the velocity into contact-coordinates.
-		mat3 worldToContact = contactToWorld;
-		worldToContact = worldToContact.Invert();
-		vec3 contactVelocity = worldToContact * vel;
+	// Get the relative contact position
+	SimdVec3 collisionRelativePosition(contactPoint - Collider.center);
 
-		// Calculate the desired velocity change
-		float velocityLimit = 0.25f;
+	// Work out the velocity of the contact point.
+	SimdVec3 vel = cross(SimdVec3(AngularVelocity), collisionRelativePosition) + SimdVec3(Velocity);
 
-		// Calculate the acceleration induced velocity accumulated this frame
-		float velocityFromAcc = 0;
+	// Turn the velocity into contact-coordinates. The basis is orthonormal, so the transpose is its inverse.
+	SimdVec3 contactVelocity = contactToWorld.invertOrthonormal() * vel;
 
-		vec3 contactNormal = Collider.GetCollisionNormal(otherCollider);
+	// Calculate the desired velocity change
+	float velocityLimit = 0.25f;
 
-		velocityFromAcc += Accumulator  * deltaT * contactNormal;
+	// Calculate the acceleration induced velocity accumulated this frame
+	float velocityFromAcc = 0;
 
-		float restitution = 0.8f;
+	velocityFromAcc += Accumulator  * deltaT * contactNormal;
 
+	float restitution = Restitution;
 
-		// Combine the bounce velocity with the removed acceleration velocity.
-		float desiredDeltaVelocity = -contactVelocity.x() - restitution * (contactVelocity.x() - velocityFromAcc);
-		
-		// Calculate the impulse contact
-		vec3 impulseContact;
 
-		float inverseMass = 1.0f / Mass;
+	// Combine the bounce velocity with the removed acceleration velocity.
+	float desiredDeltaVelocity = -contactVelocity.x() - restitution * (contactVelocity.x() - velocityFromAcc);
+	
+	float inverseMass = 1.0f / Mass;
 
-		float friction = 0.2f;
+	float friction = 0.2f;
 
-		// The equivalent of a cross product in matrices is multiplication
-		// by a skew symmetric matrix - we build the matrix for converting
-		// between linear and angular quantities.
-		mat3 impulseToTorque;
-		SetSkewSymmetric(impulseToTorque, collisionRelativePosition);
+	// The equivalent of a cross product in matrices is multiplication
+	// by a skew symmetric matrix - we build the matrix for converting
+	// between linear and angular quantities.
+	SimdMat3 impulseToTorque = SimdMat3::skewSymmetric(collisionRelativePosition);
+	SimdMat3 inverseInertia(InverseMomentOfInertia);
 
-		// Build the matrix to convert contact impulse to change in velocity
-		// in world coordinates.
-		mat3 deltaVelWorld = impulseToTorque;
-		deltaVelWorld *= InverseMomentOfInertia;
-		deltaVelWorld *= impulseToTorque;
-		deltaVelWorld = deltaVelWorld * -1.0f;
+	// Build the matrix to convert contact impulse to change in velocity
+	// in world coordinates.
+	SimdMat3 deltaVelWorld = impulseToTorque * inverseInertia * impulseToTorque * -1.0f;
 
-		// Do a change of basis to convert into contact coordinates.
-		mat3 deltaVelocity = contactToWorld;
-		deltaVelocity.Transpose();
-		deltaVelocity *= deltaVelWorld;
-		deltaVelocity *= contactToWorld;
+	// Do a change of basis to convert into contact coordinates.
+	SimdMat3 deltaVelocity = contactToWorld * deltaVelWorld * contactToWorld;
 
-		// Add in the linear velocity change
-		deltaVelocity.data[0] += inverseMass;
-		//deltaVelocity.data[4] += inverseMass;
-		deltaVelocity.data[3] += inverseMass;
-		//deltaVelocity.data[8] += inverseMass;
-		deltaVelocity.data[7] += inverseMass;
+	// Add in the linear velocity change (data[0], data[3] and data[7] of the column major matrix)
+	deltaVelocity.c[0] = deltaVelocity.c[0] + SimdVec3(inverseMass, 0.0f, 0.0f);
+	deltaVelocity.c[1] = deltaVelocity.c[1] + SimdVec3(inverseMass, 0.0f, 0.0f);
+	deltaVelocity.c[2] = deltaVelocity.c[2] + SimdVec3(0.0f, inverseMass, 0.0f);
 
-		// Invert to get the impulse needed per unit velocity
-		mat3 impulseMatrix = deltaVelocity;
-		impulseMatrix = impulseMatrix.Invert();
+	// Invert to get the impulse needed per unit velocity
+	SimdMat3 impulseMatrix = deltaVelocity.invert();
 
-		// Find the target velocities to kill
-		vec3 velKill(desiredDeltaVelocity,
-			-contactVelocity.y(),
-			-contactVelocity.z());
+	// Find the target velocities to kill
+	SimdVec3 velKill(desiredDeltaVelocity,
+		-contactVelocity.y(),
+		-contactVelocity.z());
 
-		// Find the impulse to kill target velocities
-		impulseContact = impulseMatrix * velKill;
+	// Find the impulse to kill target velocities
+	SimdVec3 impulseContact = impulseMatrix * velKill;
 
-		// Check for exceeding friction
-		float planarImpulse = Kore::sqrt(
-			impulseContact.y() * impulseContact.y() +
-			impulseContact.z() * impulseContact.z()
-			);
+	// Without friction only the velocity along the normal changes
+	if (!withFriction) impulseContact = SimdVec3(desiredDeltaVelocity / deltaVelocity.c[0].x(), 0.0f, 0.0f);
 
-		//if ((planarImpulse > impulseContact.x() * friction) & (planarImpulse > 0.1f))
-		//{
-		//	// We need to use dynamic friction
-		//	impulseContact.set(impulseContact.x(), impulseContact.y() / planarImpulse, impulseContact.z() / planarImpulse);
+	//// Check for exceeding friction
+	//float planarImpulse = Kore::sqrt(
+	//	impulseContact.y() * impulseContact.y() +
+	//	impulseContact.z() * impulseContact.z()
+	//	);
 
-		//	float x = deltaVelocity.data[0] +
-		//		deltaVelocity.data[1] * friction*impulseContact.y() +
-		//		deltaVelocity.data[2] * friction*impulseContact.z();
+	//if ((planarImpulse > impulseContact.x() * friction) & (planarImpulse > 0.1f))
+	//{
+	//	// We need to use dynamic friction
+	//	impulseContact.set(impulseContact.x(), impulseContact.y() / planarImpulse, impulseContact.z() / planarImpulse);
 
-		//	x = desiredDeltaVelocity / x;
+	//	float x = deltaVelocity.data[0] +
+	//		deltaVelocity.data[1] * friction*impulseContact.y() +
+	//		deltaVelocity.data[2] * friction*impulseContact.z();
 
-		//	impulseContact.set(x, impulseContact.y() * friction * x, impulseContact.z() * friction * x);
-		//}
+	//	x = desiredDeltaVelocity / x;
 
-		// Use the impulse contact
-		vec3 impulse = contactToWorld * impulseContact;
+	//	impulseContact.set(x, impulseContact.y() * friction * x, impulseContact.z() * friction * x);
+	//}
 
-		vec3 impulsiveTorque = collisionRelativePosition.cross(impulse);
+	// Use the impulse contact
+	SimdVec3 impulse = contactToWorld * impulseContact;
 
-		vec3 rotationChange = InverseMomentOfInertia * impulsiveTorque;
+	SimdVec3 impulsiveTorque = cross(collisionRelativePosition, impulse);
 
-		vec3 velocityChange = impulse / Mass;
+	SimdVec3 rotationChange = inverseInertia * impulsiveTorque;
 
-		AngularVelocity += rotationChange;
-		Velocity += velocityChange;
+	SimdVec3 velocityChange = impulse * inverseMass;
 
-		// Move the object out of the collider
-		float penetrationDepth = Collider.PenetrationDepth(otherCollider);
-		 SetPosition(Position - contactNormal * penetrationDepth * 1.05f);
-	}
+	AngularVelocity += rotationChange.toVec3();
+	Velocity += velocityChange.toVec3();
 }
 
 
@@ -159,7 +164,7 @@ void PhysicsObject::HandleCollision(PhysicsObject* other, float deltaT) {
 	// Check if we are colliding with the plane
 	if (Collider.IntersectsWith(other->Collider)) {
 
-		float restitution = 0.8f;
+		float restitution = Restitution;
 
 		vec3 collisionNormal = Collider.GetCollisionNormal(other->Collider);
 			
@@ -195,17 +200,23 @@ void PhysicsObject::ApplyForceToCenter(vec3 force) {
 }
 
 
-void PhysicsObject::Integrate(float deltaT) {
+void PhysicsObject::Integrate(float deltaT, int steps /*= 1*/) {
 	// Derive a new Velocity based on the accumulated forces
 	Velocity += (Accumulator / Mass) * deltaT;
 
 	// Multiply by a damping coefficient (e.g. 0.98)
-	float damping = 0.98f;
+	float damping = Damping;
+	for (int i = 1; i < steps; ++i) damping *= Damping;
 	Velocity *= damping;
 
 	AngularVelocity *= damping;
 
-	Rotation.addScaledVector(AngularVelocity, deltaT);
+	if (AngularVelocity.x() != 0.0f || AngularVelocity.y() != 0.0f || AngularVelocity.z() != 0.0f) {
+		Rotation.addScaledVector(AngularVelocity, deltaT);
+		// Normalised here rather than when the matrix is built, so objects that are never drawn do not drift
+		Rotation.normalise();
+		TransformDirty = true;
+	}
 	
 	// Derive a new position based on the velocity (Note: Use SetPosition to also set the collider's values)
 	SetPosition(Position + Velocity * deltaT);
@@ -214,10 +225,36 @@ void PhysicsObject::Integrate(float deltaT) {
 	Accumulator = vec3(0, 0, 0);
 }
 
-void PhysicsObject::UpdateMatrix() {
-	// Update the Mesh matrix
-	Rotation.normalise();
-	Mesh->M = mat4::Translation(Position.x(), Position.y(), Position.z()) * mat4::Scale(0.5f, 0.5f, 0.5f) * Rotation.getMatrix();
+vec3 PhysicsObject::GetRenderPosition() {
+	if (StepInterval == 1 || LastStepTime <= 0.0f) return Position;
+	float alpha = PendingTime / LastStepTime;
+	if (alpha > 1.0f) alpha = 1.0f;
+	return PreviousPosition + (Position - PreviousPosition) * alpha;
+}
+
+bool PhysicsObject::UpdateMatrix() {
+	// Objects at rest keep their matrix, objects between two steps move along the interpolated position
+	vec3 renderPosition = GetRenderPosition();
+	float* m = Transform.data;
+	if (!TransformDirty && m[12] == renderPosition.x() && m[13] == renderPosition.y() && m[14] == renderPosition.z()) return false;
+	TransformDirty = false;
+
+	// Translation * Scale * Rotation, written directly as the upper 3x4 part (column major).
+	// The last row stays (0, 0, 0, 1) from the constructor.
+	float r = Rotation.r, i = Rotation.i, j = Rotation.j, k = Rotation.k;
+	m[0] = Scale * (1 - (2 * j * j + 2 * k * k));
+	m[1] = Scale * (2 * i * j + 2 * k * r);
+	m[2] = Scale * (2 * i * k - 2 * j * r);
+	m[4] = Scale * (2 * i * j - 2 * k * r);
+	m[5] = Scale * (1 - (2 * i * i + 2 * k * k));
+	m[6] = Scale * (2 * j * k + 2 * i * r);
+	m[8] = Scale * (2 * i * k + 2 * j * r);
+	m[9] = Scale * (2 * j * k - 2 * i * r);
+	m[10] = Scale * (1 - (2 * i * i + 2 * j * j));
+	m[12] = renderPosition.x();
+	m[13] = renderPosition.y();
+	m[14] = renderPosition.z();
+	return true;
 }
 
 
@@ -10,16 +10,30 @@ using namespace Kore;
 class PhysicsObject {
 	vec3 Position;
 	Quat Rotation;
+	float Scale;
+
+	// Set when position, rotation or scale changed since the last UpdateMatrix
+	bool TransformDirty;
+
+	// The impulse for one contact with a mesh, which bounces off along the normal and with friction also stops the contact point from sliding
+	void ApplyContactImpulse(const vec3& contactNormal, const vec3& contactPoint, float deltaT, bool withFriction);
 
 public:
 	float Mass;
 	vec3 Velocity;
 	vec3 AngularVelocity;
 
+	// Bounciness of collisions (0.8) and velocity kept per 1/60 s update (0.98)
+	float Restitution;
+	float Damping;
+
 	mat3 MomentOfInertia;
 	mat3 InverseMomentOfInertia;
 
 	void SetPosition(vec3 pos) {
+		if (pos.x() != Position.x() || pos.y() != Position.y() || pos.z() != Position.z()) {
+			TransformDirty = true;
+		}
 		Position = pos;
 		Collider.center = pos;
 	}
@@ -28,6 +42,25 @@ public:
 		return Position;
 	}
 
+	void SetRotation(const Quat& rotation) {
+		Rotation = rotation;
+		TransformDirty = true;
+	}
+
+	Quat GetRotation() {
+		return Rotation;
+	}
+
+	// Uniform scale of the mesh, 0.5 by default
+	void SetScale(float scale) {
+		Scale = scale;
+		TransformDirty = true;
+	}
+
+	float GetScale() {
+		return Scale;
+	}
+
 	// Force accumulator
 	vec3 Accumulator;
 
@@ -35,10 +68,34 @@ public:
 
 	MeshObject* Mesh;
 
+	// The model matrix, the mesh is shared between objects
+	mat4 Transform;
+
+	// Managed by PhysicsWorld: the slot in the pool (-1 if not pooled) and in physicsObjects (-1 if not simulated)
+	int PoolIndex;
+	int ActiveIndex;
+
+	// Simulation level of detail, managed by PhysicsWorld. Objects far from the focus points only step every StepInterval updates.
+	int StepInterval;
+	int StepPhase;
+	// Set if the object steps in the current update
+	bool Stepping;
+	// Time and number of updates since the last step
+	float PendingTime;
+	int PendingSteps;
+	// The position before the last step and the length of that step, for interpolating between steps
+	vec3 PreviousPosition;
+	float LastStepTime;
+	// Updates left before a woken up object may be reduced again
+	int WakeUpdates;
+
 	PhysicsObject();
 
-	// Do the integration step for the equations of motion
-	void Integrate(float deltaT);
+	// Do the integration step for the equations of motion, damping is applied once per covered update
+	void Integrate(float deltaT, int steps = 1);
+
+	// Where to draw the object, between the last two steps if it does not step every update
+	vec3 GetRenderPosition();
 
 	// Apply a force that acts along the center of mass
 	void ApplyForceToCenter(vec3 force);
@@ -54,9 +111,10 @@ public:
 
 	void HandleCollision(const TriangleCollider& collider, float deltaT);
 
-	void HandleCollision(TriangleMeshCollider& collider, float deltaT);
+	// Returns true if there was a contact. All contacts with the mesh are resolved together, which also moves the object out of the mesh.
+	bool HandleCollision(TriangleMeshCollider& collider, float deltaT);
 
-	// Update the matrix of the mesh
-	void UpdateMatrix();
+	// Update the model matrix if the object moved, returns false if it was still up to date
+	bool UpdateMatrix();
 
 };
@@ -1,16 +1,101 @@
 #include "pch.h"
 #include "PhysicsWorld.h"
+#include "MemoryTracking.h"
+#include "ParticleSystem.h"
+
+#include <algorithm>
+#include <cstring>
 
 using namespace Kore;
 
-PhysicsWorld::PhysicsWorld(int inMaxPhysicsObjects /*= 100*/)
-	: maxPhysicsObjects(inMaxPhysicsObjects)
+namespace {
+	// Layout of a saved state: the header, the simulated objects in the order of physicsObjects,
+	// the mesh colliders, the generations of all pool slots and the free list
+	struct StateHeader {
+		char magic[4];
+		int size;
+		int maxPhysicsObjects;
+		int numActive;
+		int numFree;
+		int numMeshColliders;
+		unsigned updateCount;
+		int numFocusPoints;
+		vec3 focusPoints[maxFocusPoints];
+	};
+
+	struct BodyState {
+		// The pool index, or -1 - the index in addedObjects for objects added with AddObject
+		int object;
+		// Index in objectMeshes, -1 for none
+		int mesh;
+		vec3 position;
+		Quat rotation;
+		vec3 velocity;
+		vec3 angularVelocity;
+		vec3 accumulator;
+		vec3 previousPosition;
+		float pendingTime;
+		float lastStepTime;
+		float mass;
+		float radius;
+		float restitution;
+		float damping;
+		float scale;
+		short stepInterval;
+		short stepPhase;
+		short pendingSteps;
+		short wakeUpdates;
+	};
+
+	struct ColliderState {
+		CollisionMesh* mesh;
+		int lastCollision;
+	};
+
+	int stateSize(int maxPhysicsObjects, int numActive, int numFree, int numMeshColliders) {
+		int size = sizeof(StateHeader) + numActive * sizeof(BodyState) + numMeshColliders * sizeof(ColliderState) + maxPhysicsObjects * sizeof(unsigned) + numFree * sizeof(int);
+		return (size + 7) & ~7;
+	}
+}
+
+PhysicsWorld::PhysicsWorld(int inMaxPhysicsObjects /*= 100*/, int commandCapacity /*= 1024*/)
+	: maxPhysicsObjects(inMaxPhysicsObjects), maxMeshColliders(0), numActive(0), commands(commandCapacity, MemoryPhysics),
+	colliderNodes(nullptr), numColliderNodes(0), colliderOrder(nullptr), colliderBoxes(nullptr), collidersChanged(false), colliderCandidates(nullptr), meshColliders(nullptr), numMeshColliders(0), particles(nullptr)
 {
-	physicsObjects = new PhysicsObject*[maxPhysicsObjects];
-	for (int i = 0; i < maxPhysicsObjects; i++) {
+	MemoryScope scope(MemoryPhysics);
+	for (int i = 0; i < maxCommandSources; ++i) {
+		commandSequences[i].store(0);
+	}
+	drainedCommands = new PhysicsCommand[commands.getCapacity()];
+	droppedCommands.store(0);
+
+	numFocusPoints = 0;
+	updateCount = 0;
+	lodNearDistance = 30.0f;
+	lodFarDistance = 40.0f;
+	lodInterval = 4;
+	memset(&stats, 0, sizeof(stats));
+
+	// One more for the terminating nullptr
+	physicsObjects = new PhysicsObject*[maxPhysicsObjects + 1];
+	for (int i = 0; i <= maxPhysicsObjects; i++) {
 		physicsObjects[i] = nullptr;
 	}
 
+	pool = new PhysicsObject[maxPhysicsObjects];
+	generations = new unsigned[maxPhysicsObjects];
+	freeList = new int[maxPhysicsObjects];
+	numFree = maxPhysicsObjects;
+	addedObjects = new PhysicsObject*[maxPhysicsObjects];
+	numAdded = 0;
+	restoreSeen = new bool[2 * maxPhysicsObjects];
+	numObjectMeshes = 0;
+	for (int i = 0; i < maxPhysicsObjects; i++) {
+		generations[i] = 1;
+		// Hand out low indices first
+		freeList[i] = maxPhysicsObjects - 1 - i;
+	}
+
 	plane.normal = vec3(0, 1, 0);
 	plane.d = -1;
 
@@ -42,36 +127,576 @@ PhysicsWorld::PhysicsWorld(int inMaxPhysicsObjects /*= 100*/)
 }
 
 void PhysicsWorld::Update(float deltaT) {
+	memset(&stats, 0, sizeof(stats));
+
+	ApplyCommands();
+	UpdateLevelOfDetail(deltaT);
+
 	PhysicsObject** currentP = &physicsObjects[0];
 	while (*currentP != nullptr) {
-		// Apply gravity (= constant accceleration, so we multiply with the mass and divide in the integration step.
-		// The alternative would be to add gravity during the integration as a constant.
-
-		(*currentP)->ApplyForceToCenter(vec3(0.0f, (*currentP)->Mass * -9.81f, 0.0f));
+		PhysicsObject* po = *currentP;
 
-		// Check for collisions with the other objects
+		// Check for collisions with the other objects. Two objects that both skip this update keep their contact for later,
+		// a stepping object touching a skipping one wakes it up.
 		PhysicsObject** currentCollision = currentP + 1;
 		while (*currentCollision != nullptr) {
-
-			(*currentP)->HandleCollision(*currentCollision, deltaT);
+			PhysicsObject* other = *currentCollision;
 			++currentCollision;
+			if (!po->Stepping && !other->Stepping) {
+				++stats.pairTestsSkipped;
+				continue;
+			}
+			++stats.pairTests;
+			if (!po->Stepping || !other->Stepping) {
+				if (!po->Collider.IntersectsWith(other->Collider)) continue;
+				Promote(po->Stepping ? other : po);
+			}
+			po->HandleCollision(other, deltaT);
+		}
+
+		if (!po->Stepping) {
+			++stats.stepsSkipped;
+			++currentP;
+			continue;
 		}
 
-		(*currentP)->HandleCollision(meshCollider, deltaT);
+		// A reduced object covers all updates since its last step at once
+		float stepTime = po->PendingTime;
+		int steps = po->PendingSteps;
+		po->PendingTime = 0.0f;
+		po->PendingSteps = 0;
+		po->PreviousPosition = po->GetPosition();
+		po->LastStepTime = stepTime;
+		++stats.steps;
+
+		// Apply gravity (= constant accceleration, so we multiply with the mass and divide in the integration step.
+		// The alternative would be to add gravity during the integration as a constant.
+
+		po->ApplyForceToCenter(vec3(0.0f, po->Mass * -9.81f, 0.0f));
+
+		// Only colliders with bounds overlapping the sphere can touch it, they are handled in the order of meshColliders.
+		// A contact moves the sphere, so the colliders after it are looked up again from the new position.
+		int numCandidates = FindMeshColliders(po->Collider, 0, colliderCandidates);
+		for (int i = 0; i < numCandidates; ++i) {
+			TriangleMeshCollider& collider = meshColliders[colliderCandidates[i]];
+			bool contact = po->HandleCollision(collider, stepTime);
+			stats.triangleTests += collider.triangleTests;
+			stats.primitiveTests += collider.primitiveTests;
+			collider.triangleTests = 0;
+			collider.primitiveTests = 0;
+			if (contact) {
+				numCandidates = FindMeshColliders(po->Collider, colliderCandidates[i] + 1, colliderCandidates);
+				i = -1;
+			}
+		}
 
 		// Integrate the equations of motion
-		(*currentP)->Integrate(deltaT);
+		po->Integrate(stepTime, steps);
 
 		++currentP;
 	}
+
+	if (particles != nullptr) {
+		// The particle threads only read the hierarchy
+		PrepareQueries();
+		particles->Update(deltaT, *this);
+	}
 }
 
+void PhysicsWorld::SetFocusPoints(const vec3* points, int count) {
+	numFocusPoints = count < maxFocusPoints ? count : maxFocusPoints;
+	for (int i = 0; i < numFocusPoints; ++i) {
+		focusPoints[i] = points[i];
+	}
+}
+
+void PhysicsWorld::Promote(PhysicsObject* po) {
+	po->Stepping = true;
+	po->WakeUpdates = lodInterval * 8;
+	if (po->StepInterval == 1) return;
+	po->StepInterval = 1;
+	++stats.promotions;
+	--stats.reduced;
+	++stats.fullRate;
+}
+
+void PhysicsWorld::UpdateLevelOfDetail(float deltaT) {
+	++updateCount;
+	float near2 = lodNearDistance * lodNearDistance;
+	float far2 = lodFarDistance * lodFarDistance;
+	bool enabled = numFocusPoints > 0 && lodInterval > 1;
+
+	for (int i = 0; i < numActive; ++i) {
+		PhysicsObject* po = physicsObjects[i];
+		po->PendingTime += deltaT;
+		++po->PendingSteps;
+
+		if (!enabled) {
+			if (po->StepInterval != 1) ++stats.promotions;
+			po->StepInterval = 1;
+		}
+		else {
+			float distance2 = far2 + 1.0f;
+			vec3 position = po->GetPosition();
+			for (int j = 0; j < numFocusPoints; ++j) {
+				vec3 offset = position - focusPoints[j];
+				float d2 = offset * offset;
+				if (d2 < distance2) distance2 = d2;
+			}
+
+			if (po->WakeUpdates > 0) {
+				--po->WakeUpdates;
+			}
+			else if (po->StepInterval == 1 && distance2 > far2) {
+				po->StepInterval = lodInterval;
+				// Spread the reduced objects over the updates
+				po->StepPhase = i % lodInterval;
+				++stats.demotions;
+			}
+			else if (po->StepInterval != 1 && distance2 < near2) {
+				po->StepInterval = 1;
+				++stats.promotions;
+			}
+		}
+
+		po->Stepping = po->StepInterval == 1 || (updateCount + po->StepPhase) % po->StepInterval == 0;
+		if (po->StepInterval == 1) ++stats.fullRate;
+		else ++stats.reduced;
+	}
+}
+
+
+PhysicsWorld::~PhysicsWorld() {
+	delete particles;
+	delete[] drainedCommands;
+	delete[] colliderCandidates;
+	delete[] colliderBoxes;
+	delete[] colliderOrder;
+	delete[] colliderNodes;
+	delete[] meshColliders;
+	delete[] restoreSeen;
+	delete[] addedObjects;
+	delete[] freeList;
+	delete[] generations;
+	delete[] pool;
+	delete[] physicsObjects;
+}
 
 void PhysicsWorld::AddObject(PhysicsObject* po) {
-	PhysicsObject** current = &physicsObjects[0];
-	while (*current != nullptr) {
-		++current;
+	if (numActive == maxPhysicsObjects) return;
+	po->ActiveIndex = numActive;
+	physicsObjects[numActive++] = po;
+
+	GetMeshIndex(po->Mesh);
+	if (po->PoolIndex >= 0) return;
+	for (int i = 0; i < numAdded; ++i) {
+		if (addedObjects[i] == po) return;
+	}
+	if (numAdded < maxPhysicsObjects) addedObjects[numAdded++] = po;
+}
+
+int PhysicsWorld::GetMeshIndex(MeshObject* mesh) {
+	if (mesh == nullptr) return -1;
+	for (int i = 0; i < numObjectMeshes; ++i) {
+		if (objectMeshes[i] == mesh) return i;
+	}
+	if (numObjectMeshes == maxObjectMeshes) return -1;
+	objectMeshes[numObjectMeshes] = mesh;
+	return numObjectMeshes++;
+}
+
+BodyHandle PhysicsWorld::SpawnObject() {
+	BodyHandle handle;
+	handle.index = -1;
+	handle.generation = 0;
+	if (numFree == 0 || numActive == maxPhysicsObjects) return handle;
+
+	int index = freeList[--numFree];
+	PhysicsObject* po = &pool[index];
+	*po = PhysicsObject();
+	po->PoolIndex = index;
+	AddObject(po);
+
+	handle.index = index;
+	handle.generation = generations[index];
+	return handle;
+}
+
+int PhysicsWorld::SpawnObjects(int count, BodyHandle* handles) {
+	int spawned = 0;
+	while (spawned < count) {
+		handles[spawned] = SpawnObject();
+		if (handles[spawned].index < 0) break;
+		++spawned;
+	}
+	return spawned;
+}
+
+void PhysicsWorld::RemoveObject(PhysicsObject* po) {
+	int slot = po->ActiveIndex;
+	if (slot < 0 || slot >= numActive || physicsObjects[slot] != po) return;
+
+	// Keep the array dense by moving the last object into the gap
+	--numActive;
+	physicsObjects[slot] = physicsObjects[numActive];
+	physicsObjects[slot]->ActiveIndex = slot;
+	physicsObjects[numActive] = nullptr;
+	po->ActiveIndex = -1;
+
+	if (po->PoolIndex >= 0) {
+		++generations[po->PoolIndex];
+		freeList[numFree++] = po->PoolIndex;
+	}
+}
+
+bool PhysicsWorld::RemoveObject(BodyHandle handle) {
+	PhysicsObject* po = GetObject(handle);
+	if (po == nullptr) return false;
+	RemoveObject(po);
+	return true;
+}
+
+void PhysicsWorld::RemoveObjects(const BodyHandle* handles, int count) {
+	for (int i = 0; i < count; ++i) {
+		RemoveObject(handles[i]);
 	}
-	*current = po;
+}
 
+bool PhysicsWorld::IsValid(BodyHandle handle) {
+	return handle.index >= 0 && handle.index < maxPhysicsObjects && generations[handle.index] == handle.generation && pool[handle.index].ActiveIndex >= 0;
+}
+
+PhysicsObject* PhysicsWorld::GetObject(BodyHandle handle) {
+	return IsValid(handle) ? &pool[handle.index] : nullptr;
+}
+
+unsigned PhysicsWorld::GetStateChecksum() {
+	unsigned hash = 2166136261u;
+	for (int i = 0; i < numActive; ++i) {
+		PhysicsObject* po = physicsObjects[i];
+		Quat rotation = po->GetRotation();
+		float state[13] = {
+			po->GetPosition().x(), po->GetPosition().y(), po->GetPosition().z(),
+			rotation.r, rotation.i, rotation.j, rotation.k,
+			po->Velocity.x(), po->Velocity.y(), po->Velocity.z(),
+			po->AngularVelocity.x(), po->AngularVelocity.y(), po->AngularVelocity.z()
+		};
+		const unsigned char* bytes = (const unsigned char*)state;
+		for (int b = 0; b < (int)sizeof(state); ++b) {
+			hash ^= bytes[b];
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+int PhysicsWorld::GetStateSize() {
+	return stateSize(maxPhysicsObjects, numActive, numFree, numMeshColliders);
+}
+
+int PhysicsWorld::SaveState(void* buffer, int capacity) {
+	int size = GetStateSize();
+	if (capacity < size) return 0;
+
+	char* data = (char*)buffer;
+	StateHeader* header = (StateHeader*)data;
+	memcpy(header->magic, "PWST", 4);
+	header->size = size;
+	header->maxPhysicsObjects = maxPhysicsObjects;
+	header->numActive = numActive;
+	header->numFree = numFree;
+	header->numMeshColliders = numMeshColliders;
+	header->updateCount = updateCount;
+	header->numFocusPoints = numFocusPoints;
+	for (int i = 0; i < maxFocusPoints; ++i) {
+		header->focusPoints[i] = i < numFocusPoints ? focusPoints[i] : vec3(0, 0, 0);
+	}
+	data += sizeof(StateHeader);
+
+	BodyState* bodies = (BodyState*)data;
+	for (int i = 0; i < numActive; ++i) {
+		PhysicsObject* po = physicsObjects[i];
+		BodyState& body = bodies[i];
+		if (po->PoolIndex >= 0) {
+			body.object = po->PoolIndex;
+		}
+		else {
+			// Objects added with AddObject are few, usually only the player's
+			body.object = maxPhysicsObjects;
+			for (int added = 0; added < numAdded; ++added) {
+				if (addedObjects[added] == po) body.object = -1 - added;
+			}
+		}
+		body.mesh = GetMeshIndex(po->Mesh);
+		body.position = po->GetPosition();
+		body.rotation = po->GetRotation();
+		body.velocity = po->Velocity;
+		body.angularVelocity = po->AngularVelocity;
+		body.accumulator = po->Accumulator;
+		body.previousPosition = po->PreviousPosition;
+		body.pendingTime = po->PendingTime;
+		body.lastStepTime = po->LastStepTime;
+		body.mass = po->Mass;
+		body.radius = po->Collider.radius;
+		body.restitution = po->Restitution;
+		body.damping = po->Damping;
+		body.scale = po->GetScale();
+		body.stepInterval = (short)po->StepInterval;
+		body.stepPhase = (short)po->StepPhase;
+		body.pendingSteps = (short)po->PendingSteps;
+		body.wakeUpdates = (short)po->WakeUpdates;
+	}
+	data += numActive * sizeof(BodyState);
+
+	ColliderState* colliders = (ColliderState*)data;
+	// Clears the padding of the entries
+	memset(colliders, 0, numMeshColliders * sizeof(ColliderState));
+	for (int i = 0; i < numMeshColliders; ++i) {
+		colliders[i].mesh = meshColliders[i].mesh;
+		colliders[i].lastCollision = meshColliders[i].lastCollision;
+	}
+	data += numMeshColliders * sizeof(ColliderState);
+
+	memcpy(data, generations, maxPhysicsObjects * sizeof(unsigned));
+	data += maxPhysicsObjects * sizeof(unsigned);
+	memcpy(data, freeList, numFree * sizeof(int));
+	data += numFree * sizeof(int);
+
+	// Padding, so equal states have equal bytes
+	memset(data, 0, (char*)buffer + size - data);
+	return size;
+}
+
+bool PhysicsWorld::RestoreState(const void* buffer, int size) {
+	const char* data = (const char*)buffer;
+	const StateHeader* header = (const StateHeader*)data;
+	if (size < (int)sizeof(StateHeader) || memcmp(header->magic, "PWST", 4) != 0 || header->size != size || header->maxPhysicsObjects != maxPhysicsObjects) {
+		return false;
+	}
+	// The counts have to describe exactly this buffer before anything in it is read
+	if (header->numActive < 0 || header->numActive > maxPhysicsObjects || header->numFree < 0 || header->numFree > maxPhysicsObjects
+		|| header->numMeshColliders < 0 || header->numMeshColliders > size / (int)sizeof(ColliderState)
+		|| header->numFocusPoints < 0 || header->numFocusPoints > maxFocusPoints
+		|| stateSize(maxPhysicsObjects, header->numActive, header->numFree, header->numMeshColliders) != size) {
+		return false;
+	}
+	data += sizeof(StateHeader);
+
+	// Every pool slot is either simulated or free, and every object is simulated at most once
+	memset(restoreSeen, 0, 2 * maxPhysicsObjects);
+	const BodyState* bodies = (const BodyState*)data;
+	for (int i = 0; i < header->numActive; ++i) {
+		int object = bodies[i].object;
+		if (object >= maxPhysicsObjects || object < -numAdded || bodies[i].stepInterval < 1) return false;
+		int slot = object >= 0 ? object : maxPhysicsObjects - 1 - object;
+		if (restoreSeen[slot]) return false;
+		restoreSeen[slot] = true;
+	}
+	const int* savedFreeList = (const int*)(data + header->numActive * sizeof(BodyState) + header->numMeshColliders * sizeof(ColliderState) + maxPhysicsObjects * sizeof(unsigned));
+	for (int i = 0; i < header->numFree; ++i) {
+		int slot = savedFreeList[i];
+		if (slot < 0 || slot >= maxPhysicsObjects || restoreSeen[slot]) return false;
+		restoreSeen[slot] = true;
+	}
+
+	for (int i = 0; i < numActive; ++i) {
+		physicsObjects[i]->ActiveIndex = -1;
+	}
+	int previousActive = numActive;
+	numActive = header->numActive;
+	numFree = header->numFree;
+	updateCount = header->updateCount;
+	SetFocusPoints(header->focusPoints, header->numFocusPoints);
+
+	for (int i = 0; i < numActive; ++i) {
+		const BodyState& body = bodies[i];
+		PhysicsObject* po = body.object >= 0 ? &pool[body.object] : addedObjects[-1 - body.object];
+		po->Mesh = body.mesh >= 0 && body.mesh < numObjectMeshes ? objectMeshes[body.mesh] : nullptr;
+		po->SetPosition(body.position);
+		po->SetRotation(body.rotation);
+		po->Velocity = body.velocity;
+		po->AngularVelocity = body.angularVelocity;
+		po->Accumulator = body.accumulator;
+		po->PreviousPosition = body.previousPosition;
+		po->PendingTime = body.pendingTime;
+		po->LastStepTime = body.lastStepTime;
+		po->Mass = body.mass;
+		po->Collider.radius = body.radius;
+		po->Restitution = body.restitution;
+		po->Damping = body.damping;
+		po->SetScale(body.scale);
+		po->StepInterval = body.stepInterval;
+		po->StepPhase = body.stepPhase;
+		po->PendingSteps = body.pendingSteps;
+		po->WakeUpdates = body.wakeUpdates;
+		// Recomputed by the next update
+		po->Stepping = true;
+		po->PoolIndex = body.object >= 0 ? body.object : -1;
+		po->ActiveIndex = i;
+		physicsObjects[i] = po;
+	}
+	for (int i = numActive; i < previousActive; ++i) {
+		physicsObjects[i] = nullptr;
+	}
+	data += numActive * sizeof(BodyState);
+
+	// Colliders are matched by their mesh, streaming may have added or removed some since the state was saved.
+	// A mesh placed several times keeps the order of its colliders unless colliders were removed.
+	const ColliderState* colliders = (const ColliderState*)data;
+	for (int i = 0; i < header->numMeshColliders; ++i) {
+		if (i < numMeshColliders && meshColliders[i].mesh == colliders[i].mesh) {
+			meshColliders[i].lastCollision = colliders[i].lastCollision;
+			continue;
+		}
+		for (int j = 0; j < numMeshColliders; ++j) {
+			if (meshColliders[j].mesh == colliders[i].mesh) meshColliders[j].lastCollision = colliders[i].lastCollision;
+		}
+	}
+	data += header->numMeshColliders * sizeof(ColliderState);
+
+	memcpy(generations, data, maxPhysicsObjects * sizeof(unsigned));
+	data += maxPhysicsObjects * sizeof(unsigned);
+	memcpy(freeList, data, numFree * sizeof(int));
+	return true;
+}
+
+BodyHandle PhysicsWorld::GetHandle(PhysicsObject* po) {
+	BodyHandle handle;
+	handle.index = po->PoolIndex;
+	handle.generation = po->PoolIndex >= 0 ? generations[po->PoolIndex] : 0;
+	return handle;
+}
+
+void PhysicsWorld::AddMeshCollider(CollisionMesh* mesh) {
+	AddMeshCollider(mesh, mat4::Identity());
+}
+
+void PhysicsWorld::AddMeshCollider(CollisionMesh* mesh, const mat4& transform) {
+	if (numMeshColliders == maxMeshColliders) {
+		maxMeshColliders = maxMeshColliders == 0 ? 16 : maxMeshColliders * 2;
+		TriangleMeshCollider* grown = new TriangleMeshCollider[maxMeshColliders];
+		for (int i = 0; i < numMeshColliders; ++i) {
+			grown[i] = meshColliders[i];
+		}
+		delete[] meshColliders;
+		meshColliders = grown;
+
+		delete[] colliderNodes;
+		delete[] colliderOrder;
+		delete[] colliderBoxes;
+		delete[] colliderCandidates;
+		colliderNodes = new CollisionNode[maxMeshColliders * 2];
+		colliderOrder = new int[maxMeshColliders];
+		colliderBoxes = new float[maxMeshColliders * 6];
+		colliderCandidates = new int[maxMeshColliders];
+	}
+	TriangleMeshCollider& collider = meshColliders[numMeshColliders];
+	collider.mesh = mesh;
+	collider.lastCollision = 0;
+	collider.SetTransform(transform);
+	++numMeshColliders;
+	collidersChanged = true;
+}
+
+void PhysicsWorld::RemoveMeshCollider(CollisionMesh* mesh) {
+	for (int i = 0; i < numMeshColliders; ++i) {
+		if (meshColliders[i].mesh == mesh) {
+			meshColliders[i] = meshColliders[--numMeshColliders];
+			collidersChanged = true;
+			--i;
+		}
+	}
+}
+
+void PhysicsWorld::EnableParticles(int maxParticles, float radius, int threads) {
+	delete particles;
+	MemoryScope scope(MemoryPhysics);
+	particles = new ParticleSystem(maxParticles, radius, threads);
+}
+
+void PhysicsWorld::UpdateColliderTree() {
+	for (int i = 0; i < numMeshColliders; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			colliderBoxes[i * 6 + k] = meshColliders[i].min[k];
+			colliderBoxes[i * 6 + 3 + k] = meshColliders[i].max[k];
+		}
+	}
+	numColliderNodes = buildCollisionTree(colliderBoxes, numMeshColliders, 2, colliderNodes, colliderOrder);
+	collidersChanged = false;
+}
+
+int PhysicsWorld::FindMeshColliders(const SphereCollider& sphere, int first, int* out) {
+	PrepareQueries();
+	vec3 extents(sphere.radius, sphere.radius, sphere.radius);
+	int count = 0;
+	auto collect = [&](int collider) {
+		if (collider >= first) out[count++] = collider;
+	};
+	queryCollisionTree(colliderNodes, numColliderNodes, colliderOrder, sphere.center - extents, sphere.center + extents, collect);
+	std::sort(out, out + count);
+	return count;
+}
+
+bool PhysicsWorld::PushCommand(const PhysicsCommand& command) {
+	if (command.source < 0 || command.source >= maxCommandSources) return false;
+	PhysicsCommand queued = command;
+	queued.sequence = commandSequences[command.source].fetch_add(1);
+	if (!commands.push(queued)) {
+		droppedCommands.fetch_add(1);
+		return false;
+	}
+	return true;
+}
+
+namespace {
+	bool commandOrder(const PhysicsCommand& a, const PhysicsCommand& b) {
+		if (a.source != b.source) return a.source < b.source;
+		return a.sequence < b.sequence;
+	}
+}
+
+int PhysicsWorld::ApplyCommands() {
+	// Producers may interleave arbitrarily, sorting makes the result independent of thread timing
+	int count = 0;
+	while (count < commands.getCapacity() && commands.pop(drainedCommands[count])) {
+		++count;
+	}
+	std::sort(drainedCommands, drainedCommands + count, commandOrder);
+	for (int i = 0; i < count; ++i) {
+		ApplyCommand(drainedCommands[i]);
+	}
+	return count;
+}
+
+void PhysicsWorld::ApplyCommand(const PhysicsCommand& command) {
+	if (command.type == PhysicsCommand::Spawn) {
+		PhysicsObject* po = GetObject(SpawnObject());
+		if (po == nullptr) return;
+		po->SetPosition(command.position);
+		po->Velocity = command.vector;
+		po->Collider.radius = command.radius;
+		po->Mass = command.mass;
+		po->Mesh = command.mesh;
+		GetMeshIndex(po->Mesh);
+		po->ApplyImpulse(command.vector);
+		return;
+	}
+
+	PhysicsObject* po = GetObject(command.body);
+	if (po == nullptr) return;
+	if (command.type == PhysicsCommand::Despawn) {
+		RemoveObject(po);
+		return;
+	}
+
+	// Pushed objects run at full rate again, starting with the next level of detail update
+	if (po->StepInterval != 1) ++stats.promotions;
+	po->StepInterval = 1;
+	po->WakeUpdates = lodInterval * 8;
+	if (command.type == PhysicsCommand::Impulse) {
+		po->ApplyImpulse(command.vector);
+	}
+	else if (command.type == PhysicsCommand::Force) {
+		po->ApplyForceToCenter(command.vector);
+	}
 }
@@ -3,20 +3,133 @@
 #include <Kore/Math/Vector.h>
 #include <Kore/Math/Matrix.h>
 #include <Kore/Math/Core.h>
+#include <atomic>
+#include <cassert>
 #include "ObjLoader.h"
 #include "Collision.h"
+#include "CommandQueue.h"
 #include "PhysicsObject.h"
 
 using namespace Kore;
 
 
 class PhysicsObject;
+class MeshObject;
+class ParticleSystem;
+
+// Refers to a pooled object. The generation changes when the object is removed, so old handles stop resolving.
+struct BodyHandle {
+	int index;
+	unsigned generation;
+};
+
+// A change to the world requested from outside the simulation step, e.g. by input handling or a controller thread.
+// Commands are applied at the start of Update, ordered by source and then by the order they were pushed from that source.
+struct PhysicsCommand {
+	enum Type { Spawn, Despawn, Impulse, Force };
+	Type type;
+
+	// Identifies the producer, each producer should use its own source (below maxCommandSources)
+	int source;
+	// Set by PushCommand
+	unsigned sequence;
+
+	// Target of Despawn, Impulse and Force
+	BodyHandle body;
+
+	// Spawn: the start position, the initial velocity (which is also applied as an impulse), radius, mass and mesh
+	vec3 position;
+	// Spawn: velocity, Impulse: impulse, Force: force
+	vec3 vector;
+	float radius;
+	float mass;
+	MeshObject* mesh;
+};
+
+const int maxCommandSources = 8;
+
+const int maxFocusPoints = 4;
+
+// Distinct meshes of simulated objects that saved states can refer to
+const int maxObjectMeshes = 16;
+
+// Work done by the last Update
+struct SimulationStats {
+	// Objects stepping every update and objects on the reduced rate
+	int fullRate;
+	int reduced;
+	int steps;
+	int stepsSkipped;
+	// Sphere pairs tested and pairs skipped because neither object stepped
+	int pairTests;
+	int pairTestsSkipped;
+	int promotions;
+	int demotions;
+	// Tests against the level geometry
+	int triangleTests;
+	int primitiveTests;
+};
 
 // Handles all physically simulated objects.
 class PhysicsWorld {
 	
 	int maxPhysicsObjects;
 
+	int maxMeshColliders;
+
+	// All pooled objects are allocated up front, spawning takes one from the free list
+	PhysicsObject* pool;
+	unsigned* generations;
+	int* freeList;
+	int numFree;
+
+	// Objects added with AddObject in the order they were first added, saved states refer to them by this index
+	PhysicsObject** addedObjects;
+	int numAdded;
+
+	// Pool slots followed by added objects, marks those a state refers to while RestoreState checks it
+	bool* restoreSeen;
+
+	// Meshes of the objects in the order they first appeared, saved states refer to them by this index
+	MeshObject* objectMeshes[maxObjectMeshes];
+	int numObjectMeshes;
+
+	// -1 for no mesh or if there are more than maxObjectMeshes
+	int GetMeshIndex(MeshObject* mesh);
+
+	// Number of entries in physicsObjects
+	int numActive;
+
+	CommandQueue<PhysicsCommand> commands;
+	std::atomic<unsigned> commandSequences[maxCommandSources];
+	// Commands taken from the queue in one ApplyCommands, sorted before they are applied
+	PhysicsCommand* drainedCommands;
+
+	void ApplyCommand(const PhysicsCommand& command);
+
+	vec3 focusPoints[maxFocusPoints];
+	int numFocusPoints;
+	// Counts the updates, selects which reduced objects step
+	unsigned updateCount;
+
+	void UpdateLevelOfDetail(float deltaT);
+	void Promote(PhysicsObject* po);
+
+	// Hierarchy over the world bounds of the mesh colliders, rebuilt before the next query when colliders were added or removed.
+	// All arrays grow with meshColliders, so rebuilding does not allocate.
+	CollisionNode* colliderNodes;
+	int numColliderNodes;
+	int* colliderOrder;
+	float* colliderBoxes;
+	bool collidersChanged;
+	// Result of FindMeshColliders
+	int* colliderCandidates;
+
+	void UpdateColliderTree();
+
+	// Writes the indices of the colliders from first on whose bounds overlap the sphere to out, ascending. Returns how many were found.
+	int FindMeshColliders(const SphereCollider& sphere, int first, int* out);
+
 public:
 	
 	// The ground plane
@@ -25,20 +138,124 @@ public:
 	TriangleCollider triangle1;
 	TriangleCollider triangle2;
 
-	TriangleMeshCollider meshCollider;
+	// The static level geometry, a level split into chunks has one collider per resident chunk.
+	// Remove and add a collider again to move it.
+	TriangleMeshCollider* meshColliders;
+	int numMeshColliders;
 
 	// null terminated array of PhysicsObject pointers
 	PhysicsObject** physicsObjects;
 
-	PhysicsWorld(int inMaxPhysicsObjects = 100);
+	PhysicsWorld(int inMaxPhysicsObjects = 100, int commandCapacity = 1024);
+
+	~PhysicsWorld();
 	
-	// Integration step
+	// Integration step, applies the queued commands first
 	void Update(float deltaT);
 
+	// Queue a command, can be called from any thread. Returns false if the queue is full or the source is out of range.
+	bool PushCommand(const PhysicsCommand& command);
+
+	// Apply all queued commands in (source, sequence) order, returns how many were applied. Only call from the simulation thread.
+	int ApplyCommands();
+
+	// Commands rejected by PushCommand because the queue was full
+	std::atomic<int> droppedCommands;
+
+	// Objects further than lodFarDistance from all focus points step every lodInterval updates with the accumulated time.
+	// They return to full rate within lodNearDistance of a focus point, when touched by a stepping object or when a command targets them.
+	// Without focus points or with an interval of 1 everything steps every update.
+	float lodNearDistance;
+	float lodFarDistance;
+	int lodInterval;
+
+	// Usually the followed ball and the camera, at most maxFocusPoints
+	void SetFocusPoints(const vec3* points, int count);
+
+	SimulationStats stats;
+
 	// Handle the collisions
 	void HandleCollisions(float deltaT);
 
-	// Add an object to be simulated
+	// Add an object to be simulated, the caller keeps ownership
 	void AddObject(PhysicsObject* po);
 
+	// Take a default constructed object from the pool and start simulating it. Returns an invalid handle if the pool is exhausted.
+	BodyHandle SpawnObject();
+
+	// Spawn up to count objects, returns how many were spawned
+	int SpawnObjects(int count, BodyHandle* handles);
+
+	// Stop simulating the object and return it to the pool. Returns false for stale handles.
+	bool RemoveObject(BodyHandle handle);
+
+	// Also works for objects added with AddObject
+	void RemoveObject(PhysicsObject* po);
+
+	void RemoveObjects(const BodyHandle* handles, int count);
+
+	// nullptr if the object was removed in the meantime
+	PhysicsObject* GetObject(BodyHandle handle);
+
+	// Only pooled objects have a valid handle
+	BodyHandle GetHandle(PhysicsObject* po);
+
+	bool IsValid(BodyHandle handle);
+
+	// FNV-1a over position, rotation and velocities of all simulated objects, for comparing runs
+	unsigned GetStateChecksum();
+
+	// Everything Update changes, in one flat block: 120 bytes per simulated object, the pool's generations and free list,
+	// the level of detail and the last contacts of the mesh colliders. The size is a multiple of 8 bytes.
+	// Objects are stored by their pool index or the order they were added in and meshes by the order they were first used in,
+	// so a world set up the same way can restore the state.
+	// Queued commands are not part of the state, save between updates.
+	int GetStateSize();
+
+	// Returns the bytes written, 0 if capacity is less than GetStateSize
+	int SaveState(void* buffer, int capacity);
+
+	// Continue from a state saved by this world. Objects simulated now but not in the state stop being simulated,
+	// objects added with AddObject have to be alive. Returns false without changing anything if the state is not from a world
+	// of this size, is truncated or inconsistent, or refers to objects this world does not know.
+	bool RestoreState(const void* buffer, int size);
+
+	int GetObjectCount() {
+		return numActive;
+	}
+
+	// Pooled objects that can still be spawned
+	int GetFreeCount() {
+		return numFree;
+	}
+
+	void AddMeshCollider(CollisionMesh* mesh);
+
+	// Place the mesh with a transform (rotation, translation and uniform scale), the same mesh can be added any number of times
+	void AddMeshCollider(CollisionMesh* mesh, const mat4& transform);
+
+	// Removes all colliders using the mesh
+	void RemoveMeshCollider(CollisionMesh* mesh);
+
+	// Rebuilds the hierarchy of the mesh colliders if colliders were added or removed since the last call.
+	// Update does this itself, other callers of QueryMeshColliders have to call it after adding or removing colliders.
+	void PrepareQueries() {
+		if (collidersChanged) UpdateColliderTree();
+	}
+
+	// Calls visit(collider) for the mesh colliders whose bounds overlap the box, in no particular order.
+	// Doesn't change the world, so several threads can query at once while nothing adds or removes colliders.
+	// The hierarchy has to be up to date, see PrepareQueries.
+	template<typename Visitor> void QueryMeshColliders(const vec3& boxMin, const vec3& boxMax, Visitor& visit) const {
+		assert(!collidersChanged);
+		queryCollisionTree(colliderNodes, numColliderNodes, colliderOrder, boxMin, boxMax, visit);
+	}
+
+	// Simulate up to maxParticles spheres of the radius as a particle system in every Update, after the objects.
+	// Replaces the particles of an earlier call. Particles are not part of the checksum or the saved state.
+	void EnableParticles(int maxParticles, float radius, int threads = 0);
+
+	// nullptr until EnableParticles was called
+	ParticleSystem* particles;
+
 };
@@ -0,0 +1,421 @@
+#include "pch.h"
+#include "RenderDevice.h"
+#include "MemoryTracking.h"
+#include "TextureCache.h"
+
+#include <Kore/IO/FileReader.h>
+#include <Kore/Graphics1/Image.h>
+#include <Kore/Log.h>
+#include <cstring>
+
+using namespace Kore;
+
+namespace {
+	int floatsPerVertex(const Graphics4::VertexStructure& structure) {
+		int floats = 0;
+		for (int i = 0; i < structure.size; ++i) {
+			switch (structure.elements[i].data) {
+			case Graphics4::Float1VertexData: floats += 1; break;
+			case Graphics4::Float2VertexData: floats += 2; break;
+			case Graphics4::Float3VertexData: floats += 3; break;
+			case Graphics4::Float4VertexData: floats += 4; break;
+			case Graphics4::Float4x4VertexData: floats += 16; break;
+			case Graphics4::ColorVertexData: floats += 1; break;
+			default: break;
+			}
+		}
+		return floats;
+	}
+
+	Graphics4::Shader* loadShader(const char* filename, Graphics4::ShaderType type) {
+		FileReader reader(filename);
+		return new Graphics4::Shader(reader.readAll(), reader.size(), type);
+	}
+
+	void uploadLevel(Graphics4::Texture* texture, const BakedTexture& baked, int level) {
+		unsigned char* pixels = texture->lock();
+		baked.copyLevel(level, pixels, texture->stride());
+		texture->unlock();
+	}
+}
+
+int DeviceIds::allocate() {
+	if (numFree > 0) return freeIds[--numFree];
+	// Room for every id handed out so far, so release never has to grow the list
+	if (next == capacity) {
+		capacity = capacity == 0 ? 64 : capacity * 2;
+		int* grown = new int[capacity];
+		if (numFree > 0) memcpy(grown, freeIds, numFree * sizeof(int));
+		delete[] freeIds;
+		freeIds = grown;
+	}
+	return next++;
+}
+
+void DeviceIds::release(int id) {
+	freeIds[numFree++] = id;
+}
+
+// Kore
+
+DeviceVertexBuffer* KoreRenderDevice::createVertexBuffer(int count, const Graphics4::VertexStructure& structure, int instanceDataStepRate) {
+	DeviceVertexBuffer* buffer = new DeviceVertexBuffer;
+	buffer->id = vertexBufferIds.allocate();
+	buffer->native = new Graphics4::VertexBuffer(count, structure, instanceDataStepRate);
+	buffer->shadow = nullptr;
+	buffer->count = count;
+	buffer->stride = floatsPerVertex(structure);
+	return buffer;
+}
+
+float* KoreRenderDevice::lock(DeviceVertexBuffer* buffer) {
+	return buffer->native->lock();
+}
+
+void KoreRenderDevice::unlock(DeviceVertexBuffer* buffer) {
+	buffer->native->unlock();
+}
+
+void KoreRenderDevice::destroy(DeviceVertexBuffer* buffer) {
+	if (buffer == nullptr) return;
+	vertexBufferIds.release(buffer->id);
+	delete buffer->native;
+	delete buffer;
+}
+
+DeviceIndexBuffer* KoreRenderDevice::createIndexBuffer(int count) {
+	DeviceIndexBuffer* buffer = new DeviceIndexBuffer;
+	buffer->id = indexBufferIds.allocate();
+	buffer->native = new Graphics4::IndexBuffer(count);
+	buffer->shadow = nullptr;
+	buffer->count = count;
+	return buffer;
+}
+
+int* KoreRenderDevice::lock(DeviceIndexBuffer* buffer) {
+	return buffer->native->lock();
+}
+
+void KoreRenderDevice::unlock(DeviceIndexBuffer* buffer) {
+	buffer->native->unlock();
+}
+
+void KoreRenderDevice::destroy(DeviceIndexBuffer* buffer) {
+	if (buffer == nullptr) return;
+	indexBufferIds.release(buffer->id);
+	delete buffer->native;
+	delete buffer;
+}
+
+DeviceTexture* KoreRenderDevice::createTexture(const char* filename) {
+	DeviceTexture* texture = new DeviceTexture;
+	texture->id = textureIds.allocate();
+	texture->nativeArray = nullptr;
+	texture->layers = 1;
+
+	BakedTexture baked(filename);
+	if (!baked.isValid()) {
+		texture->native = new Graphics4::Texture(filename, true);
+		texture->levels = 1;
+		return texture;
+	}
+
+	// Nothing reads baked textures back, so Kore does not have to keep a copy of the pixels
+	texture->native = new Graphics4::Texture(baked.getWidth(), baked.getHeight(), Graphics1::Image::RGBA32, false);
+	texture->levels = baked.getLevelCount();
+	uploadLevel(texture->native, baked, 0);
+	for (int level = 1; level < baked.getLevelCount(); ++level) {
+		Graphics4::Texture mipmap(baked.getWidth(level), baked.getHeight(level), Graphics1::Image::RGBA32, false);
+		uploadLevel(&mipmap, baked, level);
+		texture->native->setMipmap(&mipmap, level);
+	}
+	return texture;
+}
+
+DeviceTexture* KoreRenderDevice::createTextureArray(const char** filenames, int count) {
+	Graphics1::Image** images = new Graphics1::Image*[count];
+	for (int layer = 0; layer < count; ++layer) {
+		// TextureArray takes no mipmaps, only the full size of a baked texture is used
+		BakedTexture baked(filenames[layer]);
+		if (baked.isValid()) {
+			images[layer] = new Graphics1::Image(baked.getWidth(), baked.getHeight(), Graphics1::Image::RGBA32, true);
+			baked.copyLevel(0, images[layer]->data, baked.getWidth() * 4);
+		}
+		else {
+			images[layer] = new Graphics1::Image(filenames[layer], true);
+		}
+		if (images[layer]->width != images[0]->width || images[layer]->height != images[0]->height) {
+			Kore::log(Warning, "Texture %s does not match the size of %s", filenames[layer], filenames[0]);
+		}
+	}
+
+	DeviceTexture* texture = new DeviceTexture;
+	texture->id = textureIds.allocate();
+	texture->native = nullptr;
+	texture->nativeArray = new Graphics4::TextureArray(images, count);
+	texture->layers = count;
+	texture->levels = 1;
+
+	for (int layer = 0; layer < count; ++layer) {
+		delete images[layer];
+	}
+	delete[] images;
+	return texture;
+}
+
+void KoreRenderDevice::destroy(DeviceTexture* texture) {
+	if (texture == nullptr) return;
+	textureIds.release(texture->id);
+	delete texture->native;
+	delete texture->nativeArray;
+	delete texture;
+}
+
+DevicePipeline* KoreRenderDevice::createPipeline(const char* vertexShader, const char* fragmentShader, Graphics4::VertexStructure** inputLayout) {
+	DevicePipeline* pipeline = new DevicePipeline;
+	pipeline->id = pipelineIds.allocate();
+	pipeline->vertexShader = loadShader(vertexShader, Graphics4::VertexShader);
+	pipeline->fragmentShader = loadShader(fragmentShader, Graphics4::FragmentShader);
+	pipeline->native = new Graphics4::PipelineState;
+	pipeline->native->depthMode = Graphics4::ZCompareLess;
+	pipeline->native->depthWrite = true;
+	int i = 0;
+	for (; inputLayout[i] != nullptr; ++i) {
+		pipeline->native->inputLayout[i] = inputLayout[i];
+	}
+	pipeline->native->inputLayout[i] = nullptr;
+	pipeline->native->vertexShader = pipeline->vertexShader;
+	pipeline->native->fragmentShader = pipeline->fragmentShader;
+	pipeline->native->compile();
+	return pipeline;
+}
+
+Graphics4::TextureUnit KoreRenderDevice::getTextureUnit(DevicePipeline* pipeline, const char* name) {
+	return pipeline->native->getTextureUnit(name);
+}
+
+Graphics4::ConstantLocation KoreRenderDevice::getConstantLocation(DevicePipeline* pipeline, const char* name) {
+	return pipeline->native->getConstantLocation(name);
+}
+
+void KoreRenderDevice::begin() {
+	Graphics4::begin();
+}
+
+void KoreRenderDevice::clear(unsigned flags, unsigned color, float depth) {
+	Graphics4::clear(flags, color, depth);
+}
+
+void KoreRenderDevice::end() {
+	Graphics4::end();
+}
+
+void KoreRenderDevice::swapBuffers() {
+	Graphics4::swapBuffers();
+}
+
+void KoreRenderDevice::setPipeline(DevicePipeline* pipeline) {
+	Graphics4::setPipeline(pipeline->native);
+}
+
+void KoreRenderDevice::setMatrix(Graphics4::ConstantLocation location, const mat4& value) {
+	Graphics4::setMatrix(location, value);
+}
+
+void KoreRenderDevice::setTexture(Graphics4::TextureUnit unit, DeviceTexture* texture) {
+	if (texture->nativeArray != nullptr) Graphics4::setTextureArray(unit, texture->nativeArray);
+	else Graphics4::setTexture(unit, texture->native);
+	Graphics4::setTextureMipmapFilter(unit, texture->levels > 1 ? Graphics4::LinearMipFilter : Graphics4::NoMipFilter);
+}
+
+void KoreRenderDevice::setTextureAddressing(Graphics4::TextureUnit unit, Graphics4::TexDir dir, Graphics4::TextureAddressing addressing) {
+	Graphics4::setTextureAddressing(unit, dir, addressing);
+}
+
+void KoreRenderDevice::setVertexBuffers(DeviceVertexBuffer** buffers, int count) {
+	if (count == 1) {
+		Graphics4::setVertexBuffer(*buffers[0]->native);
+		return;
+	}
+	Graphics4::VertexBuffer* natives[4];
+	for (int i = 0; i < count; ++i) natives[i] = buffers[i]->native;
+	Graphics4::setVertexBuffers(natives, count);
+}
+
+void KoreRenderDevice::setIndexBuffer(DeviceIndexBuffer* buffer) {
+	Graphics4::setIndexBuffer(*buffer->native);
+}
+
+void KoreRenderDevice::drawIndexedVertices() {
+	Graphics4::drawIndexedVertices();
+}
+
+void KoreRenderDevice::drawIndexedVerticesInstanced(int instanceCount) {
+	Graphics4::drawIndexedVerticesInstanced(instanceCount);
+}
+
+// Null
+
+NullRenderDevice::NullRenderDevice() : commands(nullptr), numCommands(0), frames(0), drawCalls(0), streamHash(14695981039346656037ull), capacity(0) {}
+
+NullRenderDevice::~NullRenderDevice() {
+	delete[] commands;
+}
+
+void NullRenderDevice::hash(const void* data, int size) {
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+	for (int i = 0; i < size; ++i) {
+		streamHash ^= bytes[i];
+		streamHash *= 1099511628211ull;
+	}
+}
+
+void NullRenderDevice::record(RecordedCommand::Type type, const void* resource, int value) {
+	if (numCommands == capacity) {
+		MemoryScope scope(MemoryRender);
+		capacity = capacity == 0 ? 256 : capacity * 2;
+		RecordedCommand* grown = new RecordedCommand[capacity];
+		if (numCommands > 0) memcpy(grown, commands, numCommands * sizeof(RecordedCommand));
+		delete[] commands;
+		commands = grown;
+	}
+	RecordedCommand& command = commands[numCommands++];
+	command.type = type;
+	command.resource = resource;
+	command.value = value;
+
+	int typeValue = (int)type;
+	hash(&typeValue, sizeof(typeValue));
+	hash(&value, sizeof(value));
+}
+
+DeviceVertexBuffer* NullRenderDevice::createVertexBuffer(int count, const Graphics4::VertexStructure& structure, int instanceDataStepRate) {
+	DeviceVertexBuffer* buffer = new DeviceVertexBuffer;
+	buffer->id = vertexBufferIds.allocate();
+	buffer->native = nullptr;
+	buffer->count = count;
+	buffer->stride = floatsPerVertex(structure);
+	buffer->shadow = new float[count * buffer->stride];
+	return buffer;
+}
+
+float* NullRenderDevice::lock(DeviceVertexBuffer* buffer) {
+	return buffer->shadow;
+}
+
+void NullRenderDevice::unlock(DeviceVertexBuffer* buffer) {}
+
+void NullRenderDevice::destroy(DeviceVertexBuffer* buffer) {
+	if (buffer == nullptr) return;
+	vertexBufferIds.release(buffer->id);
+	delete[] buffer->shadow;
+	delete buffer;
+}
+
+DeviceIndexBuffer* NullRenderDevice::createIndexBuffer(int count) {
+	DeviceIndexBuffer* buffer = new DeviceIndexBuffer;
+	buffer->id = indexBufferIds.allocate();
+	buffer->native = nullptr;
+	buffer->count = count;
+	buffer->shadow = new int[count];
+	return buffer;
+}
+
+int* NullRenderDevice::lock(DeviceIndexBuffer* buffer) {
+	return buffer->shadow;
+}
+
+void NullRenderDevice::unlock(DeviceIndexBuffer* buffer) {}
+
+void NullRenderDevice::destroy(DeviceIndexBuffer* buffer) {
+	if (buffer == nullptr) return;
+	indexBufferIds.release(buffer->id);
+	delete[] buffer->shadow;
+	delete buffer;
+}
+
+DeviceTexture* NullRenderDevice::createTexture(const char* filename) {
+	DeviceTexture* texture = new DeviceTexture;
+	texture->id = textureIds.allocate();
+	texture->native = nullptr;
+	texture->nativeArray = nullptr;
+	texture->layers = 1;
+	texture->levels = 1;
+	return texture;
+}
+
+DeviceTexture* NullRenderDevice::createTextureArray(const char** filenames, int count) {
+	DeviceTexture* texture = createTexture(filenames[0]);
+	texture->layers = count;
+	return texture;
+}
+
+void NullRenderDevice::destroy(DeviceTexture* texture) {
+	if (texture == nullptr) return;
+	textureIds.release(texture->id);
+	delete texture;
+}
+
+DevicePipeline* NullRenderDevice::createPipeline(const char* vertexShader, const char* fragmentShader, Graphics4::VertexStructure** inputLayout) {
+	DevicePipeline* pipeline = new DevicePipeline;
+	pipeline->id = pipelineIds.allocate();
+	pipeline->native = nullptr;
+	pipeline->vertexShader = nullptr;
+	pipeline->fragmentShader = nullptr;
+	return pipeline;
+}
+
+Graphics4::TextureUnit NullRenderDevice::getTextureUnit(DevicePipeline* pipeline, const char* name) {
+	return Graphics4::TextureUnit();
+}
+
+Graphics4::ConstantLocation NullRenderDevice::getConstantLocation(DevicePipeline* pipeline, const char* name) {
+	return Graphics4::ConstantLocation();
+}
+
+void NullRenderDevice::begin() {
+	numCommands = 0;
+}
+
+void NullRenderDevice::clear(unsigned flags, unsigned color, float depth) {}
+
+void NullRenderDevice::end() {
+	++frames;
+}
+
+void NullRenderDevice::swapBuffers() {}
+
+void NullRenderDevice::setPipeline(DevicePipeline* pipeline) {
+	record(RecordedCommand::SetPipeline, pipeline, pipeline->id);
+}
+
+void NullRenderDevice::setMatrix(Graphics4::ConstantLocation location, const mat4& value) {
+	record(RecordedCommand::SetMatrix, nullptr, 0);
+	hash(value.data, sizeof(value.data));
+}
+
+void NullRenderDevice::setTexture(Graphics4::TextureUnit unit, DeviceTexture* texture) {
+	record(RecordedCommand::SetTexture, texture, texture->id);
+}
+
+void NullRenderDevice::setTextureAddressing(Graphics4::TextureUnit unit, Graphics4::TexDir dir, Graphics4::TextureAddressing addressing) {}
+
+void NullRenderDevice::setVertexBuffers(DeviceVertexBuffer** buffers, int count) {
+	for (int i = 0; i < count; ++i) {
+		record(RecordedCommand::SetVertexBuffers, buffers[i], buffers[i]->id);
+	}
+}
+
+void NullRenderDevice::setIndexBuffer(DeviceIndexBuffer* buffer) {
+	record(RecordedCommand::SetIndexBuffer, buffer, buffer->id);
+}
+
+void NullRenderDevice::drawIndexedVertices() {
+	record(RecordedCommand::Draw, nullptr, 0);
+	++drawCalls;
+}
+
+void NullRenderDevice::drawIndexedVerticesInstanced(int instanceCount) {
+	record(RecordedCommand::DrawInstanced, nullptr, instanceCount);
+	++drawCalls;
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/Graphics4/Graphics.h>
+#include <Kore/Graphics4/PipelineState.h>
+#include <Kore/Graphics4/TextureArray.h>
+
+using namespace Kore;
+
+// GPU resources as seen by the game. The Kore device creates the native objects,
+// the null device only keeps CPU memory so buffers can still be locked and filled.
+// Ids are small and unique among the live resources of a type, they are stable between runs that create and destroy
+// resources in the same order.
+struct DeviceVertexBuffer {
+	int id;
+	Graphics4::VertexBuffer* native;
+	float* shadow;
+	int count;
+	// Floats per vertex
+	int stride;
+};
+
+struct DeviceIndexBuffer {
+	int id;
+	Graphics4::IndexBuffer* native;
+	int* shadow;
+	int count;
+};
+
+struct DeviceTexture {
+	int id;
+	Graphics4::Texture* native;
+	Graphics4::TextureArray* nativeArray;
+	int layers;
+	// Mipmap levels including the full size, only baked textures have more than one
+	int levels;
+};
+
+struct DevicePipeline {
+	int id;
+	Graphics4::PipelineState* native;
+	Graphics4::Shader* vertexShader;
+	Graphics4::Shader* fragmentShader;
+};
+
+// Hands out the ids of one resource type. Ids of destroyed resources are used again, so they stay below the number of
+// resources alive at the same time. Only allocate allocates memory, release can be called anywhere.
+class DeviceIds {
+public:
+	DeviceIds() : next(0), freeIds(nullptr), numFree(0), capacity(0) {}
+
+	~DeviceIds() {
+		delete[] freeIds;
+	}
+
+	int allocate();
+	void release(int id);
+
+private:
+	int next;
+	int* freeIds;
+	int numFree;
+	int capacity;
+
+	DeviceIds(const DeviceIds&);
+	DeviceIds& operator=(const DeviceIds&);
+};
+
+// The subset of Graphics4 the game uses. Everything that renders goes through a device,
+// so the game loop can run without a window or GPU.
+class RenderDevice {
+public:
+	virtual ~RenderDevice() {}
+
+	virtual DeviceVertexBuffer* createVertexBuffer(int count, const Graphics4::VertexStructure& structure, int instanceDataStepRate = 0) = 0;
+	virtual float* lock(DeviceVertexBuffer* buffer) = 0;
+	virtual void unlock(DeviceVertexBuffer* buffer) = 0;
+	virtual void destroy(DeviceVertexBuffer* buffer) = 0;
+
+	virtual DeviceIndexBuffer* createIndexBuffer(int count) = 0;
+	virtual int* lock(DeviceIndexBuffer* buffer) = 0;
+	virtual void unlock(DeviceIndexBuffer* buffer) = 0;
+	virtual void destroy(DeviceIndexBuffer* buffer) = 0;
+
+	// Images with an up to date cache from bakeTexture are loaded from it
+	virtual DeviceTexture* createTexture(const char* filename) = 0;
+	// All layers need the same size
+	virtual DeviceTexture* createTextureArray(const char** filenames, int count) = 0;
+	virtual void destroy(DeviceTexture* texture) = 0;
+
+	// Shaders are given by their compiled file name (e.g. "shader.vert"), inputLayout is null terminated
+	virtual DevicePipeline* createPipeline(const char* vertexShader, const char* fragmentShader, Graphics4::VertexStructure** inputLayout) = 0;
+	virtual Graphics4::TextureUnit getTextureUnit(DevicePipeline* pipeline, const char* name) = 0;
+	virtual Graphics4::ConstantLocation getConstantLocation(DevicePipeline* pipeline, const char* name) = 0;
+
+	virtual void begin() = 0;
+	virtual void clear(unsigned flags, unsigned color, float depth) = 0;
+	virtual void end() = 0;
+	virtual void swapBuffers() = 0;
+
+	virtual void setPipeline(DevicePipeline* pipeline) = 0;
+	virtual void setMatrix(Graphics4::ConstantLocation location, const mat4& value) = 0;
+	// Binds a texture or a texture array
+	virtual void setTexture(Graphics4::TextureUnit unit, DeviceTexture* texture) = 0;
+	virtual void setTextureAddressing(Graphics4::TextureUnit unit, Graphics4::TexDir dir, Graphics4::TextureAddressing addressing) = 0;
+	virtual void setVertexBuffers(DeviceVertexBuffer** buffers, int count) = 0;
+	virtual void setIndexBuffer(DeviceIndexBuffer* buffer) = 0;
+	virtual void drawIndexedVertices() = 0;
+	virtual void drawIndexedVerticesInstanced(int instanceCount) = 0;
+
+protected:
+	DeviceIds vertexBufferIds;
+	DeviceIds indexBufferIds;
+	DeviceIds textureIds;
+	DeviceIds pipelineIds;
+};
+
+// Forwards everything to Kore's Graphics4
+class KoreRenderDevice : public RenderDevice {
+public:
+	DeviceVertexBuffer* createVertexBuffer(int count, const Graphics4::VertexStructure& structure, int instanceDataStepRate = 0) override;
+	float* lock(DeviceVertexBuffer* buffer) override;
+	void unlock(DeviceVertexBuffer* buffer) override;
+	void destroy(DeviceVertexBuffer* buffer) override;
+
+	DeviceIndexBuffer* createIndexBuffer(int count) override;
+	int* lock(DeviceIndexBuffer* buffer) override;
+	void unlock(DeviceIndexBuffer* buffer) override;
+	void destroy(DeviceIndexBuffer* buffer) override;
+
+	DeviceTexture* createTexture(const char* filename) override;
+	DeviceTexture* createTextureArray(const char** filenames, int count) override;
+	void destroy(DeviceTexture* texture) override;
+
+	DevicePipeline* createPipeline(const char* vertexShader, const char* fragmentShader, Graphics4::VertexStructure** inputLayout) override;
+	Graphics4::TextureUnit getTextureUnit(DevicePipeline* pipeline, const char* name) override;
+	Graphics4::ConstantLocation getConstantLocation(DevicePipeline* pipeline, const char* name) override;
+
+	void begin() override;
+	void clear(unsigned flags, unsigned color, float depth) override;
+	void end() override;
+	void swapBuffers() override;
+
+	void setPipeline(DevicePipeline* pipeline) override;
+	void setMatrix(Graphics4::ConstantLocation location, const mat4& value) override;
+	void setTexture(Graphics4::TextureUnit unit, DeviceTexture* texture) override;
+	void setTextureAddressing(Graphics4::TextureUnit unit, Graphics4::TexDir dir, Graphics4::TextureAddressing addressing) override;
+	void setVertexBuffers(DeviceVertexBuffer** buffers, int count) override;
+	void setIndexBuffer(DeviceIndexBuffer* buffer) override;
+	void drawIndexedVertices() override;
+	void drawIndexedVerticesInstanced(int instanceCount) override;
+};
+
+// One recorded state change or draw of the null device
+struct RecordedCommand {
+	enum Type { SetPipeline, SetMatrix, SetTexture, SetVertexBuffers, SetIndexBuffer, Draw, DrawInstanced };
+	Type type;
+	const void* resource;
+	int value;
+};
+
+// Does not touch the GPU. Buffers live in CPU memory and all state changes and draws of the current frame are recorded,
+// together with a running hash of the whole command stream for comparing runs.
+class NullRenderDevice : public RenderDevice {
+public:
+	NullRenderDevice();
+	~NullRenderDevice();
+
+	DeviceVertexBuffer* createVertexBuffer(int count, const Graphics4::VertexStructure& structure, int instanceDataStepRate = 0) override;
+	float* lock(DeviceVertexBuffer* buffer) override;
+	void unlock(DeviceVertexBuffer* buffer) override;
+	void destroy(DeviceVertexBuffer* buffer) override;
+
+	DeviceIndexBuffer* createIndexBuffer(int count) override;
+	int* lock(DeviceIndexBuffer* buffer) override;
+	void unlock(DeviceIndexBuffer* buffer) override;
+	void destroy(DeviceIndexBuffer* buffer) override;
+
+	DeviceTexture* createTexture(const char* filename) override;
+	DeviceTexture* createTextureArray(const char** filenames, int count) override;
+	void destroy(DeviceTexture* texture) override;
+
+	DevicePipeline* createPipeline(const char* vertexShader, const char* fragmentShader, Graphics4::VertexStructure** inputLayout) override;
+	Graphics4::TextureUnit getTextureUnit(DevicePipeline* pipeline, const char* name) override;
+	Graphics4::ConstantLocation getConstantLocation(DevicePipeline* pipeline, const char* name) override;
+
+	void begin() override;
+	void clear(unsigned flags, unsigned color, float depth) override;
+	void end() override;
+	void swapBuffers() override;
+
+	void setPipeline(DevicePipeline* pipeline) override;
+	void setMatrix(Graphics4::ConstantLocation location, const mat4& value) override;
+	void setTexture(Graphics4::TextureUnit unit, DeviceTexture* texture) override;
+	void setTextureAddressing(Graphics4::TextureUnit unit, Graphics4::TexDir dir, Graphics4::TextureAddressing addressing) override;
+	void setVertexBuffers(DeviceVertexBuffer** buffers, int count) override;
+	void setIndexBuffer(DeviceIndexBuffer* buffer) override;
+	void drawIndexedVertices() override;
+	void drawIndexedVerticesInstanced(int instanceCount) override;
+
+	// The commands of the current (or last finished) frame
+	RecordedCommand* commands;
+	int numCommands;
+
+	int frames;
+	int drawCalls;
+
+	// FNV-1a over all commands recorded so far, using the resource ids instead of pointers so runs can be compared
+	unsigned long long streamHash;
+
+private:
+	void record(RecordedCommand::Type type, const void* resource, int value);
+	void hash(const void* data, int size);
+
+	int capacity;
+};
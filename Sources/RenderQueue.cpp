@@ -0,0 +1,142 @@
+#include "pch.h"
+#include "RenderQueue.h"
+#include "MemoryTracking.h"
+
+#include <Kore/Math/Core.h>
+#include <cstring>
+
+using namespace Kore;
+
+RenderQueue::RenderQueue() : numPipelines(0), items(nullptr), scratch(nullptr), numItems(0), capacity(0), farPlane(1.0f) {
+	stats.reset();
+}
+
+RenderQueue::~RenderQueue() {
+	delete[] items;
+	delete[] scratch;
+}
+
+int RenderQueue::addPipeline(const RenderPipeline& pipeline) {
+	pipelines[numPipelines] = pipeline;
+	return numPipelines++;
+}
+
+void RenderQueue::begin(const mat4& PV, float farPlane) {
+	this->PV = PV;
+	this->farPlane = farPlane;
+	numItems = 0;
+	stats.reset();
+}
+
+void RenderQueue::add(DrawItem& item, float depth) {
+	if (numItems == capacity) {
+		MemoryScope scope(MemoryRender);
+		capacity = capacity == 0 ? 64 : capacity * 2;
+		DrawItem* grown = new DrawItem[capacity];
+		if (numItems > 0) memcpy(grown, items, numItems * sizeof(DrawItem));
+		delete[] items;
+		delete[] scratch;
+		items = grown;
+		scratch = new DrawItem[capacity];
+	}
+
+	unsigned long long textureId = item.texture->id & 0xffff;
+	unsigned long long meshId = item.vertexBuffers[0]->id & 0xffff;
+	float normalizedDepth = Kore::max(0.0f, Kore::min(1.0f, depth / farPlane));
+	unsigned long long depthBits = (unsigned long long)(normalizedDepth * 0xffffff);
+	item.key = ((unsigned long long)item.pipeline << 56) | (textureId << 40) | (meshId << 24) | depthBits;
+
+	items[numItems++] = item;
+}
+
+// LSD radix sort on the keys, 8 bits per pass. Passes in which all items share the same digit are skipped,
+// which is the common case for the pipeline, texture and mesh bytes.
+void RenderQueue::sort() {
+	int counts[256];
+	for (int shift = 0; shift < 64; shift += 8) {
+		memset(counts, 0, sizeof(counts));
+		for (int i = 0; i < numItems; ++i) {
+			++counts[(items[i].key >> shift) & 0xff];
+		}
+		if (counts[(items[0].key >> shift) & 0xff] == numItems) continue;
+
+		int offset = 0;
+		for (int digit = 0; digit < 256; ++digit) {
+			int count = counts[digit];
+			counts[digit] = offset;
+			offset += count;
+		}
+		for (int i = 0; i < numItems; ++i) {
+			scratch[counts[(items[i].key >> shift) & 0xff]++] = items[i];
+		}
+		DrawItem* swap = items;
+		items = scratch;
+		scratch = swap;
+	}
+}
+
+void RenderQueue::submit(RenderDevice& device) {
+	if (numItems == 0) return;
+	sort();
+
+	int currentPipeline = -1;
+	DeviceTexture* currentTexture = nullptr;
+	DeviceVertexBuffer* currentVertexBuffers[2] = { nullptr, nullptr };
+	int currentNumVertexBuffers = 0;
+	DeviceIndexBuffer* currentIndexBuffer = nullptr;
+
+	for (int i = 0; i < numItems; ++i) {
+		DrawItem& item = items[i];
+		RenderPipeline& pipeline = pipelines[item.pipeline];
+
+		if (item.pipeline != currentPipeline) {
+			device.setPipeline(pipeline.pipeline);
+			device.setMatrix(pipeline.pvLocation, PV);
+			currentPipeline = item.pipeline;
+			// Texture bindings belong to the pipeline's texture unit
+			currentTexture = nullptr;
+			++stats.stateChanges;
+		}
+		else {
+			++stats.stateChangesAvoided;
+		}
+
+		if (item.texture != currentTexture) {
+			device.setTexture(pipeline.tex, item.texture);
+			currentTexture = item.texture;
+			++stats.stateChanges;
+		}
+		else {
+			++stats.stateChangesAvoided;
+		}
+
+		if (item.numVertexBuffers != currentNumVertexBuffers || item.vertexBuffers[0] != currentVertexBuffers[0]
+			|| (item.numVertexBuffers > 1 && item.vertexBuffers[1] != currentVertexBuffers[1])) {
+			device.setVertexBuffers(item.vertexBuffers, item.numVertexBuffers);
+			currentVertexBuffers[0] = item.vertexBuffers[0];
+			currentVertexBuffers[1] = item.vertexBuffers[1];
+			currentNumVertexBuffers = item.numVertexBuffers;
+			++stats.stateChanges;
+		}
+		else {
+			++stats.stateChangesAvoided;
+		}
+
+		if (item.indexBuffer != currentIndexBuffer) {
+			device.setIndexBuffer(item.indexBuffer);
+			currentIndexBuffer = item.indexBuffer;
+			++stats.stateChanges;
+		}
+		else {
+			++stats.stateChangesAvoided;
+		}
+
+		if (pipeline.hasModelMatrix) {
+			device.setMatrix(pipeline.mLocation, item.M);
+		}
+
+		if (item.instanceCount > 0) device.drawIndexedVerticesInstanced(item.instanceCount);
+		else device.drawIndexedVertices();
+		++stats.drawCalls;
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "pch.h"
+
+#include "RenderDevice.h"
+
+using namespace Kore;
+
+// A pipeline together with the uniforms the queue sets for it
+struct RenderPipeline {
+	DevicePipeline* pipeline;
+	Graphics4::TextureUnit tex;
+	Graphics4::ConstantLocation pvLocation;
+	Graphics4::ConstantLocation mLocation;
+	// Instanced pipelines take the model matrix from the instance buffer
+	bool hasModelMatrix;
+};
+
+// Everything needed to issue one draw call
+struct DrawItem {
+	unsigned long long key;
+
+	int pipeline;
+	// A texture or a texture array
+	DeviceTexture* texture;
+	DeviceVertexBuffer* vertexBuffers[2];
+	int numVertexBuffers;
+	DeviceIndexBuffer* indexBuffer;
+
+	// Drawn instanced if > 0
+	int instanceCount;
+
+	mat4 M;
+};
+
+struct RenderStats {
+	int drawCalls;
+	int stateChanges;
+	int stateChangesAvoided;
+
+	void reset() {
+		drawCalls = 0;
+		stateChanges = 0;
+		stateChangesAvoided = 0;
+	}
+};
+
+// Collects the draws of a frame, sorts them by state and submits them without redundant binds.
+// The 64 bit sort key is pipeline (8 bits), texture (16 bits), mesh (16 bits), depth (24 bits), so items sharing
+// state end up next to each other and are drawn front to back within the same state. Textures and meshes are keyed
+// by their device ids, which stay small because the device reuses the ids of destroyed resources.
+class RenderQueue {
+public:
+	RenderQueue();
+	~RenderQueue();
+
+	// Register a pipeline once (at most 256), the returned id is used in the draw items
+	int addPipeline(const RenderPipeline& pipeline);
+
+	// Start a new frame, depth values are expected in [0, farPlane]
+	void begin(const mat4& PV, float farPlane);
+
+	// Fills in the sort key of the item and queues it
+	void add(DrawItem& item, float depth);
+
+	// Sort all queued items and issue the draw calls on the device
+	void submit(RenderDevice& device);
+
+	RenderStats stats;
+
+private:
+	void sort();
+
+	RenderPipeline pipelines[256];
+	int numPipelines;
+
+	DrawItem* items;
+	DrawItem* scratch;
+	int numItems;
+	int capacity;
+
+	mat4 PV;
+	float farPlane;
+};
@@ -0,0 +1,438 @@
+#include "pch.h"
+#include "SimdMath.h"
+
+#include <Kore/Math/Random.h>
+#include <Kore/Log.h>
+#include <chrono>
+#include <cmath>
+
+using namespace Kore;
+
+void applyGravity(const float* mass, float* forceY, int count, float gravity) {
+	int n = 0;
+#if defined(SIMD_AVX2)
+	__m256 g8 = _mm256_set1_ps(gravity);
+	for (; n + 8 <= count; n += 8) {
+		_mm256_storeu_ps(&forceY[n], _mm256_fmadd_ps(_mm256_loadu_ps(&mass[n]), g8, _mm256_loadu_ps(&forceY[n])));
+	}
+#endif
+#if defined(SIMD_SSE)
+	__m128 g4 = _mm_set1_ps(gravity);
+	for (; n + 4 <= count; n += 4) {
+		_mm_storeu_ps(&forceY[n], _mm_add_ps(_mm_loadu_ps(&forceY[n]), _mm_mul_ps(_mm_loadu_ps(&mass[n]), g4)));
+	}
+#endif
+	for (; n < count; ++n) {
+		forceY[n] += mass[n] * gravity;
+	}
+}
+
+void integrateBodies(float* px, float* py, float* pz, float* vx, float* vy, float* vz, float* fx, float* fy, float* fz,
+	const float* inverseMass, float damping, float deltaT, int count) {
+	float* positions[3] = { px, py, pz };
+	float* velocities[3] = { vx, vy, vz };
+	float* forces[3] = { fx, fy, fz };
+	int n = 0;
+#if defined(SIMD_AVX2)
+	__m256 dt8 = _mm256_set1_ps(deltaT);
+	__m256 damping8 = _mm256_set1_ps(damping);
+	for (; n + 8 <= count; n += 8) {
+		__m256 scale = _mm256_mul_ps(_mm256_loadu_ps(&inverseMass[n]), dt8);
+		for (int axis = 0; axis < 3; ++axis) {
+			__m256 v = _mm256_fmadd_ps(_mm256_loadu_ps(&forces[axis][n]), scale, _mm256_loadu_ps(&velocities[axis][n]));
+			v = _mm256_mul_ps(v, damping8);
+			_mm256_storeu_ps(&velocities[axis][n], v);
+			_mm256_storeu_ps(&positions[axis][n], _mm256_fmadd_ps(v, dt8, _mm256_loadu_ps(&positions[axis][n])));
+			_mm256_storeu_ps(&forces[axis][n], _mm256_setzero_ps());
+		}
+	}
+#endif
+#if defined(SIMD_SSE)
+	__m128 dt4 = _mm_set1_ps(deltaT);
+	__m128 damping4 = _mm_set1_ps(damping);
+	for (; n + 4 <= count; n += 4) {
+		__m128 scale = _mm_mul_ps(_mm_loadu_ps(&inverseMass[n]), dt4);
+		for (int axis = 0; axis < 3; ++axis) {
+			__m128 v = _mm_add_ps(_mm_loadu_ps(&velocities[axis][n]), _mm_mul_ps(_mm_loadu_ps(&forces[axis][n]), scale));
+			v = _mm_mul_ps(v, damping4);
+			_mm_storeu_ps(&velocities[axis][n], v);
+			_mm_storeu_ps(&positions[axis][n], _mm_add_ps(_mm_loadu_ps(&positions[axis][n]), _mm_mul_ps(v, dt4)));
+			_mm_storeu_ps(&forces[axis][n], _mm_setzero_ps());
+		}
+	}
+#endif
+	for (; n < count; ++n) {
+		float scale = inverseMass[n] * deltaT;
+		for (int axis = 0; axis < 3; ++axis) {
+			float v = (velocities[axis][n] + forces[axis][n] * scale) * damping;
+			velocities[axis][n] = v;
+			positions[axis][n] += v * deltaT;
+			forces[axis][n] = 0.0f;
+		}
+	}
+}
+
+void integrateRotations(float* r, float* i, float* j, float* k, float* wx, float* wy, float* wz, float damping, float deltaT, int count) {
+	int n = 0;
+#if defined(SIMD_AVX2)
+	__m256 damping8 = _mm256_set1_ps(damping);
+	__m256 half8 = _mm256_set1_ps(0.5f * deltaT);
+	for (; n + 8 <= count; n += 8) {
+		__m256 x = _mm256_mul_ps(_mm256_loadu_ps(&wx[n]), damping8);
+		__m256 y = _mm256_mul_ps(_mm256_loadu_ps(&wy[n]), damping8);
+		__m256 z = _mm256_mul_ps(_mm256_loadu_ps(&wz[n]), damping8);
+		_mm256_storeu_ps(&wx[n], x);
+		_mm256_storeu_ps(&wy[n], y);
+		_mm256_storeu_ps(&wz[n], z);
+		__m256 qr = _mm256_loadu_ps(&r[n]), qi = _mm256_loadu_ps(&i[n]), qj = _mm256_loadu_ps(&j[n]), qk = _mm256_loadu_ps(&k[n]);
+		// (0, w) * q, halved and scaled by deltaT
+		__m256 dr = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, qi), _mm256_mul_ps(y, qj)), _mm256_mul_ps(z, qk)));
+		__m256 di = _mm256_add_ps(_mm256_mul_ps(x, qr), _mm256_sub_ps(_mm256_mul_ps(y, qk), _mm256_mul_ps(z, qj)));
+		__m256 dj = _mm256_add_ps(_mm256_mul_ps(y, qr), _mm256_sub_ps(_mm256_mul_ps(z, qi), _mm256_mul_ps(x, qk)));
+		__m256 dk = _mm256_add_ps(_mm256_mul_ps(z, qr), _mm256_sub_ps(_mm256_mul_ps(x, qj), _mm256_mul_ps(y, qi)));
+		_mm256_storeu_ps(&r[n], _mm256_fmadd_ps(dr, half8, qr));
+		_mm256_storeu_ps(&i[n], _mm256_fmadd_ps(di, half8, qi));
+		_mm256_storeu_ps(&j[n], _mm256_fmadd_ps(dj, half8, qj));
+		_mm256_storeu_ps(&k[n], _mm256_fmadd_ps(dk, half8, qk));
+	}
+#endif
+#if defined(SIMD_SSE)
+	__m128 damping4 = _mm_set1_ps(damping);
+	__m128 half4 = _mm_set1_ps(0.5f * deltaT);
+	for (; n + 4 <= count; n += 4) {
+		__m128 x = _mm_mul_ps(_mm_loadu_ps(&wx[n]), damping4);
+		__m128 y = _mm_mul_ps(_mm_loadu_ps(&wy[n]), damping4);
+		__m128 z = _mm_mul_ps(_mm_loadu_ps(&wz[n]), damping4);
+		_mm_storeu_ps(&wx[n], x);
+		_mm_storeu_ps(&wy[n], y);
+		_mm_storeu_ps(&wz[n], z);
+		__m128 qr = _mm_loadu_ps(&r[n]), qi = _mm_loadu_ps(&i[n]), qj = _mm_loadu_ps(&j[n]), qk = _mm_loadu_ps(&k[n]);
+		__m128 dr = _mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, qi), _mm_mul_ps(y, qj)), _mm_mul_ps(z, qk)));
+		__m128 di = _mm_add_ps(_mm_mul_ps(x, qr), _mm_sub_ps(_mm_mul_ps(y, qk), _mm_mul_ps(z, qj)));
+		__m128 dj = _mm_add_ps(_mm_mul_ps(y, qr), _mm_sub_ps(_mm_mul_ps(z, qi), _mm_mul_ps(x, qk)));
+		__m128 dk = _mm_add_ps(_mm_mul_ps(z, qr), _mm_sub_ps(_mm_mul_ps(x, qj), _mm_mul_ps(y, qi)));
+		_mm_storeu_ps(&r[n], _mm_add_ps(qr, _mm_mul_ps(dr, half4)));
+		_mm_storeu_ps(&i[n], _mm_add_ps(qi, _mm_mul_ps(di, half4)));
+		_mm_storeu_ps(&j[n], _mm_add_ps(qj, _mm_mul_ps(dj, half4)));
+		_mm_storeu_ps(&k[n], _mm_add_ps(qk, _mm_mul_ps(dk, half4)));
+	}
+#endif
+	for (; n < count; ++n) {
+		wx[n] *= damping;
+		wy[n] *= damping;
+		wz[n] *= damping;
+		Quat q(r[n], i[n], j[n], k[n]);
+		q.addScaledVector(vec3(wx[n], wy[n], wz[n]), deltaT);
+		r[n] = q.r;
+		i[n] = q.i;
+		j[n] = q.j;
+		k[n] = q.k;
+	}
+}
+
+void normalizeQuaternions(float* r, float* i, float* j, float* k, int count) {
+	int n = 0;
+#if defined(SIMD_AVX2)
+	__m256 threshold8 = _mm256_set1_ps(0.01f);
+	__m256 one8 = _mm256_set1_ps(1.0f);
+	for (; n + 8 <= count; n += 8) {
+		__m256 qr = _mm256_loadu_ps(&r[n]), qi = _mm256_loadu_ps(&i[n]), qj = _mm256_loadu_ps(&j[n]), qk = _mm256_loadu_ps(&k[n]);
+		__m256 d = _mm256_fmadd_ps(qr, qr, _mm256_fmadd_ps(qi, qi, _mm256_fmadd_ps(qj, qj, _mm256_mul_ps(qk, qk))));
+		__m256 small = _mm256_cmp_ps(d, threshold8, _CMP_LT_OQ);
+		__m256 scale = _mm256_blendv_ps(_mm256_div_ps(one8, _mm256_sqrt_ps(d)), one8, small);
+		_mm256_storeu_ps(&r[n], _mm256_blendv_ps(_mm256_mul_ps(qr, scale), one8, small));
+		_mm256_storeu_ps(&i[n], _mm256_mul_ps(qi, scale));
+		_mm256_storeu_ps(&j[n], _mm256_mul_ps(qj, scale));
+		_mm256_storeu_ps(&k[n], _mm256_mul_ps(qk, scale));
+	}
+#endif
+#if defined(SIMD_SSE)
+	__m128 threshold4 = _mm_set1_ps(0.01f);
+	__m128 one4 = _mm_set1_ps(1.0f);
+	for (; n + 4 <= count; n += 4) {
+		__m128 qr = _mm_loadu_ps(&r[n]), qi = _mm_loadu_ps(&i[n]), qj = _mm_loadu_ps(&j[n]), qk = _mm_loadu_ps(&k[n]);
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qr, qr), _mm_mul_ps(qi, qi)), _mm_add_ps(_mm_mul_ps(qj, qj), _mm_mul_ps(qk, qk)));
+		__m128 small = _mm_cmplt_ps(d, threshold4);
+		// Almost zero quaternions keep i, j and k and get r = 1
+		__m128 scale = _mm_or_ps(_mm_and_ps(small, one4), _mm_andnot_ps(small, _mm_div_ps(one4, _mm_sqrt_ps(d))));
+		_mm_storeu_ps(&r[n], _mm_or_ps(_mm_and_ps(small, one4), _mm_andnot_ps(small, _mm_mul_ps(qr, scale))));
+		_mm_storeu_ps(&i[n], _mm_mul_ps(qi, scale));
+		_mm_storeu_ps(&j[n], _mm_mul_ps(qj, scale));
+		_mm_storeu_ps(&k[n], _mm_mul_ps(qk, scale));
+	}
+#endif
+	for (; n < count; ++n) {
+		Quat q(r[n], i[n], j[n], k[n]);
+		q.normalise();
+		r[n] = q.r;
+		i[n] = q.i;
+		j[n] = q.j;
+		k[n] = q.k;
+	}
+}
+
+void buildMatrices(const float* px, const float* py, const float* pz, const float* r, const float* i, const float* j, const float* k,
+	float scale, float* matrices, int count) {
+	int n = 0;
+#if defined(SIMD_SSE)
+	__m128 two = _mm_set1_ps(2.0f * scale);
+	__m128 s = _mm_set1_ps(scale);
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	for (; n + 4 <= count; n += 4) {
+		__m128 qr = _mm_loadu_ps(&r[n]), qi = _mm_loadu_ps(&i[n]), qj = _mm_loadu_ps(&j[n]), qk = _mm_loadu_ps(&k[n]);
+		__m128 ii = _mm_mul_ps(qi, qi), jj = _mm_mul_ps(qj, qj), kk = _mm_mul_ps(qk, qk);
+		__m128 ij = _mm_mul_ps(qi, qj), ik = _mm_mul_ps(qi, qk), jk = _mm_mul_ps(qj, qk);
+		__m128 ir = _mm_mul_ps(qi, qr), jr = _mm_mul_ps(qj, qr), kr = _mm_mul_ps(qk, qr);
+
+		// One register per matrix element for 4 bodies, transposed into 4 columns per body below
+		__m128 m0 = _mm_sub_ps(s, _mm_mul_ps(two, _mm_add_ps(jj, kk)));
+		__m128 m1 = _mm_mul_ps(two, _mm_add_ps(ij, kr));
+		__m128 m2 = _mm_mul_ps(two, _mm_sub_ps(ik, jr));
+		__m128 m4 = _mm_mul_ps(two, _mm_sub_ps(ij, kr));
+		__m128 m5 = _mm_sub_ps(s, _mm_mul_ps(two, _mm_add_ps(ii, kk)));
+		__m128 m6 = _mm_mul_ps(two, _mm_add_ps(jk, ir));
+		__m128 m8 = _mm_mul_ps(two, _mm_add_ps(ik, jr));
+		__m128 m9 = _mm_mul_ps(two, _mm_sub_ps(jk, ir));
+		__m128 m10 = _mm_sub_ps(s, _mm_mul_ps(two, _mm_add_ps(ii, jj)));
+		__m128 m12 = _mm_loadu_ps(&px[n]), m13 = _mm_loadu_ps(&py[n]), m14 = _mm_loadu_ps(&pz[n]);
+
+		__m128 c0a = m0, c0b = m1, c0c = m2, c0d = zero;
+		_MM_TRANSPOSE4_PS(c0a, c0b, c0c, c0d);
+		__m128 c1a = m4, c1b = m5, c1c = m6, c1d = zero;
+		_MM_TRANSPOSE4_PS(c1a, c1b, c1c, c1d);
+		__m128 c2a = m8, c2b = m9, c2c = m10, c2d = zero;
+		_MM_TRANSPOSE4_PS(c2a, c2b, c2c, c2d);
+		__m128 c3a = m12, c3b = m13, c3c = m14, c3d = one;
+		_MM_TRANSPOSE4_PS(c3a, c3b, c3c, c3d);
+
+		float* out = &matrices[n * 16];
+		_mm_storeu_ps(out + 0, c0a); _mm_storeu_ps(out + 4, c1a); _mm_storeu_ps(out + 8, c2a); _mm_storeu_ps(out + 12, c3a);
+		_mm_storeu_ps(out + 16, c0b); _mm_storeu_ps(out + 20, c1b); _mm_storeu_ps(out + 24, c2b); _mm_storeu_ps(out + 28, c3b);
+		_mm_storeu_ps(out + 32, c0c); _mm_storeu_ps(out + 36, c1c); _mm_storeu_ps(out + 40, c2c); _mm_storeu_ps(out + 44, c3c);
+		_mm_storeu_ps(out + 48, c0d); _mm_storeu_ps(out + 52, c1d); _mm_storeu_ps(out + 56, c2d); _mm_storeu_ps(out + 60, c3d);
+	}
+#endif
+	for (; n < count; ++n) {
+		float* out = &matrices[n * 16];
+		float qr = r[n], qi = i[n], qj = j[n], qk = k[n];
+		out[0] = scale * (1 - (2 * qj * qj + 2 * qk * qk));
+		out[1] = scale * (2 * qi * qj + 2 * qk * qr);
+		out[2] = scale * (2 * qi * qk - 2 * qj * qr);
+		out[3] = 0.0f;
+		out[4] = scale * (2 * qi * qj - 2 * qk * qr);
+		out[5] = scale * (1 - (2 * qi * qi + 2 * qk * qk));
+		out[6] = scale * (2 * qj * qk + 2 * qi * qr);
+		out[7] = 0.0f;
+		out[8] = scale * (2 * qi * qk + 2 * qj * qr);
+		out[9] = scale * (2 * qj * qk - 2 * qi * qr);
+		out[10] = scale * (1 - (2 * qi * qi + 2 * qj * qj));
+		out[11] = 0.0f;
+		out[12] = px[n];
+		out[13] = py[n];
+		out[14] = pz[n];
+		out[15] = 1.0f;
+	}
+}
+
+namespace {
+	typedef std::chrono::high_resolution_clock Clock;
+
+	double nanosecondsPer(Clock::time_point start, int count) {
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count;
+	}
+
+	float randomFloat(float min, float max) {
+		return min + (max - min) * (Random::get(0, 10000) / 10000.0f);
+	}
+
+	// The contact math of PhysicsObject::HandleCollision with the Kore types, returns the impulse in world space
+	vec3 contactImpulse(const mat3& inverseInertia, vec3 normal, vec3 velocity, vec3 relative, float inverseMass) {
+		normal.normalize();
+		mat3 contactToWorld;
+		vec3 y = normal.cross(vec3(0, 0, 1));
+		y.normalize();
+		vec3 z = normal.cross(y);
+		z.normalize();
+		for (int row = 0; row < 3; ++row) {
+			contactToWorld.Set(row, 0, normal[row]);
+			contactToWorld.Set(row, 1, y[row]);
+			contactToWorld.Set(row, 2, z[row]);
+		}
+		mat3 worldToContact = contactToWorld.Invert();
+		vec3 contactVelocity = worldToContact * velocity;
+		mat3 impulseToTorque;
+		impulseToTorque.Set(0, 1, -relative.z());
+		impulseToTorque.Set(0, 2, relative.y());
+		impulseToTorque.Set(1, 0, relative.z());
+		impulseToTorque.Set(1, 2, -relative.x());
+		impulseToTorque.Set(2, 0, -relative.y());
+		impulseToTorque.Set(2, 1, relative.x());
+		mat3 deltaVelWorld = impulseToTorque;
+		deltaVelWorld *= inverseInertia;
+		deltaVelWorld *= impulseToTorque;
+		deltaVelWorld = deltaVelWorld * -1.0f;
+		mat3 deltaVelocity = contactToWorld;
+		deltaVelocity *= deltaVelWorld;
+		deltaVelocity *= contactToWorld;
+		deltaVelocity.data[0] += inverseMass;
+		deltaVelocity.data[3] += inverseMass;
+		deltaVelocity.data[7] += inverseMass;
+		mat3 impulseMatrix = deltaVelocity.Invert();
+		vec3 impulseContact = impulseMatrix * vec3(-1.8f * contactVelocity.x(), -contactVelocity.y(), -contactVelocity.z());
+		return contactToWorld * impulseContact;
+	}
+
+	vec3 contactImpulseSimd(const SimdMat3& inverseInertia, const SimdVec3& normal, const SimdVec3& velocity, const SimdVec3& relative, float inverseMass) {
+		SimdMat3 contactToWorld = SimdMat3::basis(normal);
+		SimdVec3 contactVelocity = contactToWorld.invertOrthonormal() * velocity;
+		SimdMat3 impulseToTorque = SimdMat3::skewSymmetric(relative);
+		SimdMat3 deltaVelocity = contactToWorld * (impulseToTorque * inverseInertia * impulseToTorque * -1.0f) * contactToWorld;
+		mat3 m = deltaVelocity.toMat3();
+		m.data[0] += inverseMass;
+		m.data[3] += inverseMass;
+		m.data[7] += inverseMass;
+		SimdMat3 impulseMatrix = SimdMat3(m).invert();
+		SimdVec3 impulseContact = impulseMatrix * SimdVec3(-1.8f * contactVelocity.x(), -contactVelocity.y(), -contactVelocity.z());
+		return (contactToWorld * impulseContact).toVec3();
+	}
+}
+
+void benchmarkMath(int count) {
+	const float deltaT = 1.0f / 60.0f;
+	const float damping = 0.98f;
+	const int iterations = 100;
+	Random::init(1234);
+
+	vec3* position = new vec3[count];
+	vec3* velocity = new vec3[count];
+	vec3* force = new vec3[count];
+	vec3* angular = new vec3[count];
+	Quat* rotation = new Quat[count];
+	mat4* transform = new mat4[count];
+	float* mass = new float[count];
+
+	float* soa = new float[count * 15];
+	float* px = soa, *py = soa + count, *pz = soa + count * 2;
+	float* vx = soa + count * 3, *vy = soa + count * 4, *vz = soa + count * 5;
+	float* fx = soa + count * 6, *fy = soa + count * 7, *fz = soa + count * 8;
+	float* wx = soa + count * 9, *wy = soa + count * 10, *wz = soa + count * 11;
+	float* inverseMass = soa + count * 12;
+	float* massArray = soa + count * 13;
+	float* qr = new float[count * 4];
+	float* qi = qr + count, *qj = qr + count * 2, *qk = qr + count * 3;
+	float* matrices = new float[count * 16];
+
+	for (int n = 0; n < count; ++n) {
+		position[n] = vec3(randomFloat(-50, 50), randomFloat(0, 10), randomFloat(-50, 50));
+		velocity[n] = vec3(randomFloat(-5, 5), randomFloat(-5, 5), randomFloat(-5, 5));
+		angular[n] = vec3(randomFloat(-3, 3), randomFloat(-3, 3), randomFloat(-3, 3));
+		force[n] = vec3(0, 0, 0);
+		rotation[n] = Quat();
+		mass[n] = randomFloat(1, 10);
+		px[n] = position[n].x(); py[n] = position[n].y(); pz[n] = position[n].z();
+		vx[n] = velocity[n].x(); vy[n] = velocity[n].y(); vz[n] = velocity[n].z();
+		wx[n] = angular[n].x(); wy[n] = angular[n].y(); wz[n] = angular[n].z();
+		fx[n] = fy[n] = fz[n] = 0.0f;
+		massArray[n] = mass[n];
+		inverseMass[n] = 1.0f / mass[n];
+		qr[n] = 1.0f; qi[n] = qj[n] = qk[n] = 0.0f;
+	}
+
+	// The per object code of PhysicsWorld::Update, PhysicsObject::Integrate and UpdateMatrix
+	Clock::time_point start = Clock::now();
+	for (int iteration = 0; iteration < iterations; ++iteration) {
+		for (int n = 0; n < count; ++n) {
+			force[n] += vec3(0.0f, mass[n] * -9.81f, 0.0f);
+			velocity[n] += (force[n] / mass[n]) * deltaT;
+			velocity[n] *= damping;
+			angular[n] *= damping;
+			rotation[n].addScaledVector(angular[n], deltaT);
+			position[n] = position[n] + velocity[n] * deltaT;
+			force[n] = vec3(0, 0, 0);
+		}
+	}
+	double scalarIntegrate = nanosecondsPer(start, count * iterations);
+
+	start = Clock::now();
+	for (int iteration = 0; iteration < iterations; ++iteration) {
+		for (int n = 0; n < count; ++n) {
+			rotation[n].normalise();
+			transform[n] = mat4::Translation(position[n].x(), position[n].y(), position[n].z()) * mat4::Scale(0.5f, 0.5f, 0.5f) * rotation[n].getMatrix();
+		}
+	}
+	double scalarMatrices = nanosecondsPer(start, count * iterations);
+
+	start = Clock::now();
+	for (int iteration = 0; iteration < iterations; ++iteration) {
+		applyGravity(massArray, fy, count, -9.81f);
+		integrateBodies(px, py, pz, vx, vy, vz, fx, fy, fz, inverseMass, damping, deltaT, count);
+		integrateRotations(qr, qi, qj, qk, wx, wy, wz, damping, deltaT, count);
+	}
+	double batchIntegrate = nanosecondsPer(start, count * iterations);
+
+	start = Clock::now();
+	for (int iteration = 0; iteration < iterations; ++iteration) {
+		normalizeQuaternions(qr, qi, qj, qk, count);
+		buildMatrices(px, py, pz, qr, qi, qj, qk, 0.5f, matrices, count);
+	}
+	double batchMatrices = nanosecondsPer(start, count * iterations);
+
+	// Both paths ran the same steps, so they should agree up to rounding
+	float maxError = 0.0f;
+	for (int n = 0; n < count; ++n) {
+		for (int e = 0; e < 16; ++e) {
+			maxError = Kore::max(maxError, Kore::abs(transform[n].data[e] - matrices[n * 16 + e]));
+		}
+	}
+
+	// Contact impulses with random normals, velocities and contact points
+	const int contacts = 100000;
+	mat3 inverseInertia;
+	float I = 1.0f / (2.0f / 5.0f * 5.0f * 0.25f);
+	inverseInertia.Set(0, 0, I);
+	inverseInertia.Set(1, 1, I);
+	inverseInertia.Set(2, 2, I);
+	vec3* normals = new vec3[contacts];
+	vec3* contactVelocities = new vec3[contacts];
+	for (int n = 0; n < contacts; ++n) {
+		normals[n] = vec3(randomFloat(-1, 1), randomFloat(0.2f, 1), randomFloat(-1, 1));
+		contactVelocities[n] = vec3(randomFloat(-5, 5), randomFloat(-5, 5), randomFloat(-5, 5));
+	}
+
+	vec3 sum(0, 0, 0);
+	start = Clock::now();
+	for (int n = 0; n < contacts; ++n) {
+		vec3 normal = normals[n];
+		normal.normalize();
+		sum += contactImpulse(inverseInertia, normal, contactVelocities[n], normal * -0.5f, 0.2f);
+	}
+	double scalarContact = nanosecondsPer(start, contacts);
+
+	SimdMat3 simdInertia(inverseInertia);
+	vec3 simdSum(0, 0, 0);
+	start = Clock::now();
+	for (int n = 0; n < contacts; ++n) {
+		SimdVec3 normal = normalize(SimdVec3(normals[n]));
+		simdSum += contactImpulseSimd(simdInertia, normal, SimdVec3(contactVelocities[n]), normal * -0.5f, 0.2f);
+	}
+	double simdContact = nanosecondsPer(start, contacts);
+
+	Kore::log(Info, "Math benchmark, %i bodies, %i steps", count, iterations);
+	Kore::log(Info, "  gravity + integration: %.2f ns/body scalar, %.2f ns/body batch (%.1fx)", scalarIntegrate, batchIntegrate, scalarIntegrate / batchIntegrate);
+	Kore::log(Info, "  normalize + matrices:  %.2f ns/body scalar, %.2f ns/body batch (%.1fx), max difference %g", scalarMatrices, batchMatrices, scalarMatrices / batchMatrices, maxError);
+	Kore::log(Info, "  contact impulse:       %.2f ns scalar, %.2f ns SIMD (%.1fx), sums %f / %f", scalarContact, simdContact, scalarContact / simdContact, sum.getLength(), simdSum.getLength());
+
+	delete[] contactVelocities;
+	delete[] normals;
+	delete[] matrices;
+	delete[] qr;
+	delete[] soa;
+	delete[] mass;
+	delete[] transform;
+	delete[] rotation;
+	delete[] force;
+	delete[] angular;
+	delete[] velocity;
+	delete[] position;
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+#include "pch.h"
+
+#include <Kore/Math/Core.h>
+#include <Kore/Math/Matrix.h>
+#include "Quat.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+#if defined(__SSE4_1__) || defined(__AVX__)
+#define SIMD_SSE4
+#include <smmintrin.h>
+#endif
+
+// The AVX2 kernels use fused multiply-add. GCC and Clang only provide it with -mfma, MSVC with /arch:AVX2.
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#define SIMD_AVX2
+#include <immintrin.h>
+#endif
+
+using namespace Kore;
+
+// Vector, matrix and quaternion types for the physics hot path. With SSE every value lives in one register
+// (the w lane of vectors is kept at 0), otherwise the same operations run on plain floats.
+
+struct SimdVec3 {
+#ifdef SIMD_SSE
+	__m128 v;
+
+	SimdVec3() : v(_mm_setzero_ps()) {}
+	explicit SimdVec3(__m128 v) : v(v) {}
+	SimdVec3(float x, float y, float z) : v(_mm_set_ps(0.0f, z, y, x)) {}
+	explicit SimdVec3(const vec3& value) : v(_mm_set_ps(0.0f, value.z(), value.y(), value.x())) {}
+
+	float x() const { return _mm_cvtss_f32(v); }
+	float y() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))); }
+	float z() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))); }
+#else
+	float v[4];
+
+	SimdVec3() { v[0] = v[1] = v[2] = v[3] = 0.0f; }
+	SimdVec3(float x, float y, float z) { v[0] = x; v[1] = y; v[2] = z; v[3] = 0.0f; }
+	explicit SimdVec3(const vec3& value) { v[0] = value.x(); v[1] = value.y(); v[2] = value.z(); v[3] = 0.0f; }
+
+	float x() const { return v[0]; }
+	float y() const { return v[1]; }
+	float z() const { return v[2]; }
+#endif
+
+	vec3 toVec3() const {
+		return vec3(x(), y(), z());
+	}
+};
+
+inline SimdVec3 operator+(const SimdVec3& a, const SimdVec3& b) {
+#ifdef SIMD_SSE
+	return SimdVec3(_mm_add_ps(a.v, b.v));
+#else
+	return SimdVec3(a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2]);
+#endif
+}
+
+inline SimdVec3 operator-(const SimdVec3& a, const SimdVec3& b) {
+#ifdef SIMD_SSE
+	return SimdVec3(_mm_sub_ps(a.v, b.v));
+#else
+	return SimdVec3(a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2]);
+#endif
+}
+
+inline SimdVec3 operator*(const SimdVec3& a, float f) {
+#ifdef SIMD_SSE
+	return SimdVec3(_mm_mul_ps(a.v, _mm_set1_ps(f)));
+#else
+	return SimdVec3(a.v[0] * f, a.v[1] * f, a.v[2] * f);
+#endif
+}
+
+inline float dot(const SimdVec3& a, const SimdVec3& b) {
+#if defined(SIMD_SSE4)
+	return _mm_cvtss_f32(_mm_dp_ps(a.v, b.v, 0x71));
+#elif defined(SIMD_SSE)
+	__m128 m = _mm_mul_ps(a.v, b.v);
+	__m128 s = _mm_add_ps(m, _mm_movehl_ps(m, m));
+	s = _mm_add_ss(s, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(s);
+#else
+	return a.v[0] * b.v[0] + a.v[1] * b.v[1] + a.v[2] * b.v[2];
+#endif
+}
+
+inline SimdVec3 cross(const SimdVec3& a, const SimdVec3& b) {
+#ifdef SIMD_SSE
+	__m128 aYZX = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 bYZX = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = _mm_sub_ps(_mm_mul_ps(a.v, bYZX), _mm_mul_ps(aYZX, b.v));
+	return SimdVec3(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+#else
+	return SimdVec3(a.v[1] * b.v[2] - a.v[2] * b.v[1], a.v[2] * b.v[0] - a.v[0] * b.v[2], a.v[0] * b.v[1] - a.v[1] * b.v[0]);
+#endif
+}
+
+inline SimdVec3 normalize(const SimdVec3& a) {
+	return a * (1.0f / Kore::sqrt(dot(a, a)));
+}
+
+// 3x3 matrix stored as three columns, the same layout as mat3
+struct SimdMat3 {
+	SimdVec3 c[3];
+
+	SimdMat3() {}
+
+	SimdMat3(const SimdVec3& c0, const SimdVec3& c1, const SimdVec3& c2) {
+		c[0] = c0;
+		c[1] = c1;
+		c[2] = c2;
+	}
+
+	explicit SimdMat3(const mat3& m) {
+		for (int k = 0; k < 3; ++k) c[k] = SimdVec3(m.data[k * 3 + 0], m.data[k * 3 + 1], m.data[k * 3 + 2]);
+	}
+
+	mat3 toMat3() const {
+		mat3 m;
+		for (int k = 0; k < 3; ++k) {
+			m.data[k * 3 + 0] = c[k].x();
+			m.data[k * 3 + 1] = c[k].y();
+			m.data[k * 3 + 2] = c[k].z();
+		}
+		return m;
+	}
+
+	SimdVec3 operator*(const SimdVec3& v) const {
+#ifdef SIMD_SSE
+		__m128 x = _mm_shuffle_ps(v.v, v.v, _MM_SHUFFLE(0, 0, 0, 0));
+		__m128 y = _mm_shuffle_ps(v.v, v.v, _MM_SHUFFLE(1, 1, 1, 1));
+		__m128 z = _mm_shuffle_ps(v.v, v.v, _MM_SHUFFLE(2, 2, 2, 2));
+		return SimdVec3(_mm_add_ps(_mm_add_ps(_mm_mul_ps(c[0].v, x), _mm_mul_ps(c[1].v, y)), _mm_mul_ps(c[2].v, z)));
+#else
+		return c[0] * v.x() + c[1] * v.y() + c[2] * v.z();
+#endif
+	}
+
+	SimdMat3 operator*(const SimdMat3& m) const {
+		return SimdMat3(*this * m.c[0], *this * m.c[1], *this * m.c[2]);
+	}
+
+	SimdMat3 operator*(float f) const {
+		return SimdMat3(c[0] * f, c[1] * f, c[2] * f);
+	}
+
+	SimdMat3 transpose() const {
+#ifdef SIMD_SSE
+		__m128 c0 = c[0].v, c1 = c[1].v, c2 = c[2].v, c3 = _mm_setzero_ps();
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+		return SimdMat3(SimdVec3(c0), SimdVec3(c1), SimdVec3(c2));
+#else
+		return SimdMat3(SimdVec3(c[0].x(), c[1].x(), c[2].x()), SimdVec3(c[0].y(), c[1].y(), c[2].y()), SimdVec3(c[0].z(), c[1].z(), c[2].z()));
+#endif
+	}
+
+	// Adjugate divided by the determinant. The rows of the adjugate are cross products of the columns.
+	SimdMat3 invert() const {
+		SimdVec3 r0 = cross(c[1], c[2]);
+		SimdVec3 r1 = cross(c[2], c[0]);
+		SimdVec3 r2 = cross(c[0], c[1]);
+		float inverseDeterminant = 1.0f / dot(c[0], r0);
+		return SimdMat3(r0 * inverseDeterminant, r1 * inverseDeterminant, r2 * inverseDeterminant).transpose();
+	}
+
+	// For matrices with orthonormal columns, e.g. a contact basis
+	SimdMat3 invertOrthonormal() const {
+		return transpose();
+	}
+
+	// Multiplying with this matrix is the same as the cross product v x a
+	static SimdMat3 skewSymmetric(const SimdVec3& v) {
+		return SimdMat3(SimdVec3(0.0f, v.z(), -v.y()), SimdVec3(-v.z(), 0.0f, v.x()), SimdVec3(v.y(), -v.x(), 0.0f));
+	}
+
+	// Orthonormal basis with the normalized x as its first column, see SphereCollider::GetCollisonBasis
+	static SimdMat3 basis(const SimdVec3& x) {
+		SimdVec3 first = normalize(x);
+		SimdVec3 second = normalize(cross(first, SimdVec3(0.0f, 0.0f, 1.0f)));
+		SimdVec3 third = normalize(cross(first, second));
+		return SimdMat3(first, second, third);
+	}
+};
+
+// Quaternion with the same component order as Quat (r, i, j, k)
+struct SimdQuat {
+#ifdef SIMD_SSE
+	__m128 q;
+
+	SimdQuat() : q(_mm_set_ps(0.0f, 0.0f, 0.0f, 1.0f)) {}
+	explicit SimdQuat(__m128 q) : q(q) {}
+	explicit SimdQuat(const Quat& value) : q(_mm_loadu_ps(value.data)) {}
+
+	Quat toQuat() const {
+		Quat result;
+		_mm_storeu_ps(result.data, q);
+		return result;
+	}
+#else
+	float q[4];
+
+	SimdQuat() { q[0] = 1.0f; q[1] = q[2] = q[3] = 0.0f; }
+	explicit SimdQuat(const Quat& value) { for (int n = 0; n < 4; ++n) q[n] = value.data[n]; }
+
+	Quat toQuat() const {
+		return Quat(q[0], q[1], q[2], q[3]);
+	}
+#endif
+
+	// this = this * m, as Quat::operator*=
+	void operator*=(const SimdQuat& m) {
+#ifdef SIMD_SSE
+		__m128 r = _mm_shuffle_ps(q, q, _MM_SHUFFLE(0, 0, 0, 0));
+		__m128 i = _mm_shuffle_ps(q, q, _MM_SHUFFLE(1, 1, 1, 1));
+		__m128 j = _mm_shuffle_ps(q, q, _MM_SHUFFLE(2, 2, 2, 2));
+		__m128 k = _mm_shuffle_ps(q, q, _MM_SHUFFLE(3, 3, 3, 3));
+		__m128 a = _mm_mul_ps(_mm_shuffle_ps(m.q, m.q, _MM_SHUFFLE(2, 3, 0, 1)), _mm_set_ps(1.0f, -1.0f, 1.0f, -1.0f));
+		__m128 b = _mm_mul_ps(_mm_shuffle_ps(m.q, m.q, _MM_SHUFFLE(1, 0, 3, 2)), _mm_set_ps(-1.0f, 1.0f, 1.0f, -1.0f));
+		__m128 c = _mm_mul_ps(_mm_shuffle_ps(m.q, m.q, _MM_SHUFFLE(0, 1, 2, 3)), _mm_set_ps(1.0f, 1.0f, -1.0f, -1.0f));
+		q = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, m.q), _mm_mul_ps(i, a)), _mm_add_ps(_mm_mul_ps(j, b), _mm_mul_ps(k, c)));
+#else
+		Quat result = toQuat();
+		result *= m.toQuat();
+		for (int n = 0; n < 4; ++n) q[n] = result.data[n];
+#endif
+	}
+
+	// As Quat::addScaledVector
+	void addScaledVector(const SimdVec3& vector, float scale) {
+#ifdef SIMD_SSE
+		// (0, x, y, z) * scale, the w lane of the vector is 0
+		__m128 v = _mm_mul_ps(vector.v, _mm_set1_ps(scale));
+		SimdQuat rotation(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 1, 0, 3)));
+		rotation *= *this;
+		q = _mm_add_ps(q, _mm_mul_ps(rotation.q, _mm_set1_ps(0.5f)));
+#else
+		Quat result = toQuat();
+		result.addScaledVector(vector.toVec3(), scale);
+		*this = SimdQuat(result);
+#endif
+	}
+
+	// As Quat::normalise, an almost zero quaternion only gets r set to 1
+	void normalise() {
+#ifdef SIMD_SSE
+		__m128 squared = _mm_mul_ps(q, q);
+		__m128 sum = _mm_add_ps(squared, _mm_shuffle_ps(squared, squared, _MM_SHUFFLE(2, 3, 0, 1)));
+		sum = _mm_add_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		if (_mm_cvtss_f32(sum) < 0.01f) {
+			q = _mm_move_ss(q, _mm_set_ss(1.0f));
+			return;
+		}
+		q = _mm_div_ps(q, _mm_sqrt_ps(sum));
+#else
+		Quat result = toQuat();
+		result.normalise();
+		*this = SimdQuat(result);
+#endif
+	}
+
+	// The rotation as columns of a 3x3 matrix, as Quat::getMatrix
+	SimdMat3 getMatrix() const {
+		Quat value = toQuat();
+		float r = value.r, i = value.i, j = value.j, k = value.k;
+		return SimdMat3(SimdVec3(1 - (2 * j * j + 2 * k * k), 2 * i * j + 2 * k * r, 2 * i * k - 2 * j * r),
+			SimdVec3(2 * i * j - 2 * k * r, 1 - (2 * i * i + 2 * k * k), 2 * j * k + 2 * i * r),
+			SimdVec3(2 * i * k + 2 * j * r, 2 * j * k - 2 * i * r, 1 - (2 * i * i + 2 * j * j)));
+	}
+};
+
+// Batch kernels over bodies stored as separate arrays per component (AVX2 for 8 bodies at a time, SSE for 4, scalar for the rest)
+
+// force += mass * gravity
+void applyGravity(const float* mass, float* forceY, int count, float gravity);
+
+// velocity += force * inverseMass * deltaT, velocity *= damping, position += velocity * deltaT, force = 0 (as PhysicsObject::Integrate)
+void integrateBodies(float* px, float* py, float* pz, float* vx, float* vy, float* vz, float* fx, float* fy, float* fz,
+	const float* inverseMass, float damping, float deltaT, int count);
+
+// angularVelocity *= damping, then the orientation is advanced as Quat::addScaledVector
+void integrateRotations(float* r, float* i, float* j, float* k, float* wx, float* wy, float* wz, float damping, float deltaT, int count);
+
+// As Quat::normalise for every quaternion
+void normalizeQuaternions(float* r, float* i, float* j, float* k, int count);
+
+// Writes Translation * Scale * Rotation as a column major 4x4 matrix (16 floats) per body
+void buildMatrices(const float* px, const float* py, const float* pz, const float* r, const float* i, const float* j, const float* k,
+	float scale, float* matrices, int count);
+
+// Times the batch kernels and the contact math against the Kore vec3/mat3/Quat code and logs the results
+void benchmarkMath(int count);
@@ -0,0 +1,94 @@
+#include "pch.h"
+#include "SnapshotBenchmark.h"
+
+#include <Kore/Log.h>
+#include <Kore/Math/Core.h>
+#include <chrono>
+#include <cstring>
+#include "Benchmark.h"
+#include "PhysicsObject.h"
+#include "PhysicsWorld.h"
+#include "WorldSnapshot.h"
+
+using namespace Kore;
+
+void benchmarkSnapshot(int bodies) {
+	const float deltaT = 1.0f / 60.0f;
+	const int updates = 300;
+	const int snapshotUpdate = 100;
+	int side = (int)Kore::sqrt((float)bodies) + 1;
+	float extent = side * 1.5f;
+
+	CollisionMesh* groundMesh = createGroundMesh(extent);
+
+	PhysicsWorld world(bodies);
+	world.AddMeshCollider(groundMesh);
+	for (int i = 0; i < bodies; ++i) {
+		PhysicsObject* po = world.GetObject(world.SpawnObject());
+		po->SetPosition(vec3((i % side) * 3.0f - extent, 1.0f + (i % 3), (i / side) * 3.0f - extent));
+		po->Velocity = vec3((i % 7) * 0.5f - 1.5f, 0.0f, (i % 5) * 0.5f - 1.0f);
+	}
+	vec3 focus(0, 0, 0);
+	world.SetFocusPoints(&focus, 1);
+
+	WorldSnapshot previous;
+	WorldSnapshot snapshot;
+	WorldSnapshot delta;
+	unsigned* checksums = new unsigned[updates];
+	BodyHandle* handles = new BodyHandle[bodies];
+	// The first run takes the snapshot, the second one starts from it
+	for (int run = 0; run < 2; ++run) {
+		int mismatches = 0;
+		for (int u = run == 0 ? 0 : snapshotUpdate; u < updates; ++u) {
+			if (run == 0 && u == snapshotUpdate - 1) previous.Save(world);
+			if (run == 0 && u == snapshotUpdate) snapshot.Save(world);
+			// Every 50 updates a tenth of the objects is removed and spawned again, which changes the order of physicsObjects
+			if (u % 50 == 25) {
+				int count = 0;
+				for (int i = 0; i < world.GetObjectCount(); i += 10) handles[count++] = world.GetHandle(world.physicsObjects[i]);
+				world.RemoveObjects(handles, count);
+				for (int i = 0; i < count; ++i) {
+					PhysicsObject* po = world.GetObject(world.SpawnObject());
+					po->SetPosition(vec3((i % side) * 3.0f - extent, 4.0f, 0.0f));
+				}
+			}
+			world.Update(deltaT);
+			if (run == 0) checksums[u] = world.GetStateChecksum();
+			else if (world.GetStateChecksum() != checksums[u]) ++mismatches;
+		}
+		if (run == 0) {
+			snapshot.Restore(world);
+		}
+		else if (mismatches == 0) {
+			Kore::log(Info, "Resimulating %i updates from the snapshot gives the same checksums", updates - snapshotUpdate);
+		}
+		else {
+			Kore::log(Error, "Resimulating from the snapshot differs in %i of %i updates", mismatches, updates - snapshotUpdate);
+		}
+	}
+
+	const int repeats = 1000;
+	BenchmarkClock::time_point start = BenchmarkClock::now();
+	for (int i = 0; i < repeats; ++i) snapshot.Save(world);
+	BenchmarkClock::time_point saved = BenchmarkClock::now();
+	for (int i = 0; i < repeats; ++i) snapshot.Restore(world);
+	BenchmarkClock::time_point restored = BenchmarkClock::now();
+	double saveSeconds = std::chrono::duration<double>(saved - start).count() / repeats;
+	double restoreSeconds = std::chrono::duration<double>(restored - saved).count() / repeats;
+	Kore::log(Info, "Snapshot: %i bodies, %i bytes (%.1f per body), save %.1f us (%.2f GB/s), restore %.1f us (%.2f GB/s)", world.GetObjectCount(), snapshot.size,
+		(float)snapshot.size / world.GetObjectCount(), saveSeconds * 1e6, snapshot.size / saveSeconds / 1e9, restoreSeconds * 1e6, snapshot.size / restoreSeconds / 1e9);
+
+	// The world is back at the end of the first run, step it once more for a delta of a single update
+	previous.Save(world);
+	world.Update(deltaT);
+	snapshot.Save(world);
+	snapshot.WriteDelta(previous, delta);
+	WorldSnapshot rebuilt;
+	bool matches = rebuilt.ApplyDelta(previous, delta) && rebuilt.size == snapshot.size && memcmp(rebuilt.data, snapshot.data, snapshot.size) == 0;
+	Kore::log(matches ? Info : Error, "Delta of one update: %i bytes (%.1f%% of the snapshot), %s", delta.size, 100.0f * delta.size / snapshot.size, matches ? "rebuilds the snapshot" : "does not rebuild the snapshot");
+
+	delete[] handles;
+	delete[] checksums;
+	world.RemoveMeshCollider(groundMesh);
+	delete groundMesh;
+}
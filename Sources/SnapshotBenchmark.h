@@ -0,0 +1,7 @@
+#pragma once
+
+#include "pch.h"
+
+// Spheres bouncing on a ground plane, some removed and respawned while they move. The world is saved in the middle of the run,
+// restored and simulated again, which has to give the same checksums. Also times saving and restoring and reports the delta sizes.
+void benchmarkSnapshot(int bodies);
@@ -0,0 +1,446 @@
+#include "pch.h"
+#include "TextureCache.h"
+#include "MemoryTracking.h"
+
+#include <Kore/Graphics1/Image.h>
+#include <Kore/IO/FileReader.h>
+#include <Kore/Log.h>
+#include <Kore/Math/Core.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace Kore;
+
+namespace {
+	const int textureFileVersion = 1;
+	// Enough for 32768x32768
+	const int maxLevels = 16;
+
+	// FNV-1a over the whole file, false if it can not be read
+	bool hashFile(const char* filename, int& size, unsigned& hash) {
+		FileReader reader;
+		if (!reader.open(filename)) return false;
+		size = reader.size();
+		hash = 2166136261u;
+		unsigned char buffer[4096];
+		for (int position = 0; position < size;) {
+			int count = size - position < (int)sizeof(buffer) ? size - position : (int)sizeof(buffer);
+			if (reader.read(buffer, count) != count) return false;
+			for (int i = 0; i < count; ++i) {
+				hash ^= buffer[i];
+				hash *= 16777619u;
+			}
+			position += count;
+		}
+		return true;
+	}
+
+	// Null if the platform can not map files or the file does not exist
+	const unsigned char* mapFile(const char* filename, int& size) {
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return nullptr;
+		size = (int)GetFileSize(file, nullptr);
+		HANDLE mapping = size > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+		void* view = mapping != nullptr ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		// The view keeps the file open
+		if (mapping != nullptr) CloseHandle(mapping);
+		CloseHandle(file);
+		return (const unsigned char*)view;
+#elif defined(__unix__) || defined(__APPLE__)
+		int file = open(filename, O_RDONLY);
+		if (file < 0) return nullptr;
+		struct stat info;
+		void* view = MAP_FAILED;
+		if (fstat(file, &info) == 0 && info.st_size > 0) {
+			size = (int)info.st_size;
+			view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		}
+		close(file);
+		return view != MAP_FAILED ? (const unsigned char*)view : nullptr;
+#else
+		return nullptr;
+#endif
+	}
+
+	void unmapFile(const unsigned char* data, int size) {
+#if defined(_WIN32)
+		UnmapViewOfFile(data);
+#elif defined(__unix__) || defined(__APPLE__)
+		munmap((void*)data, (size_t)size);
+#endif
+	}
+
+	int levelSize(int format, int width, int height) {
+		if (format == TextureFileBC1) return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+		return width * height * 4;
+	}
+
+	// The header if data is a complete cache of the given image
+	const TextureFileHeader* validate(const unsigned char* data, int size, int sourceSize, unsigned sourceHash) {
+		if (size < (int)sizeof(TextureFileHeader)) return nullptr;
+		const TextureFileHeader* header = (const TextureFileHeader*)data;
+		if (memcmp(header->magic, "KTEX", 4) != 0 || header->version != textureFileVersion) return nullptr;
+		if (header->format != TextureFileRGBA32 && header->format != TextureFileBC1) return nullptr;
+		if (header->numLevels < 1 || header->numLevels > maxLevels) return nullptr;
+		if (header->sourceSize != sourceSize || header->sourceHash != sourceHash) return nullptr;
+		if ((int)sizeof(TextureFileHeader) + header->numLevels * (int)sizeof(TextureFileLevel) > size) return nullptr;
+
+		const TextureFileLevel* levels = (const TextureFileLevel*)(data + sizeof(TextureFileHeader));
+		if (levels[0].width != header->width || levels[0].height != header->height) return nullptr;
+		for (int level = 0; level < header->numLevels; ++level) {
+			const TextureFileLevel& entry = levels[level];
+			if (entry.width < 1 || entry.height < 1 || entry.size != levelSize(header->format, entry.width, entry.height)) return nullptr;
+			if (entry.offset < 0 || entry.offset > size - entry.size) return nullptr;
+		}
+		return header;
+	}
+
+	// Averages blocks of 2x2 pixels, the last row or column is repeated for odd sizes
+	void downsample(const unsigned char* source, int width, int height, unsigned char* target, int targetWidth, int targetHeight) {
+		for (int y = 0; y < targetHeight; ++y) {
+			int y0 = Kore::min(y * 2, height - 1);
+			int y1 = Kore::min(y * 2 + 1, height - 1);
+			for (int x = 0; x < targetWidth; ++x) {
+				int x0 = Kore::min(x * 2, width - 1);
+				int x1 = Kore::min(x * 2 + 1, width - 1);
+				for (int c = 0; c < 4; ++c) {
+					int sum = source[(y0 * width + x0) * 4 + c] + source[(y0 * width + x1) * 4 + c] + source[(y1 * width + x0) * 4 + c] + source[(y1 * width + x1) * 4 + c];
+					target[(y * targetWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+	}
+
+	unsigned short toRGB565(const int* rgb) {
+		return (unsigned short)(((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | (rgb[2] * 31 + 127) / 255);
+	}
+
+	void fromRGB565(unsigned short color, int* rgb) {
+		int r = (color >> 11) & 31;
+		int g = (color >> 5) & 63;
+		int b = color & 31;
+		rgb[0] = (r << 3) | (r >> 2);
+		rgb[1] = (g << 2) | (g >> 4);
+		rgb[2] = (b << 3) | (b >> 2);
+	}
+
+	// The four colors of a block as RGBA. Without c0 > c1 the block has three colors and a transparent black.
+	void bc1Palette(unsigned short c0, unsigned short c1, int palette[4][4]) {
+		fromRGB565(c0, palette[0]);
+		fromRGB565(c1, palette[1]);
+		for (int c = 0; c < 3; ++c) {
+			if (c0 > c1) {
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+			else {
+				palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+				palette[3][c] = 0;
+			}
+		}
+		palette[0][3] = palette[1][3] = palette[2][3] = 255;
+		palette[3][3] = c0 > c1 ? 255 : 0;
+	}
+
+	// Takes the corners of the bounding box of the colors along the direction in which they vary together, moved inwards a little
+	void encodeBC1Block(const unsigned char* pixels, int width, int height, int blockX, int blockY, unsigned char* block) {
+		int colors[16][3];
+		int low[3] = { 255, 255, 255 };
+		int high[3] = { 0, 0, 0 };
+		int mean[3] = { 0, 0, 0 };
+		for (int i = 0; i < 16; ++i) {
+			int x = Kore::min(blockX * 4 + i % 4, width - 1);
+			int y = Kore::min(blockY * 4 + i / 4, height - 1);
+			for (int c = 0; c < 3; ++c) {
+				colors[i][c] = pixels[(y * width + x) * 4 + c];
+				low[c] = Kore::min(low[c], colors[i][c]);
+				high[c] = Kore::max(high[c], colors[i][c]);
+				mean[c] += colors[i][c];
+			}
+		}
+
+		// Green and blue go down while red goes up: flip them on the diagonal
+		int covarianceGreen = 0;
+		int covarianceBlue = 0;
+		for (int i = 0; i < 16; ++i) {
+			int red = colors[i][0] * 16 - mean[0];
+			covarianceGreen += red * (colors[i][1] * 16 - mean[1]) / 16;
+			covarianceBlue += red * (colors[i][2] * 16 - mean[2]) / 16;
+		}
+		int first[3];
+		int second[3];
+		for (int c = 0; c < 3; ++c) {
+			int inset = (high[c] - low[c]) / 16;
+			first[c] = high[c] - inset;
+			second[c] = low[c] + inset;
+		}
+		if (covarianceGreen < 0) {
+			int swap = first[1];
+			first[1] = second[1];
+			second[1] = swap;
+		}
+		if (covarianceBlue < 0) {
+			int swap = first[2];
+			first[2] = second[2];
+			second[2] = swap;
+		}
+
+		unsigned short c0 = toRGB565(first);
+		unsigned short c1 = toRGB565(second);
+		if (c0 < c1) {
+			unsigned short swap = c0;
+			c0 = c1;
+			c1 = swap;
+		}
+		unsigned indices = 0;
+		if (c0 != c1) {
+			int palette[4][4];
+			bc1Palette(c0, c1, palette);
+			for (int i = 0; i < 16; ++i) {
+				int best = 0;
+				int bestDistance = 0x7fffffff;
+				for (int p = 0; p < 4; ++p) {
+					int dr = colors[i][0] - palette[p][0];
+					int dg = colors[i][1] - palette[p][1];
+					int db = colors[i][2] - palette[p][2];
+					int distance = dr * dr + dg * dg + db * db;
+					if (distance < bestDistance) {
+						bestDistance = distance;
+						best = p;
+					}
+				}
+				indices |= (unsigned)best << (i * 2);
+			}
+		}
+
+		block[0] = (unsigned char)(c0 & 0xff);
+		block[1] = (unsigned char)(c0 >> 8);
+		block[2] = (unsigned char)(c1 & 0xff);
+		block[3] = (unsigned char)(c1 >> 8);
+		for (int i = 0; i < 4; ++i) block[4 + i] = (unsigned char)(indices >> (i * 8));
+	}
+
+	void decodeBC1(const unsigned char* blocks, int width, int height, unsigned char* pixels, int stride) {
+		int blocksX = (width + 3) / 4;
+		int blocksY = (height + 3) / 4;
+		for (int by = 0; by < blocksY; ++by) {
+			for (int bx = 0; bx < blocksX; ++bx) {
+				const unsigned char* block = &blocks[(by * blocksX + bx) * 8];
+				unsigned short c0 = (unsigned short)(block[0] | block[1] << 8);
+				unsigned short c1 = (unsigned short)(block[2] | block[3] << 8);
+				unsigned indices = (unsigned)block[4] | (unsigned)block[5] << 8 | (unsigned)block[6] << 16 | (unsigned)block[7] << 24;
+				int palette[4][4];
+				bc1Palette(c0, c1, palette);
+				unsigned char colors[4][4];
+				for (int p = 0; p < 4; ++p) {
+					for (int c = 0; c < 4; ++c) colors[p][c] = (unsigned char)palette[p][c];
+				}
+				int columns = Kore::min(width - bx * 4, 4);
+				int rows = Kore::min(height - by * 4, 4);
+				for (int y = 0; y < rows; ++y) {
+					unsigned char* row = &pixels[(by * 4 + y) * stride + bx * 16];
+					for (int x = 0; x < columns; ++x) {
+						memcpy(&row[x * 4], colors[(indices >> ((y * 4 + x) * 2)) & 3], 4);
+					}
+				}
+			}
+		}
+	}
+}
+
+void getBakedTextureName(const char* filename, char* bakedName, int size) {
+	snprintf(bakedName, size, "%s.baked", filename);
+}
+
+bool bakeTexture(const char* filename, bool compress) {
+	MemoryScope scope(MemoryLoader);
+	int sourceSize = 0;
+	unsigned sourceHash = 0;
+	if (!hashFile(filename, sourceSize, sourceHash)) {
+		Kore::log(Error, "Could not read %s", filename);
+		return false;
+	}
+
+	Graphics1::Image image(filename, true);
+	if (image.format != Graphics1::Image::RGBA32 || image.width < 1 || image.height < 1) {
+		Kore::log(Error, "%s is not an RGBA image", filename);
+		return false;
+	}
+	int width = image.width;
+	int height = image.height;
+
+	bool opaque = true;
+	for (int i = 0; i < width * height && opaque; ++i) {
+		if (image.data[i * 4 + 3] != 255) opaque = false;
+	}
+	if (compress && !opaque) {
+		Kore::log(Warning, "%s has transparent pixels and is stored without compression", filename);
+	}
+
+	TextureFileHeader header;
+	memcpy(header.magic, "KTEX", 4);
+	header.version = textureFileVersion;
+	header.format = compress && opaque ? TextureFileBC1 : TextureFileRGBA32;
+	header.width = width;
+	header.height = height;
+	header.sourceSize = sourceSize;
+	header.sourceHash = sourceHash;
+
+	TextureFileLevel levels[maxLevels];
+	int offset = sizeof(TextureFileHeader);
+	int levelWidth = width;
+	int levelHeight = height;
+	for (header.numLevels = 0; header.numLevels < maxLevels; ++header.numLevels) {
+		levels[header.numLevels].width = levelWidth;
+		levels[header.numLevels].height = levelHeight;
+		levels[header.numLevels].size = levelSize(header.format, levelWidth, levelHeight);
+		if (levelWidth == 1 && levelHeight == 1) {
+			++header.numLevels;
+			break;
+		}
+		levelWidth = Kore::max(levelWidth / 2, 1);
+		levelHeight = Kore::max(levelHeight / 2, 1);
+	}
+	offset += header.numLevels * sizeof(TextureFileLevel);
+	for (int level = 0; level < header.numLevels; ++level) {
+		levels[level].offset = offset;
+		offset += levels[level].size;
+	}
+
+	char bakedName[256];
+	getBakedTextureName(filename, bakedName, sizeof(bakedName));
+	FILE* file = fopen(bakedName, "wb");
+	if (file == nullptr) {
+		Kore::log(Error, "Could not open %s for writing", bakedName);
+		return false;
+	}
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(levels, sizeof(TextureFileLevel), header.numLevels, file);
+
+	// Each level is made from the previous one
+	unsigned char* pixels = new unsigned char[width * height * 4];
+	unsigned char* next = new unsigned char[width * height * 4];
+	unsigned char* blocks = new unsigned char[levelSize(TextureFileBC1, width, height)];
+	memcpy(pixels, image.data, width * height * 4);
+	for (int level = 0; level < header.numLevels; ++level) {
+		const TextureFileLevel& entry = levels[level];
+		if (level > 0) {
+			downsample(pixels, levels[level - 1].width, levels[level - 1].height, next, entry.width, entry.height);
+			unsigned char* swap = pixels;
+			pixels = next;
+			next = swap;
+		}
+		if (header.format == TextureFileBC1) {
+			int blocksX = (entry.width + 3) / 4;
+			int blocksY = (entry.height + 3) / 4;
+			for (int by = 0; by < blocksY; ++by) {
+				for (int bx = 0; bx < blocksX; ++bx) {
+					encodeBC1Block(pixels, entry.width, entry.height, bx, by, &blocks[(by * blocksX + bx) * 8]);
+				}
+			}
+			fwrite(blocks, 1, entry.size, file);
+		}
+		else {
+			fwrite(pixels, 1, entry.size, file);
+		}
+	}
+	delete[] blocks;
+	delete[] next;
+	delete[] pixels;
+
+	bool written = ferror(file) == 0;
+	if (fclose(file) != 0) written = false;
+	if (!written) {
+		Kore::log(Error, "Could not write %s", bakedName);
+		remove(bakedName);
+	}
+	return written;
+}
+
+BakedTexture::BakedTexture(const char* filename) : data(nullptr), size(0), header(nullptr), levels(nullptr), mapped(false) {
+	int sourceSize = 0;
+	unsigned sourceHash = 0;
+	if (!hashFile(filename, sourceSize, sourceHash)) return;
+
+	char bakedName[256];
+	getBakedTextureName(filename, bakedName, sizeof(bakedName));
+	data = mapFile(bakedName, size);
+	mapped = data != nullptr;
+	if (!mapped) {
+		FileReader reader;
+		if (!reader.open(bakedName)) return;
+		MemoryScope scope(MemoryLoader);
+		size = reader.size();
+		unsigned char* copy = new unsigned char[size];
+		if (reader.read(copy, size) != size) size = 0;
+		data = copy;
+	}
+
+	header = validate(data, size, sourceSize, sourceHash);
+	if (header == nullptr) {
+		Kore::log(Warning, "%s is out of date, loading %s", bakedName, filename);
+		return;
+	}
+	levels = (const TextureFileLevel*)(data + sizeof(TextureFileHeader));
+}
+
+BakedTexture::~BakedTexture() {
+	if (data == nullptr) return;
+	if (mapped) unmapFile(data, size);
+	else delete[] data;
+}
+
+void BakedTexture::copyLevel(int level, unsigned char* pixels, int stride) const {
+	const TextureFileLevel& entry = levels[level];
+	if (header->format == TextureFileBC1) {
+		decodeBC1(data + entry.offset, entry.width, entry.height, pixels, stride);
+		return;
+	}
+	for (int y = 0; y < entry.height; ++y) {
+		memcpy(&pixels[y * stride], &data[entry.offset + y * entry.width * 4], entry.width * 4);
+	}
+}
+
+void bakeTextures(const char** textures, int count, bool compress) {
+	for (int i = 0; i < count; ++i) {
+		if (!bakeTexture(textures[i], compress)) continue;
+
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		Graphics1::Image* image = new Graphics1::Image(textures[i], true);
+		std::chrono::high_resolution_clock::time_point decoded = std::chrono::high_resolution_clock::now();
+		int imageBytes = image->width * image->height * 4;
+		delete image;
+
+		int cacheBytes = 0;
+		int levels = 0;
+		std::chrono::high_resolution_clock::time_point mapped = std::chrono::high_resolution_clock::now();
+		std::chrono::high_resolution_clock::time_point loaded;
+		{
+			BakedTexture baked(textures[i]);
+			if (!baked.isValid()) continue;
+			unsigned char* pixels = new unsigned char[baked.getWidth() * baked.getHeight() * 4];
+			for (int level = 0; level < baked.getLevelCount(); ++level) {
+				baked.copyLevel(level, pixels, baked.getWidth(level) * 4);
+			}
+			loaded = std::chrono::high_resolution_clock::now();
+			delete[] pixels;
+			cacheBytes = baked.getSize();
+			levels = baked.getLevelCount();
+		}
+		Kore::log(Info, "%s: %i levels, %i bytes (%i bytes of pixels in the PNG), decode %.2f ms, cache %.2f ms", textures[i], levels, cacheBytes, imageBytes,
+			std::chrono::duration<double, std::milli>(decoded - start).count(), std::chrono::duration<double, std::milli>(loaded - mapped).count());
+	}
+}
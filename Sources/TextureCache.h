@@ -0,0 +1,92 @@
+#pragma once
+
+#include "pch.h"
+
+// Textures converted ahead of time by bakeTexture, so loading one neither decodes an image nor builds mipmaps.
+// The cache of image.png is image.png.baked next to it. It stores the size and a hash of the image it was made from
+// and is ignored once the image changes, the image is then loaded as before until the cache is baked again.
+//
+// File layout (all values 32 bit, little endian):
+//   TextureFileHeader
+//   TextureFileLevel per mip level, from the full size down to 1x1
+//   the data of each level at its offset, 4 bytes per pixel or 8 bytes per block of 4x4 pixels for BC1
+struct TextureFileHeader {
+	char magic[4];
+	int version;
+	int format;
+	int width;
+	int height;
+	int numLevels;
+	int sourceSize;
+	unsigned sourceHash;
+};
+
+struct TextureFileLevel {
+	int width;
+	int height;
+	int offset;
+	int size;
+};
+
+enum TextureFileFormat {
+	// 8 bits per channel
+	TextureFileRGBA32,
+	// Two colors per block of 4x4 pixels and two more interpolated between them, no alpha
+	TextureFileBC1
+};
+
+// Name of the cache file of an image
+void getBakedTextureName(const char* filename, char* bakedName, int size);
+
+// Decodes the image, builds its mip chain and writes the cache. BC1 is only used if compress is set and the image is opaque.
+bool bakeTexture(const char* filename, bool compress);
+
+// Bakes the textures and logs the time of decoding each image against loading its cache with all mipmaps
+void bakeTextures(const char** filenames, int count, bool compress);
+
+// The cache of an image, mapped into memory while the object lives. Files are read into memory where they can not be mapped.
+// isValid is false if there is no cache, it is damaged or it was made from a different image.
+class BakedTexture {
+public:
+	BakedTexture(const char* filename);
+	~BakedTexture();
+
+	bool isValid() const {
+		return header != nullptr;
+	}
+
+	int getWidth(int level = 0) const {
+		return levels[level].width;
+	}
+
+	int getHeight(int level = 0) const {
+		return levels[level].height;
+	}
+
+	int getLevelCount() const {
+		return header->numLevels;
+	}
+
+	TextureFileFormat getFormat() const {
+		return (TextureFileFormat)header->format;
+	}
+
+	// Bytes of the cache file
+	int getSize() const {
+		return size;
+	}
+
+	// Writes a level as RGBA with stride bytes per row, BC1 blocks are decoded
+	void copyLevel(int level, unsigned char* pixels, int stride) const;
+
+private:
+	const unsigned char* data;
+	int size;
+	const TextureFileHeader* header;
+	const TextureFileLevel* levels;
+	// Either the file is mapped or data is a copy
+	bool mapped;
+
+	BakedTexture(const BakedTexture&);
+	BakedTexture& operator=(const BakedTexture&);
+};
@@ -0,0 +1,134 @@
+#include "pch.h"
+#include "WorldSnapshot.h"
+
+#include <cstring>
+#include "MemoryTracking.h"
+
+namespace {
+	struct DeltaHeader {
+		char magic[4];
+		int size;
+		int baseSize;
+		int numRuns;
+	};
+
+	// Followed by count words
+	struct DeltaRun {
+		int start;
+		int count;
+	};
+
+	typedef unsigned long long Word;
+}
+
+WorldSnapshot::WorldSnapshot() : data(nullptr), size(0), capacity(0) {}
+
+WorldSnapshot::~WorldSnapshot() {
+	delete[] data;
+}
+
+void WorldSnapshot::Reserve(int bytes) {
+	if (bytes <= capacity) return;
+	MemoryScope scope(MemoryPhysics);
+	capacity = bytes + bytes / 4;
+	char* grown = new char[capacity];
+	if (size > 0) memcpy(grown, data, size);
+	delete[] data;
+	data = grown;
+}
+
+void WorldSnapshot::Save(PhysicsWorld& world) {
+	Reserve(world.GetStateSize());
+	size = world.SaveState(data, capacity);
+}
+
+bool WorldSnapshot::Restore(PhysicsWorld& world) const {
+	return size > 0 && world.RestoreState(data, size);
+}
+
+int WorldSnapshot::WriteDelta(const WorldSnapshot& base, WorldSnapshot& delta) const {
+	// A run for every other word is the worst case
+	delta.size = 0;
+	delta.Reserve(sizeof(DeltaHeader) + size * 2);
+
+	const Word* words = (const Word*)data;
+	const Word* baseWords = (const Word*)base.data;
+	int numWords = size / sizeof(Word);
+	// Words beyond the end of base always count as changed
+	int numBaseWords = base.size / sizeof(Word);
+
+	DeltaHeader* header = (DeltaHeader*)delta.data;
+	memcpy(header->magic, "PWDL", 4);
+	header->size = size;
+	header->baseSize = base.size;
+	header->numRuns = 0;
+	char* out = delta.data + sizeof(DeltaHeader);
+
+	int i = 0;
+	while (i < numWords) {
+		if (i < numBaseWords && words[i] == baseWords[i]) {
+			++i;
+			continue;
+		}
+		// Gaps of up to two unchanged words are copied along instead of starting a new run
+		int last = i;
+		for (int next = i + 1; next < numWords && next - last <= 2; ++next) {
+			if (next >= numBaseWords || words[next] != baseWords[next]) last = next;
+		}
+
+		DeltaRun run;
+		run.start = i;
+		run.count = last - i + 1;
+		memcpy(out, &run, sizeof(run));
+		out += sizeof(run);
+		memcpy(out, &words[i], run.count * sizeof(Word));
+		out += run.count * sizeof(Word);
+		++header->numRuns;
+		i = last + 1;
+	}
+
+	delta.size = (int)(out - delta.data);
+	return delta.size;
+}
+
+bool WorldSnapshot::ApplyDelta(const WorldSnapshot& base, const WorldSnapshot& delta) {
+	const DeltaHeader* header = (const DeltaHeader*)delta.data;
+	if (delta.size < (int)sizeof(DeltaHeader) || memcmp(header->magic, "PWDL", 4) != 0 || header->baseSize != base.size
+		|| header->size < 0 || header->size % sizeof(Word) != 0 || header->numRuns < 0) {
+		return false;
+	}
+
+	// Check all runs first, so a truncated delta or one for another snapshot leaves this snapshot as it was
+	int numWords = header->size / sizeof(Word);
+	const char* in = delta.data + sizeof(DeltaHeader);
+	const char* end = delta.data + delta.size;
+	for (int i = 0; i < header->numRuns; ++i) {
+		DeltaRun run;
+		if (end - in < (int)sizeof(run)) return false;
+		memcpy(&run, in, sizeof(run));
+		in += sizeof(run);
+		if (run.start < 0 || run.count < 1 || run.count > numWords - run.start || (end - in) / (int)sizeof(Word) < run.count) return false;
+		in += run.count * sizeof(Word);
+	}
+
+	if (this != &base) {
+		size = 0;
+		Reserve(header->size);
+		memcpy(data, base.data, header->size < base.size ? header->size : base.size);
+	}
+	else {
+		Reserve(header->size);
+	}
+	size = header->size;
+
+	Word* words = (Word*)data;
+	in = delta.data + sizeof(DeltaHeader);
+	for (int i = 0; i < header->numRuns; ++i) {
+		DeltaRun run;
+		memcpy(&run, in, sizeof(run));
+		in += sizeof(run);
+		memcpy(&words[run.start], in, run.count * sizeof(Word));
+		in += run.count * sizeof(Word);
+	}
+	return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "pch.h"
+
+#include "PhysicsWorld.h"
+
+// A saved PhysicsWorld state for rollback and resimulation. The buffer is kept between saves and only grows.
+// A snapshot can also be stored as its difference to an earlier one, which is small when few objects moved in between.
+class WorldSnapshot {
+public:
+	WorldSnapshot();
+	~WorldSnapshot();
+
+	void Save(PhysicsWorld& world);
+
+	// False if nothing was saved or the snapshot is from a world of a different size
+	bool Restore(PhysicsWorld& world) const;
+
+	// Write the changes from base to this snapshot into delta, as runs of changed 8 byte words. Returns the size of the delta.
+	int WriteDelta(const WorldSnapshot& base, WorldSnapshot& delta) const;
+
+	// Make this snapshot base with delta (written by WriteDelta against the same base) applied, base may be this snapshot.
+	// Returns false without changing anything if the delta was written against a different base or is damaged.
+	bool ApplyDelta(const WorldSnapshot& base, const WorldSnapshot& delta);
+
+	char* data;
+	int size;
+
+private:
+	// Keeps the current contents
+	void Reserve(int bytes);
+
+	int capacity;
+};
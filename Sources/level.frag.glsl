@@ -0,0 +1,10 @@
+#version 450
+
+uniform sampler2DArray tex;
+in vec3 texCoord;
+in vec3 normal;
+out vec4 frag;
+
+void main() {
+	frag = texture(tex, texCoord) + normal.x * 0.01;
+}
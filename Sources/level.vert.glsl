@@ -0,0 +1,16 @@
+#version 450
+
+in vec3 pos;
+in vec2 tex;
+in vec3 nor;
+in float layer;
+out vec3 texCoord;
+out vec3 normal;
+uniform mat4 PV;
+uniform mat4 M;
+
+void main() {
+	gl_Position = PV * M * vec4(pos.x, pos.y, pos.z, 1.0);
+	texCoord = vec3(tex, layer);
+	normal = (PV * M * vec4(nor, 0.0)).xyz;
+}